@@ -4,16 +4,21 @@
 #include "system_info.h"
 #include "audio_codec.h"
 #include "mqtt_protocol.h"
+#include "control_message.h"
 #include "websocket_protocol.h"
 #include "font_awesome_symbols.h"
 #include "assets/lang_config.h"
 #include "mcp_server.h"
+#include "boot_profiler.h"
+#include "settings.h"
 
 #include <cstring>
 #include <esp_log.h>
+#include <esp_app_desc.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
 #include <arpa/inet.h>
+#include <freertos/semphr.h>
 
 #define TAG "Application"
 
@@ -67,16 +72,29 @@ Application::~Application() {
     vEventGroupDelete(event_group_);
 }
 
-void Application::CheckNewVersion(Ota& ota) {
+// In the background the device is already usable, so the user only hears about updates and activation
+void Application::CheckNewVersion(Ota& ota, bool background) {
     const int MAX_RETRY = 10;
     int retry_count = 0;
     int retry_delay = 10; // 初始重试延迟为10秒
 
+    // The foreground check runs on the main task before the event loop starts. The background one hands
+    // everything that touches the device state, the display or the audio service to the main task
+    auto run = [this, background](std::function<void()> callback) {
+        if (background) {
+            RunOnMainTask(callback);
+        } else {
+            callback();
+        }
+    };
+
     auto& board = Board::GetInstance();
     while (true) {
-        SetDeviceState(kDeviceStateActivating);
         auto display = board.GetDisplay();
-        display->SetStatus(Lang::Strings::CHECKING_NEW_VERSION);
+        if (!background) {
+            SetDeviceState(kDeviceStateActivating);
+            display->SetStatus(Lang::Strings::CHECKING_NEW_VERSION);
+        }
 
         if (!ota.CheckVersion()) {
             retry_count++;
@@ -85,14 +103,16 @@ void Application::CheckNewVersion(Ota& ota) {
                 return;
             }
 
-            char buffer[256];
-            snprintf(buffer, sizeof(buffer), Lang::Strings::CHECK_NEW_VERSION_FAILED, retry_delay, ota.GetCheckVersionUrl().c_str());
-            Alert(Lang::Strings::ERROR, buffer, "sad", Lang::Sounds::OGG_EXCLAMATION);
+            if (!background) {
+                char buffer[256];
+                snprintf(buffer, sizeof(buffer), Lang::Strings::CHECK_NEW_VERSION_FAILED, retry_delay, ota.GetCheckVersionUrl().c_str());
+                Alert(Lang::Strings::ERROR, buffer, "sad", Lang::Sounds::OGG_EXCLAMATION);
+            }
 
             ESP_LOGW(TAG, "Check new version failed, retry in %d seconds (%d/%d)", retry_delay, retry_count, MAX_RETRY);
             for (int i = 0; i < retry_delay; i++) {
                 vTaskDelay(pdMS_TO_TICKS(1000));
-                if (device_state_ == kDeviceStateIdle) {
+                if (!background && device_state_ == kDeviceStateIdle) {
                     break;
                 }
             }
@@ -103,18 +123,29 @@ void Application::CheckNewVersion(Ota& ota) {
         retry_delay = 10; // 重置重试延迟时间
 
         if (ota.HasNewVersion()) {
-            Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "happy", Lang::Sounds::OGG_UPGRADE);
+            if (background) {
+                // Do not interrupt a conversation. The state is taken on the main task right after the idle
+                // check, so a wake word cannot start a conversation in between
+                RunWhenIdle([this]() {
+                    SetDeviceState(kDeviceStateUpgrading);
+                });
+            }
+            run([this]() {
+                Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "happy", Lang::Sounds::OGG_UPGRADE);
+            });
 
             vTaskDelay(pdMS_TO_TICKS(3000));
 
-            SetDeviceState(kDeviceStateUpgrading);
-            
-            display->SetIcon(FONT_AWESOME_DOWNLOAD);
-            std::string message = std::string(Lang::Strings::NEW_VERSION) + ota.GetFirmwareVersion();
-            display->SetChatMessage("system", message.c_str());
+            run([this, &board, display, &ota]() {
+                SetDeviceState(kDeviceStateUpgrading);
+
+                display->SetIcon(FONT_AWESOME_DOWNLOAD);
+                std::string message = std::string(Lang::Strings::NEW_VERSION) + ota.GetFirmwareVersion();
+                display->SetChatMessage("system", message.c_str());
 
-            board.SetPowerSaveMode(false);
-            audio_service_.Stop();
+                board.SetPowerSaveMode(false);
+                audio_service_.Stop();
+            });
             vTaskDelay(pdMS_TO_TICKS(1000));
 
             bool upgrade_success = ota.StartUpgrade([display](int progress, size_t speed) {
@@ -128,9 +159,11 @@ void Application::CheckNewVersion(Ota& ota) {
             if (!upgrade_success) {
                 // Upgrade failed, restart audio service and continue running
                 ESP_LOGE(TAG, "Firmware upgrade failed, restarting audio service and continuing operation...");
-                audio_service_.Start(); // Restart audio service
-                board.SetPowerSaveMode(true); // Restore power save mode
-                Alert(Lang::Strings::ERROR, Lang::Strings::UPGRADE_FAILED, "sad", Lang::Sounds::OGG_EXCLAMATION);
+                run([this, &board]() {
+                    audio_service_.Start(); // Restart audio service
+                    board.SetPowerSaveMode(true); // Restore power save mode
+                    Alert(Lang::Strings::ERROR, Lang::Strings::UPGRADE_FAILED, "sad", Lang::Sounds::OGG_EXCLAMATION);
+                });
                 vTaskDelay(pdMS_TO_TICKS(3000));
                 // Continue to normal operation (don't break, just fall through)
             } else {
@@ -146,22 +179,27 @@ void Application::CheckNewVersion(Ota& ota) {
         // No new version, mark the current version as valid
         ota.MarkCurrentVersionValid();
         if (!ota.HasActivationCode() && !ota.HasActivationChallenge()) {
+            SaveBootProtocol(ota);
             xEventGroupSetBits(event_group_, MAIN_EVENT_CHECK_NEW_VERSION_DONE);
             // Exit the loop if done checking new version
             break;
         }
 
-        display->SetStatus(Lang::Strings::ACTIVATION);
-        // Activation code is shown to the user and waiting for the user to input
-        if (ota.HasActivationCode()) {
-            ShowActivationCode(ota.GetActivationCode(), ota.GetActivationMessage());
-        }
+        run([this, display, &ota]() {
+            SetDeviceState(kDeviceStateActivating);
+            display->SetStatus(Lang::Strings::ACTIVATION);
+            // Activation code is shown to the user and waiting for the user to input
+            if (ota.HasActivationCode()) {
+                ShowActivationCode(ota.GetActivationCode(), ota.GetActivationMessage());
+            }
+        });
 
         // This will block the loop until the activation is done or timeout
         for (int i = 0; i < 10; ++i) {
             ESP_LOGI(TAG, "Activating... %d/%d", i + 1, 10);
             esp_err_t err = ota.Activate();
             if (err == ESP_OK) {
+                SaveBootProtocol(ota);
                 xEventGroupSetBits(event_group_, MAIN_EVENT_CHECK_NEW_VERSION_DONE);
                 break;
             } else if (err == ESP_ERR_TIMEOUT) {
@@ -176,6 +214,127 @@ void Application::CheckNewVersion(Ota& ota) {
     }
 }
 
+// Indexed by ControlMessageType, messages without a handler are logged and dropped
+const Application::ControlHandler Application::kControlHandlers[kControlMessageTypeCount] = {
+    nullptr,                            // unknown
+    nullptr,                            // listen
+    &Application::HandleTtsMessage,
+    &Application::HandleSttMessage,
+    &Application::HandleLlmMessage,
+    nullptr,                            // abort
+    &Application::HandleMcpMessage,
+    &Application::HandleSystemMessage,
+    &Application::HandleAlertMessage,
+#if CONFIG_RECEIVE_CUSTOM_MESSAGE
+    &Application::HandleCustomMessage,
+#else
+    nullptr,                            // custom
+#endif
+    nullptr,                            // goodbye
+};
+
+// Called on the network task
+void Application::OnIncomingControl(const ControlMessage& message) {
+    auto handler = kControlHandlers[message.type];
+    if (handler == nullptr) {
+        auto name = message.type_name.empty() ? std::string_view(ControlMessageCodec::TypeName(message.type)) : message.type_name;
+        ESP_LOGW(TAG, "Unknown message type: %.*s", (int)name.size(), name.data());
+        return;
+    }
+    (this->*handler)(message);
+}
+
+void Application::HandleTtsMessage(const ControlMessage& message) {
+    if (message.state == kControlStateStart) {
+        Schedule([this]() {
+            aborted_ = false;
+            if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
+                SetDeviceState(kDeviceStateSpeaking);
+            }
+        });
+    } else if (message.state == kControlStateStop) {
+        Schedule([this]() {
+            if (device_state_ == kDeviceStateSpeaking) {
+                if (listening_mode_ == kListeningModeManualStop) {
+                    SetDeviceState(kDeviceStateIdle);
+                } else {
+                    SetDeviceState(kDeviceStateListening);
+                }
+            }
+        });
+    } else if (message.state == kControlStateSentenceStart && !message.text.empty()) {
+        ESP_LOGI(TAG, "<< %.*s", (int)message.text.size(), message.text.data());
+        Schedule([this, text = std::string(message.text)]() {
+            auto display = Board::GetInstance().GetDisplay();
+            display->SetChatMessage("assistant", text.c_str());
+        });
+    }
+}
+
+void Application::HandleSttMessage(const ControlMessage& message) {
+    if (!message.text.empty()) {
+        ESP_LOGI(TAG, ">> %.*s", (int)message.text.size(), message.text.data());
+        Schedule([this, text = std::string(message.text)]() {
+            auto display = Board::GetInstance().GetDisplay();
+            display->SetChatMessage("user", text.c_str());
+        });
+    }
+}
+
+void Application::HandleLlmMessage(const ControlMessage& message) {
+    if (!message.emotion.empty()) {
+        Schedule([this, emotion = std::string(message.emotion)]() {
+            auto display = Board::GetInstance().GetDisplay();
+            display->SetEmotion(emotion.c_str());
+        });
+    }
+}
+
+void Application::HandleMcpMessage(const ControlMessage& message) {
+    if (!message.payload.empty()) {
+        McpServer::GetInstance().ParseMessage(std::string(message.payload));
+    }
+}
+
+void Application::HandleSystemMessage(const ControlMessage& message) {
+    if (message.command.empty()) {
+        return;
+    }
+    ESP_LOGI(TAG, "System command: %.*s", (int)message.command.size(), message.command.data());
+    if (message.command == "reboot") {
+        // Do a reboot if user requests a OTA update
+        Schedule([this]() {
+            Reboot();
+        });
+    } else {
+        ESP_LOGW(TAG, "Unknown system command: %.*s", (int)message.command.size(), message.command.data());
+    }
+}
+
+void Application::HandleAlertMessage(const ControlMessage& message) {
+    if (message.status.empty() || message.message.empty() || message.emotion.empty()) {
+        ESP_LOGW(TAG, "Alert command requires status, message and emotion");
+        return;
+    }
+    Alert(std::string(message.status).c_str(), std::string(message.message).c_str(),
+        std::string(message.emotion).c_str(), Lang::Sounds::OGG_VIBRATION);
+}
+
+#if CONFIG_RECEIVE_CUSTOM_MESSAGE
+void Application::HandleCustomMessage(const ControlMessage& message) {
+    std::string payload(message.payload);
+    ESP_LOGI(TAG, "Received custom message: %s", payload.c_str());
+    if (payload.empty()) {
+        ESP_LOGW(TAG, "Invalid custom message format: missing payload");
+        return;
+    }
+    Schedule([this, payload = std::move(payload)]() {
+        auto display = Board::GetInstance().GetDisplay();
+        display->SetChatMessage("system", payload.c_str());
+    });
+}
+#endif
+
 void Application::ShowActivationCode(const std::string& code, const std::string& message) {
     struct digit_sound {
         char digit;
@@ -194,7 +353,6 @@ void Application::ShowActivationCode(const std::string& code, const std::string&
         digit_sound{'9', Lang::Sounds::OGG_9}
     }};
 
-    // This sentence uses 9KB of SRAM, so we need to wait for it to finish
     Alert(Lang::Strings::ACTIVATION, message.c_str(), "happy", Lang::Sounds::OGG_ACTIVATION);
 
     for (const auto& digit : code) {
@@ -249,6 +407,7 @@ void Application::ToggleChatState() {
         Schedule([this]() {
             if (!protocol_->IsAudioChannelOpened()) {
                 SetDeviceState(kDeviceStateConnecting);
+                SelectEncodeProfile();
                 if (!protocol_->OpenAudioChannel()) {
                     return;
                 }
@@ -286,6 +445,7 @@ void Application::StartListening() {
         Schedule([this]() {
             if (!protocol_->IsAudioChannelOpened()) {
                 SetDeviceState(kDeviceStateConnecting);
+                SelectEncodeProfile();
                 if (!protocol_->OpenAudioChannel()) {
                     return;
                 }
@@ -326,8 +486,154 @@ void Application::StopListening() {
     });
 }
 
+// Lets the next boot start the protocol without waiting for the version check
+void Application::SaveBootProtocol(Ota& ota) {
+    std::string protocol = ota.HasMqttConfig() ? "mqtt" : ota.HasWebsocketConfig() ? "websocket" : "";
+    Settings settings("boot", true);
+    if (settings.GetString("protocol") != protocol) {
+        settings.SetString("protocol", protocol);
+    }
+}
+
+// Runs the callback on the main event loop and waits for it to return
+void Application::RunOnMainTask(const std::function<void()>& callback) {
+    auto done = xSemaphoreCreateBinary();
+    Schedule([&callback, done]() {
+        callback();
+        xSemaphoreGive(done);
+    });
+    xSemaphoreTake(done, portMAX_DELAY);
+    vSemaphoreDelete(done);
+}
+
+// Runs the callback on the main event loop once the device is idle, in the same step as the idle check
+void Application::RunWhenIdle(const std::function<void()>& callback) {
+    bool done = false;
+    while (true) {
+        RunOnMainTask([this, &callback, &done]() {
+            if (CanEnterSleepMode()) {
+                callback();
+                done = true;
+            }
+        });
+        if (done) {
+            return;
+        }
+        vTaskDelay(pdMS_TO_TICKS(1000));
+    }
+}
+
+// Creates the protocol and connects its callbacks, it is started by the caller. Called once at boot, see StartCheckNewVersionTask()
+void Application::InitializeProtocol(const std::string& protocol) {
+    if (protocol == "mqtt") {
+        protocol_ = std::make_unique<MqttProtocol>();
+    } else if (protocol == "websocket") {
+        protocol_ = std::make_unique<WebsocketProtocol>();
+    } else {
+        ESP_LOGW(TAG, "No protocol specified in the OTA config, using MQTT");
+        protocol_ = std::make_unique<MqttProtocol>();
+    }
+
+    protocol_->OnNetworkError([this](const std::string& message) {
+        last_error_message_ = message;
+        xEventGroupSetBits(event_group_, MAIN_EVENT_ERROR);
+    });
+    protocol_->OnIncomingAudio([this](AudioStreamPacketPtr packet) {
+        if (device_state_ == kDeviceStateSpeaking) {
+            audio_service_.PushPacketToDecodeQueue(std::move(packet));
+        }
+    });
+    protocol_->OnAudioChannelOpened([this]() {
+        auto codec = Board::GetInstance().GetAudioCodec();
+        Board::GetInstance().SetPowerSaveMode(false);
+        if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
+            ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
+                protocol_->server_sample_rate(), codec->output_sample_rate());
+        }
+    });
+    protocol_->OnAudioChannelClosed([this]() {
+        Board::GetInstance().SetPowerSaveMode(true);
+        Schedule([this]() {
+            auto display = Board::GetInstance().GetDisplay();
+            display->SetChatMessage("system", "");
+            SetDeviceState(kDeviceStateIdle);
+        });
+    });
+    protocol_->OnIncomingControl([this](const ControlMessage& message) {
+        OnIncomingControl(message);
+    });
+}
+
+// Work that does not need the network, run while the network comes up
+void Application::StartBootTasks() {
+    xTaskCreate([](void* arg) {
+        Application* app = (Application*)arg;
+        {
+            // Registered before the protocol starts, the server lists the tools right after the hello
+            BootPhase phase("mcp_tools");
+            McpServer::GetInstance().AddCommonTools();
+        }
+        bool wake_word_ready;
+        {
+            BootPhase phase("wake_word");
+            wake_word_ready = app->audio_service_.InitializeWakeWord();
+        }
+        // Listen already, a wake word before the network is ready is answered locally.
+        // Checked again afterwards in case the board entered WiFi configuration meanwhile.
+        if (wake_word_ready && app->device_state_ == kDeviceStateStarting) {
+            app->audio_service_.EnableWakeWordDetection(true);
+            if (app->device_state_ != kDeviceStateStarting && app->device_state_ != kDeviceStateIdle) {
+                app->audio_service_.EnableWakeWordDetection(false);
+            }
+        }
+        xEventGroupSetBits(app->event_group_, MAIN_EVENT_BOOT_PREPARED);
+        vTaskDelete(NULL);
+    }, "boot_prepare", 4096 * 2, this, 2, nullptr);
+}
+
+void Application::StartCheckNewVersionTask() {
+    xTaskCreate([](void* arg) {
+        Application* app = (Application*)arg;
+        // The protocol was started from the settings of the last boot
+        std::string boot_protocol = Settings("boot", false).GetString("protocol");
+        bool has_server_time;
+        bool server_changed;
+        {
+            BootPhase phase("ota");
+            Ota ota;
+            app->CheckNewVersion(ota, true);
+            has_server_time = ota.HasServerTime();
+            server_changed = ota.HasServerConfigChanged();
+        }
+        // Back to normal after an activation or a failed upgrade
+        app->Schedule([app, has_server_time]() {
+            app->has_server_time_ = has_server_time;
+            if (app->device_state_ == kDeviceStateActivating || app->device_state_ == kDeviceStateUpgrading) {
+                app->SetDeviceState(kDeviceStateIdle);
+            }
+        });
+
+        // protocol_ is never replaced after boot: MCP tools read it from other tasks, and the protocol's own
+        // timer and tasks hold it. A new protocol type is used from the next boot, new settings of the same
+        // protocol are applied by restarting it in place
+        std::string protocol = Settings("boot", false).GetString("protocol");
+        if (!protocol.empty() && protocol != boot_protocol) {
+            ESP_LOGI(TAG, "Server switched to the %s protocol, used from the next boot", protocol.c_str());
+        } else if (!protocol.empty() && server_changed) {
+            ESP_LOGI(TAG, "Server settings changed, restarting the %s protocol", protocol.c_str());
+            app->RunWhenIdle([app]() {
+                app->protocol_->Start();
+            });
+        }
+        app->check_new_version_task_handle_ = nullptr;
+        vTaskDelete(NULL);
+    }, "check_version", 4096 * 2, this, 2, &check_new_version_task_handle_);
+}
+
 void Application::Start() {
+    int board_phase = BootProfiler::GetInstance().Begin("board");
     auto& board = Board::GetInstance();
+    BootProfiler::GetInstance().End(board_phase);
     SetDeviceState(kDeviceStateStarting);
 
     /* Setup the display */
@@ -335,14 +641,22 @@ void Application::Start() {
 
     /* Setup the audio service */
     auto codec = board.GetAudioCodec();
-    audio_service_.Initialize(codec);
-    audio_service_.Start();
+    {
+        BootPhase phase("audio");
+        audio_service_.Initialize(codec);
+        audio_service_.Start();
+    }
 
     AudioServiceCallbacks callbacks;
     callbacks.on_send_queue_available = [this]() {
         xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
     };
     callbacks.on_wake_word_detected = [this](const std::string& wake_word) {
+        // Detected while the network is still coming up, there is no server to talk to yet
+        if (device_state_ == kDeviceStateStarting) {
+            Board::GetInstance().GetDisplay()->ShowNotification(Lang::Strings::SERVER_NOT_CONNECTED);
+            return;
+        }
         xEventGroupSetBits(event_group_, MAIN_EVENT_WAKE_WORD_DETECTED);
     };
     callbacks.on_vad_change = [this](bool speaking) {
@@ -353,151 +667,48 @@ void Application::Start() {
     /* Start the clock timer to update the status bar */
     esp_timer_start_periodic(clock_timer_handle_, 1000000);
 
+    StartBootTasks();
+
     /* Wait for the network to be ready */
-    board.StartNetwork();
+    {
+        BootPhase phase("network");
+        board.StartNetwork();
+    }
 
     // Update the status bar immediately to show the network state
     display->UpdateStatusBar(true);
 
-    // Check for new firmware version or get the MQTT broker address
-    Ota ota;
-    CheckNewVersion(ota);
+    // With the protocol of the last boot known, the version check moves to the background
+    std::string protocol = Settings("boot", false).GetString("protocol");
+    if (protocol.empty()) {
+        // Check for new firmware version or get the MQTT broker address
+        BootPhase phase("ota");
+        Ota ota;
+        CheckNewVersion(ota, false);
+        has_server_time_ = ota.HasServerTime();
+        protocol = ota.HasMqttConfig() ? "mqtt" : ota.HasWebsocketConfig() ? "websocket" : "";
+    } else {
+        StartCheckNewVersionTask();
+    }
 
     // Initialize the protocol
     display->SetStatus(Lang::Strings::LOADING_PROTOCOL);
 
-    // Add MCP common tools before initializing the protocol
-    McpServer::GetInstance().AddCommonTools();
-
-    if (ota.HasMqttConfig()) {
-        protocol_ = std::make_unique<MqttProtocol>();
-    } else if (ota.HasWebsocketConfig()) {
-        protocol_ = std::make_unique<WebsocketProtocol>();
-    } else {
-        ESP_LOGW(TAG, "No protocol specified in the OTA config, using MQTT");
-        protocol_ = std::make_unique<MqttProtocol>();
+    {
+        BootPhase phase("boot_tasks");
+        xEventGroupWaitBits(event_group_, MAIN_EVENT_BOOT_PREPARED, pdTRUE, pdTRUE, portMAX_DELAY);
     }
 
-    protocol_->OnNetworkError([this](const std::string& message) {
-        last_error_message_ = message;
-        xEventGroupSetBits(event_group_, MAIN_EVENT_ERROR);
-    });
-    protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
-        if (device_state_ == kDeviceStateSpeaking) {
-            audio_service_.PushPacketToDecodeQueue(std::move(packet));
-        }
-    });
-    protocol_->OnAudioChannelOpened([this, codec, &board]() {
-        board.SetPowerSaveMode(false);
-        if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
-            ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
-                protocol_->server_sample_rate(), codec->output_sample_rate());
-        }
-    });
-    protocol_->OnAudioChannelClosed([this, &board]() {
-        board.SetPowerSaveMode(true);
-        Schedule([this]() {
-            auto display = Board::GetInstance().GetDisplay();
-            display->SetChatMessage("system", "");
-            SetDeviceState(kDeviceStateIdle);
-        });
-    });
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
-                Schedule([this]() {
-                    aborted_ = false;
-                    if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
-                        SetDeviceState(kDeviceStateSpeaking);
-                    }
-                });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
-                Schedule([this]() {
-                    if (device_state_ == kDeviceStateSpeaking) {
-                        if (listening_mode_ == kListeningModeManualStop) {
-                            SetDeviceState(kDeviceStateIdle);
-                        } else {
-                            SetDeviceState(kDeviceStateListening);
-                        }
-                    }
-                });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (cJSON_IsString(text)) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([this, display, message = std::string(text->valuestring)]() {
-                        display->SetChatMessage("assistant", message.c_str());
-                    });
-                }
-            }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (cJSON_IsString(text)) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([this, display, message = std::string(text->valuestring)]() {
-                    display->SetChatMessage("user", message.c_str());
-                });
-            }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(emotion)) {
-                Schedule([this, display, emotion_str = std::string(emotion->valuestring)]() {
-                    display->SetEmotion(emotion_str.c_str());
-                });
-            }
-        } else if (strcmp(type->valuestring, "mcp") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            if (cJSON_IsObject(payload)) {
-                McpServer::GetInstance().ParseMessage(payload);
-            }
-        } else if (strcmp(type->valuestring, "system") == 0) {
-            auto command = cJSON_GetObjectItem(root, "command");
-            if (cJSON_IsString(command)) {
-                ESP_LOGI(TAG, "System command: %s", command->valuestring);
-                if (strcmp(command->valuestring, "reboot") == 0) {
-                    // Do a reboot if user requests a OTA update
-                    Schedule([this]() {
-                        Reboot();
-                    });
-                } else {
-                    ESP_LOGW(TAG, "Unknown system command: %s", command->valuestring);
-                }
-            }
-        } else if (strcmp(type->valuestring, "alert") == 0) {
-            auto status = cJSON_GetObjectItem(root, "status");
-            auto message = cJSON_GetObjectItem(root, "message");
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(status) && cJSON_IsString(message) && cJSON_IsString(emotion)) {
-                Alert(status->valuestring, message->valuestring, emotion->valuestring, Lang::Sounds::OGG_VIBRATION);
-            } else {
-                ESP_LOGW(TAG, "Alert command requires status, message and emotion");
-            }
-#if CONFIG_RECEIVE_CUSTOM_MESSAGE
-        } else if (strcmp(type->valuestring, "custom") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            ESP_LOGI(TAG, "Received custom message: %s", cJSON_PrintUnformatted(root));
-            if (cJSON_IsObject(payload)) {
-                Schedule([this, display, payload_str = std::string(cJSON_PrintUnformatted(payload))]() {
-                    display->SetChatMessage("system", payload_str.c_str());
-                });
-            } else {
-                ESP_LOGW(TAG, "Invalid custom message format: missing payload");
-            }
-#endif
-        } else {
-            ESP_LOGW(TAG, "Unknown message type: %s", type->valuestring);
-        }
-    });
+    int protocol_phase = BootProfiler::GetInstance().Begin("protocol");
+    InitializeProtocol(protocol);
     bool protocol_started = protocol_->Start();
+    BootProfiler::GetInstance().End(protocol_phase);
 
     SetDeviceState(kDeviceStateIdle);
+    BootProfiler::GetInstance().Mark("ready");
 
-    has_server_time_ = ota.HasServerTime();
     if (protocol_started) {
-        std::string message = std::string(Lang::Strings::VERSION) + ota.GetCurrentVersion();
+        std::string message = std::string(Lang::Strings::VERSION) + esp_app_get_description()->version;
         display->ShowNotification(message.c_str());
         display->SetChatMessage("system", "");
         // Play the success sound to indicate the device is ready
@@ -506,6 +717,7 @@ void Application::Start() {
 
     // Print heap stats
     SystemInfo::PrintHeapStats();
+    BootProfiler::GetInstance().PrintTimeline();
 }
 
 void Application::OnClockTimer() {
@@ -520,6 +732,21 @@ void Application::OnClockTimer() {
         // SystemInfo::PrintTaskList();
         SystemInfo::PrintHeapStats();
     }
+    if (clock_ticks_ % 60 == 0) {
+#if CONFIG_AUDIO_DEBUG_STATS
+        AudioLatency::GetInstance().PrintStats();
+        audio_service_.PrintWakeWordGateStats();
+#endif
+#if CONFIG_WAKE_WORD_IDLE_CPU_REPORT
+        if (device_state_ == kDeviceStateIdle) {
+            // Sampling takes a second, keep it off the timer task
+            xTaskCreate([](void* arg) {
+                SystemInfo::PrintTaskCpuUsage(pdMS_TO_TICKS(1000));
+                vTaskDelete(NULL);
+            }, "cpu_usage", 4096, nullptr, 1, nullptr);
+        }
+#endif
+    }
 }
 
 // Add a async task to MainLoop
@@ -550,11 +777,10 @@ void Application::MainEventLoop() {
         }
 
         if (bits & MAIN_EVENT_SEND_AUDIO) {
-            while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (!protocol_->SendAudio(std::move(packet))) {
-                    break;
-                }
-            }
+            // Packets are popped one at a time, so those after a failed send stay queued
+            protocol_->SendAudioBatch([this]() {
+                return audio_service_.PopPacketFromSendQueue();
+            });
         }
 
         if (bits & MAIN_EVENT_WAKE_WORD_DETECTED) {
@@ -585,11 +811,26 @@ void Application::OnWakeWordDetected() {
     }
 
     if (device_state_ == kDeviceStateIdle) {
+        // The wake word audio is encoded with the profile of the channel about to be opened
+        if (!protocol_->IsAudioChannelOpened()) {
+            SelectEncodeProfile();
+        }
         audio_service_.EncodeWakeWord();
 
+        std::function<void()> send_wake_word;
+#if CONFIG_USE_AFE_WAKE_WORD || CONFIG_USE_CUSTOM_WAKE_WORD
+        bool wake_word_sent = false;
+        send_wake_word = [this, &wake_word_sent]() {
+            while (auto packet = audio_service_.PopWakeWordPacket()) {
+                protocol_->SendAudio(std::move(packet));
+            }
+            wake_word_sent = true;
+        };
+#endif
         if (!protocol_->IsAudioChannelOpened()) {
             SetDeviceState(kDeviceStateConnecting);
-            if (!protocol_->OpenAudioChannel()) {
+            // The protocol may send the wake word data while it waits for the server hello
+            if (!protocol_->OpenAudioChannel(send_wake_word)) {
                 audio_service_.EnableWakeWordDetection(true);
                 return;
             }
@@ -599,8 +840,8 @@ void Application::OnWakeWordDetected() {
         ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
 #if CONFIG_USE_AFE_WAKE_WORD || CONFIG_USE_CUSTOM_WAKE_WORD
         // Encode and send the wake word data to the server
-        while (auto packet = audio_service_.PopWakeWordPacket()) {
-            protocol_->SendAudio(std::move(packet));
+        if (!wake_word_sent) {
+            send_wake_word();
         }
         // Set the chat state to wake word detected
         protocol_->SendWakeWordDetected(wake_word);
@@ -617,6 +858,12 @@ void Application::OnWakeWordDetected() {
     }
 }
 
+void Application::SelectEncodeProfile() {
+    // Realtime chat (AEC on) is the case where shorter frames pay off
+    auto& profile = audio_service_.SelectEncodeProfile(protocol_->hello_rtt_ms(), aec_mode_ != kAecOff);
+    protocol_->SetClientFrameDuration(profile.frame_duration_ms);
+}
+
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
@@ -650,8 +897,13 @@ void Application::SetDeviceState(DeviceState state) {
         case kDeviceStateIdle:
             display->SetStatus(Lang::Strings::STANDBY);
             display->SetEmotion("neutral");
-            audio_service_.EnableVoiceProcessing(false);
+            // Wake word first, so a shared AFE front-end keeps running through the switch
             audio_service_.EnableWakeWordDetection(true);
+            audio_service_.EnableVoiceProcessing(false);
+            break;
+        case kDeviceStateWifiConfiguring:
+            // Wake word detection starts early during boot, acoustic provisioning needs the microphone
+            audio_service_.EnableWakeWordDetection(false);
             break;
         case kDeviceStateConnecting:
             display->SetStatus(Lang::Strings::CONNECTING);
@@ -674,13 +926,9 @@ void Application::SetDeviceState(DeviceState state) {
             display->SetStatus(Lang::Strings::SPEAKING);
 
             if (listening_mode_ != kListeningModeRealtime) {
+                // Only a wake word behind the AFE front-end hears past our own playback
+                audio_service_.EnableWakeWordDetection(audio_service_.IsWakeWordBargeInSupported());
                 audio_service_.EnableVoiceProcessing(false);
-                // Only AFE wake word can be detected in speaking mode
-#if CONFIG_USE_AFE_WAKE_WORD
-                audio_service_.EnableWakeWordDetection(true);
-#else
-                audio_service_.EnableWakeWordDetection(false);
-#endif
             }
             audio_service_.ResetDecoder();
             break;
@@ -768,6 +1016,15 @@ void Application::SetAecMode(AecMode mode) {
     });
 }
 
+cJSON* Application::GetChannelStatsJson() {
+    if (!protocol_) {
+        return nullptr;
+    }
+    auto json = protocol_->GetChannelStatsJson();
+    cJSON_AddNumberToObject(json, "uplink_backlog", audio_service_.GetSendQueueSize());
+    return json;
+}
+
 void Application::PlaySound(const std::string_view& sound) {
     audio_service_.PlaySound(sound);
 }
\ No newline at end of file
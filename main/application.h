@@ -23,6 +23,7 @@
 #define MAIN_EVENT_VAD_CHANGE (1 << 3)
 #define MAIN_EVENT_ERROR (1 << 4)
 #define MAIN_EVENT_CHECK_NEW_VERSION_DONE (1 << 5)
+#define MAIN_EVENT_BOOT_PREPARED (1 << 6)
 
 enum AecMode {
     kAecOff,
@@ -60,6 +61,8 @@ public:
     AecMode GetAecMode() const { return aec_mode_; }
     void PlaySound(const std::string_view& sound);
     AudioService& GetAudioService() { return audio_service_; }
+    // Link metrics of the audio channel plus the uplink backlog, nullptr before the protocol starts
+    cJSON* GetChannelStatsJson();
 
 private:
     Application();
@@ -81,8 +84,28 @@ private:
     int clock_ticks_ = 0;
     TaskHandle_t check_new_version_task_handle_ = nullptr;
 
+    using ControlHandler = void (Application::*)(const ControlMessage& message);
+    static const ControlHandler kControlHandlers[kControlMessageTypeCount];
+
+    void OnIncomingControl(const ControlMessage& message);
+    void HandleTtsMessage(const ControlMessage& message);
+    void HandleSttMessage(const ControlMessage& message);
+    void HandleLlmMessage(const ControlMessage& message);
+    void HandleMcpMessage(const ControlMessage& message);
+    void HandleSystemMessage(const ControlMessage& message);
+    void HandleAlertMessage(const ControlMessage& message);
+#if CONFIG_RECEIVE_CUSTOM_MESSAGE
+    void HandleCustomMessage(const ControlMessage& message);
+#endif
     void OnWakeWordDetected();
-    void CheckNewVersion(Ota& ota);
+    void SelectEncodeProfile();
+    void CheckNewVersion(Ota& ota, bool background);
+    void StartCheckNewVersionTask();
+    void SaveBootProtocol(Ota& ota);
+    void RunOnMainTask(const std::function<void()>& callback);
+    void RunWhenIdle(const std::function<void()>& callback);
+    void InitializeProtocol(const std::string& protocol);
+    void StartBootTasks();
     void ShowActivationCode(const std::string& code, const std::string& message);
     void OnClockTimer();
     void SetListeningMode(ListeningMode mode);
@@ -0,0 +1,149 @@
+#include "audio_activity_gate.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+#include <cstdlib>
+
+// Audio kept while closed, replayed ahead of the chunk that opens the gate
+#define GATE_LOOKBACK_MS 320
+// A wake word is about one second long, keep feeding for a while after its last loud chunk
+#define GATE_HANGOVER_MS 1500
+// Mean absolute level below which the gate never opens, about -58 dBFS
+#define GATE_MIN_LEVEL 40
+// Below this frequency a chunk is rumble or handling noise rather than voice
+#define GATE_MIN_FREQUENCY_HZ 80
+
+#define TAG "AudioActivityGate"
+
+AudioActivityGate::AudioActivityGate() {
+}
+
+AudioActivityGate::~AudioActivityGate() {
+    if (ring_ != nullptr) {
+        heap_caps_free(ring_);
+    }
+}
+
+bool AudioActivityGate::Configure(size_t chunk_samples, int channels, int chunk_ms) {
+    if (chunk_samples == chunk_samples_ && channels == channels_ && ring_ != nullptr) {
+        return true;
+    }
+    if (ring_ != nullptr) {
+        heap_caps_free(ring_);
+        ring_ = nullptr;
+    }
+    chunk_samples_ = 0;
+    if (chunk_samples == 0 || chunk_ms <= 0) {
+        return false;
+    }
+
+    slots_ = (GATE_LOOKBACK_MS + chunk_ms - 1) / chunk_ms;
+    size_t size = slots_ * chunk_samples * sizeof(int16_t);
+    ring_ = (int16_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (ring_ == nullptr) {
+        ring_ = (int16_t*)heap_caps_malloc(size, MALLOC_CAP_DEFAULT);
+    }
+    if (ring_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes of look-back", (unsigned)size);
+        return false;
+    }
+
+    chunk_samples_ = chunk_samples;
+    channels_ = channels;
+    // A tone of f Hz crosses zero 2 * f times per second
+    min_crossings_ = 2 * GATE_MIN_FREQUENCY_HZ * chunk_ms / 1000;
+    hangover_chunks_ = GATE_HANGOVER_MS / chunk_ms;
+    Reset();
+    ESP_LOGI(TAG, "Gate chunk: %u samples, %d ms, look-back: %d chunks", (unsigned)chunk_samples, chunk_ms, slots_);
+    return true;
+}
+
+void AudioActivityGate::Reset() {
+    head_ = 0;
+    held_ = 0;
+    hangover_ = 0;
+    open_ = false;
+}
+
+bool AudioActivityGate::IsActive(const int16_t* data) {
+    int frames = chunk_samples_ / channels_;
+    uint32_t sum = 0;
+    int crossings = 0;
+    int16_t previous = data[0];
+    for (int i = 0, j = 0; i < frames; i++, j += channels_) {
+        int16_t sample = data[j];
+        sum += abs(sample);
+        // The sign bit of the xor is set when the signs differ
+        crossings += (sample ^ previous) < 0;
+        previous = sample;
+    }
+
+    int32_t level_q4 = (int32_t)((sum << 4) / frames);
+    if (floor_q4_ < 0) {
+        floor_q4_ = level_q4;
+    }
+    bool active = level_q4 > 2 * floor_q4_ && level_q4 >= (GATE_MIN_LEVEL << 4) && crossings >= min_crossings_;
+
+    // Follow a falling floor quickly and a rising one slowly, so speech barely lifts it but a fan does
+    if (level_q4 < floor_q4_) {
+        floor_q4_ += (level_q4 - floor_q4_) >> 2;
+    } else {
+        floor_q4_ += (level_q4 - floor_q4_) >> (active ? 8 : 5);
+    }
+    return active;
+}
+
+bool AudioActivityGate::Push(const std::vector<int16_t>& chunk) {
+    if (ring_ == nullptr || chunk.size() != chunk_samples_) {
+        return true;
+    }
+
+    total_chunks_++;
+    if (IsActive(chunk.data())) {
+        if (!open_) {
+            onsets_++;
+        }
+        open_ = true;
+        hangover_ = hangover_chunks_;
+    } else if (open_ && --hangover_ <= 0) {
+        open_ = false;
+    }
+
+    if (open_) {
+        open_chunks_++;
+        return true;
+    }
+
+    // The oldest chunk is overwritten once the look-back is full
+    memcpy(ring_ + head_ * chunk_samples_, chunk.data(), chunk_samples_ * sizeof(int16_t));
+    head_ = (head_ + 1) % slots_;
+    if (held_ < slots_) {
+        held_++;
+    }
+    return false;
+}
+
+bool AudioActivityGate::PopHeld(std::vector<int16_t>& chunk) {
+    if (held_ == 0) {
+        return false;
+    }
+    int index = (head_ - held_ + slots_) % slots_;
+    held_--;
+    open_chunks_++;
+    chunk.assign(ring_ + index * chunk_samples_, ring_ + (index + 1) * chunk_samples_);
+    return true;
+}
+
+void AudioActivityGate::PrintStats() {
+    uint32_t total = total_chunks_.exchange(0, std::memory_order_relaxed);
+    uint32_t open = open_chunks_.exchange(0, std::memory_order_relaxed);
+    uint32_t onsets = onsets_.exchange(0, std::memory_order_relaxed);
+    if (total == 0) {
+        return;
+    }
+    // Replayed look-back chunks count as fed
+    uint32_t permille = open * 1000 / total;
+    ESP_LOGI(TAG, "Wake word model fed %lu.%lu%% of %lu chunks, onsets: %lu, noise floor: %ld",
+        permille / 10, permille % 10, total, onsets, floor_q4_ >> 4);
+}
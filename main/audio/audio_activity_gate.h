@@ -0,0 +1,54 @@
+#ifndef AUDIO_ACTIVITY_GATE_H
+#define AUDIO_ACTIVITY_GATE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/*
+ * Cheap first stage in front of the wake word model.
+ *
+ * Each input chunk is scored with its mean absolute level and zero crossing count in integer math. The gate
+ * opens when the level rises 6 dB above a tracked noise floor with enough crossings to be voice rather than
+ * rumble, and stays open for a hangover after the last active chunk. While closed, the chunks are kept in a
+ * short look-back ring and replayed when the gate opens, so the model still sees the onset of the word.
+ */
+class AudioActivityGate {
+public:
+    AudioActivityGate();
+    ~AudioActivityGate();
+
+    // chunk_samples counts all interleaved channels, the level is measured on the first one
+    bool Configure(size_t chunk_samples, int channels, int chunk_ms);
+    size_t chunk_samples() const { return chunk_samples_; }
+    // Closes the gate and drops the held chunks
+    void Reset();
+    // False if the chunk was held back, otherwise PopHeld() returns the held chunks before this one
+    bool Push(const std::vector<int16_t>& chunk);
+    bool PopHeld(std::vector<int16_t>& chunk);
+
+    // Logs the share of audio passed to the model since the last call, may be called from any task
+    void PrintStats();
+
+private:
+    int16_t* ring_ = nullptr;
+    size_t chunk_samples_ = 0;
+    int channels_ = 1;
+    int slots_ = 0;
+    int head_ = 0;
+    int held_ = 0;
+    int min_crossings_ = 0;
+    int hangover_chunks_ = 0;
+    int hangover_ = 0;
+    bool open_ = false;
+    // Noise floor in Q4, negative until the first chunk
+    int32_t floor_q4_ = -1;
+    std::atomic<uint32_t> total_chunks_{0};
+    std::atomic<uint32_t> open_chunks_{0};
+    std::atomic<uint32_t> onsets_{0};
+
+    bool IsActive(const int16_t* data);
+};
+
+#endif // AUDIO_ACTIVITY_GATE_H
@@ -0,0 +1,67 @@
+#include "audio_dsp.h"
+
+#include <algorithm>
+#include <cmath>
+
+int32_t AudioDsp::VolumeToGain(int volume) {
+    volume = std::clamp(volume, 0, 100);
+    return pow(double(volume) / 100.0, 2) * 65536;
+}
+
+void AudioDsp::ApplyGain16To32(const int16_t* __restrict in, int32_t* __restrict out, int samples, int32_t gain_q16) {
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        out[i] = in[i] * gain_q16;
+        out[i + 1] = in[i + 1] * gain_q16;
+        out[i + 2] = in[i + 2] * gain_q16;
+        out[i + 3] = in[i + 3] * gain_q16;
+    }
+    for (; i < samples; i++) {
+        out[i] = in[i] * gain_q16;
+    }
+}
+
+static inline int16_t Saturate16(int32_t value) {
+    return std::clamp<int32_t>(value, INT16_MIN, INT16_MAX);
+}
+
+void AudioDsp::Narrow32To16(const int32_t* __restrict in, int16_t* __restrict out, int samples, int shift) {
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        out[i] = Saturate16(in[i] >> shift);
+        out[i + 1] = Saturate16(in[i + 1] >> shift);
+        out[i + 2] = Saturate16(in[i + 2] >> shift);
+        out[i + 3] = Saturate16(in[i + 3] >> shift);
+    }
+    for (; i < samples; i++) {
+        out[i] = Saturate16(in[i] >> shift);
+    }
+}
+
+void AudioDsp::Deinterleave(const int16_t* __restrict in, int16_t* __restrict left, int16_t* __restrict right, int frames) {
+    for (int i = 0; i < frames; i++) {
+        left[i] = in[2 * i];
+        right[i] = in[2 * i + 1];
+    }
+}
+
+void AudioDsp::Interleave(const int16_t* __restrict left, const int16_t* __restrict right, int16_t* __restrict out, int frames) {
+    for (int i = 0; i < frames; i++) {
+        out[2 * i] = left[i];
+        out[2 * i + 1] = right[i];
+    }
+}
+
+void AudioDsp::ExtractChannel(const int16_t* in, int16_t* out, int frames, int channels, int channel) {
+    // Writes never overtake reads, so this also works in place
+    in += channel;
+    for (int i = 0; i < frames; i++) {
+        out[i] = in[i * channels];
+    }
+}
+
+void AudioDsp::DownmixStereo(const int16_t* in, int16_t* out, int frames) {
+    for (int i = 0; i < frames; i++) {
+        out[i] = (static_cast<int32_t>(in[2 * i]) + in[2 * i + 1]) >> 1;
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef AUDIO_DSP_H
+#define AUDIO_DSP_H
+
+#include <cstdint>
+
+/*
+ * PCM kernels shared by the codecs and the audio service.
+ *
+ * The loops work on caller-owned buffers and never allocate. Gain and narrowing are branch
+ * free and unrolled by four, saturation compiles to the Xtensa MIN/MAX instructions.
+ */
+class AudioDsp {
+public:
+    // Q16 gain for an output volume of 0-100, squared to follow perceived loudness
+    static int32_t VolumeToGain(int volume);
+    // out = in * gain_q16, gain_q16 is at most 65536 so the product always fits in 32 bits
+    static void ApplyGain16To32(const int16_t* in, int32_t* out, int samples, int32_t gain_q16);
+    // out = saturate16(in >> shift)
+    static void Narrow32To16(const int32_t* in, int16_t* out, int samples, int shift);
+    // Splits interleaved stereo frames into two channels
+    static void Deinterleave(const int16_t* in, int16_t* left, int16_t* right, int frames);
+    // Merges two channels into interleaved stereo frames
+    static void Interleave(const int16_t* left, const int16_t* right, int16_t* out, int frames);
+    // Copies one channel of interleaved frames, out may be the same buffer as in
+    static void ExtractChannel(const int16_t* in, int16_t* out, int frames, int channels, int channel);
+    // Averages interleaved stereo frames to mono, out may be the same buffer as in
+    static void DownmixStereo(const int16_t* in, int16_t* out, int frames);
+};
+
+#endif // AUDIO_DSP_H
@@ -0,0 +1,173 @@
+#include "audio_jitter_buffer.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "AudioJitterBuffer"
+
+AudioJitterBuffer::AudioJitterBuffer(size_t capacity) : slots_(capacity) {
+}
+
+void AudioJitterBuffer::Put(AudioStreamPacketPtr packet, int64_t now_ms) {
+    stats_.received++;
+    if (packet->frame_duration > 0) {
+        frame_duration_ = packet->frame_duration;
+    }
+
+    // Packets from the websocket and local sounds arrive in order without a sequence number
+    uint32_t sequence = packet->sequence != 0 ? packet->sequence : last_sequence_ + 1;
+    bool active = playing_ || count_ > 0;
+    if (active && count_ == 0 && now_ms - last_arrival_ms_ > ARRIVAL_JITTER_STREAM_PAUSE_MS) {
+        // A new utterance, buffer it up again before playing
+        playing_ = false;
+        active = false;
+    }
+    if (dry_) {
+        // Running dry is only an underrun if the utterance goes on, not at its end
+        if (active) {
+            stats_.underruns++;
+        }
+        dry_ = false;
+    }
+    last_arrival_ms_ = now_ms;
+    if (!started_) {
+        started_ = true;
+        next_sequence_ = sequence;
+        last_sequence_ = sequence;
+    }
+
+    int32_t offset = static_cast<int32_t>(sequence - next_sequence_);
+    if (offset < 0) {
+        stats_.late++;
+        return;
+    }
+    if (offset >= static_cast<int32_t>(slots_.size())) {
+        // The sender restarted its sequence, or playout fell too far behind to catch up
+        ESP_LOGW(TAG, "Sequence jumped from %lu to %lu, resyncing", next_sequence_, sequence);
+        for (auto& slot : slots_) {
+            if (slot.packet) {
+                Drop(slot);
+            }
+        }
+        next_sequence_ = sequence;
+        last_sequence_ = sequence;
+        playing_ = false;
+        active = false;
+    }
+
+    Slot& slot = SlotFor(sequence);
+    if (slot.packet) {
+        return; // Duplicate
+    }
+    if (static_cast<int32_t>(sequence - last_sequence_) < 0) {
+        stats_.reordered++;
+    } else {
+        last_sequence_ = sequence;
+    }
+
+    // RFC 3550 inter-arrival jitter, measured only while a stream is flowing
+    int64_t media_ms = packet->timestamp != 0 ? packet->timestamp : (int64_t)sequence * frame_duration_;
+    if (!active) {
+        jitter_.Restart();
+    }
+    jitter_.Add(now_ms, media_ms);
+    if (active) {
+        stats_.jitter_ms = jitter_.jitter_ms();
+        int target = JITTER_BUFFER_MIN_FRAMES +
+            (JITTER_BUFFER_JITTER_MULTIPLIER * stats_.jitter_ms + frame_duration_ - 1) / frame_duration_;
+        stats_.target_frames = std::clamp<int>(target, JITTER_BUFFER_MIN_FRAMES, slots_.size() / 2);
+    }
+
+    slot.packet = std::move(packet);
+    slot.arrival_ms = now_ms;
+    count_++;
+}
+
+JitterBufferResult AudioJitterBuffer::Get(AudioStreamPacketPtr& packet, int64_t now_ms) {
+    if (count_ == 0) {
+        // The playback queue holds two frames, nothing for longer than that means it ran dry
+        if (playing_ && !dry_ && now_ms - last_output_ms_ > 2 * frame_duration_) {
+            dry_ = true;
+        }
+        return kJitterBufferEmpty;
+    }
+
+    if (!playing_) {
+        if (Span() < stats_.target_frames && WaitedMs(now_ms) < TargetDelayMs()) {
+            return kJitterBufferWait;
+        }
+        // Nothing was playing, so there is no audio to conceal before the first buffered packet
+        while (!SlotFor(next_sequence_).packet) {
+            next_sequence_++;
+        }
+        playing_ = true;
+    }
+
+    Slot& slot = SlotFor(next_sequence_);
+    if (slot.packet) {
+        packet = std::move(slot.packet);
+        count_--;
+        next_sequence_++;
+        last_output_ms_ = now_ms;
+        dry_ = false;
+        return kJitterBufferPacket;
+    }
+
+    // Give a missing packet the target delay to turn up, unless more than enough audio is queued behind it
+    if (count_ <= stats_.target_frames && WaitedMs(now_ms) < TargetDelayMs()) {
+        return kJitterBufferWait;
+    }
+    stats_.concealed++;
+    next_sequence_++;
+    last_output_ms_ = now_ms;
+    return kJitterBufferConceal;
+}
+
+int AudioJitterBuffer::GetWaitTimeMs(int64_t now_ms) const {
+    if (count_ == 0) {
+        return -1;
+    }
+    if (playing_) {
+        if (slots_[next_sequence_ % slots_.size()].packet || count_ > stats_.target_frames) {
+            return -1;
+        }
+    } else if (Span() >= stats_.target_frames) {
+        return -1;
+    }
+    int64_t remaining = TargetDelayMs() - WaitedMs(now_ms);
+    return remaining > 0 ? remaining : 1;
+}
+
+void AudioJitterBuffer::Reset() {
+    for (auto& slot : slots_) {
+        if (slot.packet) {
+            Drop(slot);
+        }
+    }
+    started_ = false;
+    playing_ = false;
+    dry_ = false;
+    jitter_.Restart();
+}
+
+uint32_t AudioJitterBuffer::Span() const {
+    if (count_ == 0) {
+        return 0;
+    }
+    return last_sequence_ - next_sequence_ + 1;
+}
+
+int64_t AudioJitterBuffer::WaitedMs(int64_t now_ms) const {
+    int64_t oldest = now_ms;
+    for (auto& slot : slots_) {
+        if (slot.packet && slot.arrival_ms < oldest) {
+            oldest = slot.arrival_ms;
+        }
+    }
+    return now_ms - oldest;
+}
+
+void AudioJitterBuffer::Drop(Slot& slot) {
+    slot.packet.reset();
+    count_--;
+}
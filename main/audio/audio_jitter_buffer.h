@@ -0,0 +1,83 @@
+#ifndef AUDIO_JITTER_BUFFER_H
+#define AUDIO_JITTER_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "protocol.h"
+#include "arrival_jitter.h"
+
+#define JITTER_BUFFER_MIN_FRAMES 1
+#define JITTER_BUFFER_JITTER_MULTIPLIER 3
+
+enum JitterBufferResult {
+    kJitterBufferEmpty,     // Nothing buffered
+    kJitterBufferWait,      // Buffering, or waiting for a missing / late packet
+    kJitterBufferPacket,    // The next packet in sequence order is ready
+    kJitterBufferConceal,   // The next packet is lost, the decoder should conceal it
+};
+
+struct JitterBufferStats {
+    uint32_t received = 0;
+    uint32_t reordered = 0;     // Arrived after a packet with a higher sequence, but in time
+    uint32_t late = 0;          // Arrived after its slot was played or concealed, dropped
+    uint32_t concealed = 0;
+    uint32_t underruns = 0;     // Playout ran dry in the middle of an utterance
+    uint32_t jitter_ms = 0;     // Smoothed inter-arrival jitter (RFC 3550)
+    uint32_t target_frames = JITTER_BUFFER_MIN_FRAMES;
+};
+
+/*
+ * Reorders incoming Opus packets by sequence number and paces the start of playout.
+ *
+ * Each utterance starts playing once the target depth is buffered, or the oldest packet has
+ * waited for the target delay. The target depth follows the measured inter-arrival jitter,
+ * so a clean link plays with about one frame of delay while a jittery one buffers more.
+ * A missing packet is waited for up to the target delay before it is reported as lost.
+ *
+ * Packets without a sequence number (websocket, local sounds) are numbered on arrival.
+ * Only the opus codec task touches the buffer, except Size() which is safe from any task.
+ */
+class AudioJitterBuffer {
+public:
+    explicit AudioJitterBuffer(size_t capacity);
+
+    void Put(AudioStreamPacketPtr packet, int64_t now_ms);
+    JitterBufferResult Get(AudioStreamPacketPtr& packet, int64_t now_ms);
+    // How long the caller may sleep before Get() can make progress, -1 for no timeout
+    int GetWaitTimeMs(int64_t now_ms) const;
+    void Reset();
+
+    size_t Size() const { return count_; }
+    bool Full() const { return count_ >= slots_.size(); }
+    const JitterBufferStats& stats() const { return stats_; }
+
+private:
+    struct Slot {
+        AudioStreamPacketPtr packet;
+        int64_t arrival_ms = 0;
+    };
+
+    std::vector<Slot> slots_;
+    std::atomic<size_t> count_ = 0;
+    bool started_ = false;      // next_sequence_ is valid
+    bool playing_ = false;
+    bool dry_ = false;
+    uint32_t next_sequence_ = 0;
+    uint32_t last_sequence_ = 0;
+    int frame_duration_ = 60;
+    int64_t last_arrival_ms_ = 0;
+    int64_t last_output_ms_ = 0;
+    ArrivalJitter jitter_;
+    JitterBufferStats stats_;
+
+    Slot& SlotFor(uint32_t sequence) { return slots_[sequence % slots_.size()]; }
+    uint32_t Span() const;
+    // How long the oldest buffered packet has been waiting
+    int64_t WaitedMs(int64_t now_ms) const;
+    int64_t TargetDelayMs() const { return (int64_t)stats_.target_frames * frame_duration_; }
+    void Drop(Slot& slot);
+};
+
+#endif // AUDIO_JITTER_BUFFER_H
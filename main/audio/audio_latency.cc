@@ -0,0 +1,106 @@
+#include "audio_latency.h"
+
+#include <esp_log.h>
+#include <cJSON.h>
+
+#define TAG "AudioLatency"
+
+static const char* const kStageNames[kAudioLatencyStageCount] = {
+    "capture",
+    "encode_queue",
+    "encode",
+    "send_queue",
+    "uplink",
+    "decode",
+    "playback",
+    "downlink",
+};
+
+static int BucketIndex(uint32_t us) {
+    if (us < 4) {
+        return us;
+    }
+    int octave = 31 - __builtin_clz(us);
+    int index = (octave - 1) * 4 + ((us >> (octave - 2)) & 3);
+    return index < AUDIO_LATENCY_BUCKETS ? index : AUDIO_LATENCY_BUCKETS - 1;
+}
+
+static uint32_t BucketUpperBound(int index) {
+    if (index < 4) {
+        return index + 1;
+    }
+    int octave = index / 4 + 1;
+    return (uint32_t)(5 + index % 4) << (octave - 2);
+}
+
+void AudioLatency::Record(AudioLatencyStage stage, int64_t latency_us) {
+    if (latency_us < 0) {
+        return;
+    }
+    uint32_t us = latency_us > UINT32_MAX ? UINT32_MAX : latency_us;
+    auto& histogram = histograms_[stage];
+    histogram.buckets[BucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+    uint32_t max_us = histogram.max_us.load(std::memory_order_relaxed);
+    while (us > max_us && !histogram.max_us.compare_exchange_weak(max_us, us, std::memory_order_relaxed)) {
+    }
+}
+
+uint32_t AudioLatency::GetPercentile(AudioLatencyStage stage, int percentile) const {
+    auto& histogram = histograms_[stage];
+    uint32_t count = histogram.count.load(std::memory_order_relaxed);
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t target = ((uint64_t)count * percentile + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < AUDIO_LATENCY_BUCKETS; i++) {
+        seen += histogram.buckets[i].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            return BucketUpperBound(i);
+        }
+    }
+    return histogram.max_us.load(std::memory_order_relaxed);
+}
+
+void AudioLatency::Reset() {
+    for (auto& histogram : histograms_) {
+        for (auto& bucket : histogram.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        histogram.count.store(0, std::memory_order_relaxed);
+        histogram.max_us.store(0, std::memory_order_relaxed);
+    }
+}
+
+std::string AudioLatency::GetStatsJson() const {
+    cJSON* root = cJSON_CreateObject();
+    for (int i = 0; i < kAudioLatencyStageCount; i++) {
+        auto stage = static_cast<AudioLatencyStage>(i);
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "count", histograms_[i].count.load(std::memory_order_relaxed));
+        cJSON_AddNumberToObject(item, "p50_ms", GetPercentile(stage, 50) / 1000.0);
+        cJSON_AddNumberToObject(item, "p95_ms", GetPercentile(stage, 95) / 1000.0);
+        cJSON_AddNumberToObject(item, "p99_ms", GetPercentile(stage, 99) / 1000.0);
+        cJSON_AddNumberToObject(item, "max_ms", histograms_[i].max_us.load(std::memory_order_relaxed) / 1000.0);
+        cJSON_AddItemToObject(root, kStageNames[i], item);
+    }
+    auto json_str = cJSON_PrintUnformatted(root);
+    std::string json(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return json;
+}
+
+void AudioLatency::PrintStats() const {
+    for (int i = 0; i < kAudioLatencyStageCount; i++) {
+        auto stage = static_cast<AudioLatencyStage>(i);
+        uint32_t count = histograms_[i].count.load(std::memory_order_relaxed);
+        if (count == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%-12s count: %lu, p50: %lu us, p95: %lu us, p99: %lu us, max: %lu us", kStageNames[i], count,
+            GetPercentile(stage, 50), GetPercentile(stage, 95), GetPercentile(stage, 99),
+            histograms_[i].max_us.load(std::memory_order_relaxed));
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef AUDIO_LATENCY_H
+#define AUDIO_LATENCY_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/*
+ * Latency of each audio pipeline stage, measured per frame with esp_timer_get_time().
+ *
+ * Uplink frames are stamped when the newest input chunk is read from I2S, downlink frames
+ * when they are received from the network. The uplink total does not include the frame
+ * duration itself, which the processor needs to collect a full frame.
+ */
+enum AudioLatencyStage {
+    kAudioLatencyCapture,       // I2S read to audio processor output (AFE)
+    kAudioLatencyEncodeQueue,   // Processor output to encode start
+    kAudioLatencyEncode,        // Encode start to encode end
+    kAudioLatencySendQueue,     // Encode end to handed to the protocol
+    kAudioLatencyUplink,        // I2S read to handed to the protocol
+    kAudioLatencyDecode,        // Received to decoded, including the jitter buffer
+    kAudioLatencyPlayback,      // Decoded to written to I2S
+    kAudioLatencyDownlink,      // Received to written to I2S
+    kAudioLatencyStageCount,
+};
+
+// 4 buckets per octave of microseconds, about 19% resolution up to 16 seconds
+#define AUDIO_LATENCY_BUCKETS 92
+
+/*
+ * Lock-free latency histograms, Record() may be called from any task.
+ */
+class AudioLatency {
+public:
+    static AudioLatency& GetInstance() {
+        static AudioLatency instance;
+        return instance;
+    }
+    AudioLatency(const AudioLatency&) = delete;
+    AudioLatency& operator=(const AudioLatency&) = delete;
+
+    void Record(AudioLatencyStage stage, int64_t latency_us);
+    // Upper bound of the bucket holding the percentile, in microseconds
+    uint32_t GetPercentile(AudioLatencyStage stage, int percentile) const;
+    uint32_t GetCount(AudioLatencyStage stage) const { return histograms_[stage].count.load(std::memory_order_relaxed); }
+    void Reset();
+    std::string GetStatsJson() const;
+    void PrintStats() const;
+
+private:
+    AudioLatency() = default;
+    ~AudioLatency() = default;
+
+    struct Histogram {
+        std::atomic<uint32_t> buckets[AUDIO_LATENCY_BUCKETS] = {};
+        std::atomic<uint32_t> count = 0;
+        std::atomic<uint32_t> max_us = 0;
+    };
+
+    Histogram histograms_[kAudioLatencyStageCount];
+};
+
+#endif // AUDIO_LATENCY_H
@@ -0,0 +1,59 @@
+#include "audio_pool.h"
+
+#include <esp_log.h>
+
+#define TAG "AudioPool"
+
+#if CONFIG_AUDIO_POOL_IN_PSRAM
+#define AUDIO_POOL_MALLOC_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+#define AUDIO_POOL_MALLOC_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+
+void AudioStreamPacketDeleter::operator()(AudioStreamPacket* packet) const {
+    AudioPool::GetInstance().ReleasePacket(packet);
+}
+
+void AudioTaskDeleter::operator()(AudioTask* task) const {
+    AudioPool::GetInstance().ReleaseTask(task);
+}
+
+void AudioPool::Initialize(size_t max_packets, size_t max_tasks) {
+    if (!packets_.Initialize(max_packets, AUDIO_POOL_MALLOC_CAPS)) {
+        ESP_LOGE(TAG, "Failed to allocate %u packets, falling back to heap", max_packets);
+    }
+    if (!tasks_.Initialize(max_tasks, AUDIO_POOL_MALLOC_CAPS)) {
+        ESP_LOGE(TAG, "Failed to allocate %u tasks, falling back to heap", max_tasks);
+    }
+    ESP_LOGI(TAG, "Audio pool initialized, packets: %u, tasks: %u", max_packets, max_tasks);
+}
+
+AudioStreamPacketPtr AudioPool::AcquirePacket() {
+    auto packet = packets_.Acquire();
+    packet->sample_rate = 0;
+    packet->frame_duration = 0;
+    packet->timestamp = 0;
+    packet->sequence = 0;
+    packet->origin_time_us = 0;
+    packet->stage_time_us = 0;
+    packet->payload.clear();
+    return AudioStreamPacketPtr(packet);
+}
+
+AudioTaskPtr AudioPool::AcquireTask() {
+    auto task = tasks_.Acquire();
+    task->type = kAudioTaskTypeEncodeToSendQueue;
+    task->timestamp = 0;
+    task->origin_time_us = 0;
+    task->stage_time_us = 0;
+    task->pcm.clear();
+    return AudioTaskPtr(task);
+}
+
+void AudioPool::ReleasePacket(AudioStreamPacket* packet) {
+    packets_.Release(packet);
+}
+
+void AudioPool::ReleaseTask(AudioTask* task) {
+    tasks_.Release(task);
+}
@@ -0,0 +1,132 @@
+#ifndef AUDIO_POOL_H
+#define AUDIO_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <esp_heap_caps.h>
+
+#include "protocol.h"
+#include "audio_service.h"
+
+struct AudioPoolStats {
+    size_t capacity = 0;
+    size_t in_use = 0;
+    size_t peak_in_use = 0;
+    uint32_t fallback_allocations = 0; // Pool was exhausted and the object came from the heap
+};
+
+/*
+ * A fixed-capacity slab of objects allocated once from the given heap caps.
+ * Released objects keep their vector capacity, so after warm-up a pooled object
+ * is reused without touching the heap. Objects that do not fit in the pool are
+ * allocated with new and deleted on release.
+ */
+template <typename T>
+class ObjectPool {
+public:
+    ObjectPool() = default;
+    ~ObjectPool() {
+        if (slab_ != nullptr) {
+            for (size_t i = 0; i < capacity_; i++) {
+                slab_[i].~T();
+            }
+            heap_caps_free(slab_);
+        }
+    }
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    bool Initialize(size_t capacity, uint32_t caps) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (slab_ != nullptr) {
+            return true;
+        }
+        slab_ = (T*)heap_caps_malloc(sizeof(T) * capacity, caps);
+        if (slab_ == nullptr) {
+            return false;
+        }
+        capacity_ = capacity;
+        free_list_.reserve(capacity);
+        for (size_t i = 0; i < capacity; i++) {
+            free_list_.push_back(new (&slab_[i]) T());
+        }
+        return true;
+    }
+
+    T* Acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_list_.empty()) {
+                T* object = free_list_.back();
+                free_list_.pop_back();
+                in_use_++;
+                if (in_use_ > peak_in_use_) {
+                    peak_in_use_ = in_use_;
+                }
+                return object;
+            }
+            fallback_allocations_++;
+        }
+        return new T();
+    }
+
+    void Release(T* object) {
+        if (slab_ == nullptr || object < slab_ || object >= slab_ + capacity_) {
+            delete object;
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_list_.push_back(object);
+        in_use_--;
+    }
+
+    AudioPoolStats GetStats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        AudioPoolStats stats;
+        stats.capacity = capacity_;
+        stats.in_use = in_use_;
+        stats.peak_in_use = peak_in_use_;
+        stats.fallback_allocations = fallback_allocations_;
+        return stats;
+    }
+
+private:
+    std::mutex mutex_;
+    T* slab_ = nullptr;
+    size_t capacity_ = 0;
+    std::vector<T*> free_list_;
+    size_t in_use_ = 0;
+    size_t peak_in_use_ = 0;
+    uint32_t fallback_allocations_ = 0;
+};
+
+class AudioPool {
+public:
+    static AudioPool& GetInstance() {
+        static AudioPool instance;
+        return instance;
+    }
+    AudioPool(const AudioPool&) = delete;
+    AudioPool& operator=(const AudioPool&) = delete;
+
+    void Initialize(size_t max_packets, size_t max_tasks);
+    AudioStreamPacketPtr AcquirePacket();
+    AudioTaskPtr AcquireTask();
+    void ReleasePacket(AudioStreamPacket* packet);
+    void ReleaseTask(AudioTask* task);
+    AudioPoolStats GetPacketStats() { return packets_.GetStats(); }
+    AudioPoolStats GetTaskStats() { return tasks_.GetStats(); }
+
+private:
+    AudioPool() = default;
+    ~AudioPool() = default;
+
+    ObjectPool<AudioStreamPacket> packets_;
+    ObjectPool<AudioTask> tasks_;
+};
+
+#endif // AUDIO_POOL_H
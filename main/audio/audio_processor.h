@@ -12,10 +12,13 @@ public:
     virtual ~AudioProcessor() = default;
     
     virtual void Initialize(AudioCodec* codec, int frame_duration_ms) = 0;
+    // Changes the output frame size, only while the processor is stopped
+    virtual void SetFrameDuration(int frame_duration_ms) = 0;
     virtual void Feed(std::vector<int16_t>&& data) = 0;
     virtual void Start() = 0;
     virtual void Stop() = 0;
     virtual bool IsRunning() = 0;
+    // The callback copies what it keeps, so the processor and the input task can reuse their buffers
     virtual void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) = 0;
     virtual void OnVadStateChange(std::function<void(bool speaking)> callback) = 0;
     virtual size_t GetFeedSize() = 0;
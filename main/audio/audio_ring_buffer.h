@@ -0,0 +1,112 @@
+#ifndef AUDIO_RING_BUFFER_H
+#define AUDIO_RING_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/*
+ * A preallocated single-producer / single-consumer ring buffer.
+ *
+ * Push() must only be called by the producer and Pop() only by the consumer, the other
+ * methods are safe to call from any task. The counters run freely and are masked into
+ * the slot array, so the slot count is rounded up to a power of two while Push() still
+ * honours the requested capacity.
+ *
+ * SetCapacity() lowers the number of items Push() accepts below the slot count, for queues whose
+ * depth is given in time while the duration of an item changes at runtime.
+ *
+ * Clear() may be called from any task. It records the current write position and the
+ * consumer drops everything before that position on its next Pop(), so items pushed
+ * after Clear() returns are kept.
+ */
+template <typename T, size_t Capacity>
+class AudioRingBuffer {
+public:
+    static_assert(Capacity > 0, "Capacity must be greater than 0");
+
+    bool Push(T&& item) {
+        uint32_t head = head_.load();
+        if (head - tail_.load() >= capacity_.load()) {
+            return false;
+        }
+        slots_[head & kMask] = std::move(item);
+        head_.store(head + 1);
+        return true;
+    }
+
+    // was_full is set if the producer may be waiting for free space
+    bool Pop(T& item, bool* was_full = nullptr) {
+        uint32_t tail = tail_.load();
+        uint32_t next = DiscardCleared(tail);
+        bool popped = next != head_.load();
+        if (popped) {
+            item = std::move(slots_[next & kMask]);
+            tail_.store(next + 1);
+        }
+        if (was_full != nullptr) {
+            *was_full = head_.load() - tail >= capacity_.load();
+        }
+        return popped;
+    }
+
+    // Items already queued above a lowered capacity stay until they are popped
+    void SetCapacity(size_t capacity) {
+        capacity_.store(capacity < 1 ? 1 : capacity > Capacity ? Capacity : capacity);
+    }
+
+    size_t capacity() const { return capacity_.load(); }
+
+    void Clear() {
+        clear_until_.store(head_.load());
+    }
+
+    size_t Size() const {
+        uint32_t head = head_.load();
+        uint32_t tail = tail_.load();
+        uint32_t clear_until = clear_until_.load();
+        if (static_cast<int32_t>(clear_until - tail) > 0) {
+            tail = clear_until;
+        }
+        return head - tail;
+    }
+
+    bool Empty() const { return Size() == 0; }
+
+    // Unlike Size(), this counts items still waiting to be discarded by the consumer
+    bool Full() const { return head_.load() - tail_.load() >= capacity_.load(); }
+
+private:
+    static constexpr size_t RoundUpPowerOfTwo(size_t n) {
+        size_t v = 1;
+        while (v < n) {
+            v <<= 1;
+        }
+        return v;
+    }
+
+    static constexpr uint32_t kMask = RoundUpPowerOfTwo(Capacity) - 1;
+
+    std::array<T, kMask + 1> slots_{};
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> clear_until_{0};
+    std::atomic<size_t> capacity_{Capacity};
+
+    uint32_t DiscardCleared(uint32_t tail) {
+        uint32_t clear_until = clear_until_.load();
+        if (static_cast<int32_t>(clear_until - tail) <= 0) {
+            return tail;
+        }
+        while (tail != clear_until) {
+            slots_[tail & kMask] = T();
+            ++tail;
+        }
+        tail_.store(tail);
+        return tail;
+    }
+};
+
+#endif // AUDIO_RING_BUFFER_H
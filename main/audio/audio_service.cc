@@ -1,6 +1,13 @@
 #include "audio_service.h"
+#include "audio_dsp.h"
+#include "audio_pool.h"
 #include <esp_log.h>
 #include <cstring>
+#include <algorithm>
+
+#if CONFIG_USE_AUDIO_PROCESSOR || CONFIG_USE_AFE_WAKE_WORD
+#include "processors/afe_frontend.h"
+#endif
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
@@ -18,9 +25,18 @@
 
 #define TAG "AudioService"
 
+// Longer frames need less CPU and bandwidth per second of audio, shorter frames cut latency
+static const OpusEncodeProfile kOpusEncodeProfiles[] = {
+    {"low_latency", 20, 0},
+    {"balanced", 40, 0},
+    {"default", 60, 0},
+    {"robust", 120, 3},
+};
+
 
 AudioService::AudioService() {
     event_group_ = xEventGroupCreate();
+    SetUplinkQueueDepths(OPUS_FRAME_DURATION_MS);
 }
 
 AudioService::~AudioService() {
@@ -34,34 +50,44 @@ void AudioService::Initialize(AudioCodec* codec) {
     codec_ = codec;
     codec_->Start();
 
+    AudioPool::GetInstance().Initialize(AUDIO_POOL_MAX_PACKETS, AUDIO_POOL_MAX_TASKS);
+
     /* Setup the audio codec */
     opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_->SetComplexity(0);
+    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, encode_frame_duration_ms_);
+    opus_encoder_->SetComplexity(encoder_complexity_);
 
     if (codec->input_sample_rate() != 16000) {
         input_resampler_.Configure(codec->input_sample_rate(), 16000);
         reference_resampler_.Configure(codec->input_sample_rate(), 16000);
     }
 
+#if CONFIG_USE_AFE_WAKE_WORD
+    afe_frontend_ = std::make_unique<AfeFrontend>(true);
+#elif CONFIG_USE_AUDIO_PROCESSOR
+    afe_frontend_ = std::make_unique<AfeFrontend>(false);
+#endif
+
 #if CONFIG_USE_AUDIO_PROCESSOR
-    audio_processor_ = std::make_unique<AfeAudioProcessor>();
+    audio_processor_ = std::make_unique<AfeAudioProcessor>(afe_frontend_.get());
 #else
     audio_processor_ = std::make_unique<NoAudioProcessor>();
 #endif
 
 #if CONFIG_USE_AFE_WAKE_WORD
-    wake_word_ = std::make_unique<AfeWakeWord>();
+    wake_word_ = std::make_unique<AfeWakeWord>(afe_frontend_.get());
 #elif CONFIG_USE_ESP_WAKE_WORD
     wake_word_ = std::make_unique<EspWakeWord>();
+#elif CONFIG_USE_CUSTOM_WAKE_WORD && CONFIG_USE_AUDIO_PROCESSOR
+    wake_word_ = std::make_unique<CustomWakeWord>(afe_frontend_.get());
 #elif CONFIG_USE_CUSTOM_WAKE_WORD
-    wake_word_ = std::make_unique<CustomWakeWord>();
+    wake_word_ = std::make_unique<CustomWakeWord>(nullptr);
 #else
     wake_word_ = nullptr;
 #endif
 
     audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
-        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
+        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, data);
     });
 
     audio_processor_->OnVadStateChange([this](bool speaking) {
@@ -95,6 +121,9 @@ void AudioService::Initialize(AudioCodec* codec) {
 void AudioService::Start() {
     service_stopped_ = false;
     xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+    xEventGroupClearBits(event_group_, AS_EVENT_PLAYBACK_NOT_EMPTY | AS_EVENT_PLAYBACK_NOT_FULL |
+        AS_EVENT_ENCODE_NOT_EMPTY | AS_EVENT_ENCODE_NOT_FULL |
+        AS_EVENT_DECODE_NOT_EMPTY | AS_EVENT_DECODE_NOT_FULL | AS_EVENT_SEND_NOT_FULL);
 
     esp_timer_start_periodic(audio_power_timer_, 1000000);
 
@@ -143,12 +172,15 @@ void AudioService::Stop() {
         AS_EVENT_WAKE_WORD_RUNNING |
         AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    audio_encode_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    audio_encode_queue_.Clear();
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
+
+    /* Wake up every task waiting on a queue so it can see the service is stopped */
+    xEventGroupSetBits(event_group_, AS_EVENT_PLAYBACK_NOT_EMPTY | AS_EVENT_PLAYBACK_NOT_FULL |
+        AS_EVENT_ENCODE_NOT_EMPTY | AS_EVENT_ENCODE_NOT_FULL |
+        AS_EVENT_DECODE_NOT_EMPTY | AS_EVENT_DECODE_NOT_FULL | AS_EVENT_SEND_NOT_FULL);
 }
 
 bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
@@ -164,25 +196,21 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
             return false;
         }
         if (codec_->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
-            }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
-            }
+            int frames = data.size() / 2;
+            mic_buffer_.resize(frames);
+            reference_buffer_.resize(frames);
+            AudioDsp::Deinterleave(data.data(), mic_buffer_.data(), reference_buffer_.data(), frames);
+            int resampled_frames = input_resampler_.GetOutputSamples(frames);
+            resampled_mic_buffer_.resize(resampled_frames);
+            resampled_reference_buffer_.resize(reference_resampler_.GetOutputSamples(frames));
+            input_resampler_.Process(mic_buffer_.data(), frames, resampled_mic_buffer_.data());
+            reference_resampler_.Process(reference_buffer_.data(), frames, resampled_reference_buffer_.data());
+            data.resize(resampled_frames * 2);
+            AudioDsp::Interleave(resampled_mic_buffer_.data(), resampled_reference_buffer_.data(), data.data(), resampled_frames);
         } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+            resampled_mic_buffer_.resize(input_resampler_.GetOutputSamples(data.size()));
+            input_resampler_.Process(data.data(), data.size(), resampled_mic_buffer_.data());
+            data.swap(resampled_mic_buffer_);
         }
     } else {
         data.resize(samples * codec_->input_channels());
@@ -215,42 +243,61 @@ void AudioService::AudioInputTask() {
         if (service_stopped_) {
             break;
         }
-        if (audio_input_need_warmup_) {
-            audio_input_need_warmup_ = false;
-            vTaskDelay(pdMS_TO_TICKS(120));
-            continue;
-        }
 
         /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button */
         if (bits & AS_EVENT_AUDIO_TESTING_RUNNING) {
-            if (audio_testing_queue_.size() >= AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS) {
+            if (audio_testing_queue_.Full()) {
                 ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
                 EnableAudioTesting(false);
                 continue;
             }
-            std::vector<int16_t> data;
-            int samples = OPUS_FRAME_DURATION_MS * 16000 / 1000;
+            auto& data = input_buffer_;
+            int samples = encode_frame_duration_ms_ * 16000 / 1000;
             if (ReadAudioData(data, 16000, samples)) {
                 // If input channels is 2, we need to fetch the left channel data
                 if (codec_->input_channels() == 2) {
-                    auto mono_data = std::vector<int16_t>(data.size() / 2);
-                    for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                        mono_data[i] = data[j];
-                    }
-                    data = std::move(mono_data);
+                    AudioDsp::ExtractChannel(data.data(), data.data(), data.size() / 2, 2, 0);
+                    data.resize(data.size() / 2);
                 }
-                PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(data));
+                PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, data);
                 continue;
             }
         }
 
+#if CONFIG_USE_AUDIO_PROCESSOR || CONFIG_USE_AFE_WAKE_WORD
+        /* Feed the AFE front-end once, it serves the wake word and the audio processor at the same time */
+        if (bits & (AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING)) {
+            auto& data = input_buffer_;
+            int samples = afe_frontend_->GetFeedSize();
+            if (samples > 0) {
+                if (ReadAudioData(data, 16000, samples)) {
+                    if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
+                        last_capture_time_us_ = esp_timer_get_time();
+                        afe_frontend_->Feed(data);
+                    } else if (GateWakeWordInput(data, samples)) {
+                        while (wake_word_gate_.PopHeld(wake_word_gate_buffer_)) {
+                            afe_frontend_->Feed(wake_word_gate_buffer_);
+                        }
+                        afe_frontend_->Feed(data);
+                    }
+                    continue;
+                }
+            }
+        }
+#endif
+
         /* Feed the wake word */
         if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
-            std::vector<int16_t> data;
+            auto& data = input_buffer_;
             int samples = wake_word_->GetFeedSize();
             if (samples > 0) {
                 if (ReadAudioData(data, 16000, samples)) {
-                    wake_word_->Feed(data);
+                    if (GateWakeWordInput(data, samples)) {
+                        while (wake_word_gate_.PopHeld(wake_word_gate_buffer_)) {
+                            wake_word_->Feed(wake_word_gate_buffer_);
+                        }
+                        wake_word_->Feed(data);
+                    }
                     continue;
                 }
             }
@@ -258,10 +305,11 @@ void AudioService::AudioInputTask() {
 
         /* Feed the audio processor */
         if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
-            std::vector<int16_t> data;
+            auto& data = input_buffer_;
             int samples = audio_processor_->GetFeedSize();
             if (samples > 0) {
                 if (ReadAudioData(data, 16000, samples)) {
+                    last_capture_time_us_ = esp_timer_get_time();
                     audio_processor_->Feed(std::move(data));
                     continue;
                 }
@@ -275,37 +323,59 @@ void AudioService::AudioInputTask() {
     ESP_LOGW(TAG, "Audio input task stopped");
 }
 
+// False if the input was quiet and held back, the held chunks are replayed once the gate opens
+bool AudioService::GateWakeWordInput(const std::vector<int16_t>& data, int samples) {
+#if CONFIG_WAKE_WORD_ENERGY_GATE
+#if CONFIG_USE_AUDIO_PROCESSOR || CONFIG_USE_AFE_WAKE_WORD
+    // Dropping chunks would break the continuity of the reference the AFE cancels the echo with
+    if (afe_frontend_ != nullptr && codec_->input_reference()) {
+        return true;
+    }
+#endif
+    if (wake_word_gate_reset_requested_.exchange(false)) {
+        wake_word_gate_.Reset();
+    }
+    if (!wake_word_gate_.Configure(data.size(), codec_->input_channels(), samples * 1000 / 16000)) {
+        return true;
+    }
+    return wake_word_gate_.Push(data);
+#else
+    return true;
+#endif
+}
+
 void AudioService::AudioOutputTask() {
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
-        if (service_stopped_) {
-            break;
-        }
-
-        auto task = std::move(audio_playback_queue_.front());
-        audio_playback_queue_.pop_front();
-        audio_queue_cv_.notify_all();
-        lock.unlock();
-
-        if (!codec_->output_enabled()) {
-            esp_timer_stop(audio_power_timer_);
-            esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
-            codec_->EnableOutput(true);
-        }
-        codec_->OutputData(task->pcm);
+        xEventGroupWaitBits(event_group_, AS_EVENT_PLAYBACK_NOT_EMPTY, pdTRUE, pdFALSE, portMAX_DELAY);
+
+        AudioTaskPtr task;
+        while (!service_stopped_ && PopFromQueue(audio_playback_queue_, task, AS_EVENT_PLAYBACK_NOT_FULL)) {
+            if (!codec_->output_enabled()) {
+                esp_timer_stop(audio_power_timer_);
+                esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+                codec_->EnableOutput(true);
+            }
+            codec_->OutputData(task->pcm);
+            if (task->origin_time_us > 0) {
+                auto now = esp_timer_get_time();
+                AudioLatency::GetInstance().Record(kAudioLatencyPlayback, now - task->stage_time_us);
+                AudioLatency::GetInstance().Record(kAudioLatencyDownlink, now - task->origin_time_us);
+            }
 
-        /* Update the last output time */
-        last_output_time_ = std::chrono::steady_clock::now();
-        debug_statistics_.playback_count++;
+            /* Update the last output time */
+            last_output_time_ = std::chrono::steady_clock::now();
+            debug_statistics_.playback_count++;
 
 #if CONFIG_USE_SERVER_AEC
-        /* Record the timestamp for server AEC */
-        if (task->timestamp > 0) {
-            lock.lock();
-            timestamp_queue_.push_back(task->timestamp);
-        }
+            /* Record the timestamp for server AEC */
+            if (task->timestamp > 0) {
+                timestamp_queue_.Push(uint32_t(task->timestamp));
+            }
 #endif
+        }
+        if (service_stopped_) {
+            break;
+        }
     }
 
     ESP_LOGW(TAG, "Audio output task stopped");
@@ -313,77 +383,139 @@ void AudioService::AudioOutputTask() {
 
 void AudioService::OpusCodecTask() {
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() {
-            return service_stopped_ ||
-                (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
-        });
-        if (service_stopped_) {
-            break;
+        int64_t now_ms = esp_timer_get_time() / 1000;
+        int wait_ms = jitter_buffer_.GetWaitTimeMs(now_ms);
+        if (send_pending_since_ms_ >= 0) {
+            int send_wait_ms = std::max<int64_t>(CONFIG_AUDIO_SEND_COALESCE_MS - (now_ms - send_pending_since_ms_), 1);
+            wait_ms = wait_ms < 0 ? send_wait_ms : std::min(wait_ms, send_wait_ms);
         }
+        xEventGroupWaitBits(event_group_, AS_EVENT_ENCODE_NOT_EMPTY | AS_EVENT_DECODE_NOT_EMPTY |
+            AS_EVENT_PLAYBACK_NOT_FULL | AS_EVENT_SEND_NOT_FULL, pdTRUE, pdFALSE,
+            wait_ms < 0 ? portMAX_DELAY : pdMS_TO_TICKS(wait_ms) + 1);
+
+        /* Keep working until neither the decoder nor the encoder can make progress */
+        bool busy = true;
+        while (busy && !service_stopped_) {
+            busy = false;
+            now_ms = esp_timer_get_time() / 1000;
+
+            if (decoder_reset_requested_.exchange(false)) {
+                const auto& stats = jitter_buffer_.stats();
+                ESP_LOGI(TAG, "Jitter buffer: received %lu, reordered %lu, late %lu, concealed %lu, jitter %lu ms, target %lu frames",
+                    stats.received, stats.reordered, stats.late, stats.concealed, stats.jitter_ms, stats.target_frames);
+                jitter_buffer_.Reset();
+                opus_decoder_->ResetState();
+                prompt_ = nullptr;
+            }
 
-        /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
-            auto packet = std::move(audio_decode_queue_.front());
-            audio_decode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto task = std::make_unique<AudioTask>();
-            task->type = kAudioTaskTypeDecodeToPlaybackQueue;
-            task->timestamp = packet->timestamp;
-
-            SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_->Decode(std::move(packet->payload), task->pcm)) {
-                // Resample if the sample rate is different
-                if (opus_decoder_->sample_rate() != codec_->output_sample_rate()) {
-                    int target_size = output_resampler_.GetOutputSamples(task->pcm.size());
-                    std::vector<int16_t> resampled(target_size);
-                    output_resampler_.Process(task->pcm.data(), task->pcm.size(), resampled.data());
-                    task->pcm = std::move(resampled);
-                }
+            /* Feed the sound being played a few packets ahead of playout, so it never fills the jitter buffer */
+            FeedPrompt(now_ms);
 
-                lock.lock();
-                audio_playback_queue_.push_back(std::move(task));
-                audio_queue_cv_.notify_all();
-            } else {
-                ESP_LOGE(TAG, "Failed to decode audio");
-                lock.lock();
+            /* Move the received packets into the jitter buffer */
+            AudioStreamPacketPtr packet;
+            while (!jitter_buffer_.Full() && PopFromQueue(audio_decode_queue_, packet, AS_EVENT_DECODE_NOT_FULL)) {
+                jitter_buffer_.Put(std::move(packet), now_ms);
             }
-            debug_statistics_.decode_count++;
-        }
-        
-        /* Encode the audio to send queue */
-        if (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) {
-            auto task = std::move(audio_encode_queue_.front());
-            audio_encode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->frame_duration = OPUS_FRAME_DURATION_MS;
-            packet->sample_rate = 16000;
-            packet->timestamp = task->timestamp;
-            if (!opus_encoder_->Encode(std::move(task->pcm), packet->payload)) {
-                ESP_LOGE(TAG, "Failed to encode audio");
-                continue;
+
+            /* Decode the audio from the jitter buffer, or replay the audio testing queue */
+            if (!audio_playback_queue_.Full()) {
+                auto result = jitter_buffer_.Get(packet, now_ms);
+                if (result == kJitterBufferEmpty && !(xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_TESTING_RUNNING) &&
+                    audio_testing_queue_.Pop(packet)) {
+                    result = kJitterBufferPacket;
+                    packet->origin_time_us = 0; // Recorded audio is not part of the downlink latency
+                }
+                if (result == kJitterBufferPacket || result == kJitterBufferConceal) {
+                    busy = true;
+                    auto task = AudioPool::GetInstance().AcquireTask();
+                    task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+
+                    bool decoded;
+                    if (result == kJitterBufferPacket) {
+                        task->timestamp = packet->timestamp;
+                        task->origin_time_us = packet->origin_time_us;
+                        SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
+                        decoded = opus_decoder_->Decode(std::move(packet->payload), task->pcm);
+                    } else {
+                        // An empty payload makes the decoder conceal the lost frame from its state (Opus PLC)
+                        decoded = opus_decoder_->Decode(std::vector<uint8_t>(), task->pcm);
+                    }
+                    if (decoded) {
+                        // Resample if the sample rate is different
+                        if (opus_decoder_->sample_rate() != codec_->output_sample_rate()) {
+                            // Swap with the scratch buffer so both keep their capacity
+                            resample_buffer_.resize(output_resampler_.GetOutputSamples(task->pcm.size()));
+                            output_resampler_.Process(task->pcm.data(), task->pcm.size(), resample_buffer_.data());
+                            task->pcm.swap(resample_buffer_);
+                        }
+                        if (task->origin_time_us > 0) {
+                            task->stage_time_us = esp_timer_get_time();
+                            AudioLatency::GetInstance().Record(kAudioLatencyDecode, task->stage_time_us - task->origin_time_us);
+                        }
+                        PushToQueue(audio_playback_queue_, task, AS_EVENT_PLAYBACK_NOT_EMPTY);
+                    } else {
+                        ESP_LOGE(TAG, "Failed to decode audio");
+                    }
+                    debug_statistics_.decode_count++;
+                }
             }
 
-            if (task->type == kAudioTaskTypeEncodeToSendQueue) {
-                {
-                    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-                    audio_send_queue_.push_back(std::move(packet));
+            /* Encode the audio to send queue */
+            AudioTaskPtr task;
+            if (!audio_send_queue_.Full() && PopFromQueue(audio_encode_queue_, task, AS_EVENT_ENCODE_NOT_FULL)) {
+                busy = true;
+                // The frame duration follows the processor output, which changes with the encode profile
+                int frame_duration = task->pcm.size() * 1000 / 16000;
+                if (opus_encoder_->duration_ms() != frame_duration) {
+                    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, frame_duration);
+                    opus_encoder_->SetComplexity(encoder_complexity_);
+                }
+                if (encoder_complexity_ != encode_complexity_) {
+                    encoder_complexity_ = encode_complexity_;
+                    opus_encoder_->SetComplexity(encoder_complexity_);
+                }
+
+                auto packet = AudioPool::GetInstance().AcquirePacket();
+                packet->frame_duration = frame_duration;
+                packet->sample_rate = 16000;
+                packet->timestamp = task->timestamp;
+                int64_t encode_start_time = esp_timer_get_time();
+                if (!opus_encoder_->Encode(std::move(task->pcm), packet->payload)) {
+                    ESP_LOGE(TAG, "Failed to encode audio");
+                    continue;
+                }
+                int64_t encode_end_time = esp_timer_get_time();
+                if (task->origin_time_us > 0) {
+                    AudioLatency::GetInstance().Record(kAudioLatencyEncodeQueue, encode_start_time - task->stage_time_us);
+                    AudioLatency::GetInstance().Record(kAudioLatencyEncode, encode_end_time - encode_start_time);
+                    packet->origin_time_us = task->origin_time_us;
+                    packet->stage_time_us = encode_end_time;
+                }
+                // Microseconds of encoding per millisecond of audio is the load in permille
+                int load = (encode_end_time - encode_start_time) / frame_duration;
+                encode_load_permille_ = encode_load_permille_ + (load - encode_load_permille_) / 8;
+
+                if (task->type == kAudioTaskTypeEncodeToSendQueue) {
+                    if (PushToQueue(audio_send_queue_, packet, 0) && send_pending_since_ms_ < 0) {
+                        send_pending_since_ms_ = now_ms;
+                    }
+                } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
+                    PushToQueue(audio_testing_queue_, packet, 0);
                 }
+                debug_statistics_.encode_count++;
+            }
+
+            /* Wake the send queue consumer once per coalescing window, or earlier if the queue is filling up */
+            if (send_pending_since_ms_ >= 0 && (now_ms - send_pending_since_ms_ >= CONFIG_AUDIO_SEND_COALESCE_MS ||
+                audio_send_queue_.Size() >= audio_send_queue_.capacity() / 2)) {
+                send_pending_since_ms_ = -1;
                 if (callbacks_.on_send_queue_available) {
                     callbacks_.on_send_queue_available();
                 }
-            } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
-                std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-                audio_testing_queue_.push_back(std::move(packet));
             }
-            debug_statistics_.encode_count++;
-            lock.lock();
+        }
+        if (service_stopped_) {
+            break;
         }
     }
 
@@ -405,57 +537,75 @@ void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
     }
 }
 
-void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm) {
-    auto task = std::make_unique<AudioTask>();
+// Copies the samples into the pooled task, whose buffer keeps its capacity from frame to frame
+void AudioService::PushTaskToEncodeQueue(AudioTaskType type, const std::vector<int16_t>& pcm) {
+    auto task = AudioPool::GetInstance().AcquireTask();
     task->type = type;
-    task->pcm = std::move(pcm);
-    
-    /* Push the task to the encode queue */
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
+    task->pcm.assign(pcm.begin(), pcm.end());
 
     /* If the task is to send queue, we need to set the timestamp */
-    if (type == kAudioTaskTypeEncodeToSendQueue && !timestamp_queue_.empty()) {
-        if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
-            task->timestamp = timestamp_queue_.front();
-        } else {
-            ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        task->origin_time_us = last_capture_time_us_;
+        task->stage_time_us = esp_timer_get_time();
+        if (task->origin_time_us > 0) {
+            AudioLatency::GetInstance().Record(kAudioLatencyCapture, task->stage_time_us - task->origin_time_us);
+        }
+
+        size_t pending = timestamp_queue_.Size();
+        uint32_t timestamp = 0;
+        if (timestamp_queue_.Pop(timestamp)) {
+            if (pending <= MAX_TIMESTAMPS_IN_QUEUE) {
+                task->timestamp = timestamp;
+            } else {
+                ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", pending);
+            }
         }
-        timestamp_queue_.pop_front();
     }
 
-    audio_queue_cv_.wait(lock, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; });
-    audio_encode_queue_.push_back(std::move(task));
-    audio_queue_cv_.notify_all();
+    /* Push the task to the encode queue */
+    while (!PushToQueue(audio_encode_queue_, task, AS_EVENT_ENCODE_NOT_EMPTY)) {
+        if (service_stopped_) {
+            return;
+        }
+        xEventGroupWaitBits(event_group_, AS_EVENT_ENCODE_NOT_FULL, pdTRUE, pdFALSE, portMAX_DELAY);
+    }
 }
 
-bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
-        if (wait) {
-            audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
-        } else {
+bool AudioService::PushPacketToDecodeQueue(AudioStreamPacketPtr packet, bool wait) {
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(decode_queue_mutex_);
+            if (PushToQueue(audio_decode_queue_, packet, AS_EVENT_DECODE_NOT_EMPTY)) {
+                return true;
+            }
+        }
+        if (!wait || service_stopped_) {
             return false;
         }
+        xEventGroupWaitBits(event_group_, AS_EVENT_DECODE_NOT_FULL, pdTRUE, pdFALSE, portMAX_DELAY);
+    }
+}
+
+// The packet is about to be handed to the protocol
+static void RecordSendLatency(const AudioStreamPacket& packet) {
+    if (packet.origin_time_us > 0) {
+        auto now = esp_timer_get_time();
+        AudioLatency::GetInstance().Record(kAudioLatencySendQueue, now - packet.stage_time_us);
+        AudioLatency::GetInstance().Record(kAudioLatencyUplink, now - packet.origin_time_us);
     }
-    audio_decode_queue_.push_back(std::move(packet));
-    audio_queue_cv_.notify_all();
-    return true;
 }
 
-std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    if (audio_send_queue_.empty()) {
-        return nullptr;
+AudioStreamPacketPtr AudioService::PopPacketFromSendQueue() {
+    AudioStreamPacketPtr packet;
+    if (PopFromQueue(audio_send_queue_, packet, AS_EVENT_SEND_NOT_FULL)) {
+        RecordSendLatency(*packet);
     }
-    auto packet = std::move(audio_send_queue_.front());
-    audio_send_queue_.pop_front();
-    audio_queue_cv_.notify_all();
     return packet;
 }
 
 void AudioService::EncodeWakeWord() {
     if (wake_word_) {
-        wake_word_->EncodeWakeWordData();
+        wake_word_->EncodeWakeWordData(encode_frame_duration_ms_);
     }
 }
 
@@ -463,14 +613,30 @@ const std::string& AudioService::GetLastWakeWord() const {
     return wake_word_->GetLastDetectedWakeWord();
 }
 
-std::unique_ptr<AudioStreamPacket> AudioService::PopWakeWordPacket() {
-    auto packet = std::make_unique<AudioStreamPacket>();
+AudioStreamPacketPtr AudioService::PopWakeWordPacket() {
+    auto packet = AudioPool::GetInstance().AcquirePacket();
     if (wake_word_->GetWakeWordOpus(packet->payload)) {
         return packet;
     }
     return nullptr;
 }
 
+bool AudioService::InitializeWakeWord() {
+    if (!wake_word_) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
+    if (!wake_word_initialized_) {
+        if (!wake_word_->Initialize(codec_)) {
+            ESP_LOGE(TAG, "Failed to initialize wake word");
+            return false;
+        }
+        wake_word_initialized_ = true;
+    }
+    return true;
+}
+
 void AudioService::EnableWakeWordDetection(bool enable) {
     if (!wake_word_) {
         return;
@@ -478,14 +644,12 @@ void AudioService::EnableWakeWordDetection(bool enable) {
 
     ESP_LOGD(TAG, "%s wake word detection", enable ? "Enabling" : "Disabling");
     if (enable) {
-        if (!wake_word_initialized_) {
-            if (!wake_word_->Initialize(codec_)) {
-                ESP_LOGE(TAG, "Failed to initialize wake word");
-                return;
-            }
-            wake_word_initialized_ = true;
+        if (!InitializeWakeWord()) {
+            return;
         }
         wake_word_->Start();
+        // Audio held back before the last detection must not be replayed
+        wake_word_gate_reset_requested_ = true;
         xEventGroupSetBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
     } else {
         wake_word_->Stop();
@@ -497,13 +661,13 @@ void AudioService::EnableVoiceProcessing(bool enable) {
     ESP_LOGD(TAG, "%s voice processing", enable ? "Enabling" : "Disabling");
     if (enable) {
         if (!audio_processor_initialized_) {
-            audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS);
+            audio_processor_->Initialize(codec_, encode_frame_duration_ms_);
             audio_processor_initialized_ = true;
         }
+        audio_processor_->SetFrameDuration(encode_frame_duration_ms_);
 
         /* We should make sure no audio is playing */
         ResetDecoder();
-        audio_input_need_warmup_ = true;
         audio_processor_->Start();
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
     } else {
@@ -512,23 +676,36 @@ void AudioService::EnableVoiceProcessing(bool enable) {
     }
 }
 
+bool AudioService::IsWakeWordBargeInSupported() const {
+#if CONFIG_USE_AUDIO_PROCESSOR || CONFIG_USE_AFE_WAKE_WORD
+    return wake_word_ != nullptr;
+#else
+    return false;
+#endif
+}
+
+void AudioService::PrintWakeWordGateStats() {
+#if CONFIG_WAKE_WORD_ENERGY_GATE
+    wake_word_gate_.PrintStats();
+#endif
+}
+
 void AudioService::EnableAudioTesting(bool enable) {
     ESP_LOGI(TAG, "%s audio testing", enable ? "Enabling" : "Disabling");
     if (enable) {
+        audio_testing_queue_.Clear();
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
     } else {
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-        /* Copy audio_testing_queue_ to audio_decode_queue_ */
-        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-        audio_decode_queue_ = std::move(audio_testing_queue_);
-        audio_queue_cv_.notify_all();
+        /* The opus codec task plays back audio_testing_queue_ once testing is stopped */
+        xEventGroupSetBits(event_group_, AS_EVENT_DECODE_NOT_EMPTY);
     }
 }
 
 void AudioService::EnableDeviceAec(bool enable) {
     ESP_LOGI(TAG, "%s device AEC", enable ? "Enabling" : "Disabling");
     if (!audio_processor_initialized_) {
-        audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS);
+        audio_processor_->Initialize(codec_, encode_frame_duration_ms_);
         audio_processor_initialized_ = true;
     }
 
@@ -546,111 +723,106 @@ void AudioService::PlaySound(const std::string_view& ogg) {
         codec_->EnableOutput(true);
     }
 
-    const uint8_t* buf = reinterpret_cast<const uint8_t*>(ogg.data());
-    size_t size = ogg.size();
-    size_t offset = 0;
-
-    auto find_page = [&](size_t start)->size_t {
-        for (size_t i = start; i + 4 <= size; ++i) {
-            if (buf[i] == 'O' && buf[i+1] == 'g' && buf[i+2] == 'g' && buf[i+3] == 'S') return i;
+    {
+        std::lock_guard<std::mutex> lock(prompt_mutex_);
+        auto sound = ogg;
+        if (!prompt_queue_.Push(std::move(sound))) {
+            ESP_LOGW(TAG, "Too many sounds queued, dropping one");
+            return;
         }
-        return static_cast<size_t>(-1);
-    };
-
-    bool seen_head = false;
-    bool seen_tags = false;
-    int sample_rate = 16000; // 默认值
+        prompt_active_ = true;
+    }
+    xEventGroupSetBits(event_group_, AS_EVENT_DECODE_NOT_EMPTY);
+}
 
-    while (true) {
-        size_t pos = find_page(offset);
-        if (pos == static_cast<size_t>(-1)) break;
-        offset = pos;
-        if (offset + 27 > size) break;
-
-        const uint8_t* page = buf + offset;
-        uint8_t page_segments = page[26];
-        size_t seg_table_off = offset + 27;
-        if (seg_table_off + page_segments > size) break;
-
-        size_t body_size = 0;
-        for (size_t i = 0; i < page_segments; ++i) body_size += page[27 + i];
-
-        size_t body_off = seg_table_off + page_segments;
-        if (body_off + body_size > size) break;
-
-        // Parse packets using lacing
-        size_t cur = body_off;
-        size_t seg_idx = 0;
-        while (seg_idx < page_segments) {
-            size_t pkt_len = 0;
-            size_t pkt_start = cur;
-            bool continued = false;
-            do {
-                uint8_t l = page[27 + seg_idx++];
-                pkt_len += l;
-                cur += l;
-                continued = (l == 255);
-            } while (continued && seg_idx < page_segments);
-
-            if (pkt_len == 0) continue;
-            const uint8_t* pkt_ptr = buf + pkt_start;
-
-            if (!seen_head) {
-                // 解析OpusHead包
-                if (pkt_len >= 19 && std::memcmp(pkt_ptr, "OpusHead", 8) == 0) {
-                    seen_head = true;
-                    
-                    // OpusHead结构：[0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip
-                    // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
-                    if (pkt_len >= 12) {
-                        uint8_t version = pkt_ptr[8];
-                        uint8_t channel_count = pkt_ptr[9];
-                        
-                        if (pkt_len >= 16) {
-                            // 读取输入采样率 (little-endian)
-                            sample_rate = pkt_ptr[12] | (pkt_ptr[13] << 8) | 
-                                        (pkt_ptr[14] << 16) | (pkt_ptr[15] << 24);
-                            ESP_LOGI(TAG, "OpusHead: version=%d, channels=%d, sample_rate=%d", 
-                                   version, channel_count, sample_rate);
-                        }
-                    }
+void AudioService::FeedPrompt(int64_t now_ms) {
+    while (jitter_buffer_.Size() < PROMPT_PREFETCH_PACKETS) {
+        if (prompt_ == nullptr) {
+            std::string_view ogg;
+            {
+                std::lock_guard<std::mutex> lock(prompt_mutex_);
+                if (!prompt_queue_.Pop(ogg)) {
+                    prompt_active_ = false;
+                    return;
                 }
-                continue;
             }
-            if (!seen_tags) {
-                // Expect OpusTags in second packet
-                if (pkt_len >= 8 && std::memcmp(pkt_ptr, "OpusTags", 8) == 0) {
-                    seen_tags = true;
-                }
-                continue;
+            auto it = prompt_index_.find(ogg.data());
+            if (it == prompt_index_.end()) {
+                it = prompt_index_.emplace(ogg.data(), OggPrompt(ogg)).first;
             }
-
-            // Audio packet (Opus)
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->sample_rate = sample_rate;
-            packet->frame_duration = 60;
-            packet->payload.resize(pkt_len);
-            std::memcpy(packet->payload.data(), pkt_ptr, pkt_len);
-            PushPacketToDecodeQueue(std::move(packet), true);
+            prompt_ = &it->second;
+            prompt_packet_ = 0;
+        }
+        if (prompt_packet_ >= prompt_->packet_count()) {
+            prompt_ = nullptr;
+            continue;
         }
 
-        offset = body_off + body_size;
+        auto data = prompt_->packet(prompt_packet_++);
+        auto packet = AudioPool::GetInstance().AcquirePacket();
+        packet->sample_rate = prompt_->sample_rate();
+        packet->frame_duration = 60;
+        packet->payload.assign(data.begin(), data.end());
+        jitter_buffer_.Put(std::move(packet), now_ms);
     }
 }
 
+// Keeps the uplink queues at the same depth in time whatever the frame duration
+void AudioService::SetUplinkQueueDepths(int frame_duration_ms) {
+    audio_send_queue_.SetCapacity(MAX_SEND_QUEUE_MS / frame_duration_ms);
+    audio_testing_queue_.SetCapacity(AUDIO_TESTING_MAX_DURATION_MS / frame_duration_ms);
+}
+
+const OpusEncodeProfile& AudioService::SelectEncodeProfile(int rtt_ms, bool low_latency) {
+    int load = encode_load_permille_;
+    const OpusEncodeProfile* profile = &kOpusEncodeProfiles[2];
+#if CONFIG_OPUS_FRAME_DURATION_AUTO
+    if (rtt_ms <= 0) {
+        // Nothing measured yet, keep the default until the first channel has been opened
+    } else if (low_latency) {
+        // Realtime chat trades bandwidth and CPU for mouth-to-ear latency when the link and the CPU allow it
+        if (rtt_ms < 150 && load < 250) {
+            profile = &kOpusEncodeProfiles[0];
+        } else if (rtt_ms < 300 && load < 400) {
+            profile = &kOpusEncodeProfiles[1];
+        }
+    } else if (rtt_ms > 500) {
+        // Fewer, larger packets on a slow link
+        profile = &kOpusEncodeProfiles[3];
+    }
+#else
+    for (auto& p : kOpusEncodeProfiles) {
+        if (p.frame_duration_ms == CONFIG_OPUS_FIXED_FRAME_DURATION_MS) {
+            profile = &p;
+        }
+    }
+#endif
+    int complexity = load < 300 ? profile->complexity : 0;
+    ESP_LOGI(TAG, "Opus encode profile: %s (%d ms, complexity %d), rtt: %d ms, encode load: %d.%d%%",
+        profile->name, profile->frame_duration_ms, complexity, rtt_ms, load / 10, load % 10);
+    encode_frame_duration_ms_ = profile->frame_duration_ms;
+    encode_complexity_ = complexity;
+    SetUplinkQueueDepths(profile->frame_duration_ms);
+    return *profile;
+}
+
 bool AudioService::IsIdle() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
+    return audio_encode_queue_.Empty() && audio_decode_queue_.Empty() && jitter_buffer_.Size() == 0 && !prompt_active_ &&
+        audio_playback_queue_.Empty() && audio_testing_queue_.Empty();
 }
 
 void AudioService::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    opus_decoder_->ResetState();
-    timestamp_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    /* The queues are drained and the decoder is reset by their consumer tasks */
+    {
+        std::lock_guard<std::mutex> lock(prompt_mutex_);
+        prompt_queue_.Clear();
+    }
+    decoder_reset_requested_ = true;
+    timestamp_queue_.Clear();
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
+    xEventGroupSetBits(event_group_, AS_EVENT_DECODE_NOT_EMPTY | AS_EVENT_PLAYBACK_NOT_EMPTY);
 }
 
 void AudioService::CheckAndUpdateAudioPowerState() {
@@ -2,10 +2,11 @@
 #define AUDIO_SERVICE_H
 
 #include <memory>
-#include <deque>
-#include <condition_variable>
+#include <atomic>
 #include <chrono>
 #include <mutex>
+#include <string_view>
+#include <unordered_map>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -18,10 +19,16 @@
 
 #include "audio_codec.h"
 #include "audio_processor.h"
+#include "audio_ring_buffer.h"
+#include "audio_jitter_buffer.h"
+#include "audio_latency.h"
+#include "audio_activity_gate.h"
+#include "ogg_prompt.h"
 #include "processors/audio_debugger.h"
 #include "wake_word.h"
 #include "protocol.h"
 
+class AfeFrontend;
 
 /*
  * There are two types of audio data flow:
@@ -31,16 +38,36 @@
  * We use one task for MIC / Speaker / Processors, and one task for Opus Encoder / Opus Decoder.
  * 
  * Decode Queue and Send Queue are the main queues, because Opus packets are quite smaller than PCM packets.
- * 
+ *
+ * Every queue is a preallocated single-producer / single-consumer ring buffer with its own
+ * "not empty" and "not full" event bits, so a push only wakes the task on the other side.
  */
 
+// Default frame duration of both directions
 #define OPUS_FRAME_DURATION_MS 60
+// Shortest uplink frame duration of the encode profiles
+#define MIN_OPUS_FRAME_DURATION_MS 20
 #define MAX_ENCODE_TASKS_IN_QUEUE 2
 #define MAX_PLAYBACK_TASKS_IN_QUEUE 2
-#define MAX_DECODE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
-#define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
+// Queue depths in milliseconds of audio
+#define MAX_DECODE_QUEUE_MS 2400
+#define MAX_SEND_QUEUE_MS 2400
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
+// The downlink frame duration is set by the server, which sends 60 ms frames
+#define MAX_DECODE_PACKETS_IN_QUEUE (MAX_DECODE_QUEUE_MS / OPUS_FRAME_DURATION_MS)
+// Slots for the shortest uplink frames, the encode profile limits the queues to their depth in time
+#define MAX_SEND_PACKETS_IN_QUEUE (MAX_SEND_QUEUE_MS / MIN_OPUS_FRAME_DURATION_MS)
+#define MAX_TESTING_PACKETS_IN_QUEUE (AUDIO_TESTING_MAX_DURATION_MS / MIN_OPUS_FRAME_DURATION_MS)
 #define MAX_TIMESTAMPS_IN_QUEUE 3
+// Sounds waiting to be played, the activation code queues one per digit
+#define MAX_PROMPTS_IN_QUEUE 8
+// Prompt packets kept in the jitter buffer ahead of playout
+#define PROMPT_PREFETCH_PACKETS 4
+// Packets / tasks in the queues plus the ones being encoded, decoded or sent
+// The decode queue and the jitter buffer behind it may both be full. The send queue is counted at the
+// default frame duration, a full queue of shorter frames takes the rest from the heap
+#define AUDIO_POOL_MAX_PACKETS (MAX_DECODE_PACKETS_IN_QUEUE * 2 + MAX_SEND_QUEUE_MS / OPUS_FRAME_DURATION_MS + 4)
+#define AUDIO_POOL_MAX_TASKS (MAX_ENCODE_TASKS_IN_QUEUE + MAX_PLAYBACK_TASKS_IN_QUEUE + 2)
 
 #define AUDIO_POWER_TIMEOUT_MS 15000
 #define AUDIO_POWER_CHECK_INTERVAL_MS 1000
@@ -50,6 +77,12 @@
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_PLAYBACK_NOT_FULL          (1 << 4)
+#define AS_EVENT_ENCODE_NOT_EMPTY           (1 << 5)
+#define AS_EVENT_ENCODE_NOT_FULL            (1 << 6)
+#define AS_EVENT_DECODE_NOT_EMPTY           (1 << 7)
+#define AS_EVENT_DECODE_NOT_FULL            (1 << 8)
+#define AS_EVENT_SEND_NOT_FULL              (1 << 9)
 
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
@@ -69,6 +102,21 @@ struct AudioTask {
     AudioTaskType type;
     std::vector<int16_t> pcm;
     uint32_t timestamp;
+    int64_t origin_time_us;     // See AudioStreamPacket
+    int64_t stage_time_us;
+};
+
+// Returns the task to AudioPool, tasks are acquired with AudioPool::AcquireTask()
+struct AudioTaskDeleter {
+    void operator()(AudioTask* task) const;
+};
+using AudioTaskPtr = std::unique_ptr<AudioTask, AudioTaskDeleter>;
+
+// Uplink Opus encoding profile, chosen before the audio channel is opened
+struct OpusEncodeProfile {
+    const char* name;
+    int frame_duration_ms;
+    int complexity;
 };
 
 struct DebugStatistics {
@@ -87,13 +135,19 @@ public:
     void Start();
     void Stop();
     void EncodeWakeWord();
-    std::unique_ptr<AudioStreamPacket> PopWakeWordPacket();
+    AudioStreamPacketPtr PopWakeWordPacket();
     const std::string& GetLastWakeWord() const;
     bool IsVoiceDetected() const { return voice_detected_; }
     bool IsIdle();
     bool IsWakeWordRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_WAKE_WORD_RUNNING; }
     bool IsAudioProcessorRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_PROCESSOR_RUNNING; }
+    // True if the wake word listens through the AFE front-end, so it can interrupt our own playback
+    bool IsWakeWordBargeInSupported() const;
+    // Logs how much of the idle input reached the wake word model since the last call
+    void PrintWakeWordGateStats();
 
+    // Loads the wake word model ahead of EnableWakeWordDetection(), may be called from any task
+    bool InitializeWakeWord();
     void EnableWakeWordDetection(bool enable);
     void EnableVoiceProcessing(bool enable);
     void EnableAudioTesting(bool enable);
@@ -101,15 +155,28 @@ public:
 
     void SetCallbacks(AudioServiceCallbacks& callbacks);
 
-    bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
-    std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
+    bool PushPacketToDecodeQueue(AudioStreamPacketPtr packet, bool wait = false);
+    AudioStreamPacketPtr PopPacketFromSendQueue();
+    // Queues an embedded Ogg Opus sound without waiting, the data must stay valid until it is played
     void PlaySound(const std::string_view& sound);
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    const JitterBufferStats& GetJitterBufferStats() const { return jitter_buffer_.stats(); }
+    // Picks the uplink profile for the next audio channel, applied from the next utterance
+    const OpusEncodeProfile& SelectEncodeProfile(int rtt_ms, bool low_latency);
+    int GetEncodeFrameDuration() const { return encode_frame_duration_ms_; }
+    // Average encode time as a fraction of the frame duration, in permille
+    int GetEncodeLoad() const { return encode_load_permille_; }
+    // Encoded packets waiting to be sent
+    size_t GetSendQueueSize() const { return audio_send_queue_.Size(); }
 
 private:
     AudioCodec* codec_ = nullptr;
     AudioServiceCallbacks callbacks_;
+#if CONFIG_USE_AUDIO_PROCESSOR || CONFIG_USE_AFE_WAKE_WORD
+    // Shared by the audio processor and the wake word, declared first so it outlives both
+    std::unique_ptr<AfeFrontend> afe_frontend_;
+#endif
     std::unique_ptr<AudioProcessor> audio_processor_;
     std::unique_ptr<WakeWord> wake_word_;
     std::unique_ptr<AudioDebugger> audio_debugger_;
@@ -118,6 +185,13 @@ private:
     OpusResampler input_resampler_;
     OpusResampler reference_resampler_;
     OpusResampler output_resampler_;
+    std::vector<int16_t> resample_buffer_;
+    // Scratch buffers of ReadAudioData(), owned by the audio input task
+    std::vector<int16_t> input_buffer_;
+    std::vector<int16_t> mic_buffer_;
+    std::vector<int16_t> reference_buffer_;
+    std::vector<int16_t> resampled_mic_buffer_;
+    std::vector<int16_t> resampled_reference_buffer_;
     DebugStatistics debug_statistics_;
 
     EventGroupHandle_t event_group_;
@@ -126,32 +200,81 @@ private:
     TaskHandle_t audio_input_task_handle_ = nullptr;
     TaskHandle_t audio_output_task_handle_ = nullptr;
     TaskHandle_t opus_codec_task_handle_ = nullptr;
-    std::mutex audio_queue_mutex_;
-    std::condition_variable audio_queue_cv_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_encode_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_playback_queue_;
+    // Serializes the producers of the decode queue (network, PlaySound and audio testing)
+    std::mutex decode_queue_mutex_;
+    AudioRingBuffer<AudioStreamPacketPtr, MAX_DECODE_PACKETS_IN_QUEUE> audio_decode_queue_;
+    // Reorders the decode queue and paces playout, owned by the opus codec task
+    AudioJitterBuffer jitter_buffer_{MAX_DECODE_PACKETS_IN_QUEUE};
+    AudioRingBuffer<AudioStreamPacketPtr, MAX_SEND_PACKETS_IN_QUEUE> audio_send_queue_;
+    AudioRingBuffer<AudioStreamPacketPtr, MAX_TESTING_PACKETS_IN_QUEUE> audio_testing_queue_;
+    AudioRingBuffer<AudioTaskPtr, MAX_ENCODE_TASKS_IN_QUEUE> audio_encode_queue_;
+    AudioRingBuffer<AudioTaskPtr, MAX_PLAYBACK_TASKS_IN_QUEUE> audio_playback_queue_;
+    // Sounds queued by PlaySound(), fed to the jitter buffer by the opus codec task
+    std::mutex prompt_mutex_;
+    AudioRingBuffer<std::string_view, MAX_PROMPTS_IN_QUEUE> prompt_queue_;
+    std::atomic<bool> prompt_active_{false};
+    // Indexed on first use and kept, the sounds are embedded in flash. Owned by the opus codec task
+    std::unordered_map<const char*, OggPrompt> prompt_index_;
+    const OggPrompt* prompt_ = nullptr;
+    size_t prompt_packet_ = 0;
     // For server AEC
-    std::deque<uint32_t> timestamp_queue_;
+    AudioRingBuffer<uint32_t, MAX_TIMESTAMPS_IN_QUEUE * 2> timestamp_queue_;
 
     bool wake_word_initialized_ = false;
+    std::mutex wake_word_mutex_;
     bool audio_processor_initialized_ = false;
     bool voice_detected_ = false;
     bool service_stopped_ = true;
-    bool audio_input_need_warmup_ = false;
+    std::atomic<bool> decoder_reset_requested_{false};
+    // Holds quiet input back from the wake word model, owned by the audio input task
+    AudioActivityGate wake_word_gate_;
+    std::vector<int16_t> wake_word_gate_buffer_;
+    std::atomic<bool> wake_word_gate_reset_requested_{false};
+    // When the oldest packet not yet announced to the send queue consumer was pushed, -1 if none
+    int64_t send_pending_since_ms_ = -1;
+    std::atomic<int> encode_frame_duration_ms_{OPUS_FRAME_DURATION_MS};
+    std::atomic<int> encode_complexity_{0};
+    std::atomic<int> encode_load_permille_{0};
+    // When the newest chunk fed to the audio processor was read from I2S
+    std::atomic<int64_t> last_capture_time_us_{0};
+    int encoder_complexity_ = 0; // Applied to opus_encoder_, owned by the opus codec task
 
     esp_timer_handle_t audio_power_timer_ = nullptr;
     std::chrono::steady_clock::time_point last_input_time_;
     std::chrono::steady_clock::time_point last_output_time_;
 
     void AudioInputTask();
+    bool GateWakeWordInput(const std::vector<int16_t>& data, int samples);
     void AudioOutputTask();
     void OpusCodecTask();
-    void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
+    void PushTaskToEncodeQueue(AudioTaskType type, const std::vector<int16_t>& pcm);
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
+    void SetUplinkQueueDepths(int frame_duration_ms);
+    void FeedPrompt(int64_t now_ms);
     void CheckAndUpdateAudioPowerState();
+
+    // Push to a queue and wake its consumer, the item is left untouched if the queue is full
+    template <typename Queue, typename T>
+    bool PushToQueue(Queue& queue, T& item, EventBits_t not_empty_bit) {
+        if (!queue.Push(std::move(item))) {
+            return false;
+        }
+        if (not_empty_bit != 0) {
+            xEventGroupSetBits(event_group_, not_empty_bit);
+        }
+        return true;
+    }
+
+    // Pop from a queue and wake its producer if it might be waiting for free space
+    template <typename Queue, typename T>
+    bool PopFromQueue(Queue& queue, T& item, EventBits_t not_full_bit) {
+        bool was_full = false;
+        bool popped = queue.Pop(item, &was_full);
+        if (was_full) {
+            xEventGroupSetBits(event_group_, not_full_bit);
+        }
+        return popped;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -6,10 +6,17 @@
 #include <driver/gpio.h>
 #include <driver/i2s_pdm.h>
 #include <mutex>
+#include <vector>
 
 class NoAudioCodec : public AudioCodec {
 protected:
     std::mutex data_if_mutex_;
+    // Reused across calls, I2S moves 32-bit samples
+    std::vector<int32_t> write_buffer_;
+    std::vector<int32_t> read_buffer_;
+    // Output gain, recomputed only when the volume changes
+    int gain_volume_ = -1;
+    int32_t gain_q16_ = 0;
 
     virtual int Write(const int16_t* data, int samples) override;
     virtual int Read(int16_t* dest, int samples) override;
@@ -0,0 +1,227 @@
+#include "wav_file_audio_codec.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "WavFileAudioCodec"
+
+#define WAV_HEADER_SIZE 44
+
+static uint16_t ReadLe16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t ReadLe32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void WriteLe16(uint8_t* p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void WriteLe32(uint8_t* p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+}
+
+WavFileAudioCodec::WavFileAudioCodec(const std::string& input_path, const std::string& output_path,
+    int output_sample_rate, bool realtime, bool loop_input) : realtime_(realtime), loop_input_(loop_input) {
+    duplex_ = true;
+    input_reference_ = false;
+    input_channels_ = 1;
+    input_sample_rate_ = 16000;
+    output_sample_rate_ = output_sample_rate;
+
+    if (!input_path.empty() && OpenInput(input_path)) {
+        ESP_LOGI(TAG, "Input %s, %d Hz, %ld bytes", input_path.c_str(), input_sample_rate_,
+            input_data_end_ - input_data_offset_);
+    }
+    if (!output_path.empty() && OpenOutput(output_path)) {
+        ESP_LOGI(TAG, "Output %s, %d Hz", output_path.c_str(), output_sample_rate_);
+    }
+}
+
+WavFileAudioCodec::~WavFileAudioCodec() {
+    std::lock_guard<std::mutex> lock(file_mutex_);
+    if (input_file_ != nullptr) {
+        fclose(input_file_);
+    }
+    if (output_file_ != nullptr) {
+        FinishOutput();
+        fclose(output_file_);
+    }
+}
+
+bool WavFileAudioCodec::OpenInput(const std::string& path) {
+    input_file_ = fopen(path.c_str(), "rb");
+    if (input_file_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to open %s", path.c_str());
+        return false;
+    }
+
+    uint8_t header[12];
+    if (fread(header, 1, sizeof(header), input_file_) != sizeof(header) ||
+        memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+        ESP_LOGE(TAG, "%s is not a WAV file", path.c_str());
+        fclose(input_file_);
+        input_file_ = nullptr;
+        return false;
+    }
+
+    bool has_format = false;
+    uint8_t chunk[8];
+    while (fread(chunk, 1, sizeof(chunk), input_file_) == sizeof(chunk)) {
+        uint32_t chunk_size = ReadLe32(chunk + 4);
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16) {
+            uint8_t format[16];
+            if (fread(format, 1, sizeof(format), input_file_) != sizeof(format)) {
+                break;
+            }
+            uint16_t audio_format = ReadLe16(format);
+            uint16_t channels = ReadLe16(format + 2);
+            uint16_t bits_per_sample = ReadLe16(format + 14);
+            if (audio_format != 1 || channels != 1 || bits_per_sample != 16) {
+                ESP_LOGE(TAG, "Unsupported WAV format %u, %u channels, %u bits, need 16-bit mono PCM",
+                    audio_format, channels, bits_per_sample);
+                break;
+            }
+            input_sample_rate_ = ReadLe32(format + 4);
+            has_format = true;
+            fseek(input_file_, (chunk_size - sizeof(format) + 1) & ~1u, SEEK_CUR);
+        } else if (memcmp(chunk, "data", 4) == 0 && has_format) {
+            input_data_offset_ = ftell(input_file_);
+            input_data_end_ = input_data_offset_ + chunk_size;
+            return true;
+        } else {
+            // Chunks are padded to an even size
+            fseek(input_file_, (chunk_size + 1) & ~1u, SEEK_CUR);
+        }
+    }
+
+    ESP_LOGE(TAG, "No 16-bit mono PCM data in %s", path.c_str());
+    fclose(input_file_);
+    input_file_ = nullptr;
+    return false;
+}
+
+bool WavFileAudioCodec::OpenOutput(const std::string& path) {
+    output_file_ = fopen(path.c_str(), "wb");
+    if (output_file_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create %s", path.c_str());
+        return false;
+    }
+    // The sizes are filled in by FinishOutput()
+    uint8_t header[WAV_HEADER_SIZE] = {};
+    fwrite(header, 1, sizeof(header), output_file_);
+    return true;
+}
+
+void WavFileAudioCodec::FinishOutput() {
+    uint8_t header[WAV_HEADER_SIZE];
+    memcpy(header, "RIFF", 4);
+    WriteLe32(header + 4, WAV_HEADER_SIZE - 8 + output_data_size_);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    WriteLe32(header + 16, 16);
+    WriteLe16(header + 20, 1);
+    WriteLe16(header + 22, output_channels_);
+    WriteLe32(header + 24, output_sample_rate_);
+    WriteLe32(header + 28, output_sample_rate_ * output_channels_ * sizeof(int16_t));
+    WriteLe16(header + 32, output_channels_ * sizeof(int16_t));
+    WriteLe16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    WriteLe32(header + 40, output_data_size_);
+
+    long position = ftell(output_file_);
+    fseek(output_file_, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), output_file_);
+    fseek(output_file_, position, SEEK_SET);
+    fflush(output_file_);
+}
+
+// Blocks until the samples handed over so far are due, the way a DMA-backed I2S channel would
+void WavFileAudioCodec::Pace(int64_t& start_us, int64_t& samples, int count, int sample_rate) {
+    int64_t now = esp_timer_get_time();
+    if (samples == 0) {
+        start_us = now;
+    }
+    samples += count;
+    int64_t due_us = start_us + samples * 1000000 / sample_rate;
+    if (due_us > now) {
+        vTaskDelay(pdMS_TO_TICKS((due_us - now) / 1000));
+    } else if (now - due_us > 1000000) {
+        // Fell more than a second behind, for example while paused in a debugger, do not try to catch up
+        start_us = now;
+        samples = 0;
+    }
+}
+
+void WavFileAudioCodec::EnableInput(bool enable) {
+    if (enable == input_enabled_) {
+        return;
+    }
+    input_samples_ = 0;
+    AudioCodec::EnableInput(enable);
+}
+
+void WavFileAudioCodec::EnableOutput(bool enable) {
+    if (enable == output_enabled_) {
+        return;
+    }
+    output_samples_ = 0;
+    if (!enable) {
+        // Keep the file playable if the device is reset while idle
+        std::lock_guard<std::mutex> lock(file_mutex_);
+        if (output_file_ != nullptr) {
+            FinishOutput();
+        }
+    }
+    AudioCodec::EnableOutput(enable);
+}
+
+int WavFileAudioCodec::Read(int16_t* dest, int samples) {
+    {
+        std::lock_guard<std::mutex> lock(file_mutex_);
+        int filled = 0;
+        while (input_file_ != nullptr && filled < samples) {
+            long remaining = (input_data_end_ - ftell(input_file_)) / (long)sizeof(int16_t);
+            if (remaining <= 0) {
+                if (!loop_input_) {
+                    break;
+                }
+                fseek(input_file_, input_data_offset_, SEEK_SET);
+                continue;
+            }
+            int count = std::min<long>(remaining, samples - filled);
+            int read = fread(dest + filled, sizeof(int16_t), count, input_file_);
+            if (read <= 0) {
+                break;
+            }
+            filled += read;
+        }
+        // Silence once the input has run out, like a microphone in a quiet room
+        memset(dest + filled, 0, (samples - filled) * sizeof(int16_t));
+    }
+    if (realtime_) {
+        Pace(input_start_us_, input_samples_, samples, input_sample_rate_);
+    }
+    return samples;
+}
+
+int WavFileAudioCodec::Write(const int16_t* data, int samples) {
+    {
+        std::lock_guard<std::mutex> lock(file_mutex_);
+        if (output_file_ != nullptr) {
+            output_data_size_ += fwrite(data, sizeof(int16_t), samples, output_file_) * sizeof(int16_t);
+        }
+    }
+    if (realtime_) {
+        Pace(output_start_us_, output_samples_, samples, output_sample_rate_);
+    }
+    return samples;
+}
@@ -0,0 +1,51 @@
+#ifndef _WAV_FILE_AUDIO_CODEC_H
+#define _WAV_FILE_AUDIO_CODEC_H
+
+#include "audio_codec.h"
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+/*
+ * Plays a 16-bit mono WAV file as microphone input and records the speaker output to a WAV file,
+ * so the audio pipeline can be exercised and measured without a codec chip.
+ *
+ * The files live on any mounted VFS path (SPIFFS, SD card). With realtime pacing the codec
+ * consumes and produces samples at the sample rate like an I2S codec; without it, Read() and
+ * Write() return immediately and the pipeline runs as fast as the CPU allows.
+ */
+class WavFileAudioCodec : public AudioCodec {
+private:
+    std::mutex file_mutex_;
+    FILE* input_file_ = nullptr;
+    FILE* output_file_ = nullptr;
+    long input_data_offset_ = 0;
+    long input_data_end_ = 0;
+    uint32_t output_data_size_ = 0;
+    bool realtime_ = true;
+    bool loop_input_ = false;
+    int64_t input_start_us_ = 0;
+    int64_t input_samples_ = 0;
+    int64_t output_start_us_ = 0;
+    int64_t output_samples_ = 0;
+
+    bool OpenInput(const std::string& path);
+    bool OpenOutput(const std::string& path);
+    void FinishOutput();
+    static void Pace(int64_t& start_us, int64_t& samples, int count, int sample_rate);
+
+    virtual int Read(int16_t* dest, int samples) override;
+    virtual int Write(const int16_t* data, int samples) override;
+
+public:
+    // An empty path disables that direction, the output is always written and paced at output_sample_rate
+    WavFileAudioCodec(const std::string& input_path, const std::string& output_path, int output_sample_rate,
+        bool realtime = true, bool loop_input = false);
+    virtual ~WavFileAudioCodec();
+
+    virtual void EnableInput(bool enable) override;
+    virtual void EnableOutput(bool enable) override;
+};
+
+#endif // _WAV_FILE_AUDIO_CODEC_H
@@ -0,0 +1,91 @@
+#include "ogg_prompt.h"
+
+#include <esp_log.h>
+#include <cstring>
+
+#define TAG "OggPrompt"
+
+#define OGG_PAGE_HEADER_SIZE 27
+
+OggPrompt::OggPrompt(const std::string_view& ogg) : data_(ogg.data()) {
+    const uint8_t* buf = reinterpret_cast<const uint8_t*>(ogg.data());
+    size_t size = ogg.size();
+    size_t offset = 0;
+    bool seen_head = false;
+    bool seen_tags = false;
+
+    while (offset + OGG_PAGE_HEADER_SIZE <= size) {
+        if (std::memcmp(buf + offset, "OggS", 4) != 0) {
+            // Pages follow each other directly, only a damaged stream needs a search for the next one
+            auto next = ogg.find("OggS", offset + 1);
+            if (next == std::string_view::npos) {
+                break;
+            }
+            offset = next;
+            continue;
+        }
+
+        const uint8_t* page = buf + offset;
+        uint8_t page_segments = page[26];
+        size_t body_off = offset + OGG_PAGE_HEADER_SIZE + page_segments;
+        if (body_off > size) {
+            break;
+        }
+        size_t body_size = 0;
+        for (size_t i = 0; i < page_segments; ++i) {
+            body_size += page[OGG_PAGE_HEADER_SIZE + i];
+        }
+        if (body_off + body_size > size) {
+            break;
+        }
+
+        // Parse packets using lacing
+        size_t cur = body_off;
+        size_t seg_idx = 0;
+        bool continued = page[5] & 0x01;
+        while (seg_idx < page_segments) {
+            size_t pkt_start = cur;
+            size_t pkt_len = 0;
+            uint8_t l;
+            do {
+                l = page[OGG_PAGE_HEADER_SIZE + seg_idx++];
+                pkt_len += l;
+                cur += l;
+            } while (l == 255 && seg_idx < page_segments);
+
+            if (l == 255 || continued) {
+                // Spans two pages and cannot be read in place, Opus packets are too short for this in practice
+                continued = false;
+                ESP_LOGW(TAG, "Skipping a packet that spans pages");
+                continue;
+            }
+            if (pkt_len == 0) {
+                continue;
+            }
+            const uint8_t* pkt_ptr = buf + pkt_start;
+
+            if (!seen_head) {
+                // OpusHead结构：[0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip
+                // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
+                if (pkt_len >= 19 && std::memcmp(pkt_ptr, "OpusHead", 8) == 0) {
+                    seen_head = true;
+                    sample_rate_ = pkt_ptr[12] | (pkt_ptr[13] << 8) | (pkt_ptr[14] << 16) | (pkt_ptr[15] << 24);
+                }
+                continue;
+            }
+            if (!seen_tags) {
+                // Expect OpusTags in second packet
+                if (pkt_len >= 8 && std::memcmp(pkt_ptr, "OpusTags", 8) == 0) {
+                    seen_tags = true;
+                }
+                continue;
+            }
+
+            packets_.push_back({static_cast<uint32_t>(pkt_start), static_cast<uint16_t>(pkt_len)});
+        }
+
+        offset = body_off + body_size;
+    }
+
+    ESP_LOGI(TAG, "Indexed %u packets, sample rate %d", (unsigned)packets_.size(), sample_rate_);
+}
@@ -0,0 +1,35 @@
+#ifndef OGG_PROMPT_H
+#define OGG_PROMPT_H
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/*
+ * Packet index of an Ogg Opus stream that is embedded in flash.
+ *
+ * The pages are parsed once, the packets are then read straight from the stream,
+ * so the stream must stay valid for the lifetime of the index.
+ */
+class OggPrompt {
+public:
+    explicit OggPrompt(const std::string_view& ogg);
+
+    inline int sample_rate() const { return sample_rate_; }
+    inline size_t packet_count() const { return packets_.size(); }
+    inline std::string_view packet(size_t index) const {
+        return std::string_view(data_ + packets_[index].offset, packets_[index].size);
+    }
+
+private:
+    struct Packet {
+        uint32_t offset;
+        uint16_t size;
+    };
+
+    const char* data_;
+    int sample_rate_ = 16000;
+    std::vector<Packet> packets_;
+};
+
+#endif // OGG_PROMPT_H
@@ -1,24 +1,21 @@
 #ifndef AFE_AUDIO_PROCESSOR_H
 #define AFE_AUDIO_PROCESSOR_H
 
-#include <esp_afe_sr_models.h>
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <freertos/event_groups.h>
-
-#include <string>
+#include <atomic>
 #include <vector>
 #include <functional>
 
 #include "audio_processor.h"
 #include "audio_codec.h"
+#include "afe_frontend.h"
 
 class AfeAudioProcessor : public AudioProcessor {
 public:
-    AfeAudioProcessor();
+    AfeAudioProcessor(AfeFrontend* frontend);
     ~AfeAudioProcessor();
 
     void Initialize(AudioCodec* codec, int frame_duration_ms) override;
+    void SetFrameDuration(int frame_duration_ms) override;
     void Feed(std::vector<int16_t>&& data) override;
     void Start() override;
     void Stop() override;
@@ -29,17 +26,17 @@ public:
     void EnableDeviceAec(bool enable) override;
 
 private:
-    EventGroupHandle_t event_group_ = nullptr;
-    esp_afe_sr_iface_t* afe_iface_ = nullptr;
-    esp_afe_sr_data_t* afe_data_ = nullptr;
+    AfeFrontend* frontend_;
+    std::atomic<bool> is_running_ = false;
     std::function<void(std::vector<int16_t>&& data)> output_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
     AudioCodec* codec_ = nullptr;
     int frame_samples_ = 0;
     bool is_speaking_ = false;
     std::vector<int16_t> output_buffer_;
+    std::vector<int16_t> frame_buffer_;
 
-    void AudioProcessorTask();
+    void OnAfeOutput(afe_fetch_result_t* result);
 };
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,218 @@
+#include "afe_frontend.h"
+#include <esp_log.h>
+#include <freertos/task.h>
+
+#include <string>
+
+#define AFE_WAKE_WORD_OUTPUT (1 << 0)
+#define AFE_VOICE_OUTPUT (1 << 1)
+
+#if CONFIG_USE_CUSTOM_WAKE_WORD
+// The custom wake word runs MultiNet in the output callback, the esp-sr examples give it an 8 KB task
+#define AFE_TASK_STACK_SIZE (4096 * 2)
+#else
+#define AFE_TASK_STACK_SIZE 4096
+#endif
+
+#define TAG "AfeFrontend"
+
+AfeFrontend::AfeFrontend(bool wakenet)
+    : wakenet_(wakenet) {
+    event_group_ = xEventGroupCreate();
+}
+
+AfeFrontend::~AfeFrontend() {
+    if (afe_data_ != nullptr) {
+        afe_iface_->destroy(afe_data_);
+    }
+    if (models_ != nullptr) {
+        esp_srmodel_deinit(models_);
+    }
+    vEventGroupDelete(event_group_);
+}
+
+bool AfeFrontend::Initialize(AudioCodec* codec) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (afe_data_ != nullptr) {
+        return true;
+    }
+
+    models_ = esp_srmodel_init("model");
+    if (wakenet_ && (models_ == nullptr || models_->num == -1)) {
+        ESP_LOGE(TAG, "Failed to initialize wakenet model");
+        return false;
+    }
+    if (models_ != nullptr) {
+        for (int i = 0; i < models_->num; i++) {
+            ESP_LOGI(TAG, "Model %d: %s", i, models_->model_name[i]);
+        }
+    }
+
+    int ref_num = codec->input_reference() ? 1 : 0;
+    std::string input_format;
+    for (int i = 0; i < codec->input_channels() - ref_num; i++) {
+        input_format.push_back('M');
+    }
+    for (int i = 0; i < ref_num; i++) {
+        input_format.push_back('R');
+    }
+
+    char* ns_model_name = esp_srmodel_filter(models_, ESP_NSNET_PREFIX, NULL);
+    char* vad_model_name = esp_srmodel_filter(models_, ESP_VADN_PREFIX, NULL);
+
+    // WakeNet only runs in the speech recognition pipeline. The stages that shape the uplink, AEC, NS and VAD, are
+    // set up and switched as in the voice communication pipeline, see UpdateFeatures()
+    afe_config_t* afe_config = afe_config_init(input_format.c_str(), wakenet_ ? models_ : NULL,
+        wakenet_ ? AFE_TYPE_SR : AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
+    aec_init_ = codec->input_reference();
+    afe_config->aec_init = aec_init_;
+#if CONFIG_USE_DEVICE_AEC
+    afe_config->aec_mode = AEC_MODE_VOIP_HIGH_PERF;
+#else
+    // Without device AEC the echo is only cancelled for the wake word
+    afe_config->aec_mode = wakenet_ ? AEC_MODE_SR_HIGH_PERF : AEC_MODE_VOIP_HIGH_PERF;
+#endif
+    afe_config->vad_init = true;
+    afe_config->vad_mode = VAD_MODE_0;
+    afe_config->vad_min_noise_ms = 100;
+    if (vad_model_name != nullptr) {
+        afe_config->vad_model_name = vad_model_name;
+    }
+
+    ns_init_ = ns_model_name != nullptr;
+    afe_config->ns_init = ns_init_;
+    if (ns_init_) {
+        afe_config->ns_model_name = ns_model_name;
+        afe_config->afe_ns_mode = AFE_NS_MODE_NET;
+    }
+
+    afe_config->afe_perferred_core = 1;
+    afe_config->afe_perferred_priority = 1;
+    afe_config->agc_init = false;
+    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
+
+    afe_iface_ = esp_afe_handle_from_config(afe_config);
+    afe_data_ = afe_iface_->create_from_config(afe_config);
+    if (afe_data_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create AFE");
+        return false;
+    }
+    UpdateFeatures();
+
+    xTaskCreate([](void* arg) {
+        auto this_ = (AfeFrontend*)arg;
+        this_->AfeTask();
+        vTaskDelete(NULL);
+    }, "audio_afe", AFE_TASK_STACK_SIZE, this, 3, nullptr);
+    return true;
+}
+
+void AfeFrontend::Feed(const std::vector<int16_t>& data) {
+    if (afe_data_ == nullptr) {
+        return;
+    }
+    afe_iface_->feed(afe_data_, data.data());
+}
+
+size_t AfeFrontend::GetFeedSize() {
+    if (afe_data_ == nullptr) {
+        return 0;
+    }
+    return afe_iface_->get_feed_chunksize(afe_data_);
+}
+
+void AfeFrontend::OnWakeWordOutput(std::function<void(afe_fetch_result_t* result)> callback) {
+    wake_word_callback_ = callback;
+}
+
+void AfeFrontend::OnVoiceOutput(std::function<void(afe_fetch_result_t* result)> callback) {
+    voice_callback_ = callback;
+}
+
+void AfeFrontend::EnableWakeWordOutput(bool enable) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (enable) {
+        xEventGroupSetBits(event_group_, AFE_WAKE_WORD_OUTPUT);
+    } else {
+        xEventGroupClearBits(event_group_, AFE_WAKE_WORD_OUTPUT);
+    }
+    UpdateFeatures();
+}
+
+void AfeFrontend::EnableVoiceOutput(bool enable) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (enable) {
+        xEventGroupSetBits(event_group_, AFE_VOICE_OUTPUT);
+    } else {
+        xEventGroupClearBits(event_group_, AFE_VOICE_OUTPUT);
+    }
+    UpdateFeatures();
+}
+
+void AfeFrontend::EnableDeviceAec(bool enable) {
+#if !CONFIG_USE_DEVICE_AEC
+    if (enable) {
+        ESP_LOGE(TAG, "Device AEC is not supported");
+        return;
+    }
+#endif
+    std::lock_guard<std::mutex> lock(mutex_);
+    device_aec_ = enable;
+    UpdateFeatures();
+}
+
+// Switches the stages to what the enabled outputs need, called with mutex_ held
+void AfeFrontend::UpdateFeatures() {
+    if (afe_data_ == nullptr) {
+        return;
+    }
+
+    auto bits = xEventGroupGetBits(event_group_);
+    bool wake_word = bits & AFE_WAKE_WORD_OUTPUT;
+    bool voice = bits & AFE_VOICE_OUTPUT;
+    if (!wake_word && !voice) {
+        // Nobody is listening, drop what was fed so the next consumer starts from fresh audio
+        afe_iface_->reset_buffer(afe_data_);
+    }
+
+    if (wakenet_) {
+        wake_word ? afe_iface_->enable_wakenet(afe_data_) : afe_iface_->disable_wakenet(afe_data_);
+    }
+    if (aec_init_) {
+        // The wake word must hear past our own playback to allow barge-in while speaking. The uplink is only echo
+        // cancelled with device AEC, the server does it otherwise
+        bool aec = device_aec_ || (wake_word && !voice);
+        aec ? afe_iface_->enable_aec(afe_data_) : afe_iface_->disable_aec(afe_data_);
+    }
+    if (ns_init_) {
+        voice ? afe_iface_->enable_ns(afe_data_) : afe_iface_->disable_ns(afe_data_);
+    }
+    (voice && !device_aec_) ? afe_iface_->enable_vad(afe_data_) : afe_iface_->disable_vad(afe_data_);
+}
+
+void AfeFrontend::AfeTask() {
+    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
+    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
+    ESP_LOGI(TAG, "AFE task started, feed size: %d fetch size: %d", feed_size, fetch_size);
+
+    while (true) {
+        xEventGroupWaitBits(event_group_, AFE_WAKE_WORD_OUTPUT | AFE_VOICE_OUTPUT, pdFALSE, pdFALSE, portMAX_DELAY);
+
+        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
+        if (res == nullptr || res->ret_value == ESP_FAIL) {
+            if (res != nullptr) {
+                ESP_LOGI(TAG, "Error code: %d", res->ret_value);
+            }
+            continue;
+        }
+
+        // Read after the fetch, an output may have been switched off while waiting
+        auto bits = xEventGroupGetBits(event_group_);
+        if ((bits & AFE_VOICE_OUTPUT) && voice_callback_) {
+            voice_callback_(res);
+        }
+        if ((bits & AFE_WAKE_WORD_OUTPUT) && wake_word_callback_) {
+            wake_word_callback_(res);
+        }
+    }
+}
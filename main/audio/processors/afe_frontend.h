@@ -0,0 +1,56 @@
+#ifndef AFE_FRONTEND_H
+#define AFE_FRONTEND_H
+
+#include <esp_afe_sr_models.h>
+#include <model_path.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+#include <mutex>
+#include <vector>
+#include <functional>
+
+#include "audio_codec.h"
+
+/*
+ * One AFE pipeline shared by the wake word and the audio processor. It keeps running while either of them is
+ * enabled, so moving between wake word detection and listening only switches the WakeNet, VAD, NS and AEC
+ * stages and the routing of the fetched audio, the buffers are never reset in between.
+ */
+class AfeFrontend {
+public:
+    // With wakenet the pipeline is built for speech recognition and runs WakeNet while the wake word is enabled
+    AfeFrontend(bool wakenet);
+    ~AfeFrontend();
+
+    // Called by both consumers, only the first call builds the pipeline
+    bool Initialize(AudioCodec* codec);
+    void Feed(const std::vector<int16_t>& data);
+    size_t GetFeedSize();
+    srmodel_list_t* models() const { return models_; }
+
+    // The callbacks run on the AFE task with every fetched chunk while their output is enabled
+    void OnWakeWordOutput(std::function<void(afe_fetch_result_t* result)> callback);
+    void OnVoiceOutput(std::function<void(afe_fetch_result_t* result)> callback);
+    void EnableWakeWordOutput(bool enable);
+    void EnableVoiceOutput(bool enable);
+    void EnableDeviceAec(bool enable);
+
+private:
+    std::mutex mutex_;
+    EventGroupHandle_t event_group_ = nullptr;
+    srmodel_list_t* models_ = nullptr;
+    esp_afe_sr_iface_t* afe_iface_ = nullptr;
+    esp_afe_sr_data_t* afe_data_ = nullptr;
+    std::function<void(afe_fetch_result_t* result)> wake_word_callback_;
+    std::function<void(afe_fetch_result_t* result)> voice_callback_;
+    bool wakenet_ = false;
+    bool aec_init_ = false;
+    bool ns_init_ = false;
+    bool device_aec_ = false;
+
+    void UpdateFeatures();
+    void AfeTask();
+};
+
+#endif
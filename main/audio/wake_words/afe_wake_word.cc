@@ -2,54 +2,27 @@
 #include "audio_service.h"
 
 #include <esp_log.h>
+#include <cstring>
 #include <sstream>
 
-#define DETECTION_RUNNING_EVENT 1
-
 #define TAG "AfeWakeWord"
 
-AfeWakeWord::AfeWakeWord()
-    : afe_data_(nullptr),
-      wake_word_pcm_(),
-      wake_word_opus_() {
-
-    event_group_ = xEventGroupCreate();
+AfeWakeWord::AfeWakeWord(AfeFrontend* frontend)
+    : frontend_(frontend) {
 }
 
 AfeWakeWord::~AfeWakeWord() {
-    if (afe_data_ != nullptr) {
-        afe_iface_->destroy(afe_data_);
-    }
-
-    if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
-    }
-
-    if (wake_word_encode_task_buffer_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_buffer_);
-    }
-
-    if (models_ != nullptr) {
-        esp_srmodel_deinit(models_);
-    }
-
-    vEventGroupDelete(event_group_);
 }
 
 bool AfeWakeWord::Initialize(AudioCodec* codec) {
-    codec_ = codec;
-    int ref_num = codec_->input_reference() ? 1 : 0;
-
-    models_ = esp_srmodel_init("model");
-    if (models_ == nullptr || models_->num == -1) {
-        ESP_LOGE(TAG, "Failed to initialize wakenet model");
+    if (!frontend_->Initialize(codec)) {
         return false;
     }
-    for (int i = 0; i < models_->num; i++) {
-        ESP_LOGI(TAG, "Model %d: %s", i, models_->model_name[i]);
-        if (strstr(models_->model_name[i], ESP_WN_PREFIX) != NULL) {
-            wakenet_model_ = models_->model_name[i];
-            auto words = esp_srmodel_get_wake_words(models_, wakenet_model_);
+
+    auto models = frontend_->models();
+    for (int i = 0; i < models->num; i++) {
+        if (strstr(models->model_name[i], ESP_WN_PREFIX) != NULL) {
+            auto words = esp_srmodel_get_wake_words(models, models->model_name[i]);
             // split by ";" to get all wake words
             std::stringstream ss(words);
             std::string word;
@@ -59,29 +32,13 @@ bool AfeWakeWord::Initialize(AudioCodec* codec) {
         }
     }
 
-    std::string input_format;
-    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
-        input_format.push_back('M');
-    }
-    for (int i = 0; i < ref_num; i++) {
-        input_format.push_back('R');
+    if (!preroll_.Initialize(OPUS_FRAME_DURATION_MS)) {
+        return false;
     }
-    afe_config_t* afe_config = afe_config_init(input_format.c_str(), models_, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
-    afe_config->aec_init = codec_->input_reference();
-    afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
-    afe_config->afe_perferred_core = 1;
-    afe_config->afe_perferred_priority = 1;
-    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
-    
-    afe_iface_ = esp_afe_handle_from_config(afe_config);
-    afe_data_ = afe_iface_->create_from_config(afe_config);
-
-    xTaskCreate([](void* arg) {
-        auto this_ = (AfeWakeWord*)arg;
-        this_->AudioDetectionTask();
-        vTaskDelete(NULL);
-    }, "audio_detection", 4096, this, 3, nullptr);
 
+    frontend_->OnWakeWordOutput([this](afe_fetch_result_t* result) {
+        OnAfeOutput(result);
+    });
     return true;
 }
 
@@ -90,114 +47,44 @@ void AfeWakeWord::OnWakeWordDetected(std::function<void(const std::string& wake_
 }
 
 void AfeWakeWord::Start() {
-    xEventGroupSetBits(event_group_, DETECTION_RUNNING_EVENT);
+    // The pre-roll belongs to the AFE task, it is reset there before the next chunk
+    reset_pending_ = true;
+    frontend_->EnableWakeWordOutput(true);
 }
 
 void AfeWakeWord::Stop() {
-    xEventGroupClearBits(event_group_, DETECTION_RUNNING_EVENT);
-    if (afe_data_ != nullptr) {
-        afe_iface_->reset_buffer(afe_data_);
-    }
+    frontend_->EnableWakeWordOutput(false);
 }
 
 void AfeWakeWord::Feed(const std::vector<int16_t>& data) {
-    if (afe_data_ == nullptr) {
-        return;
-    }
-    afe_iface_->feed(afe_data_, data.data());
+    frontend_->Feed(data);
 }
 
 size_t AfeWakeWord::GetFeedSize() {
-    if (afe_data_ == nullptr) {
-        return 0;
-    }
-    return afe_iface_->get_feed_chunksize(afe_data_);
+    return frontend_->GetFeedSize();
 }
 
-void AfeWakeWord::AudioDetectionTask() {
-    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
-    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
-    ESP_LOGI(TAG, "Audio detection task started, feed size: %d fetch size: %d",
-        feed_size, fetch_size);
+void AfeWakeWord::OnAfeOutput(afe_fetch_result_t* res) {
+    if (reset_pending_.exchange(false)) {
+        preroll_.Reset();
+    }
+    // Store the wake word data for voice recognition, like who is speaking
+    preroll_.Feed(res->data, res->data_size / sizeof(int16_t));
 
-    while (true) {
-        xEventGroupWaitBits(event_group_, DETECTION_RUNNING_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
+    if (res->wakeup_state == WAKENET_DETECTED) {
+        Stop();
+        last_detected_wake_word_ = wake_words_[res->wakenet_model_index - 1];
 
-        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
-        if (res == nullptr || res->ret_value == ESP_FAIL) {
-            continue;;
-        }
-
-        // Store the wake word data for voice recognition, like who is speaking
-        StoreWakeWordData(res->data, res->data_size / sizeof(int16_t));
-
-        if (res->wakeup_state == WAKENET_DETECTED) {
-            Stop();
-            last_detected_wake_word_ = wake_words_[res->wakenet_model_index - 1];
-
-            if (wake_word_detected_callback_) {
-                wake_word_detected_callback_(last_detected_wake_word_);
-            }
+        if (wake_word_detected_callback_) {
+            wake_word_detected_callback_(last_detected_wake_word_);
         }
     }
 }
 
-void AfeWakeWord::StoreWakeWordData(const int16_t* data, size_t samples) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.emplace_back(std::vector<int16_t>(data, data + samples));
-    // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 30) {
-        wake_word_pcm_.pop_front();
-    }
-}
-
-void AfeWakeWord::EncodeWakeWordData() {
-    const size_t stack_size = 4096 * 7;
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
-        assert(wake_word_encode_task_stack_ != nullptr);
-    }
-    if (wake_word_encode_task_buffer_ == nullptr) {
-        wake_word_encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
-        assert(wake_word_encode_task_buffer_ != nullptr);
-    }
-
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (AfeWakeWord*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            auto encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-            encoder->SetComplexity(0); // 0 is the fastest
-
-            int packets = 0;
-            for (auto& pcm: this_->wake_word_pcm_) {
-                encoder->Encode(std::move(pcm), [this_](std::vector<uint8_t>&& opus) {
-                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                    this_->wake_word_opus_.emplace_back(std::move(opus));
-                    this_->wake_word_cv_.notify_all();
-                });
-                packets++;
-            }
-            this_->wake_word_pcm_.clear();
-
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %d packets in %ld ms", packets, (long)((end_time - start_time) / 1000));
-
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
-        }
-        vTaskDelete(NULL);
-    }, "encode_wake_word", stack_size, this, 2, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
+void AfeWakeWord::EncodeWakeWordData(int frame_duration_ms) {
+    preroll_.Capture(frame_duration_ms);
 }
 
 bool AfeWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    std::unique_lock<std::mutex> lock(wake_word_mutex_);
-    wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
-    });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+    return preroll_.GetPacket(opus);
 }
@@ -1,27 +1,19 @@
 #ifndef AFE_WAKE_WORD_H
 #define AFE_WAKE_WORD_H
 
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <freertos/event_groups.h>
-
-#include <esp_afe_sr_models.h>
-#include <esp_nsn_models.h>
-#include <model_path.h>
-
-#include <deque>
 #include <string>
+#include <atomic>
 #include <vector>
 #include <functional>
-#include <mutex>
-#include <condition_variable>
 
 #include "audio_codec.h"
 #include "wake_word.h"
+#include "wake_word_preroll.h"
+#include "processors/afe_frontend.h"
 
 class AfeWakeWord : public WakeWord {
 public:
-    AfeWakeWord();
+    AfeWakeWord(AfeFrontend* frontend);
     ~AfeWakeWord();
 
     bool Initialize(AudioCodec* codec);
@@ -30,31 +22,20 @@ public:
     void Start();
     void Stop();
     size_t GetFeedSize();
-    void EncodeWakeWordData();
+    void EncodeWakeWordData(int frame_duration_ms);
     bool GetWakeWordOpus(std::vector<uint8_t>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
 
 private:
-    srmodel_list_t *models_ = nullptr;
-    esp_afe_sr_iface_t* afe_iface_ = nullptr;
-    esp_afe_sr_data_t* afe_data_ = nullptr;
-    char* wakenet_model_ = NULL;
+    AfeFrontend* frontend_;
     std::vector<std::string> wake_words_;
-    EventGroupHandle_t event_group_;
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
-    AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t* wake_word_encode_task_buffer_ = nullptr;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::deque<std::vector<int16_t>> wake_word_pcm_;
-    std::deque<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    WakeWordPreroll preroll_;
+    std::atomic<bool> reset_pending_ = false;
 
-    void StoreWakeWordData(const int16_t* data, size_t size);
-    void AudioDetectionTask();
+    void OnAfeOutput(afe_fetch_result_t* result);
 };
 
 #endif
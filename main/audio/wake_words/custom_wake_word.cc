@@ -11,8 +11,8 @@
 #define TAG "CustomWakeWord"
 
 
-CustomWakeWord::CustomWakeWord()
-    : wake_word_pcm_(), wake_word_opus_() {
+CustomWakeWord::CustomWakeWord(AfeFrontend* frontend)
+    : frontend_(frontend) {
 }
 
 CustomWakeWord::~CustomWakeWord() {
@@ -21,14 +21,6 @@ CustomWakeWord::~CustomWakeWord() {
         multinet_model_data_ = nullptr;
     }
 
-    if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
-    }
-
-    if (wake_word_encode_task_buffer_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_buffer_);
-    }
-
     if (models_ != nullptr) {
         esp_srmodel_deinit(models_);
     }
@@ -60,6 +52,18 @@ bool CustomWakeWord::Initialize(AudioCodec* codec) {
     esp_mn_commands_update();
     
     multinet_->print_active_speech_commands(multinet_model_data_);
+    if (!preroll_.Initialize(OPUS_FRAME_DURATION_MS)) {
+        return false;
+    }
+
+    if (frontend_ != nullptr) {
+        if (!frontend_->Initialize(codec_)) {
+            return false;
+        }
+        frontend_->OnWakeWordOutput([this](afe_fetch_result_t* result) {
+            OnAfeOutput(result);
+        });
+    }
     return true;
 }
 
@@ -68,33 +72,65 @@ void CustomWakeWord::OnWakeWordDetected(std::function<void(const std::string& wa
 }
 
 void CustomWakeWord::Start() {
+    // The buffers belong to the task that feeds the detector, it resets them before the next chunk
+    reset_pending_ = true;
     running_ = true;
+    if (frontend_ != nullptr) {
+        frontend_->EnableWakeWordOutput(true);
+    }
 }
 
 void CustomWakeWord::Stop() {
     running_ = false;
+    if (frontend_ != nullptr) {
+        frontend_->EnableWakeWordOutput(false);
+    }
 }
 
 void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
+    if (frontend_ != nullptr) {
+        frontend_->Feed(data);
+        return;
+    }
     if (multinet_model_data_ == nullptr || !running_) {
         return;
     }
+    if (reset_pending_.exchange(false)) {
+        preroll_.Reset();
+    }
 
-    esp_mn_state_t mn_state;
     // If input channels is 2, we need to fetch the left channel data
     if (codec_->input_channels() == 2) {
-        auto mono_data = std::vector<int16_t>(data.size() / 2);
-        for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-            mono_data[i] = data[j];
+        mono_data_.resize(data.size() / 2);
+        for (size_t i = 0, j = 0; i < mono_data_.size(); ++i, j += 2) {
+            mono_data_[i] = data[j];
         }
-
-        StoreWakeWordData(mono_data);
-        mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(mono_data.data()));
+        Detect(mono_data_.data(), mono_data_.size());
     } else {
-        StoreWakeWordData(data);
-        mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(data.data()));
+        Detect(data.data(), data.size());
     }
-    
+}
+
+void CustomWakeWord::OnAfeOutput(afe_fetch_result_t* res) {
+    if (reset_pending_.exchange(false)) {
+        preroll_.Reset();
+        afe_buffer_.clear();
+    }
+    afe_buffer_.insert(afe_buffer_.end(), res->data, res->data + res->data_size / sizeof(int16_t));
+
+    size_t chunk = multinet_->get_samp_chunksize(multinet_model_data_);
+    size_t offset = 0;
+    while (running_ && afe_buffer_.size() - offset >= chunk) {
+        Detect(afe_buffer_.data() + offset, chunk);
+        offset += chunk;
+    }
+    afe_buffer_.erase(afe_buffer_.begin(), afe_buffer_.begin() + offset);
+}
+
+void CustomWakeWord::Detect(const int16_t* data, size_t samples) {
+    preroll_.Feed(data, samples);
+    esp_mn_state_t mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(data));
+
     if (mn_state == ESP_MN_STATE_DETECTING) {
         return;
     } else if (mn_state == ESP_MN_STATE_DETECTED) {
@@ -105,7 +141,7 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
         if (mn_result->command_id[0] == 1) {
             last_detected_wake_word_ = CONFIG_CUSTOM_WAKE_WORD_DISPLAY;
         }
-        running_ = false;
+        Stop();
         
         if (wake_word_detected_callback_) {
             wake_word_detected_callback_(last_detected_wake_word_);
@@ -118,68 +154,19 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
 }
 
 size_t CustomWakeWord::GetFeedSize() {
+    if (frontend_ != nullptr) {
+        return frontend_->GetFeedSize();
+    }
     if (multinet_model_data_ == nullptr) {
         return 0;
     }
     return multinet_->get_samp_chunksize(multinet_model_data_);
 }
 
-void CustomWakeWord::StoreWakeWordData(const std::vector<int16_t>& data) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.push_back(data);
-    // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 30) {
-        wake_word_pcm_.pop_front();
-    }
-}
-
-void CustomWakeWord::EncodeWakeWordData() {
-    const size_t stack_size = 4096 * 7;
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
-        assert(wake_word_encode_task_stack_ != nullptr);
-    }
-    if (wake_word_encode_task_buffer_ == nullptr) {
-        wake_word_encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
-        assert(wake_word_encode_task_buffer_ != nullptr);
-    }
-
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (CustomWakeWord*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            auto encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-            encoder->SetComplexity(0); // 0 is the fastest
-
-            int packets = 0;
-            for (auto& pcm: this_->wake_word_pcm_) {
-                encoder->Encode(std::move(pcm), [this_](std::vector<uint8_t>&& opus) {
-                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                    this_->wake_word_opus_.emplace_back(std::move(opus));
-                    this_->wake_word_cv_.notify_all();
-                });
-                packets++;
-            }
-            this_->wake_word_pcm_.clear();
-
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %d packets in %ld ms", packets, (long)((end_time - start_time) / 1000));
-
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
-        }
-        vTaskDelete(NULL);
-    }, "encode_wake_word", stack_size, this, 2, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
+void CustomWakeWord::EncodeWakeWordData(int frame_duration_ms) {
+    preroll_.Capture(frame_duration_ms);
 }
 
 bool CustomWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    std::unique_lock<std::mutex> lock(wake_word_mutex_);
-    wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
-    });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+    return preroll_.GetPacket(opus);
 }
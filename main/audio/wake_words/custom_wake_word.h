@@ -6,20 +6,20 @@
 #include <esp_mn_models.h>
 #include <model_path.h>
 
-#include <deque>
 #include <string>
 #include <vector>
 #include <functional>
-#include <mutex>
-#include <condition_variable>
 #include <atomic>
 
 #include "audio_codec.h"
 #include "wake_word.h"
+#include "wake_word_preroll.h"
+#include "processors/afe_frontend.h"
 
 class CustomWakeWord : public WakeWord {
 public:
-    CustomWakeWord();
+    // Without a front-end the raw microphone input is fed to MultiNet
+    CustomWakeWord(AfeFrontend* frontend);
     ~CustomWakeWord();
 
     bool Initialize(AudioCodec* codec);
@@ -28,7 +28,7 @@ public:
     void Start();
     void Stop();
     size_t GetFeedSize();
-    void EncodeWakeWordData();
+    void EncodeWakeWordData(int frame_duration_ms);
     bool GetWakeWordOpus(std::vector<uint8_t>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
 
@@ -43,16 +43,19 @@ private:
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
     std::atomic<bool> running_ = false;
+    // Set by Start(), the buffers are reset on the task that feeds the detector
+    std::atomic<bool> reset_pending_ = false;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t* wake_word_encode_task_buffer_ = nullptr;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::deque<std::vector<int16_t>> wake_word_pcm_;
-    std::deque<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    // Left channel of stereo input, reused for every chunk
+    std::vector<int16_t> mono_data_;
+    WakeWordPreroll preroll_;
 
-    void StoreWakeWordData(const std::vector<int16_t>& data);
+    // Echo cancelled audio of the shared front-end, regrouped into MultiNet chunks
+    AfeFrontend* frontend_;
+    std::vector<int16_t> afe_buffer_;
+
+    void Detect(const int16_t* data, size_t samples);
+    void OnAfeOutput(afe_fetch_result_t* result);
 };
 
 #endif
@@ -0,0 +1,201 @@
+#include "wake_word_preroll.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "WakeWordPreroll"
+
+WakeWordPreroll::WakeWordPreroll() {
+}
+
+WakeWordPreroll::~WakeWordPreroll() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stopping_ = true;
+        cv_.notify_all();
+        cv_.wait(lock, [this]() { return task_ == nullptr; });
+    }
+    if (task_stack_ != nullptr) {
+        heap_caps_free(task_stack_);
+    }
+    if (task_buffer_ != nullptr) {
+        heap_caps_free(task_buffer_);
+    }
+    if (pcm_ != nullptr) {
+        heap_caps_free(pcm_);
+    }
+}
+
+bool WakeWordPreroll::Initialize(int frame_duration_ms) {
+    pcm_capacity_ = WAKE_WORD_PREROLL_SAMPLE_RATE / 1000 * (WAKE_WORD_PREROLL_MS + WAKE_WORD_PREROLL_BACKLOG_MS);
+    pcm_ = (int16_t*)heap_caps_malloc(pcm_capacity_ * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (pcm_ == nullptr) {
+        pcm_ = (int16_t*)heap_caps_malloc(pcm_capacity_ * sizeof(int16_t), MALLOC_CAP_DEFAULT);
+    }
+    task_stack_ = (StackType_t*)heap_caps_malloc(WAKE_WORD_PREROLL_STACK_SIZE, MALLOC_CAP_SPIRAM);
+    task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
+    if (pcm_ == nullptr || task_stack_ == nullptr || task_buffer_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate wake word pre-roll");
+        return false;
+    }
+    SetFrameDuration(frame_duration_ms);
+
+    task_ = xTaskCreateStatic([](void* arg) {
+        auto this_ = (WakeWordPreroll*)arg;
+        this_->EncoderTask();
+        vTaskDelete(NULL);
+    }, "wake_preroll", WAKE_WORD_PREROLL_STACK_SIZE, this, WAKE_WORD_PREROLL_PRIORITY, task_stack_, task_buffer_);
+    return true;
+}
+
+// Only called by the encoder task, or before it starts
+void WakeWordPreroll::SetFrameDuration(int frame_duration_ms) {
+    if (frame_duration_ms == frame_duration_ms_) {
+        return;
+    }
+    frame_duration_ms_ = frame_duration_ms;
+    encoder_ = std::make_unique<OpusEncoderWrapper>(WAKE_WORD_PREROLL_SAMPLE_RATE, 1, frame_duration_ms);
+    encoder_->SetComplexity(0); // 0 is the fastest
+    frame_.reserve(FrameSamples());
+    packets_.resize((WAKE_WORD_PREROLL_MS + frame_duration_ms - 1) / frame_duration_ms);
+    packet_head_ = 0;
+    packet_count_ = 0;
+}
+
+void WakeWordPreroll::Feed(const int16_t* data, size_t samples) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pcm_ == nullptr || capture_state_ != kCaptureNone) {
+        return;
+    }
+    if (samples > pcm_capacity_) {
+        data += samples - pcm_capacity_;
+        samples = pcm_capacity_;
+    }
+    size_t offset = write_pos_ % pcm_capacity_;
+    size_t first = std::min(samples, pcm_capacity_ - offset);
+    memcpy(pcm_ + offset, data, first * sizeof(int16_t));
+    memcpy(pcm_, data + first, (samples - first) * sizeof(int16_t));
+    write_pos_ += samples;
+
+    if (write_pos_ - encode_pos_ > pcm_capacity_) {
+        ESP_LOGW(TAG, "Encoder fell behind, dropping %u samples", (unsigned)(write_pos_ - encode_pos_ - pcm_capacity_));
+        encode_pos_ = write_pos_ - pcm_capacity_;
+    }
+    if (write_pos_ - encode_pos_ >= FrameSamples()) {
+        cv_.notify_all();
+    }
+}
+
+void WakeWordPreroll::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    start_pos_ = encode_pos_ = write_pos_;
+    packet_count_ = 0;
+    capture_state_ = kCaptureNone;
+    generation_++;
+    reset_encoder_ = true;
+    cv_.notify_all();
+}
+
+void WakeWordPreroll::Capture(int frame_duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (task_ == nullptr) {
+        return;
+    }
+    capture_frame_duration_ms_ = frame_duration_ms;
+    capture_state_ = kCaptureRequested;
+    vTaskPrioritySet(task_, WAKE_WORD_PREROLL_CAPTURE_PRIORITY);
+    cv_.notify_all();
+}
+
+bool WakeWordPreroll::GetPacket(std::vector<uint8_t>& opus) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return capture_state_ != kCaptureRequested; });
+    if (capture_state_ != kCaptureReady || packet_read_ >= packet_count_) {
+        return false;
+    }
+    size_t index = (packet_head_ + packets_.size() - packet_count_ + packet_read_) % packets_.size();
+    // Copied so the slot keeps its capacity for the next pre-roll
+    opus = packets_[index];
+    packet_read_++;
+    return true;
+}
+
+void WakeWordPreroll::EncoderTask() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this]() {
+            return stopping_ || reset_encoder_ || capture_state_ == kCaptureRequested
+                || (capture_state_ == kCaptureNone && write_pos_ - encode_pos_ >= FrameSamples());
+        });
+        if (stopping_) {
+            break;
+        }
+        if (reset_encoder_) {
+            reset_encoder_ = false;
+            encoder_->ResetState();
+            continue;
+        }
+        if (capture_state_ == kCaptureRequested) {
+            FinishCapture(lock);
+            continue;
+        }
+        EncodeFrame(lock);
+    }
+    task_ = nullptr;
+    cv_.notify_all();
+}
+
+// Encodes the next frame, padded with silence if less audio is left. The lock is released while encoding.
+bool WakeWordPreroll::EncodeFrame(std::unique_lock<std::mutex>& lock) {
+    size_t frame_samples = FrameSamples();
+    size_t samples = std::min((size_t)(write_pos_ - encode_pos_), frame_samples);
+    size_t offset = encode_pos_ % pcm_capacity_;
+    size_t first = std::min(samples, pcm_capacity_ - offset);
+    frame_.resize(frame_samples);
+    memcpy(frame_.data(), pcm_ + offset, first * sizeof(int16_t));
+    memcpy(frame_.data() + first, pcm_, (samples - first) * sizeof(int16_t));
+    std::fill(frame_.begin() + samples, frame_.end(), 0);
+    encode_pos_ += samples;
+
+    uint32_t generation = generation_;
+    auto& packet = packets_[packet_head_];
+    lock.unlock();
+    bool encoded = encoder_->Encode(std::move(frame_), packet);
+    lock.lock();
+
+    if (!encoded || generation != generation_) {
+        return false;
+    }
+    packet_head_ = (packet_head_ + 1) % packets_.size();
+    packet_count_ = std::min(packet_count_ + 1, packets_.size());
+    return true;
+}
+
+void WakeWordPreroll::FinishCapture(std::unique_lock<std::mutex>& lock) {
+    auto start_time = esp_timer_get_time();
+    uint32_t generation = generation_;
+    if (capture_frame_duration_ms_ != frame_duration_ms_) {
+        // The uplink frame duration changed since the pre-roll was encoded, start over from the PCM
+        SetFrameDuration(capture_frame_duration_ms_);
+        uint64_t window = WAKE_WORD_PREROLL_SAMPLE_RATE / 1000 * WAKE_WORD_PREROLL_MS;
+        encode_pos_ = std::max(start_pos_, write_pos_ > window ? write_pos_ - window : 0);
+    }
+    while (write_pos_ > encode_pos_ && generation == generation_) {
+        EncodeFrame(lock);
+    }
+    vTaskPrioritySet(NULL, WAKE_WORD_PREROLL_PRIORITY);
+    // Detection restarted meanwhile
+    if (generation != generation_) {
+        return;
+    }
+
+    capture_state_ = kCaptureReady;
+    packet_read_ = 0;
+    ESP_LOGI(TAG, "Wake word pre-roll ready, %u packets in %ld ms", (unsigned)packet_count_,
+        (long)((esp_timer_get_time() - start_time) / 1000));
+    cv_.notify_all();
+}
@@ -0,0 +1,89 @@
+#ifndef WAKE_WORD_PREROLL_H
+#define WAKE_WORD_PREROLL_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <opus_encoder.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+// Audio up to the wake word sent to the server, for example to identify who is speaking
+#define WAKE_WORD_PREROLL_MS 2000
+// How far the encoder may fall behind the detector before the oldest unencoded audio is dropped
+#define WAKE_WORD_PREROLL_BACKLOG_MS 500
+#define WAKE_WORD_PREROLL_SAMPLE_RATE 16000
+#define WAKE_WORD_PREROLL_STACK_SIZE (4096 * 7)
+#define WAKE_WORD_PREROLL_PRIORITY 1
+// Raised while the last frames are encoded after a detection
+#define WAKE_WORD_PREROLL_CAPTURE_PRIORITY 3
+
+/*
+ * Keeps the wake word pre-roll encoded as Opus at all times. Feed() copies the detector input into a fixed PCM
+ * ring, and a low priority task encodes it frame by frame into a fixed ring of packets covering the last
+ * WAKE_WORD_PREROLL_MS. After a detection only the last partial frame is left to encode, so the packets can be
+ * sent right away. Nothing is allocated per chunk once initialized.
+ */
+class WakeWordPreroll {
+public:
+    WakeWordPreroll();
+    ~WakeWordPreroll();
+
+    bool Initialize(int frame_duration_ms);
+    // Called by the detector with 16 kHz mono audio
+    void Feed(const int16_t* data, size_t samples);
+    // Forgets the buffered audio, called when detection starts again
+    void Reset();
+    // Freezes the pre-roll after a detection, a different frame duration re-encodes the buffered PCM
+    void Capture(int frame_duration_ms);
+    // The captured packets, oldest first, false after the last one
+    bool GetPacket(std::vector<uint8_t>& opus);
+
+private:
+    enum CaptureState {
+        kCaptureNone,
+        kCaptureRequested,
+        kCaptureReady,
+    };
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    TaskHandle_t task_ = nullptr;
+    StaticTask_t* task_buffer_ = nullptr;
+    StackType_t* task_stack_ = nullptr;
+    bool stopping_ = false;
+
+    // Sample positions run freely and are taken modulo the ring size
+    int16_t* pcm_ = nullptr;
+    size_t pcm_capacity_ = 0;
+    uint64_t write_pos_ = 0;
+    uint64_t encode_pos_ = 0;
+    // Start of the audio fed since the last Reset()
+    uint64_t start_pos_ = 0;
+    // Bumped by Reset(), so a frame encoded meanwhile is not stored
+    uint32_t generation_ = 0;
+    bool reset_encoder_ = false;
+
+    std::vector<std::vector<uint8_t>> packets_;
+    size_t packet_head_ = 0;
+    size_t packet_count_ = 0;
+    size_t packet_read_ = 0;
+
+    int frame_duration_ms_ = 0;
+    int capture_frame_duration_ms_ = 0;
+    CaptureState capture_state_ = kCaptureNone;
+    std::unique_ptr<OpusEncoderWrapper> encoder_;
+    std::vector<int16_t> frame_;
+
+    void EncoderTask();
+    void SetFrameDuration(int frame_duration_ms);
+    bool EncodeFrame(std::unique_lock<std::mutex>& lock);
+    void FinishCapture(std::unique_lock<std::mutex>& lock);
+    size_t FrameSamples() const { return WAKE_WORD_PREROLL_SAMPLE_RATE / 1000 * frame_duration_ms_; }
+};
+
+#endif // WAKE_WORD_PREROLL_H
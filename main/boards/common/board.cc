@@ -99,7 +99,8 @@ std::string Board::GetJson() {
                 }
             ],
             "ota": {
-                "label": "ota_0"
+                "label": "ota_0",
+                "delta": true
             },
             "board": {
                 ...
@@ -152,6 +153,9 @@ std::string Board::GetJson() {
     json += R"("ota":{)";
     auto ota_partition = esp_ota_get_running_partition();
     json += R"("label":")" + std::string(ota_partition->label) + R"(")";
+#if CONFIG_OTA_DELTA_UPDATE
+    json += R"(,"delta":true)";
+#endif
     json += R"(},)";
 
     json += R"("board":)" + GetBoardJson();
@@ -130,7 +130,12 @@ std::string Ml307Board::GetDeviceStatusJson() {
      *     "network": {
      *         "type": "cellular",
      *         "carrier": "CHINA MOBILE",
-     *         "csq": 10
+     *         "csq": 10,
+     *         "audio_channel": {
+     *             "rtt_ms": 120,
+     *             "jitter_ms": 8,
+     *             ...
+     *         }
      *     }
      * }
      */
@@ -184,6 +189,10 @@ std::string Ml307Board::GetDeviceStatusJson() {
     } else if (csq >= 25 && csq <= 31) {
         cJSON_AddStringToObject(network, "signal", "strong");
     }
+    auto channel = Application::GetInstance().GetChannelStatsJson();
+    if (channel != nullptr) {
+        cJSON_AddItemToObject(network, "audio_channel", channel);
+    }
     cJSON_AddItemToObject(root, "network", network);
 
     auto json_str = cJSON_PrintUnformatted(root);
@@ -190,7 +190,12 @@ std::string WifiBoard::GetDeviceStatusJson() {
      *     "network": {
      *         "type": "wifi",
      *         "ssid": "Xiaozhi",
-     *         "rssi": -60
+     *         "rssi": -60,
+     *         "audio_channel": {
+     *             "rtt_ms": 120,
+     *             "jitter_ms": 8,
+     *             ...
+     *         }
      *     },
      *     "chip": {
      *         "temperature": 25
@@ -244,6 +249,10 @@ std::string WifiBoard::GetDeviceStatusJson() {
     } else {
         cJSON_AddStringToObject(network, "signal", "weak");
     }
+    auto channel = Application::GetInstance().GetChannelStatsJson();
+    if (channel != nullptr) {
+        cJSON_AddItemToObject(network, "audio_channel", channel);
+    }
     cJSON_AddItemToObject(root, "network", network);
 
     // Chip
@@ -0,0 +1,64 @@
+#include "boot_profiler.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <string>
+
+#define TAG "BootProfiler"
+
+int BootProfiler::Begin(const char* name) {
+#if CONFIG_BOOT_PROFILER
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (phases_.size() >= BOOT_PROFILER_MAX_PHASES) {
+        return -1;
+    }
+    if (phases_.empty()) {
+        phases_.reserve(BOOT_PROFILER_MAX_PHASES);
+    }
+    phases_.push_back({ name, pcTaskGetName(NULL), esp_timer_get_time(), -1 });
+    return phases_.size() - 1;
+#else
+    return -1;
+#endif
+}
+
+void BootProfiler::End(int phase) {
+    if (phase < 0) {
+        return;
+    }
+    auto now = esp_timer_get_time();
+    std::lock_guard<std::mutex> lock(mutex_);
+    phases_[phase].end_us = now;
+}
+
+void BootProfiler::Mark(const char* name) {
+    End(Begin(name));
+}
+
+void BootProfiler::PrintTimeline() {
+#if CONFIG_BOOT_PROFILER
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = esp_timer_get_time();
+    ESP_LOGI(TAG, "Boot timeline of " BOARD_NAME ", ready after %lld ms:", now / 1000);
+
+    std::string bar;
+    for (auto& phase : phases_) {
+        int64_t end_us = phase.end_us >= 0 ? phase.end_us : now;
+        int first = phase.start_us * BOOT_PROFILER_BAR_WIDTH / now;
+        int last = end_us * BOOT_PROFILER_BAR_WIDTH / now;
+        bar.assign(BOOT_PROFILER_BAR_WIDTH + 1, ' ');
+        for (int i = first; i <= last && i <= BOOT_PROFILER_BAR_WIDTH; i++) {
+            bar[i] = phase.end_us == phase.start_us ? '|' : '=';
+        }
+        if (phase.end_us >= 0) {
+            ESP_LOGI(TAG, "%6lld ms %6lld ms  [%s]  %-12s %s", phase.start_us / 1000, (end_us - phase.start_us) / 1000,
+                bar.c_str(), phase.name, phase.task);
+        } else {
+            ESP_LOGI(TAG, "%6lld ms   running  [%s]  %-12s %s", phase.start_us / 1000, bar.c_str(), phase.name, phase.task);
+        }
+    }
+#endif
+}
@@ -0,0 +1,60 @@
+#ifndef _BOOT_PROFILER_H_
+#define _BOOT_PROFILER_H_
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#define BOOT_PROFILER_MAX_PHASES 32
+// Width of the timeline bars in characters
+#define BOOT_PROFILER_BAR_WIDTH 40
+
+/*
+ * Records how long each boot phase takes and on which task, measured from power on with esp_timer.
+ * Phases may overlap when they run on different tasks. PrintTimeline() logs them once the device is ready.
+ */
+class BootProfiler {
+public:
+    static BootProfiler& GetInstance() {
+        static BootProfiler instance;
+        return instance;
+    }
+    // 删除拷贝构造函数和赋值运算符
+    BootProfiler(const BootProfiler&) = delete;
+    BootProfiler& operator=(const BootProfiler&) = delete;
+
+    // Returns the phase to pass to End(), or -1 if nothing is recorded
+    int Begin(const char* name);
+    void End(int phase);
+    // A phase without duration, such as entering app_main
+    void Mark(const char* name);
+    void PrintTimeline();
+
+private:
+    BootProfiler() = default;
+
+    struct Phase {
+        const char* name;
+        const char* task;
+        int64_t start_us;
+        int64_t end_us;
+    };
+
+    std::mutex mutex_;
+    std::vector<Phase> phases_;
+};
+
+// Records the enclosing scope as a boot phase
+class BootPhase {
+public:
+    explicit BootPhase(const char* name) : phase_(BootProfiler::GetInstance().Begin(name)) {}
+    ~BootPhase() { BootProfiler::GetInstance().End(phase_); }
+
+    BootPhase(const BootPhase&) = delete;
+    BootPhase& operator=(const BootPhase&) = delete;
+
+private:
+    int phase_;
+};
+
+#endif // _BOOT_PROFILER_H_
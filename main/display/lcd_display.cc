@@ -7,6 +7,7 @@
 #include <esp_err.h>
 #include <esp_lvgl_port.h>
 #include <esp_heap_caps.h>
+#include <esp_timer.h>
 #include "assets/lang_config.h"
 #include <cstring>
 #include "settings.h"
@@ -67,6 +68,126 @@ const ThemeColors LIGHT_THEME = {
 
 LV_FONT_DECLARE(font_awesome_30_4);
 
+#define LCD_PARTIAL_BUFFER_LINES 20
+#if CONFIG_LCD_RENDER_MODE_DOUBLE_BUFFER
+// Internal RAM left for Wi-Fi, audio and task stacks after the draw buffers
+#define LCD_INTERNAL_RAM_RESERVE (96 * 1024)
+// Upper bound of both draw buffers together in internal RAM
+#define LCD_INTERNAL_BUFFER_MAX (48 * 1024)
+// With fewer lines per buffer the SPI window setup eats what double buffering saves
+#define LCD_MIN_BUFFER_LINES 20
+// Internal DMA buffer the PSRAM draw buffers are copied through, in lines
+#define LCD_TRANS_LINES 10
+#endif
+
+struct LcdDrawBuffers {
+    uint32_t buffer_size;
+    bool double_buffer;
+    bool spiram;
+    uint32_t trans_size;
+};
+
+// Sizes the draw buffers of the SPI display from the memory this board has left
+static LcdDrawBuffers SelectDrawBuffers(int width, int height) {
+    LcdDrawBuffers buffers = {
+        .buffer_size = static_cast<uint32_t>(width * LCD_PARTIAL_BUFFER_LINES),
+        .double_buffer = false,
+        .spiram = false,
+        .trans_size = 0,
+    };
+#if CONFIG_LCD_RENDER_MODE_DOUBLE_BUFFER
+    size_t line_size = width * sizeof(uint16_t);
+    size_t internal = heap_caps_get_largest_free_block(MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+    size_t budget = 0;
+    if (internal > LCD_INTERNAL_RAM_RESERVE) {
+        budget = std::min<size_t>(internal - LCD_INTERNAL_RAM_RESERVE, LCD_INTERNAL_BUFFER_MAX);
+    }
+    int lines = std::min<int>(budget / 2 / line_size, height);
+    if (lines >= LCD_MIN_BUFFER_LINES) {
+        // The flush is finished by the SPI DMA interrupt, LVGL renders into the other buffer meanwhile
+        buffers.buffer_size = width * lines;
+        buffers.double_buffer = true;
+        ESP_LOGI(TAG, "Draw buffers: 2 x %d lines in internal RAM", lines);
+        return buffers;
+    }
+
+    // esp_lvgl_port copies each chunk of a PSRAM buffer into the transfer buffer and waits for it, so this
+    // flush is synchronous. It still saves LVGL render passes over the 20-line buffer, but nothing overlaps.
+    lines = height / 2;
+    size_t psram = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
+    if (psram > 2 * lines * line_size && internal > width * LCD_TRANS_LINES * sizeof(uint16_t)) {
+        buffers.buffer_size = width * lines;
+        buffers.double_buffer = true;
+        buffers.spiram = true;
+        buffers.trans_size = width * LCD_TRANS_LINES;
+        ESP_LOGI(TAG, "Draw buffers: 2 x %d lines in PSRAM, synchronous flush", lines);
+        return buffers;
+    }
+    ESP_LOGW(TAG, "Not enough memory for double buffering, using %d lines", LCD_PARTIAL_BUFFER_LINES);
+#endif
+    return buffers;
+}
+
+#if CONFIG_LCD_RENDER_STATS
+#define LCD_RENDER_STATS_INTERVAL_US (10 * 1000 * 1000)
+
+// Owned by the LVGL task, there is only one display
+static struct {
+    int64_t window_start_us;
+    int64_t render_start_us;
+    int64_t wait_start_us;
+    uint32_t frames;
+    int64_t render_us;
+    int64_t max_render_us;
+    int64_t wait_us;
+} render_stats;
+
+static void RenderStatsEventCallback(lv_event_t* e) {
+    int64_t now = esp_timer_get_time();
+    switch (lv_event_get_code(e)) {
+    case LV_EVENT_RENDER_START:
+        render_stats.render_start_us = now;
+        break;
+    case LV_EVENT_FLUSH_WAIT_START:
+        render_stats.wait_start_us = now;
+        break;
+    case LV_EVENT_FLUSH_WAIT_FINISH:
+        render_stats.wait_us += now - render_stats.wait_start_us;
+        break;
+    case LV_EVENT_RENDER_READY: {
+        int64_t render_us = now - render_stats.render_start_us;
+        render_stats.frames++;
+        render_stats.render_us += render_us;
+        render_stats.max_render_us = std::max(render_stats.max_render_us, render_us);
+
+        int64_t elapsed = now - render_stats.window_start_us;
+        if (render_stats.window_start_us == 0) {
+            render_stats = {};
+            render_stats.window_start_us = now;
+        } else if (elapsed >= LCD_RENDER_STATS_INTERVAL_US) {
+            uint32_t fps_x10 = render_stats.frames * 10000000LL / elapsed;
+            ESP_LOGI(TAG, "Render: %lu.%lu fps, %lld us/frame (max %lld us), waiting for panel %lld us/frame",
+                fps_x10 / 10, fps_x10 % 10, render_stats.render_us / render_stats.frames, render_stats.max_render_us,
+                render_stats.wait_us / render_stats.frames);
+            render_stats = {};
+            render_stats.window_start_us = now;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Counts the frames LVGL renders and the time it blocks on the panel transfer
+static void AddRenderStats(lv_display_t* display) {
+    lv_display_add_event_cb(display, RenderStatsEventCallback, LV_EVENT_RENDER_START, nullptr);
+    lv_display_add_event_cb(display, RenderStatsEventCallback, LV_EVENT_RENDER_READY, nullptr);
+    lv_display_add_event_cb(display, RenderStatsEventCallback, LV_EVENT_FLUSH_WAIT_START, nullptr);
+    lv_display_add_event_cb(display, RenderStatsEventCallback, LV_EVENT_FLUSH_WAIT_FINISH, nullptr);
+}
+#endif
+
 LcdDisplay::LcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel, DisplayFonts fonts, int width, int height)
     : panel_io_(panel_io), panel_(panel), fonts_(fonts) {
     width_ = width;
@@ -106,16 +227,21 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
     port_cfg.task_priority = 1;
     port_cfg.timer_period_ms = 40;
+#if CONFIG_LCD_RENDER_MODE_DOUBLE_BUFFER && !CONFIG_FREERTOS_UNICORE
+    // The audio input and AFE tasks run on core 1
+    port_cfg.task_affinity = 0;
+#endif
     lvgl_port_init(&port_cfg);
 
     ESP_LOGI(TAG, "Adding LCD display");
+    auto buffers = SelectDrawBuffers(width_, height_);
     const lvgl_port_display_cfg_t display_cfg = {
         .io_handle = panel_io_,
         .panel_handle = panel_,
         .control_handle = nullptr,
-        .buffer_size = static_cast<uint32_t>(width_ * 20),
-        .double_buffer = false,
-        .trans_size = 0,
+        .buffer_size = buffers.buffer_size,
+        .double_buffer = buffers.double_buffer,
+        .trans_size = buffers.trans_size,
         .hres = static_cast<uint32_t>(width_),
         .vres = static_cast<uint32_t>(height_),
         .monochrome = false,
@@ -126,8 +252,8 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         },
         .color_format = LV_COLOR_FORMAT_RGB565,
         .flags = {
-            .buff_dma = 1,
-            .buff_spiram = 0,
+            .buff_dma = !buffers.spiram,
+            .buff_spiram = buffers.spiram,
             .sw_rotate = 0,
             .swap_bytes = 1,
             .full_refresh = 0,
@@ -140,6 +266,9 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         ESP_LOGE(TAG, "Failed to add display");
         return;
     }
+#if CONFIG_LCD_RENDER_STATS
+    AddRenderStats(display_);
+#endif
 
     if (offset_x != 0 || offset_y != 0) {
         lv_display_set_offset(display_, offset_x, offset_y);
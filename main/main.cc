@@ -7,15 +7,19 @@
 
 #include "application.h"
 #include "system_info.h"
+#include "boot_profiler.h"
 
 #define TAG "main"
 
 extern "C" void app_main(void)
 {
+    BootProfiler::GetInstance().Mark("app_main");
+
     // Initialize the default event loop
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
     // Initialize NVS flash for WiFi configuration
+    int nvs_phase = BootProfiler::GetInstance().Begin("nvs");
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
         ESP_LOGW(TAG, "Erasing NVS flash to fix corruption");
@@ -23,6 +27,7 @@ extern "C" void app_main(void)
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+    BootProfiler::GetInstance().End(nvs_phase);
 
     // Launch the application
     auto& app = Application::GetInstance();
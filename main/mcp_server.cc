@@ -8,17 +8,84 @@
 #include <esp_app_desc.h>
 #include <algorithm>
 #include <cstring>
-#include <esp_pthread.h>
+#include <esp_heap_caps.h>
 
 #include "application.h"
 #include "display.h"
 #include "board.h"
+#include "audio_latency.h"
 
 #define TAG "MCP"
 
-#define DEFAULT_TOOLCALL_STACK_SIZE 6144
+#if CONFIG_MCP_TOOL_STACK_IN_PSRAM
+#define MCP_TOOL_STACK_CAPS MALLOC_CAP_SPIRAM
+#else
+#define MCP_TOOL_STACK_CAPS MALLOC_CAP_INTERNAL
+#endif
+#define MCP_DEADLINE_CHECK_INTERVAL_MS 100
+// tools/list replies are split into pages of this size, the reserved bytes leave room for the cursor
+#define MCP_TOOLS_LIST_PAGE_SIZE 8000
+#define MCP_TOOLS_LIST_RESERVED_SIZE 30
 
 McpServer::McpServer() {
+    esp_timer_create_args_t deadline_timer_args = {
+        .callback = [](void* arg) {
+            auto server = (McpServer*)arg;
+            server->CheckDeadlines();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "mcp_deadline",
+        .skip_unhandled_events = true,
+    };
+    esp_timer_create(&deadline_timer_args, &deadline_timer_);
+}
+
+// Called with call_mutex_ held. The stack is kept once allocated, so a burst of calls cannot fragment the heap
+bool McpServer::StartWorker() {
+    auto stack = (StackType_t*)heap_caps_malloc(CONFIG_MCP_TOOL_STACK_SIZE, MCP_TOOL_STACK_CAPS);
+    auto task_buffer = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
+    if (stack == nullptr || task_buffer == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate a %d byte stack for a tool call worker", CONFIG_MCP_TOOL_STACK_SIZE);
+        heap_caps_free(stack);
+        heap_caps_free(task_buffer);
+        return false;
+    }
+
+    auto& worker = workers_.emplace_back();
+    worker.stack = stack;
+    worker.task_buffer = task_buffer;
+    char name[16];
+    snprintf(name, sizeof(name), "tool_call_%u", pool_workers_);
+    pool_workers_++;
+    // Blocks on call_mutex_ until the caller has queued its call
+    worker.task = xTaskCreateStatic([](void* arg) {
+        auto& worker = *(ToolCallWorker*)arg;
+        McpServer::GetInstance().WorkerTask(worker);
+    }, name, CONFIG_MCP_TOOL_STACK_SIZE, &worker, 1, worker.stack, worker.task_buffer);
+    return true;
+}
+
+// Called with call_mutex_ held. The call runs on a task of its own with the stack it asked for, like every
+// call did before the pool, and the stack is freed when it returns
+bool McpServer::StartDedicatedWorker(std::unique_ptr<ToolCall> call, int stack_size) {
+    auto& worker = workers_.emplace_back();
+    worker.dedicated = true;
+    BeginToolCall(worker, *call);
+    auto call_ptr = call.release();
+    if (xTaskCreate([](void* arg) {
+            auto& worker = *(ToolCallWorker*)arg;
+            McpServer::GetInstance().RunToolCall(worker, std::unique_ptr<ToolCall>(worker.call));
+            vTaskDelete(NULL);
+        }, "tool_call", stack_size, &worker, 1, &worker.task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create a task with a %d byte stack", stack_size);
+        call_ptr->tool->running_--;
+        call_ptr->tool->stats_.calls--;
+        workers_.pop_back();
+        delete call_ptr;
+        return false;
+    }
+    return true;
 }
 
 McpServer::~McpServer() {
@@ -33,6 +100,8 @@ void McpServer::AddCommonTools() {
     // the tools list to utilize the prompt cache.
     // Backup the original tools list and restore it after adding the common tools.
     auto original_tools = std::move(tools_);
+    tools_.clear();
+    tool_index_.clear();
     auto& board = Board::GetInstance();
 
     AddTool("self.get_device_status",
@@ -56,6 +125,51 @@ void McpServer::AddCommonTools() {
             return true;
         });
     
+    AddTool("self.audio.get_latency_stats",
+        "Get the latency percentiles (p50 / p95 / p99 / max, in ms) of each audio pipeline stage, for diagnosing audio delay.\n"
+        "Args:\n"
+        "  `reset`: Clear the statistics after reading them.",
+        PropertyList({
+            Property("reset", kPropertyTypeBoolean, false)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& latency = AudioLatency::GetInstance();
+            auto json = latency.GetStatsJson();
+            if (properties["reset"].value<bool>()) {
+                latency.Reset();
+            }
+            return json;
+        });
+
+    AddTool("self.mcp.get_tool_stats",
+        "Get the statistics of the tool calls handled by the device: for each tool the number of calls, "
+        "the queue depth, how long calls waited for a worker and how long they ran, plus rejected, cancelled and timed out calls.",
+        PropertyList(),
+        [this](const PropertyList& properties) -> ReturnValue {
+            auto json = GetToolStatsJson();
+            auto json_str = cJSON_PrintUnformatted(json);
+            std::string result(json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
+            return result;
+        });
+
+    AddTool("self.network.get_channel_stats",
+        "Get the link metrics of the audio channel to the server: round trip time, jitter, lost and reordered packets, "
+        "bytes per second in each direction and the number of packets waiting to be sent. Use this for diagnosing choppy or delayed voice.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto json = Application::GetInstance().GetChannelStatsJson();
+            if (json == nullptr) {
+                return std::string("{}");
+            }
+            auto json_str = cJSON_PrintUnformatted(json);
+            std::string result(json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
+            return result;
+        });
+
     auto backlight = board.GetBacklight();
     if (backlight) {
         AddTool("self.screen.set_brightness",
@@ -94,28 +208,71 @@ void McpServer::AddCommonTools() {
             PropertyList({
                 Property("question", kPropertyTypeString)
             }),
-            [camera](const PropertyList& properties) -> ReturnValue {
+            [this, camera](const PropertyList& properties) -> ReturnValue {
                 if (!camera->Capture()) {
                     return "{\"success\": false, \"message\": \"Failed to capture photo\"}";
                 }
+                // Uploading and explaining the photo takes seconds, skip it if nobody waits for the answer anymore
+                if (IsToolCallCancelled()) {
+                    return "{\"success\": false, \"message\": \"Cancelled\"}";
+                }
                 auto question = properties["question"].value<std::string>();
                 return camera->Explain(question);
             });
     }
 
     // Restore the original tools list to the end of the tools list
+    std::lock_guard<std::mutex> lock(tools_mutex_);
     tools_.insert(tools_.end(), original_tools.begin(), original_tools.end());
+    RebuildToolIndex();
 }
 
 void McpServer::AddTool(McpTool* tool) {
+    std::lock_guard<std::mutex> lock(tools_mutex_);
     // Prevent adding duplicate tools
-    if (std::find_if(tools_.begin(), tools_.end(), [tool](const McpTool* t) { return t->name() == tool->name(); }) != tools_.end()) {
+    if (tool_index_.find(tool->name()) != tool_index_.end()) {
         ESP_LOGW(TAG, "Tool %s already added", tool->name().c_str());
         return;
     }
 
     ESP_LOGI(TAG, "Add tool: %s", tool->name().c_str());
+    tool_index_.emplace(tool->name(), tools_.size());
     tools_.push_back(tool);
+    tool_page_ends_.clear();
+}
+
+// Called with tools_mutex_ held after the tools were reordered
+void McpServer::RebuildToolIndex() {
+    tool_index_.clear();
+    for (size_t i = 0; i < tools_.size(); i++) {
+        // The first of duplicated names wins, like the linear search did
+        tool_index_.emplace(tools_[i]->name(), i);
+    }
+    tool_page_ends_.clear();
+}
+
+// Called with tools_mutex_ held. The pages are filled greedily, so the end of the page starting at a tool never
+// moves backwards as the start moves forward, and all of them are found in one pass with two cursors
+void McpServer::BuildToolPages() {
+    const size_t overhead = strlen("{\"tools\":[") + MCP_TOOLS_LIST_RESERVED_SIZE;
+    size_t count = tools_.size();
+    tool_page_ends_.assign(count, 0);
+    size_t end = 0;
+    size_t size = overhead;     // Of the tools in [start, end), each followed by a comma
+    for (size_t start = 0; start < count; start++) {
+        if (end < start) {
+            end = start;
+            size = overhead;
+        }
+        while (end < count && size + tools_[end]->to_json().size() + 1 <= MCP_TOOLS_LIST_PAGE_SIZE) {
+            size += tools_[end]->to_json().size() + 1;
+            end++;
+        }
+        tool_page_ends_[start] = end;
+        if (end > start) {
+            size -= tools_[start]->to_json().size() + 1;
+        }
+    }
 }
 
 void McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
@@ -167,6 +324,14 @@ void McpServer::ParseMessage(const cJSON* json) {
     }
     
     auto method_str = std::string(method->valuestring);
+    if (method_str == "notifications/cancelled") {
+        auto params = cJSON_GetObjectItem(json, "params");
+        auto request_id = cJSON_GetObjectItem(params, "requestId");
+        if (cJSON_IsNumber(request_id)) {
+            CancelToolCall(request_id->valueint);
+        }
+        return;
+    }
     if (method_str.find("notifications") == 0) {
         return;
     }
@@ -230,7 +395,15 @@ void McpServer::ParseMessage(const cJSON* json) {
             ReplyError(id_int, "Invalid stackSize");
             return;
         }
-        DoToolCall(id_int, std::string(tool_name->valuestring), tool_arguments, stack_size ? stack_size->valueint : DEFAULT_TOOLCALL_STACK_SIZE);
+        auto timeout = cJSON_GetObjectItem(params, "timeoutMs");
+        if (timeout != nullptr && !cJSON_IsNumber(timeout)) {
+            ESP_LOGE(TAG, "tools/call: Invalid timeoutMs");
+            ReplyError(id_int, "Invalid timeoutMs");
+            return;
+        }
+        DoToolCall(id_int, std::string(tool_name->valuestring), tool_arguments,
+            stack_size ? stack_size->valueint : CONFIG_MCP_TOOL_STACK_SIZE,
+            timeout ? timeout->valueint : CONFIG_MCP_TOOL_CALL_TIMEOUT_MS);
     } else {
         ESP_LOGE(TAG, "Method not implemented: %s", method_str.c_str());
         ReplyError(id_int, "Method not implemented: " + method_str);
@@ -255,47 +428,39 @@ void McpServer::ReplyError(int id, const std::string& message) {
 }
 
 void McpServer::GetToolsList(int id, const std::string& cursor) {
-    const int max_payload_size = 8000;
     std::string json = "{\"tools\":[";
-    
-    bool found_cursor = cursor.empty();
-    auto it = tools_.begin();
-    std::string next_cursor = "";
-    
-    while (it != tools_.end()) {
-        // 如果我们还没有找到起始位置，继续搜索
-        if (!found_cursor) {
-            if ((*it)->name() == cursor) {
-                found_cursor = true;
-            } else {
-                ++it;
-                continue;
-            }
+    std::string next_cursor;
+    {
+        std::lock_guard<std::mutex> lock(tools_mutex_);
+        size_t start = 0;
+        if (!cursor.empty()) {
+            auto index = tool_index_.find(cursor);
+            // An unknown cursor gives an empty list, as before
+            start = index != tool_index_.end() ? index->second : tools_.size();
         }
-        
-        // 添加tool前检查大小
-        std::string tool_json = (*it)->to_json() + ",";
-        if (json.length() + tool_json.length() + 30 > max_payload_size) {
-            // 如果添加这个tool会超出大小限制，设置next_cursor并退出循环
-            next_cursor = (*it)->name();
-            break;
+        if (tool_page_ends_.size() != tools_.size()) {
+            BuildToolPages();
+        }
+
+        size_t end = start < tools_.size() ? tool_page_ends_[start] : start;
+        if (end == start && start < tools_.size()) {
+            auto& name = tools_[start]->name();
+            ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", name.c_str());
+            ReplyError(id, "Failed to add tool " + name + " because of payload size limit");
+            return;
+        }
+        for (size_t i = start; i < end; i++) {
+            json += tools_[i]->to_json();
+            json += ',';
+        }
+        if (end < tools_.size()) {
+            next_cursor = tools_[end]->name();
         }
-        
-        json += tool_json;
-        ++it;
     }
-    
+
     if (json.back() == ',') {
         json.pop_back();
     }
-    
-    if (json.back() == '[' && !tools_.empty()) {
-        // 如果没有添加任何tool，返回错误
-        ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", next_cursor.c_str());
-        ReplyError(id, "Failed to add tool " + next_cursor + " because of payload size limit");
-        return;
-    }
-
     if (next_cursor.empty()) {
         json += "]}";
     } else {
@@ -305,19 +470,22 @@ void McpServer::GetToolsList(int id, const std::string& cursor) {
     ReplyResult(id, json);
 }
 
-void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size) {
-    auto tool_iter = std::find_if(tools_.begin(), tools_.end(), 
-                                 [&tool_name](const McpTool* tool) { 
-                                     return tool->name() == tool_name; 
-                                 });
-    
-    if (tool_iter == tools_.end()) {
+void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size, int timeout_ms) {
+    McpTool* tool = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(tools_mutex_);
+        auto index = tool_index_.find(tool_name);
+        if (index != tool_index_.end()) {
+            tool = tools_[index->second];
+        }
+    }
+    if (tool == nullptr) {
         ESP_LOGE(TAG, "tools/call: Unknown tool: %s", tool_name.c_str());
         ReplyError(id, "Unknown tool: " + tool_name);
         return;
     }
 
-    PropertyList arguments = (*tool_iter)->properties();
+    PropertyList arguments = tool->properties();
     try {
         for (auto& argument : arguments) {
             bool found = false;
@@ -347,21 +515,217 @@ void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* to
         return;
     }
 
-    // Start a task to receive data with stack size
-    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
-    cfg.thread_name = "tool_call";
-    cfg.stack_size = stack_size;
-    cfg.prio = 1;
-    esp_pthread_set_cfg(&cfg);
-
-    // Use a thread to call the tool to avoid blocking the main thread
-    tool_call_thread_ = std::thread([this, id, tool_iter, arguments = std::move(arguments)]() {
-        try {
-            ReplyResult(id, (*tool_iter)->Call(arguments));
-        } catch (const std::exception& e) {
-            ESP_LOGE(TAG, "tools/call: %s", e.what());
-            ReplyError(id, e.what());
+    auto call = std::make_unique<ToolCall>();
+    call->id = id;
+    call->tool = tool;
+    call->arguments = std::move(arguments);
+    call->enqueue_time_us = esp_timer_get_time();
+    call->deadline_us = timeout_ms > 0 ? call->enqueue_time_us + timeout_ms * 1000LL : 0;
+    const char* error = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(call_mutex_);
+        if (stack_size > CONFIG_MCP_TOOL_STACK_SIZE) {
+            ESP_LOGI(TAG, "tools/call: %s asks for a %d byte stack, more than the %d of the workers", tool_name.c_str(),
+                stack_size, CONFIG_MCP_TOOL_STACK_SIZE);
+            if (!StartDedicatedWorker(std::move(call), stack_size)) {
+                tool->stats_.rejected++;
+                error = "Not enough memory for the tool call stack";
+            }
+        } else if (call_queue_.size() >= CONFIG_MCP_TOOL_QUEUE_SIZE) {
+            tool->stats_.rejected++;
+            error = "Too many pending tool calls";
+        } else if (idle_workers_ == 0 && pool_workers_ < CONFIG_MCP_TOOL_WORKERS && !StartWorker() && pool_workers_ == 0) {
+            tool->stats_.rejected++;
+            error = "Not enough memory for the tool call stack";
+        } else {
+            tool->queued_++;
+            tool->stats_.max_queue_depth = std::max<uint32_t>(tool->stats_.max_queue_depth, tool->queued_);
+            call_queue_.push_back(std::move(call));
         }
-    });
-    tool_call_thread_.detach();
-}
\ No newline at end of file
+        if (error == nullptr && !esp_timer_is_active(deadline_timer_)) {
+            esp_timer_start_periodic(deadline_timer_, MCP_DEADLINE_CHECK_INTERVAL_MS * 1000);
+        }
+    }
+    if (error != nullptr) {
+        ESP_LOGE(TAG, "tools/call: %s, rejected %s", error, tool_name.c_str());
+        ReplyError(id, error);
+        return;
+    }
+    call_cv_.notify_all();
+}
+
+void McpServer::WorkerTask(ToolCallWorker& worker) {
+    while (true) {
+        std::unique_ptr<ToolCall> call;
+        {
+            std::unique_lock<std::mutex> lock(call_mutex_);
+            // The oldest call whose tool is below its concurrency limit, the others keep their place
+            auto runnable = call_queue_.end();
+            idle_workers_++;
+            call_cv_.wait(lock, [this, &runnable]() {
+                runnable = std::find_if(call_queue_.begin(), call_queue_.end(), [](const std::unique_ptr<ToolCall>& call) {
+                    return call->tool->running_ < call->tool->max_concurrency_;
+                });
+                return runnable != call_queue_.end();
+            });
+            idle_workers_--;
+            call = std::move(*runnable);
+            call_queue_.erase(runnable);
+            call->tool->queued_--;
+            BeginToolCall(worker, *call);
+        }
+        RunToolCall(worker, std::move(call));
+    }
+}
+
+// Called with call_mutex_ held
+void McpServer::BeginToolCall(ToolCallWorker& worker, ToolCall& call) {
+    auto& stats = call.tool->stats_;
+    int64_t wait_us = esp_timer_get_time() - call.enqueue_time_us;
+    stats.calls++;
+    stats.total_wait_us += wait_us;
+    stats.max_wait_us = std::max(stats.max_wait_us, wait_us);
+    call.tool->running_++;
+    worker.call = &call;
+}
+
+void McpServer::RunToolCall(ToolCallWorker& worker, std::unique_ptr<ToolCall> call) {
+    int64_t start_time = esp_timer_get_time();
+    std::string result;
+    bool success = true;
+    try {
+        result = call->tool->Call(call->arguments);
+    } catch (const std::exception& e) {
+        ESP_LOGE(TAG, "tools/call: %s", e.what());
+        result = e.what();
+        success = false;
+    }
+    int64_t run_us = esp_timer_get_time() - start_time;
+
+    bool finished;
+    {
+        std::lock_guard<std::mutex> lock(call_mutex_);
+        auto& stats = call->tool->stats_;
+        stats.total_run_us += run_us;
+        stats.max_run_us = std::max(stats.max_run_us, run_us);
+        call->tool->running_--;
+        worker.call = nullptr;
+        finished = call->finished;
+        if (worker.dedicated) {
+            workers_.remove_if([&worker](const ToolCallWorker& w) { return &w == &worker; });
+        }
+    }
+    // A call of the same tool may be runnable now
+    call_cv_.notify_all();
+
+    if (finished) {
+        ESP_LOGW(TAG, "tools/call: Dropped the result of %s, the call was cancelled or timed out", call->tool->name().c_str());
+    } else if (success) {
+        ReplyResult(call->id, result);
+    } else {
+        ReplyError(call->id, result);
+    }
+}
+
+// Cancelled calls get no reply, as the MCP specification asks
+void McpServer::CancelToolCall(int id) {
+    std::lock_guard<std::mutex> lock(call_mutex_);
+    for (auto it = call_queue_.begin(); it != call_queue_.end(); ++it) {
+        if ((*it)->id == id) {
+            ESP_LOGI(TAG, "Cancelled queued tool call %d", id);
+            (*it)->tool->queued_--;
+            (*it)->tool->stats_.cancelled++;
+            call_queue_.erase(it);
+            return;
+        }
+    }
+    for (auto& worker : workers_) {
+        if (worker.call != nullptr && worker.call->id == id && !worker.call->finished) {
+            ESP_LOGI(TAG, "Cancelled running tool call %d", id);
+            worker.call->finished = true;
+            worker.call->tool->stats_.cancelled++;
+            return;
+        }
+    }
+}
+
+bool McpServer::IsToolCallCancelled() {
+    auto task = xTaskGetCurrentTaskHandle();
+    std::lock_guard<std::mutex> lock(call_mutex_);
+    for (auto& worker : workers_) {
+        if (worker.task == task) {
+            return worker.call != nullptr && worker.call->finished;
+        }
+    }
+    return false;
+}
+
+void McpServer::CheckDeadlines() {
+    std::vector<int> expired;
+    {
+        std::lock_guard<std::mutex> lock(call_mutex_);
+        int64_t now = esp_timer_get_time();
+        for (auto it = call_queue_.begin(); it != call_queue_.end();) {
+            auto& call = *it;
+            if (call->deadline_us != 0 && now > call->deadline_us) {
+                expired.push_back(call->id);
+                call->tool->queued_--;
+                call->tool->stats_.timed_out++;
+                it = call_queue_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        bool running = false;
+        for (auto& worker : workers_) {
+            auto call = worker.call;
+            if (call == nullptr) {
+                continue;
+            }
+            running = true;
+            if (!call->finished && call->deadline_us != 0 && now > call->deadline_us) {
+                // The tool keeps running until it returns, IsToolCallCancelled() tells it to stop early
+                expired.push_back(call->id);
+                call->finished = true;
+                call->tool->stats_.timed_out++;
+            }
+        }
+        if (call_queue_.empty() && !running) {
+            esp_timer_stop(deadline_timer_);
+        }
+    }
+    for (int id : expired) {
+        ESP_LOGW(TAG, "tools/call: Call %d timed out", id);
+        ReplyError(id, "Tool call timed out");
+    }
+}
+
+cJSON* McpServer::GetToolStatsJson() {
+    cJSON* root = cJSON_CreateObject();
+    std::lock_guard<std::mutex> tools_lock(tools_mutex_);
+    std::lock_guard<std::mutex> lock(call_mutex_);
+    cJSON_AddNumberToObject(root, "workers", pool_workers_);
+    cJSON_AddNumberToObject(root, "queued", call_queue_.size());
+    cJSON* tools = cJSON_CreateObject();
+    for (auto tool : tools_) {
+        auto& stats = tool->stats_;
+        if (stats.calls == 0 && stats.rejected == 0 && stats.timed_out == 0) {
+            continue;
+        }
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "calls", stats.calls);
+        cJSON_AddNumberToObject(item, "running", tool->running_);
+        cJSON_AddNumberToObject(item, "queued", tool->queued_);
+        cJSON_AddNumberToObject(item, "max_queue_depth", stats.max_queue_depth);
+        cJSON_AddNumberToObject(item, "rejected", stats.rejected);
+        cJSON_AddNumberToObject(item, "cancelled", stats.cancelled);
+        cJSON_AddNumberToObject(item, "timed_out", stats.timed_out);
+        cJSON_AddNumberToObject(item, "avg_wait_ms", stats.calls ? stats.total_wait_us / stats.calls / 1000 : 0);
+        cJSON_AddNumberToObject(item, "max_wait_ms", stats.max_wait_us / 1000);
+        cJSON_AddNumberToObject(item, "avg_run_ms", stats.calls ? stats.total_run_us / stats.calls / 1000 : 0);
+        cJSON_AddNumberToObject(item, "max_run_ms", stats.max_run_us / 1000);
+        cJSON_AddItemToObject(tools, tool->name().c_str(), item);
+    }
+    cJSON_AddItemToObject(root, "tools", tools);
+    return root;
+}
@@ -4,13 +4,22 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <mutex>
 #include <functional>
 #include <variant>
 #include <optional>
 #include <stdexcept>
 #include <thread>
+#include <deque>
+#include <list>
+#include <memory>
+#include <condition_variable>
 
 #include <cJSON.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
 
 // 添加类型别名
 using ReturnValue = std::variant<bool, int, std::string>;
@@ -86,7 +95,8 @@ public:
         value_ = value;
     }
 
-    std::string to_json() const {
+    // The caller owns the returned object
+    cJSON* CreateSchema() const {
         cJSON *json = cJSON_CreateObject();
         
         if (type_ == kPropertyTypeBoolean) {
@@ -111,7 +121,11 @@ public:
                 cJSON_AddStringToObject(json, "default", value<std::string>().c_str());
             }
         }
-        
+        return json;
+    }
+
+    std::string to_json() const {
+        cJSON *json = CreateSchema();
         char *json_str = cJSON_PrintUnformatted(json);
         std::string result(json_str);
         cJSON_free(json_str);
@@ -154,14 +168,17 @@ public:
         return required;
     }
 
-    std::string to_json() const {
+    // The caller owns the returned object
+    cJSON* CreateSchema() const {
         cJSON *json = cJSON_CreateObject();
-        
         for (const auto& property : properties_) {
-            cJSON *prop_json = cJSON_Parse(property.to_json().c_str());
-            cJSON_AddItemToObject(json, property.name().c_str(), prop_json);
+            cJSON_AddItemToObject(json, property.name().c_str(), property.CreateSchema());
         }
-        
+        return json;
+    }
+
+    std::string to_json() const {
+        cJSON *json = CreateSchema();
         char *json_str = cJSON_PrintUnformatted(json);
         std::string result(json_str);
         cJSON_free(json_str);
@@ -171,28 +188,37 @@ public:
     }
 };
 
+// Tool call metrics, counted since boot
+struct McpToolStats {
+    uint32_t calls = 0;             // Started
+    uint32_t rejected = 0;          // The queue was full
+    uint32_t cancelled = 0;         // By notifications/cancelled
+    uint32_t timed_out = 0;         // Passed the deadline while queued or running
+    uint32_t max_queue_depth = 0;   // Calls of this tool waiting at the same time
+    int64_t total_wait_us = 0;
+    int64_t max_wait_us = 0;
+    int64_t total_run_us = 0;
+    int64_t max_run_us = 0;
+};
+
 class McpTool {
+    friend class McpServer;
+
 private:
     std::string name_;
     std::string description_;
     PropertyList properties_;
     std::function<ReturnValue(const PropertyList&)> callback_;
-
-public:
-    McpTool(const std::string& name, 
-            const std::string& description, 
-            const PropertyList& properties, 
-            std::function<ReturnValue(const PropertyList&)> callback)
-        : name_(name), 
-        description_(description), 
-        properties_(properties), 
-        callback_(callback) {}
-
-    inline const std::string& name() const { return name_; }
-    inline const std::string& description() const { return description_; }
-    inline const PropertyList& properties() const { return properties_; }
-
-    std::string to_json() const {
+    // The schema does not change after registration, so it is serialized once for every tools/list
+    std::string json_;
+    // Calls of this tool that may run at the same time, further calls wait in the queue
+    int max_concurrency_ = 1;
+    // Guarded by McpServer::call_mutex_
+    int running_ = 0;
+    int queued_ = 0;
+    McpToolStats stats_;
+
+    std::string BuildJson() const {
         std::vector<std::string> required = properties_.GetRequired();
         
         cJSON *json = cJSON_CreateObject();
@@ -202,8 +228,7 @@ public:
         cJSON *input_schema = cJSON_CreateObject();
         cJSON_AddStringToObject(input_schema, "type", "object");
         
-        cJSON *properties = cJSON_Parse(properties_.to_json().c_str());
-        cJSON_AddItemToObject(input_schema, "properties", properties);
+        cJSON_AddItemToObject(input_schema, "properties", properties_.CreateSchema());
         
         if (!required.empty()) {
             cJSON *required_array = cJSON_CreateArray();
@@ -223,6 +248,25 @@ public:
         return result;
     }
 
+public:
+    McpTool(const std::string& name, 
+            const std::string& description, 
+            const PropertyList& properties, 
+            std::function<ReturnValue(const PropertyList&)> callback)
+        : name_(name), 
+        description_(description), 
+        properties_(properties), 
+        callback_(callback) {
+        json_ = BuildJson();
+    }
+
+    inline const std::string& name() const { return name_; }
+    inline const std::string& description() const { return description_; }
+    inline const PropertyList& properties() const { return properties_; }
+    inline const std::string& to_json() const { return json_; }
+    inline int max_concurrency() const { return max_concurrency_; }
+    inline void set_max_concurrency(int max_concurrency) { max_concurrency_ = max_concurrency; }
+
     std::string Call(const PropertyList& properties) {
         ReturnValue return_value = callback_(properties);
         // 返回结果
@@ -261,8 +305,29 @@ public:
     void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
     void ParseMessage(const cJSON* json);
     void ParseMessage(const std::string& message);
+    // For long running tools to check between steps, true if the call running on this task was cancelled or timed out
+    bool IsToolCallCancelled();
+    // The caller owns the returned object
+    cJSON* GetToolStatsJson();
 
 private:
+    struct ToolCall {
+        int id;
+        McpTool* tool;
+        PropertyList arguments;
+        int64_t enqueue_time_us;
+        int64_t deadline_us;    // 0 if the call has no deadline
+        bool finished = false;  // Replied to or cancelled, the result is dropped
+    };
+
+    struct ToolCallWorker {
+        TaskHandle_t task = nullptr;
+        StaticTask_t* task_buffer = nullptr;
+        StackType_t* stack = nullptr;
+        ToolCall* call = nullptr;
+        bool dedicated = false;     // Runs a single call that needs a larger stack, then exits
+    };
+
     McpServer();
     ~McpServer();
 
@@ -272,10 +337,35 @@ private:
     void ReplyError(int id, const std::string& message);
 
     void GetToolsList(int id, const std::string& cursor);
-    void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size);
-
+    void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size, int timeout_ms);
+    void CancelToolCall(int id);
+    bool StartWorker();
+    bool StartDedicatedWorker(std::unique_ptr<ToolCall> call, int stack_size);
+    void WorkerTask(ToolCallWorker& worker);
+    void BeginToolCall(ToolCallWorker& worker, ToolCall& call);
+    void RunToolCall(ToolCallWorker& worker, std::unique_ptr<ToolCall> call);
+    void CheckDeadlines();
+
+    void RebuildToolIndex();
+    void BuildToolPages();
+
+    // Registered tools in tools/list order, common tools first to make use of the prompt cache
+    std::mutex tools_mutex_;
     std::vector<McpTool*> tools_;
-    std::thread tool_call_thread_;
+    std::unordered_map<std::string, size_t> tool_index_;
+    // tools/list page that starts at each tool, as the index one past its last tool, empty when stale
+    std::vector<size_t> tool_page_ends_;
+
+    // Pool of tool call workers fed by a bounded queue. A worker is started when a call finds none idle,
+    // up to CONFIG_MCP_TOOL_WORKERS, and then kept with its stack
+    std::mutex call_mutex_;
+    std::condition_variable call_cv_;
+    std::deque<std::unique_ptr<ToolCall>> call_queue_;
+    // A list, so the tasks can hold on to their entry while dedicated workers come and go
+    std::list<ToolCallWorker> workers_;
+    size_t pool_workers_ = 0;
+    size_t idle_workers_ = 0;
+    esp_timer_handle_t deadline_timer_ = nullptr;
 };
 
 #endif // MCP_SERVER_H
@@ -1,4 +1,5 @@
 #include "ota.h"
+#include "ota_delta.h"
 #include "system_info.h"
 #include "settings.h"
 #include "assets/lang_config.h"
@@ -10,6 +11,12 @@
 #include <esp_app_format.h>
 #include <esp_efuse.h>
 #include <esp_efuse_table.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/sha256.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 #ifdef SOC_HMAC_SUPPORTED
 #include <esp_hmac.h>
 #endif
@@ -18,9 +25,21 @@
 #include <vector>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
 
 #define TAG "Ota"
 
+// Two chunks in flight, one downloading while the other is written
+#define OTA_CHUNK_COUNT 2
+#define OTA_CHUNK_SIZE (32 * 1024)
+#define OTA_CHUNK_SIZE_INTERNAL (4 * 1024)
+// Consecutive failed attempts before the upgrade is abandoned, with exponential backoff in between
+#define OTA_MAX_RETRIES 5
+#define OTA_RETRY_DELAY_MS 1000
+#define OTA_MAX_RETRY_DELAY_MS 8000
+
 
 Ota::Ota() {
 #ifdef ESP_EFUSE_BLOCK_USR_DATA
@@ -107,7 +126,7 @@ bool Ota::CheckVersion() {
     data = http->ReadAll();
     http->Close();
 
-    // Response: { "firmware": { "version": "1.0.0", "url": "http://" } }
+    // Response: { "firmware": { "version": "1.0.0", "url": "http://", "sha256": "optional hex digest" } }
     // Parse the JSON response and check if the version is newer
     // If it is, set has_new_version_ to true and store the new version and URL
     
@@ -141,6 +160,7 @@ bool Ota::CheckVersion() {
         }
     }
 
+    server_config_changed_ = false;
     has_mqtt_config_ = false;
     cJSON *mqtt = cJSON_GetObjectItem(root, "mqtt");
     if (cJSON_IsObject(mqtt)) {
@@ -150,10 +170,12 @@ bool Ota::CheckVersion() {
             if (cJSON_IsString(item)) {
                 if (settings.GetString(item->string) != item->valuestring) {
                     settings.SetString(item->string, item->valuestring);
+                    server_config_changed_ = true;
                 }
             } else if (cJSON_IsNumber(item)) {
                 if (settings.GetInt(item->string) != item->valueint) {
                     settings.SetInt(item->string, item->valueint);
+                    server_config_changed_ = true;
                 }
             }
         }
@@ -171,10 +193,12 @@ bool Ota::CheckVersion() {
             if (cJSON_IsString(item)) {
                 if (settings.GetString(item->string) != item->valuestring) {
                     settings.SetString(item->string, item->valuestring);
+                    server_config_changed_ = true;
                 }
             } else if (cJSON_IsNumber(item)) {
                 if (settings.GetInt(item->string) != item->valueint) {
                     settings.SetInt(item->string, item->valueint);
+                    server_config_changed_ = true;
                 }
             }
         }
@@ -219,6 +243,24 @@ bool Ota::CheckVersion() {
         if (cJSON_IsString(url)) {
             firmware_url_ = url->valuestring;
         }
+        firmware_sha256_.clear();
+        cJSON *sha256 = cJSON_GetObjectItem(firmware, "sha256");
+        if (cJSON_IsString(sha256)) {
+            firmware_sha256_ = sha256->valuestring;
+            std::transform(firmware_sha256_.begin(), firmware_sha256_.end(), firmware_sha256_.begin(), ::tolower);
+        }
+        // A patch against the running firmware, only usable if it was made from this version:
+        // "delta": { "from": "1.0.0", "url": "http://" }
+        firmware_delta_url_.clear();
+        cJSON *delta = cJSON_GetObjectItem(firmware, "delta");
+        if (cJSON_IsObject(delta)) {
+            cJSON *from = cJSON_GetObjectItem(delta, "from");
+            cJSON *delta_url = cJSON_GetObjectItem(delta, "url");
+            if (cJSON_IsString(from) && cJSON_IsString(delta_url) && current_version_ == from->valuestring) {
+                firmware_delta_url_ = delta_url->valuestring;
+                ESP_LOGI(TAG, "Delta update available from %s", from->valuestring);
+            }
+        }
 
         if (cJSON_IsString(version) && cJSON_IsString(url)) {
             // Check if the version is newer, for example, 0.1.0 is newer than 0.0.1
@@ -262,119 +304,367 @@ void Ota::MarkCurrentVersionValid() {
     }
 }
 
-bool Ota::Upgrade(const std::string& firmware_url) {
-    ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
-    esp_ota_handle_t update_handle = 0;
+namespace {
+
+struct OtaChunk {
+    uint8_t* data;
+    size_t size;
+};
+
+// Flash side of an upgrade: checks the image header, hashes and writes the image as it arrives
+class OtaFlashWriter {
+public:
+    explicit OtaFlashWriter(const esp_partition_t* partition) : partition_(partition) {
+        mbedtls_sha256_init(&sha256_);
+        mbedtls_sha256_starts(&sha256_, 0);
+    }
+
+    ~OtaFlashWriter() {
+        if (begun_) {
+            esp_ota_abort(update_handle_);
+        }
+        mbedtls_sha256_free(&sha256_);
+    }
+
+    bool Write(const uint8_t* data, size_t size) {
+        mbedtls_sha256_update(&sha256_, data, size);
+        if (begun_) {
+            return WriteFlash(data, size);
+        }
+
+        image_header_.append((const char*)data, size);
+        if (image_header_.size() < sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
+            return true;
+        }
+        esp_app_desc_t new_app_info;
+        memcpy(&new_app_info, image_header_.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
+        ESP_LOGI(TAG, "New firmware version: %s", new_app_info.version);
+
+        auto current_version = esp_app_get_description()->version;
+        if (memcmp(new_app_info.version, current_version, sizeof(new_app_info.version)) == 0) {
+            ESP_LOGE(TAG, "Firmware version is the same, skipping upgrade");
+            return false;
+        }
+
+        if (esp_ota_begin(partition_, OTA_WITH_SEQUENTIAL_WRITES, &update_handle_) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to begin OTA");
+            return false;
+        }
+        begun_ = true;
+
+        bool success = WriteFlash((const uint8_t*)image_header_.data(), image_header_.size());
+        std::string().swap(image_header_);
+        return success;
+    }
+
+    bool Finish(const std::string& expected_sha256) {
+        if (!begun_) {
+            ESP_LOGE(TAG, "Firmware image is too small");
+            return false;
+        }
+
+        uint8_t digest[32];
+        mbedtls_sha256_finish(&sha256_, digest);
+        char sha256[sizeof(digest) * 2 + 1];
+        for (size_t i = 0; i < sizeof(digest); i++) {
+            sprintf(sha256 + i * 2, "%02x", digest[i]);
+        }
+        if (!expected_sha256.empty() && expected_sha256 != sha256) {
+            ESP_LOGE(TAG, "Firmware SHA-256 mismatch, expected %s, got %s", expected_sha256.c_str(), sha256);
+            return false;
+        }
+        ESP_LOGI(TAG, "Firmware SHA-256: %s", sha256);
+
+        begun_ = false;
+        esp_err_t err = esp_ota_end(update_handle_);
+        if (err != ESP_OK) {
+            if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+                ESP_LOGE(TAG, "Image validation failed, image is corrupted");
+            } else {
+                ESP_LOGE(TAG, "Failed to end OTA: %s", esp_err_to_name(err));
+            }
+            return false;
+        }
+
+        err = esp_ota_set_boot_partition(partition_);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
+            return false;
+        }
+        return true;
+    }
+
+private:
+    const esp_partition_t* partition_;
+    esp_ota_handle_t update_handle_ = 0;
+    bool begun_ = false;
+    std::string image_header_;
+    mbedtls_sha256_context sha256_;
+
+    bool WriteFlash(const uint8_t* data, size_t size) {
+        auto err = esp_ota_write(update_handle_, data, size);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+            return false;
+        }
+        return true;
+    }
+};
+
+// "bytes 1024-4095/4096"
+bool ParseContentRange(const std::string& value, size_t& start, size_t& total) {
+    unsigned long first, last, length;
+    if (sscanf(value.c_str(), "bytes %lu-%lu/%lu", &first, &last, &length) != 3 || first > last || last >= length) {
+        return false;
+    }
+    start = first;
+    total = length;
+    return true;
+}
+
+} // namespace
+
+// Chunks travel from the download loop to the flash task through full_chunks, and back through free_chunks
+struct OtaPipeline {
+    OtaFlashWriter writer;
+    // Set for delta upgrades, turns the downloaded patch into the image the writer gets
+    std::unique_ptr<OtaDeltaPatcher> patcher;
+    QueueHandle_t free_chunks;
+    QueueHandle_t full_chunks;
+    SemaphoreHandle_t flash_done;
+    std::atomic<bool> failed{false};
+
+    explicit OtaPipeline(const esp_partition_t* partition) : writer(partition) {
+        free_chunks = xQueueCreate(OTA_CHUNK_COUNT, sizeof(OtaChunk));
+        full_chunks = xQueueCreate(OTA_CHUNK_COUNT + 1, sizeof(OtaChunk));
+        flash_done = xSemaphoreCreateBinary();
+    }
+
+    ~OtaPipeline() {
+        vQueueDelete(free_chunks);
+        vQueueDelete(full_chunks);
+        vSemaphoreDelete(flash_done);
+    }
+
+    bool Write(const uint8_t* data, size_t size) {
+        return patcher ? patcher->Write(data, size) : writer.Write(data, size);
+    }
+};
+
+bool Ota::Upgrade(const std::string& firmware_url, bool delta) {
+    ESP_LOGI(TAG, "Upgrading firmware from %s%s", firmware_url.c_str(), delta ? " (delta)" : "");
     auto update_partition = esp_ota_get_next_update_partition(NULL);
     if (update_partition == NULL) {
         ESP_LOGE(TAG, "Failed to get update partition");
         return false;
     }
-
     ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition->label, update_partition->address);
-    bool image_header_checked = false;
-    std::string image_header;
 
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(0);
-    if (!http->Open("GET", firmware_url)) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection");
-        return false;
+    // Large chunks keep the flash busy while the next one downloads, small internal ones if there is no PSRAM
+    size_t chunk_size = OTA_CHUNK_SIZE;
+    uint8_t* chunks[OTA_CHUNK_COUNT] = {};
+    for (auto& chunk : chunks) {
+        chunk = (uint8_t*)heap_caps_malloc(chunk_size, MALLOC_CAP_SPIRAM);
+    }
+    if (std::find(std::begin(chunks), std::end(chunks), nullptr) != std::end(chunks)) {
+        chunk_size = OTA_CHUNK_SIZE_INTERNAL;
+        for (auto& chunk : chunks) {
+            heap_caps_free(chunk);
+            chunk = (uint8_t*)heap_caps_malloc(chunk_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        }
+    }
+    bool success = std::find(std::begin(chunks), std::end(chunks), nullptr) == std::end(chunks);
+    if (!success) {
+        ESP_LOGE(TAG, "Failed to allocate OTA buffers");
     }
 
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to get firmware, status code: %d", http->GetStatusCode());
-        return false;
+    if (success) {
+        OtaPipeline pipeline(update_partition);
+        if (delta) {
+            pipeline.patcher = std::make_unique<OtaDeltaPatcher>(esp_ota_get_running_partition(), [&pipeline](const uint8_t* data, size_t size) {
+                return pipeline.writer.Write(data, size);
+            });
+        }
+        for (auto chunk : chunks) {
+            OtaChunk free_chunk = { chunk, chunk_size };
+            xQueueSend(pipeline.free_chunks, &free_chunk, 0);
+        }
+
+        xTaskCreate([](void* arg) {
+            auto pipeline = (OtaPipeline*)arg;
+            OtaChunk chunk;
+            // A chunk without data marks the end of the download
+            while (xQueueReceive(pipeline->full_chunks, &chunk, portMAX_DELAY) == pdTRUE && chunk.data != nullptr) {
+                if (!pipeline->failed && !pipeline->Write(chunk.data, chunk.size)) {
+                    pipeline->failed = true;
+                }
+                xQueueSend(pipeline->free_chunks, &chunk, portMAX_DELAY);
+            }
+            xSemaphoreGive(pipeline->flash_done);
+            vTaskDelete(NULL);
+        }, "ota_flash", 4096, &pipeline, 3, nullptr);
+
+        bool downloaded = Download(firmware_url, pipeline);
+        OtaChunk end = { nullptr, 0 };
+        xQueueSend(pipeline.full_chunks, &end, portMAX_DELAY);
+        xSemaphoreTake(pipeline.flash_done, portMAX_DELAY);
+
+        success = downloaded && !pipeline.failed;
+        if (success && pipeline.patcher) {
+            // The patch header names the image it produces, it must be the firmware the server announced
+            auto& target_sha256 = pipeline.patcher->target_sha256();
+            success = pipeline.patcher->Finish() && (firmware_sha256_.empty() || firmware_sha256_ == target_sha256)
+                && pipeline.writer.Finish(target_sha256);
+        } else if (success) {
+            success = pipeline.writer.Finish(firmware_sha256_);
+        }
     }
 
-    size_t content_length = http->GetBodyLength();
-    if (content_length == 0) {
-        ESP_LOGE(TAG, "Failed to get content length");
-        return false;
+    for (auto chunk : chunks) {
+        heap_caps_free(chunk);
+    }
+    if (success) {
+        ESP_LOGI(TAG, "Firmware upgrade successful");
     }
+    return success;
+}
 
-    char buffer[512];
-    size_t total_read = 0, recent_read = 0;
+/*
+ * Feeds the firmware into the pipeline. After a dropped connection the download continues where it stopped
+ * with a Range request, the If-Range validator makes sure the remaining bytes belong to the same file.
+ */
+bool Ota::Download(const std::string& firmware_url, OtaPipeline& pipeline) {
+    auto network = Board::GetInstance().GetNetwork();
+    size_t total_size = 0, total_read = 0, recent_read = 0;
+    std::string etag;
+    OtaChunk chunk = { nullptr, 0 };
+    size_t chunk_capacity = 0;
+    int retries = 0;
     auto last_calc_time = esp_timer_get_time();
+
     while (true) {
-        int ret = http->Read(buffer, sizeof(buffer));
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
+        if (retries > OTA_MAX_RETRIES) {
+            ESP_LOGE(TAG, "Giving up after %d retries", OTA_MAX_RETRIES);
             return false;
         }
+        if (retries > 0) {
+            int delay_ms = std::min(OTA_RETRY_DELAY_MS << (retries - 1), OTA_MAX_RETRY_DELAY_MS);
+            ESP_LOGW(TAG, "Resuming download at %u/%u in %d ms", total_read, total_size, delay_ms);
+            vTaskDelay(pdMS_TO_TICKS(delay_ms));
+        }
+        retries++;
 
-        // Calculate speed and progress every second
-        recent_read += ret;
-        total_read += ret;
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || ret == 0) {
-            size_t progress = total_read * 100 / content_length;
-            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, total_read, content_length, recent_read);
-            if (upgrade_callback_) {
-                upgrade_callback_(progress, recent_read);
+        auto http = network->CreateHttp(0);
+        if (total_read > 0) {
+            http->SetHeader("Range", "bytes=" + std::to_string(total_read) + "-");
+            if (!etag.empty()) {
+                http->SetHeader("If-Range", etag);
             }
-            last_calc_time = esp_timer_get_time();
-            recent_read = 0;
         }
-
-        if (ret == 0) {
-            break;
+        if (!http->Open("GET", firmware_url)) {
+            ESP_LOGE(TAG, "Failed to open HTTP connection");
+            continue;
         }
 
-        if (!image_header_checked) {
-            image_header.append(buffer, ret);
-            if (image_header.size() >= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-                esp_app_desc_t new_app_info;
-                memcpy(&new_app_info, image_header.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
-                ESP_LOGI(TAG, "New firmware version: %s", new_app_info.version);
-
-                auto current_version = esp_app_get_description()->version;
-                if (memcmp(new_app_info.version, current_version, sizeof(new_app_info.version)) == 0) {
-                    ESP_LOGE(TAG, "Firmware version is the same, skipping upgrade");
+        // Bytes the server sends again because it ignored the range
+        size_t skip = 0;
+        int status_code = http->GetStatusCode();
+        if (status_code == 206 && total_read > 0) {
+            size_t start, total;
+            if (!ParseContentRange(http->GetResponseHeader("Content-Range"), start, total) || start != total_read || total != total_size) {
+                ESP_LOGE(TAG, "Unexpected Content-Range: %s", http->GetResponseHeader("Content-Range").c_str());
+                return false;
+            }
+        } else if (status_code == 200) {
+            size_t content_length = http->GetBodyLength();
+            auto new_etag = http->GetResponseHeader("ETag");
+            if (total_read == 0) {
+                if (content_length == 0) {
+                    ESP_LOGE(TAG, "Failed to get content length");
                     return false;
                 }
-
-                if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle)) {
-                    esp_ota_abort(update_handle);
-                    ESP_LOGE(TAG, "Failed to begin OTA");
+                total_size = content_length;
+                etag = new_etag;
+            } else {
+                if (content_length != total_size || new_etag != etag) {
+                    ESP_LOGE(TAG, "Firmware changed on the server during the download");
                     return false;
                 }
-
-                image_header_checked = true;
-                std::string().swap(image_header);
+                ESP_LOGW(TAG, "Server does not support range requests, skipping %u bytes", total_read);
+                skip = total_read;
             }
-        }
-        auto err = esp_ota_write(update_handle, buffer, ret);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
-            esp_ota_abort(update_handle);
+        } else if (status_code >= 500) {
+            ESP_LOGE(TAG, "Failed to get firmware, status code: %d", status_code);
+            continue;
+        } else {
+            ESP_LOGE(TAG, "Failed to get firmware, status code: %d", status_code);
             return false;
         }
-    }
-    http->Close();
 
-    esp_err_t err = esp_ota_end(update_handle);
-    if (err != ESP_OK) {
-        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-            ESP_LOGE(TAG, "Image validation failed, image is corrupted");
-        } else {
-            ESP_LOGE(TAG, "Failed to end OTA: %s", esp_err_to_name(err));
+        while (total_read < total_size && !pipeline.failed) {
+            if (chunk.data == nullptr) {
+                xQueueReceive(pipeline.free_chunks, &chunk, portMAX_DELAY);
+                chunk_capacity = chunk.size;
+                chunk.size = 0;
+            }
+
+            size_t size = std::min(chunk_capacity - chunk.size, total_size - total_read);
+            if (skip > 0) {
+                size = std::min(size, skip);
+            }
+            int ret = http->Read((char*)chunk.data + chunk.size, size);
+            if (ret <= 0) {
+                ESP_LOGW(TAG, "Connection dropped: %s", ret < 0 ? esp_err_to_name(ret) : "end of stream");
+                break;
+            }
+            if (skip > 0) {
+                skip -= ret;
+                continue;
+            }
+            // Any progress means the link works, the retry budget is for consecutive failures
+            retries = 0;
+            chunk.size += ret;
+            total_read += ret;
+            recent_read += ret;
+
+            if (chunk.size == chunk_capacity || total_read == total_size) {
+                xQueueSend(pipeline.full_chunks, &chunk, portMAX_DELAY);
+                chunk.data = nullptr;
+            }
+
+            // Calculate speed and progress every second
+            if (esp_timer_get_time() - last_calc_time >= 1000000 || total_read == total_size) {
+                size_t progress = total_read * 100 / total_size;
+                ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, total_read, total_size, recent_read);
+                if (upgrade_callback_) {
+                    upgrade_callback_(progress, recent_read);
+                }
+                last_calc_time = esp_timer_get_time();
+                recent_read = 0;
+            }
         }
-        return false;
-    }
+        http->Close();
 
-    err = esp_ota_set_boot_partition(update_partition);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
-        return false;
+        if (pipeline.failed) {
+            return false;
+        }
+        if (total_read == total_size) {
+            return true;
+        }
     }
-
-    ESP_LOGI(TAG, "Firmware upgrade successful");
-    return true;
 }
 
 bool Ota::StartUpgrade(std::function<void(int progress, size_t speed)> callback) {
     upgrade_callback_ = callback;
-    return Upgrade(firmware_url_);
+#if CONFIG_OTA_DELTA_UPDATE
+    if (!firmware_delta_url_.empty()) {
+        if (Upgrade(firmware_delta_url_, true)) {
+            return true;
+        }
+        ESP_LOGW(TAG, "Delta upgrade failed, falling back to the full firmware");
+    }
+#endif
+    return Upgrade(firmware_url_, false);
 }
 
 std::vector<int> Ota::ParseVersion(const std::string& version) {
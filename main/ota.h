@@ -7,6 +7,8 @@
 #include <esp_err.h>
 #include "board.h"
 
+struct OtaPipeline;
+
 class Ota {
 public:
     Ota();
@@ -20,6 +22,8 @@ public:
     bool HasWebsocketConfig() { return has_websocket_config_; }
     bool HasActivationCode() { return has_activation_code_; }
     bool HasServerTime() { return has_server_time_; }
+    // True if the mqtt or websocket settings were rewritten by the last check
+    bool HasServerConfigChanged() { return server_config_changed_; }
     bool StartUpgrade(std::function<void(int progress, size_t speed)> callback);
     void MarkCurrentVersionValid();
 
@@ -36,17 +40,23 @@ private:
     bool has_mqtt_config_ = false;
     bool has_websocket_config_ = false;
     bool has_server_time_ = false;
+    bool server_config_changed_ = false;
     bool has_activation_code_ = false;
     bool has_serial_number_ = false;
     bool has_activation_challenge_ = false;
     std::string current_version_;
     std::string firmware_version_;
     std::string firmware_url_;
+    // Hex SHA-256 of the firmware image, optional in the check version response
+    std::string firmware_sha256_;
+    // Patch from the running version to firmware_version_, empty if the server offers none
+    std::string firmware_delta_url_;
     std::string activation_challenge_;
     std::string serial_number_;
     int activation_timeout_ms_ = 30000;
 
-    bool Upgrade(const std::string& firmware_url);
+    bool Upgrade(const std::string& firmware_url, bool delta);
+    bool Download(const std::string& firmware_url, OtaPipeline& pipeline);
     std::function<void(int progress, size_t speed)> upgrade_callback_;
     std::vector<int> ParseVersion(const std::string& version);
     bool IsNewVersionAvailable(const std::string& currentVersion, const std::string& newVersion);
@@ -0,0 +1,204 @@
+#include "ota_delta.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/sha256.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "OtaDelta"
+
+enum OtaDeltaOpcode : uint8_t {
+    kOtaDeltaEnd = 0x00,
+    kOtaDeltaCopy = 0x01,
+    kOtaDeltaInsert = 0x02,
+};
+
+static uint32_t ReadLe32(const uint8_t* data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+OtaDeltaPatcher::OtaDeltaPatcher(const esp_partition_t* source, Output output)
+    : source_(source), output_(output) {
+    copy_buffer_ = (uint8_t*)heap_caps_malloc(OTA_DELTA_COPY_BUFFER_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+OtaDeltaPatcher::~OtaDeltaPatcher() {
+    heap_caps_free(copy_buffer_);
+}
+
+bool OtaDeltaPatcher::Write(const uint8_t* data, size_t size) {
+    const uint8_t* end = data + size;
+    while (data < end) {
+        switch (state_) {
+        case kStateHeader: {
+            size_t length = std::min((size_t)(end - data), sizeof(header_) - header_size_);
+            memcpy(header_ + header_size_, data, length);
+            header_size_ += length;
+            data += length;
+            if (header_size_ == sizeof(header_)) {
+                if (!ParseHeader()) {
+                    return false;
+                }
+                state_ = kStateOpcode;
+            }
+            break;
+        }
+        case kStateOpcode:
+            opcode_ = *data++;
+            if (opcode_ == kOtaDeltaEnd) {
+                state_ = kStateEnd;
+            } else if (opcode_ == kOtaDeltaCopy || opcode_ == kOtaDeltaInsert) {
+                operand_count_ = opcode_ == kOtaDeltaCopy ? 2 : 1;
+                operand_index_ = 0;
+                operand_shift_ = 0;
+                operands_[0] = operands_[1] = 0;
+                state_ = kStateOperand;
+            } else {
+                ESP_LOGE(TAG, "Unknown patch opcode 0x%02x", opcode_);
+                return false;
+            }
+            break;
+        case kStateOperand: {
+            uint8_t byte = *data++;
+            // The fifth byte holds the top 4 bits of a 32-bit operand and ends it
+            if (operand_shift_ == 28 && byte > 0x0F) {
+                ESP_LOGE(TAG, "Patch operand too large");
+                return false;
+            }
+            operands_[operand_index_] |= (uint32_t)(byte & 0x7F) << operand_shift_;
+            operand_shift_ += 7;
+            if (byte & 0x80) {
+                break;
+            }
+            operand_shift_ = 0;
+            if (++operand_index_ == operand_count_ && !Execute()) {
+                return false;
+            }
+            break;
+        }
+        case kStateInsert: {
+            // Literal data goes straight from the download chunk to the output
+            size_t length = std::min((size_t)(end - data), insert_remaining_);
+            if (!output_(data, length)) {
+                return false;
+            }
+            data += length;
+            produced_ += length;
+            insert_remaining_ -= length;
+            if (insert_remaining_ == 0) {
+                state_ = kStateOpcode;
+            }
+            break;
+        }
+        case kStateEnd:
+            ESP_LOGE(TAG, "Unexpected data after the end of the patch");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool OtaDeltaPatcher::Finish() {
+    if (state_ != kStateEnd || produced_ != target_size_) {
+        ESP_LOGE(TAG, "Patch is incomplete, produced %u/%u bytes", produced_, target_size_);
+        return false;
+    }
+    return true;
+}
+
+bool OtaDeltaPatcher::ParseHeader() {
+    if (memcmp(header_, OTA_DELTA_MAGIC, 4) != 0 || header_[4] != OTA_DELTA_VERSION) {
+        ESP_LOGE(TAG, "Not a supported patch");
+        return false;
+    }
+    source_size_ = ReadLe32(header_ + 8);
+    target_size_ = ReadLe32(header_ + 12);
+    const uint8_t* source_sha256 = header_ + 16;
+    const uint8_t* target_sha256 = header_ + 48;
+
+    char hex[3];
+    target_sha256_.clear();
+    for (int i = 0; i < 32; i++) {
+        snprintf(hex, sizeof(hex), "%02x", target_sha256[i]);
+        target_sha256_ += hex;
+    }
+    ESP_LOGI(TAG, "Patch from %u to %u bytes, target SHA-256: %s", source_size_, target_size_, target_sha256_.c_str());
+
+    if (copy_buffer_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate copy buffer");
+        return false;
+    }
+    if (source_size_ > source_->size) {
+        ESP_LOGE(TAG, "Patch source is larger than partition %s", source_->label);
+        return false;
+    }
+    // Checked before anything is written, a patch for another build would only fail at the final hash
+    return VerifySource(source_sha256);
+}
+
+bool OtaDeltaPatcher::VerifySource(const uint8_t* expected_sha256) {
+    auto start_time = esp_timer_get_time();
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_starts(&sha256, 0);
+    bool success = true;
+    for (size_t offset = 0; offset < source_size_; offset += OTA_DELTA_COPY_BUFFER_SIZE) {
+        size_t length = std::min(source_size_ - offset, (size_t)OTA_DELTA_COPY_BUFFER_SIZE);
+        if (esp_partition_read(source_, offset, copy_buffer_, length) != ESP_OK) {
+            success = false;
+            break;
+        }
+        mbedtls_sha256_update(&sha256, copy_buffer_, length);
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha256, digest);
+    mbedtls_sha256_free(&sha256);
+
+    if (!success || memcmp(digest, expected_sha256, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "Running firmware does not match the patch source");
+        return false;
+    }
+    ESP_LOGI(TAG, "Verified patch source in %lld ms", (esp_timer_get_time() - start_time) / 1000);
+    return true;
+}
+
+bool OtaDeltaPatcher::Execute() {
+    if (opcode_ == kOtaDeltaCopy) {
+        size_t offset = operands_[0], length = operands_[1];
+        if (offset > source_size_ || length > source_size_ - offset || length > target_size_ - produced_) {
+            ESP_LOGE(TAG, "Copy out of range: %u+%u", offset, length);
+            return false;
+        }
+        state_ = kStateOpcode;
+        return Copy(offset, length);
+    }
+
+    insert_remaining_ = operands_[0];
+    if (insert_remaining_ > target_size_ - produced_) {
+        ESP_LOGE(TAG, "Insert out of range: %u", insert_remaining_);
+        return false;
+    }
+    state_ = insert_remaining_ > 0 ? kStateInsert : kStateOpcode;
+    return true;
+}
+
+bool OtaDeltaPatcher::Copy(size_t offset, size_t length) {
+    while (length > 0) {
+        size_t size = std::min(length, (size_t)OTA_DELTA_COPY_BUFFER_SIZE);
+        esp_err_t err = esp_partition_read(source_, offset, copy_buffer_, size);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read running firmware: %s", esp_err_to_name(err));
+            return false;
+        }
+        if (!output_(copy_buffer_, size)) {
+            return false;
+        }
+        offset += size;
+        length -= size;
+        produced_ += size;
+    }
+    return true;
+}
@@ -0,0 +1,77 @@
+#ifndef _OTA_DELTA_H
+#define _OTA_DELTA_H
+
+#include <functional>
+#include <string>
+#include <cstdint>
+
+#include <esp_partition.h>
+
+#define OTA_DELTA_MAGIC "XZDP"
+#define OTA_DELTA_VERSION 1
+#define OTA_DELTA_HEADER_SIZE 80
+#define OTA_DELTA_COPY_BUFFER_SIZE 4096
+
+/*
+ * Rebuilds the new firmware from a patch against the running firmware as the patch streams in, RAM use
+ * does not depend on the image size. The patch starts with a header, integers are little endian:
+ *
+ *   "XZDP", version, 3 reserved bytes, source size (u32), target size (u32),
+ *   source SHA-256 (32 bytes), target SHA-256 (32 bytes)
+ *
+ * followed by operations whose offsets and lengths are unsigned LEB128:
+ *
+ *   0x01 offset length   copy length bytes at offset of the running firmware
+ *   0x02 length data     insert the length literal bytes that follow
+ *   0x00                 end of patch
+ *
+ * scripts/ota_delta/ota_delta.py generates patches and applies them on the host the same way.
+ */
+class OtaDeltaPatcher {
+public:
+    // Receives the rebuilt firmware in order
+    using Output = std::function<bool(const uint8_t* data, size_t size)>;
+
+    OtaDeltaPatcher(const esp_partition_t* source, Output output);
+    ~OtaDeltaPatcher();
+
+    bool Write(const uint8_t* data, size_t size);
+    // True if the patch ended right after the whole target was produced
+    bool Finish();
+    // Hex digest of the firmware the patch produces, known once the header is parsed
+    const std::string& target_sha256() const { return target_sha256_; }
+
+private:
+    enum State {
+        kStateHeader,
+        kStateOpcode,
+        kStateOperand,
+        kStateInsert,
+        kStateEnd,
+    };
+
+    const esp_partition_t* source_;
+    Output output_;
+    State state_ = kStateHeader;
+    uint8_t header_[OTA_DELTA_HEADER_SIZE];
+    size_t header_size_ = 0;
+    size_t source_size_ = 0;
+    size_t target_size_ = 0;
+    size_t produced_ = 0;
+    std::string target_sha256_;
+
+    uint8_t opcode_ = 0;
+    uint32_t operands_[2];
+    int operand_count_ = 0;
+    int operand_index_ = 0;
+    int operand_shift_ = 0;
+    size_t insert_remaining_ = 0;
+    uint8_t* copy_buffer_ = nullptr;
+
+    bool ParseHeader();
+    bool VerifySource(const uint8_t* expected_sha256);
+    bool Execute();
+    bool Copy(size_t offset, size_t length);
+};
+
+#endif // _OTA_DELTA_H
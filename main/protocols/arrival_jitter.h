@@ -0,0 +1,44 @@
+#ifndef ARRIVAL_JITTER_H
+#define ARRIVAL_JITTER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+// Arrival gaps above this are a pause between utterances rather than jitter
+#define ARRIVAL_JITTER_STREAM_PAUSE_MS 500
+
+/*
+ * Interarrival jitter of a packet stream as defined in RFC 3550, in integer milliseconds.
+ *
+ * The transit time of each packet is its arrival time minus its media time. The jitter follows the
+ * difference between consecutive transit times with a gain of 1/16. A packet arriving after a pause, or the
+ * first one after Restart(), only starts a new reference.
+ */
+class ArrivalJitter {
+public:
+    // media_ms is the sending time of the packet, on any clock that advances with the stream
+    void Add(int64_t arrival_ms, int64_t media_ms) {
+        int64_t transit = arrival_ms - media_ms;
+        if (has_transit_ && arrival_ms - last_arrival_ms_ <= ARRIVAL_JITTER_STREAM_PAUSE_MS) {
+            int32_t delta = std::min<int64_t>(std::llabs(transit - last_transit_ms_), ARRIVAL_JITTER_STREAM_PAUSE_MS);
+            jitter_q4_ += delta - (jitter_q4_ + 8) / 16;
+        }
+        last_arrival_ms_ = arrival_ms;
+        last_transit_ms_ = transit;
+        has_transit_ = true;
+    }
+
+    // The next packet starts a new reference, the estimate is kept
+    void Restart() { has_transit_ = false; }
+
+    uint32_t jitter_ms() const { return jitter_q4_ / 16; }
+
+private:
+    bool has_transit_ = false;
+    int64_t last_arrival_ms_ = 0;
+    int64_t last_transit_ms_ = 0;
+    int32_t jitter_q4_ = 0;     // Jitter in 1/16 ms
+};
+
+#endif // ARRIVAL_JITTER_H
@@ -0,0 +1,338 @@
+#include "control_message.h"
+#include "json_scanner.h"
+
+#include <cstring>
+#include <utility>
+
+#define CBOR_MAJOR_UNSIGNED 0
+#define CBOR_MAJOR_BYTES 2
+#define CBOR_MAJOR_TEXT 3
+#define CBOR_MAJOR_ARRAY 4
+#define CBOR_MAJOR_MAP 5
+#define CBOR_MAJOR_SIMPLE 7
+// Nesting accepted when skipping values of unknown keys
+#define CBOR_MAX_SKIP_DEPTH 4
+
+// Indexed by the enums, the JSON names of the binary tags
+static const char* const kTypeNames[kControlMessageTypeCount] = {
+    "", "listen", "tts", "stt", "llm", "abort", "mcp", "system", "alert", "custom", "goodbye",
+};
+static const char* const kStateNames[kControlStateCount] = {
+    "", "start", "stop", "detect", "sentence_start", "sentence_end",
+};
+// Indexed by ListeningMode
+static const char* const kModeNames[] = { "auto", "manual", "realtime" };
+
+template <typename T, size_t N>
+static T FindName(const char* const (&names)[N], std::string_view name, T fallback) {
+    for (size_t i = 1; i < N; i++) {
+        if (name == names[i]) {
+            return (T)i;
+        }
+    }
+    return fallback;
+}
+
+static void WriteHead(std::string& out, uint8_t major, uint32_t value) {
+    uint8_t type = major << 5;
+    if (value < 24) {
+        out.push_back(type | value);
+    } else if (value <= 0xFF) {
+        out.push_back(type | 24);
+        out.push_back(value);
+    } else if (value <= 0xFFFF) {
+        out.push_back(type | 25);
+        out.push_back(value >> 8);
+        out.push_back(value & 0xFF);
+    } else {
+        out.push_back(type | 26);
+        out.push_back(value >> 24);
+        out.push_back((value >> 16) & 0xFF);
+        out.push_back((value >> 8) & 0xFF);
+        out.push_back(value & 0xFF);
+    }
+}
+
+static void WriteText(std::string& out, ControlMessageKey key, std::string_view text) {
+    WriteHead(out, CBOR_MAJOR_UNSIGNED, key);
+    WriteHead(out, CBOR_MAJOR_TEXT, text.size());
+    out.append(text);
+}
+
+static void WriteUnsigned(std::string& out, ControlMessageKey key, uint32_t value) {
+    WriteHead(out, CBOR_MAJOR_UNSIGNED, key);
+    WriteHead(out, CBOR_MAJOR_UNSIGNED, value);
+}
+
+bool ControlMessageCodec::IsBinary(uint8_t first_byte) {
+    return (first_byte >> 5) == CBOR_MAJOR_MAP;
+}
+
+const char* ControlMessageCodec::TypeName(ControlMessageType type) {
+    return type < kControlMessageTypeCount ? kTypeNames[type] : "";
+}
+
+void ControlMessageCodec::Encode(const ControlMessage& message, std::string& out) {
+    const std::pair<ControlMessageKey, std::string_view> texts[] = {
+        { kControlKeySessionId, message.session_id },
+        { kControlKeyText, message.text },
+        { kControlKeyEmotion, message.emotion },
+        { kControlKeyPayload, message.payload },
+        { kControlKeyCommand, message.command },
+        { kControlKeyStatus, message.status },
+        { kControlKeyMessage, message.message },
+    };
+    int count = 1 + (message.state != kControlStateNone) + (message.mode >= 0) + (message.reason != kAbortReasonNone);
+    for (auto& [key, text] : texts) {
+        count += !text.empty();
+    }
+    WriteHead(out, CBOR_MAJOR_MAP, count);
+    WriteUnsigned(out, kControlKeyType, message.type);
+    if (message.state != kControlStateNone) {
+        WriteUnsigned(out, kControlKeyState, message.state);
+    }
+    if (message.mode >= 0) {
+        WriteUnsigned(out, kControlKeyMode, message.mode);
+    }
+    if (message.reason != kAbortReasonNone) {
+        WriteUnsigned(out, kControlKeyReason, message.reason);
+    }
+    for (auto& [key, text] : texts) {
+        if (!text.empty()) {
+            WriteText(out, key, text);
+        }
+    }
+}
+
+static void AppendJsonString(std::string& out, std::string_view text) {
+    out.push_back('"');
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+        }
+        out.push_back(c);
+    }
+    out.push_back('"');
+}
+
+// Same layout as the messages used to be concatenated by hand, servers may rely on the key order
+void ControlMessageCodec::EncodeJson(const ControlMessage& message, std::string& out) {
+    out += "{\"session_id\":";
+    AppendJsonString(out, message.session_id);
+    out += ",\"type\":";
+    AppendJsonString(out, TypeName(message.type));
+    if (message.state != kControlStateNone && message.state < kControlStateCount) {
+        out += ",\"state\":";
+        AppendJsonString(out, kStateNames[message.state]);
+    }
+    if (message.mode >= 0 && message.mode < (int)(sizeof(kModeNames) / sizeof(kModeNames[0]))) {
+        out += ",\"mode\":";
+        AppendJsonString(out, kModeNames[message.mode]);
+    }
+    if (message.reason == kAbortReasonWakeWordDetected) {
+        out += ",\"reason\":\"wake_word_detected\"";
+    }
+    if (!message.text.empty()) {
+        out += ",\"text\":";
+        AppendJsonString(out, message.text);
+    }
+    if (!message.payload.empty()) {
+        // Already JSON
+        out += ",\"payload\":";
+        out.append(message.payload);
+    }
+    out += "}";
+}
+
+namespace {
+
+class CborReader {
+public:
+    CborReader(const uint8_t* data, size_t size) : data_(data), end_(data + size) {}
+
+    bool AtEnd() const { return data_ == end_; }
+
+    bool ReadHead(uint8_t& major, uint32_t& value) {
+        if (data_ >= end_) {
+            return false;
+        }
+        major = *data_ >> 5;
+        uint8_t info = *data_++ & 0x1F;
+        if (info < 24) {
+            value = info;
+            return true;
+        }
+        // 64-bit and indefinite lengths are never needed by control messages
+        int bytes = info == 24 ? 1 : info == 25 ? 2 : info == 26 ? 4 : 0;
+        if (bytes == 0 || end_ - data_ < bytes) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < bytes; i++) {
+            value = (value << 8) | *data_++;
+        }
+        return true;
+    }
+
+    bool ReadString(uint32_t length, std::string_view& text) {
+        if ((size_t)(end_ - data_) < length) {
+            return false;
+        }
+        text = std::string_view((const char*)data_, length);
+        data_ += length;
+        return true;
+    }
+
+    // Skips the rest of an item whose head was read
+    bool Skip(uint8_t major, uint32_t value, int depth = 0) {
+        std::string_view ignored;
+        switch (major) {
+        case CBOR_MAJOR_UNSIGNED:
+        case 1:
+        case CBOR_MAJOR_SIMPLE:
+            return true;
+        case CBOR_MAJOR_BYTES:
+        case CBOR_MAJOR_TEXT:
+            return ReadString(value, ignored);
+        case CBOR_MAJOR_ARRAY:
+        case CBOR_MAJOR_MAP: {
+            if (depth >= CBOR_MAX_SKIP_DEPTH) {
+                return false;
+            }
+            uint32_t items = major == CBOR_MAJOR_MAP ? value * 2 : value;
+            for (uint32_t i = 0; i < items; i++) {
+                uint8_t item_major;
+                uint32_t item_value;
+                if (!ReadHead(item_major, item_value) || !Skip(item_major, item_value, depth + 1)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        default:
+            // Tags
+            return false;
+        }
+    }
+
+private:
+    const uint8_t* data_;
+    const uint8_t* end_;
+};
+
+} // namespace
+
+bool ControlMessageCodec::Decode(const uint8_t* data, size_t size, ControlMessage& message) {
+    CborReader reader(data, size);
+    uint8_t major;
+    uint32_t count;
+    if (!reader.ReadHead(major, count) || major != CBOR_MAJOR_MAP) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t key, value;
+        if (!reader.ReadHead(major, key) || major != CBOR_MAJOR_UNSIGNED || !reader.ReadHead(major, value)) {
+            return false;
+        }
+        if (major == CBOR_MAJOR_UNSIGNED) {
+            switch (key) {
+            case kControlKeyType:
+                message.type = value < kControlMessageTypeCount ? (ControlMessageType)value : kControlMessageUnknown;
+                break;
+            case kControlKeyState:
+                message.state = value < kControlStateCount ? (ControlMessageState)value : kControlStateNone;
+                break;
+            case kControlKeyMode:
+                message.mode = value;
+                break;
+            case kControlKeyReason:
+                message.reason = (AbortReason)value;
+                break;
+            default:
+                // Tags added by newer servers
+                break;
+            }
+            continue;
+        }
+        if (major != CBOR_MAJOR_TEXT) {
+            if (!reader.Skip(major, value)) {
+                return false;
+            }
+            continue;
+        }
+
+        std::string_view text;
+        if (!reader.ReadString(value, text)) {
+            return false;
+        }
+        switch (key) {
+        case kControlKeySessionId: message.session_id = text; break;
+        case kControlKeyText: message.text = text; break;
+        case kControlKeyEmotion: message.emotion = text; break;
+        case kControlKeyPayload: message.payload = text; break;
+        case kControlKeyCommand: message.command = text; break;
+        case kControlKeyStatus: message.status = text; break;
+        case kControlKeyMessage: message.message = text; break;
+        default: break;
+        }
+    }
+    return reader.AtEnd();
+}
+
+// The string members of a JSON message and where they go, the routing keys are handled separately
+static const struct {
+    const char* name;
+    std::string_view ControlMessage::*field;
+} kJsonTextFields[] = {
+    { "session_id", &ControlMessage::session_id },
+    { "text", &ControlMessage::text },
+    { "emotion", &ControlMessage::emotion },
+    { "command", &ControlMessage::command },
+    { "status", &ControlMessage::status },
+    { "message", &ControlMessage::message },
+};
+
+bool ControlMessageCodec::DecodeJson(const char* data, size_t size, std::string& scratch, ControlMessage& message) {
+    JsonScanner scanner(data, size, scratch);
+    JsonMember member;
+    bool has_type = false;
+    while (scanner.Next(member)) {
+        if (member.type == kJsonObject) {
+            if (member.key == "payload") {
+                message.payload = member.value;
+            }
+            continue;
+        }
+        if (member.type != kJsonString) {
+            continue;
+        }
+        auto& key = member.key;
+        auto& value = member.value;
+        if (key == "type") {
+            has_type = true;
+            message.type_name = value;
+            message.type = FindName(kTypeNames, value, kControlMessageUnknown);
+        } else if (key == "state") {
+            message.state = FindName(kStateNames, value, kControlStateNone);
+        } else if (key == "mode") {
+            for (size_t i = 0; i < sizeof(kModeNames) / sizeof(kModeNames[0]); i++) {
+                if (value == kModeNames[i]) {
+                    message.mode = i;
+                }
+            }
+        } else if (key == "reason") {
+            if (value == "wake_word_detected") {
+                message.reason = kAbortReasonWakeWordDetected;
+            }
+        } else {
+            for (auto& field : kJsonTextFields) {
+                if (key == field.name) {
+                    message.*field.field = value;
+                    break;
+                }
+            }
+        }
+    }
+    return scanner.ok() && has_type;
+}
@@ -0,0 +1,47 @@
+#ifndef CONTROL_MESSAGE_H
+#define CONTROL_MESSAGE_H
+
+#include "protocol.h"
+
+#include <string>
+
+/*
+ * Encodes control messages as JSON text or as compact CBOR (RFC 8949).
+ *
+ * The binary form is a CBOR map with small integer keys (ControlMessageKey). The type, state, mode and
+ * reason are unsigned integers (ControlMessageType, ControlMessageState, ListeningMode, AbortReason),
+ * everything else is a text string. MCP and custom payloads stay JSON text inside the map, since the
+ * MCP server consumes JSON-RPC. For example {"type":"listen","state":"stop"} becomes the 5 bytes
+ * a2 00 01 02 02.
+ */
+enum ControlMessageKey : uint8_t {
+    kControlKeyType = 0,
+    kControlKeySessionId,
+    kControlKeyState,
+    kControlKeyMode,
+    kControlKeyReason,
+    kControlKeyText,
+    kControlKeyEmotion,
+    kControlKeyPayload,
+    kControlKeyCommand,
+    kControlKeyStatus,
+    kControlKeyMessage,
+};
+
+class ControlMessageCodec {
+public:
+    // True if a message starting with this byte is CBOR encoded rather than JSON
+    static bool IsBinary(uint8_t first_byte);
+
+    // Appends the encoded message to out
+    static void Encode(const ControlMessage& message, std::string& out);
+    static void EncodeJson(const ControlMessage& message, std::string& out);
+
+    // The strings of message point into data, or into scratch for escaped JSON strings, afterwards
+    static bool Decode(const uint8_t* data, size_t size, ControlMessage& message);
+    static bool DecodeJson(const char* data, size_t size, std::string& scratch, ControlMessage& message);
+
+    static const char* TypeName(ControlMessageType type);
+};
+
+#endif // CONTROL_MESSAGE_H
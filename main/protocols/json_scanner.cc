@@ -0,0 +1,239 @@
+#include "json_scanner.h"
+
+#include <cstring>
+
+// Nesting of the skipped objects and arrays
+#define JSON_SCANNER_MAX_DEPTH 32
+
+JsonScanner::JsonScanner(const char* data, size_t size, std::string& scratch)
+    : data_(data), end_(data + size), scratch_(scratch) {
+    // Unescaping never makes a string longer, so the scratch buffer does not move while views into it exist
+    scratch_.clear();
+    scratch_.reserve(size);
+
+    SkipWhitespace();
+    ok_ = Expect('{');
+}
+
+bool JsonScanner::Fail() {
+    ok_ = false;
+    return false;
+}
+
+void JsonScanner::SkipWhitespace() {
+    while (data_ < end_ && (*data_ == ' ' || *data_ == '\t' || *data_ == '\n' || *data_ == '\r')) {
+        data_++;
+    }
+}
+
+bool JsonScanner::Expect(char c) {
+    SkipWhitespace();
+    if (data_ < end_ && *data_ == c) {
+        data_++;
+        return true;
+    }
+    return false;
+}
+
+bool JsonScanner::Next(JsonMember& member) {
+    if (!ok_) {
+        return false;
+    }
+    if (Expect('}')) {
+        // The rest of the buffer, if any, is ignored like cJSON_Parse() does
+        return false;
+    }
+    if (!first_ && !Expect(',')) {
+        return Fail();
+    }
+    first_ = false;
+
+    SkipWhitespace();
+    if (!ReadString(member.key) || !Expect(':')) {
+        return Fail();
+    }
+    SkipWhitespace();
+    if (data_ < end_ && *data_ == '"') {
+        member.type = kJsonString;
+        return ReadString(member.value) || Fail();
+    }
+    const char* start = data_;
+    if (!SkipValue(member.type)) {
+        return Fail();
+    }
+    member.value = std::string_view(start, data_ - start);
+    return true;
+}
+
+bool JsonScanner::ReadHex4(uint32_t& code) {
+    if (end_ - data_ < 4) {
+        return false;
+    }
+    code = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *data_++;
+        code <<= 4;
+        if (c >= '0' && c <= '9') code |= c - '0';
+        else if (c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+        else return false;
+    }
+    return true;
+}
+
+bool JsonScanner::ReadString(std::string_view& text) {
+    if (data_ >= end_ || *data_ != '"') {
+        return false;
+    }
+    const char* start = ++data_;
+    // Fast path, most strings have no escapes and are returned in place
+    while (data_ < end_ && *data_ != '"' && *data_ != '\\') {
+        data_++;
+    }
+    if (data_ >= end_) {
+        return false;
+    }
+    if (*data_ == '"') {
+        text = std::string_view(start, data_ - start);
+        data_++;
+        return true;
+    }
+
+    size_t offset = scratch_.size();
+    scratch_.append(start, data_ - start);
+    while (data_ < end_ && *data_ != '"') {
+        char c = *data_++;
+        if (c != '\\') {
+            scratch_.push_back(c);
+            continue;
+        }
+        if (data_ >= end_) {
+            return false;
+        }
+        c = *data_++;
+        switch (c) {
+        case '"': case '\\': case '/': scratch_.push_back(c); break;
+        case 'b': scratch_.push_back('\b'); break;
+        case 'f': scratch_.push_back('\f'); break;
+        case 'n': scratch_.push_back('\n'); break;
+        case 'r': scratch_.push_back('\r'); break;
+        case 't': scratch_.push_back('\t'); break;
+        case 'u': {
+            // Servers that escape non-ASCII text send Chinese as \uXXXX, and emoji as surrogate pairs
+            uint32_t code;
+            if (!ReadHex4(code)) {
+                return false;
+            }
+            if (code >= 0xD800 && code <= 0xDBFF) {
+                uint32_t low;
+                if (end_ - data_ < 6 || data_[0] != '\\' || data_[1] != 'u') {
+                    return false;
+                }
+                data_ += 2;
+                if (!ReadHex4(low) || low < 0xDC00 || low > 0xDFFF) {
+                    return false;
+                }
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            }
+            if (code < 0x80) {
+                scratch_.push_back(code);
+            } else if (code < 0x800) {
+                scratch_.push_back(0xC0 | (code >> 6));
+                scratch_.push_back(0x80 | (code & 0x3F));
+            } else if (code < 0x10000) {
+                scratch_.push_back(0xE0 | (code >> 12));
+                scratch_.push_back(0x80 | ((code >> 6) & 0x3F));
+                scratch_.push_back(0x80 | (code & 0x3F));
+            } else {
+                scratch_.push_back(0xF0 | (code >> 18));
+                scratch_.push_back(0x80 | ((code >> 12) & 0x3F));
+                scratch_.push_back(0x80 | ((code >> 6) & 0x3F));
+                scratch_.push_back(0x80 | (code & 0x3F));
+            }
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    if (data_ >= end_) {
+        return false;
+    }
+    data_++;
+    text = std::string_view(scratch_.data() + offset, scratch_.size() - offset);
+    return true;
+}
+
+bool JsonScanner::SkipString() {
+    data_++;
+    while (data_ < end_ && *data_ != '"') {
+        if (*data_ == '\\') {
+            data_++;
+        }
+        data_++;
+    }
+    if (data_ >= end_) {
+        return false;
+    }
+    data_++;
+    return true;
+}
+
+bool JsonScanner::SkipValue(JsonType& type) {
+    if (data_ >= end_) {
+        return false;
+    }
+    char c = *data_;
+    if (c == '{' || c == '[') {
+        type = c == '{' ? kJsonObject : kJsonArray;
+        // Only the brackets matter for finding the end, the content is validated by whoever parses it
+        int depth = 0;
+        while (data_ < end_) {
+            c = *data_;
+            if (c == '"') {
+                if (!SkipString()) {
+                    return false;
+                }
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                if (++depth > JSON_SCANNER_MAX_DEPTH) {
+                    return false;
+                }
+            } else if (c == '}' || c == ']') {
+                if (--depth == 0) {
+                    data_++;
+                    return true;
+                }
+            }
+            data_++;
+        }
+        return false;
+    }
+
+    static const struct {
+        const char* text;
+        JsonType type;
+    } kLiterals[] = {
+        { "true", kJsonTrue },
+        { "false", kJsonFalse },
+        { "null", kJsonNull },
+    };
+    for (auto& literal : kLiterals) {
+        size_t length = strlen(literal.text);
+        if ((size_t)(end_ - data_) >= length && memcmp(data_, literal.text, length) == 0) {
+            type = literal.type;
+            data_ += length;
+            return true;
+        }
+    }
+
+    if (c == '-' || (c >= '0' && c <= '9')) {
+        type = kJsonNumber;
+        while (data_ < end_ && ((*data_ >= '0' && *data_ <= '9') || (*data_ != '\0' && strchr("+-.eE", *data_) != nullptr))) {
+            data_++;
+        }
+        return true;
+    }
+    return false;
+}
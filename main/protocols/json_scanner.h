@@ -0,0 +1,54 @@
+#ifndef JSON_SCANNER_H
+#define JSON_SCANNER_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+enum JsonType {
+    kJsonString,
+    kJsonNumber,
+    kJsonObject,
+    kJsonArray,
+    kJsonTrue,
+    kJsonFalse,
+    kJsonNull,
+};
+
+struct JsonMember {
+    std::string_view key;
+    JsonType type = kJsonNull;
+    // Unescaped text of strings, the raw JSON text of any other value
+    std::string_view value;
+};
+
+/*
+ * Walks the members of a JSON object one by one without building a tree, nested objects and arrays are
+ * returned as raw text. Strings without escapes point into the input; escaped strings are decoded into
+ * scratch, which is reserved up front so the views stay valid until the next scan that uses it.
+ */
+class JsonScanner {
+public:
+    JsonScanner(const char* data, size_t size, std::string& scratch);
+
+    // False at the end of the object or on malformed input, see ok()
+    bool Next(JsonMember& member);
+    bool ok() const { return ok_; }
+
+private:
+    const char* data_;
+    const char* end_;
+    std::string& scratch_;
+    bool ok_ = true;
+    bool first_ = true;
+
+    bool Fail();
+    void SkipWhitespace();
+    bool Expect(char c);
+    bool ReadString(std::string_view& text);
+    bool ReadHex4(uint32_t& code);
+    bool SkipValue(JsonType& type);
+    bool SkipString();
+};
+
+#endif // JSON_SCANNER_H
@@ -1,7 +1,9 @@
 #include "mqtt_protocol.h"
+#include "control_message.h"
 #include "board.h"
 #include "application.h"
 #include "settings.h"
+#include "audio_pool.h"
 
 #include <esp_log.h>
 #include <cstring>
@@ -54,32 +56,26 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
-        cJSON* root = cJSON_Parse(payload.c_str());
-        if (root == nullptr) {
-            ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
-            return;
-        }
-        cJSON* type = cJSON_GetObjectItem(root, "type");
-        if (!cJSON_IsString(type)) {
-            ESP_LOGE(TAG, "Message type is invalid");
-            cJSON_Delete(root);
+        ControlMessage message;
+        if (!payload.empty() && ControlMessageCodec::IsBinary(payload[0])) {
+            if (!ControlMessageCodec::Decode((const uint8_t*)payload.data(), payload.size(), message)) {
+                ESP_LOGE(TAG, "Invalid binary control message, %u bytes", payload.size());
+                return;
+            }
+        } else if (!DecodeJson(payload.data(), payload.size(), message)) {
             return;
         }
 
-        if (strcmp(type->valuestring, "hello") == 0) {
+        if (message.type_name == "hello") {
+            // The only message that needs a tree, it is parsed once per audio channel
+            cJSON* root = cJSON_ParseWithLength(payload.data(), payload.size());
             ParseServerHello(root);
-        } else if (strcmp(type->valuestring, "goodbye") == 0) {
-            auto session_id = cJSON_GetObjectItem(root, "session_id");
-            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id->valuestring : "null");
-            if (session_id == nullptr || session_id_ == session_id->valuestring) {
-                Application::GetInstance().Schedule([this]() {
-                    CloseAudioChannel();
-                });
-            }
-        } else if (on_incoming_json_ != nullptr) {
-            on_incoming_json_(root);
+            cJSON_Delete(root);
+        } else if (message.type == kControlMessageGoodbye) {
+            OnGoodbye(message.session_id);
+        } else {
+            DispatchControl(message);
         }
-        cJSON_Delete(root);
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -103,6 +99,27 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     return true;
 }
 
+void MqttProtocol::OnGoodbye(std::string_view session_id) {
+    ESP_LOGI(TAG, "Received goodbye message, session_id: %.*s", (int)session_id.size(), session_id.data());
+    if (session_id.empty() || session_id_ == session_id) {
+        Application::GetInstance().Schedule([this]() {
+            CloseAudioChannel();
+        });
+    }
+}
+
+bool MqttProtocol::SendBinaryControl(const std::string& data) {
+    if (publish_topic_.empty()) {
+        return false;
+    }
+    if (!mqtt_->Publish(publish_topic_, data)) {
+        ESP_LOGE(TAG, "Failed to publish binary control message");
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    return true;
+}
+
 bool MqttProtocol::SendText(const std::string& text) {
     if (publish_topic_.empty()) {
         return false;
@@ -115,30 +132,54 @@ bool MqttProtocol::SendText(const std::string& text) {
     return true;
 }
 
-bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+bool MqttProtocol::SendAudio(AudioStreamPacketPtr packet) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    return SendAudioLocked(*packet);
+}
+
+size_t MqttProtocol::SendAudioBatch(const std::function<AudioStreamPacketPtr()>& next) {
+    // Take the channel lock once for the whole batch
     std::lock_guard<std::mutex> lock(channel_mutex_);
+    size_t sent = 0;
+    while (auto packet = next()) {
+        if (!SendAudioLocked(*packet)) {
+            break;
+        }
+        sent++;
+    }
+    return sent;
+}
+
+bool MqttProtocol::SendAudioLocked(const AudioStreamPacket& packet) {
     if (udp_ == nullptr) {
         return false;
     }
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
+    // The counter block starts as the nonce, which also carries the size, timestamp and sequence of this packet
+    uint8_t nonce[MQTT_AUDIO_NONCE_SIZE];
+    memcpy(nonce, aes_nonce_, sizeof(nonce));
+    *(uint16_t*)&nonce[2] = htons(packet.payload.size());
+    *(uint32_t*)&nonce[8] = htonl(packet.timestamp);
     *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
 
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
+    // Keeps its capacity, so it only grows when a packet is larger than any before it
+    udp_send_buffer_.resize(sizeof(nonce) + packet.payload.size());
+    auto buffer = reinterpret_cast<uint8_t*>(udp_send_buffer_.data());
+    memcpy(buffer, nonce, sizeof(nonce));
 
     size_t nc_off = 0;
-    uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
+    uint8_t stream_block[16];
+    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet.payload.size(), &nc_off, nonce, stream_block,
+        packet.payload.data(), buffer + sizeof(nonce)) != 0) {
         ESP_LOGE(TAG, "Failed to encrypt audio data");
         return false;
     }
 
-    return udp_->Send(encrypted) > 0;
+    if (udp_->Send(udp_send_buffer_) <= 0) {
+        return false;
+    }
+    RecordOutgoingAudio(udp_send_buffer_.size());
+    return true;
 }
 
 void MqttProtocol::CloseAudioChannel() {
@@ -158,7 +199,7 @@ void MqttProtocol::CloseAudioChannel() {
     }
 }
 
-bool MqttProtocol::OpenAudioChannel() {
+bool MqttProtocol::OpenAudioChannel(std::function<void()> on_hello_sent) {
     if (mqtt_ == nullptr || !mqtt_->IsConnected()) {
         ESP_LOGI(TAG, "MQTT is not connected, try to connect now");
         if (!StartMqttClient(true)) {
@@ -171,6 +212,7 @@ bool MqttProtocol::OpenAudioChannel() {
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 
     auto message = GetHelloMessage();
+    auto hello_time = esp_timer_get_time();
     if (!SendText(message)) {
         return false;
     }
@@ -182,6 +224,7 @@ bool MqttProtocol::OpenAudioChannel() {
         SetError(Lang::Strings::SERVER_TIMEOUT);
         return false;
     }
+    RecordServerHello((esp_timer_get_time() - hello_time) / 1000);
 
     std::lock_guard<std::mutex> lock(channel_mutex_);
     auto network = Board::GetInstance().GetNetwork();
@@ -192,43 +235,49 @@ bool MqttProtocol::OpenAudioChannel() {
          * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
          * |payload payload_len|
          */
-        if (data.size() < sizeof(aes_nonce_)) {
+        if (data.size() < MQTT_AUDIO_NONCE_SIZE) {
             ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
             return;
         }
-        if (data[0] != 0x01) {
-            ESP_LOGE(TAG, "Invalid audio packet type: %x", data[0]);
-            return;
-        }
-        uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
-        uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
+        auto datagram = reinterpret_cast<const uint8_t*>(data.data());
+        if (datagram[0] != 0x01) {
+            ESP_LOGE(TAG, "Invalid audio packet type: %x", datagram[0]);
             return;
         }
+        uint32_t timestamp = ntohl(*(const uint32_t*)&datagram[8]);
+        uint32_t sequence = ntohl(*(const uint32_t*)&datagram[12]);
+        // Reordered and lost packets are handled by the jitter buffer in AudioService
         if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+            ESP_LOGD(TAG, "Received audio packet with sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
         }
 
-        size_t decrypted_size = data.size() - aes_nonce_.size();
+        // mbedtls advances the counter block, so it must not point into the received datagram
+        uint8_t nonce[MQTT_AUDIO_NONCE_SIZE];
+        memcpy(nonce, datagram, sizeof(nonce));
+        size_t decrypted_size = data.size() - MQTT_AUDIO_NONCE_SIZE;
         size_t nc_off = 0;
-        uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        auto packet = std::make_unique<AudioStreamPacket>();
+        uint8_t stream_block[16];
+        // Pooled packets keep their payload capacity, so decrypting into them does not allocate
+        auto packet = AudioPool::GetInstance().AcquirePacket();
+        packet->origin_time_us = esp_timer_get_time();
         packet->sample_rate = server_sample_rate_;
         packet->frame_duration = server_frame_duration_;
         packet->timestamp = timestamp;
+        packet->sequence = sequence;
         packet->payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
+        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block,
+            datagram + MQTT_AUDIO_NONCE_SIZE, packet->payload.data());
         if (ret != 0) {
             ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
             return;
         }
+        RecordIncomingAudio(sequence, timestamp, data.size());
         if (on_incoming_audio_ != nullptr) {
             on_incoming_audio_(std::move(packet));
         }
-        remote_sequence_ = sequence;
+        if (sequence > remote_sequence_) {
+            remote_sequence_ = sequence;
+        }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -247,16 +296,13 @@ std::string MqttProtocol::GetHelloMessage() {
     cJSON_AddNumberToObject(root, "version", 3);
     cJSON_AddStringToObject(root, "transport", "udp");
     cJSON* features = cJSON_CreateObject();
-#if CONFIG_USE_SERVER_AEC
-    cJSON_AddBoolToObject(features, "aec", true);
-#endif
-    cJSON_AddBoolToObject(features, "mcp", true);
+    AddHelloFeatures(features, true);
     cJSON_AddItemToObject(root, "features", features);
     cJSON* audio_params = cJSON_CreateObject();
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    cJSON_AddNumberToObject(audio_params, "frame_duration", client_frame_duration_);
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -277,6 +323,7 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         session_id_ = session_id->valuestring;
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
+    ParseHelloFeatures(root);
 
     // Get sample rate from hello message
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
@@ -303,7 +350,12 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
 
     // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
     // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
-    aes_nonce_ = DecodeHexString(nonce);
+    auto aes_nonce = DecodeHexString(nonce);
+    if (aes_nonce.size() != MQTT_AUDIO_NONCE_SIZE) {
+        ESP_LOGE(TAG, "Invalid nonce size: %u", aes_nonce.size());
+        return;
+    }
+    memcpy(aes_nonce_, aes_nonce.data(), MQTT_AUDIO_NONCE_SIZE);
     mbedtls_aes_init(&aes_ctx_);
     mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
     local_sequence_ = 0;
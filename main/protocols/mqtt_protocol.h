@@ -17,6 +17,8 @@
 
 #define MQTT_PING_INTERVAL_SECONDS 90
 #define MQTT_RECONNECT_INTERVAL_MS 10000
+// AES-CTR nonce that prefixes every UDP audio packet
+#define MQTT_AUDIO_NONCE_SIZE 16
 
 #define MQTT_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
 
@@ -26,8 +28,9 @@ public:
     ~MqttProtocol();
 
     bool Start() override;
-    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
-    bool OpenAudioChannel() override;
+    bool SendAudio(AudioStreamPacketPtr packet) override;
+    size_t SendAudioBatch(const std::function<AudioStreamPacketPtr()>& next) override;
+    bool OpenAudioChannel(std::function<void()> on_hello_sent = nullptr) override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
 
@@ -40,7 +43,9 @@ private:
     std::unique_ptr<Mqtt> mqtt_;
     std::unique_ptr<Udp> udp_;
     mbedtls_aes_context aes_ctx_;
-    std::string aes_nonce_;
+    uint8_t aes_nonce_[MQTT_AUDIO_NONCE_SIZE] = {};
+    // Nonce and ciphertext of the packet being sent, reused so sending does not allocate
+    std::string udp_send_buffer_;
     std::string udp_server_;
     int udp_port_;
     uint32_t local_sequence_;
@@ -49,8 +54,12 @@ private:
     bool StartMqttClient(bool report_error=false);
     void ParseServerHello(const cJSON* root);
     std::string DecodeHexString(const std::string& hex_string);
+    bool SendAudioLocked(const AudioStreamPacket& packet);
+
+    void OnGoodbye(std::string_view session_id);
 
     bool SendText(const std::string& text) override;
+    bool SendBinaryControl(const std::string& data) override;
     std::string GetHelloMessage();
 };
 
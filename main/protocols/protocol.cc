@@ -1,14 +1,19 @@
 #include "protocol.h"
+#include "control_message.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 
 #define TAG "Protocol"
 
-void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
-    on_incoming_json_ = callback;
+// A sequence this far from the highest one seen means the sender started a new stream
+#define CHANNEL_STATS_SEQUENCE_RESTART 1000
+
+void Protocol::OnIncomingControl(std::function<void(const ControlMessage& message)> callback) {
+    on_incoming_control_ = callback;
 }
 
-void Protocol::OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback) {
+void Protocol::OnIncomingAudio(std::function<void(AudioStreamPacketPtr packet)> callback) {
     on_incoming_audio_ = callback;
 }
 
@@ -31,43 +36,120 @@ void Protocol::SetError(const std::string& message) {
     }
 }
 
-void Protocol::SendAbortSpeaking(AbortReason reason) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"abort\"";
-    if (reason == kAbortReasonWakeWordDetected) {
-        message += ",\"reason\":\"wake_word_detected\"";
+size_t Protocol::SendAudioBatch(const std::function<AudioStreamPacketPtr()>& next) {
+    size_t sent = 0;
+    while (auto packet = next()) {
+        if (!SendAudio(std::move(packet))) {
+            break;
+        }
+        sent++;
     }
-    message += "}";
-    SendText(message);
+    return sent;
 }
 
-void Protocol::SendWakeWordDetected(const std::string& wake_word) {
-    std::string json = "{\"session_id\":\"" + session_id_ + 
-                      "\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"" + wake_word + "\"}";
-    SendText(json);
+bool Protocol::SendBinaryControl(const std::string& data) {
+    return false;
 }
 
-void Protocol::SendStartListening(ListeningMode mode) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\"";
-    message += ",\"type\":\"listen\",\"state\":\"start\"";
-    if (mode == kListeningModeRealtime) {
-        message += ",\"mode\":\"realtime\"";
-    } else if (mode == kListeningModeAutoStop) {
-        message += ",\"mode\":\"auto\"";
+void Protocol::AddHelloFeatures(cJSON* features, bool binary_control_supported) {
+#if CONFIG_USE_SERVER_AEC
+    cJSON_AddBoolToObject(features, "aec", true);
+#endif
+    cJSON_AddBoolToObject(features, "mcp", true);
+#if CONFIG_PROTOCOL_BINARY_CONTROL
+    if (binary_control_supported) {
+        cJSON_AddBoolToObject(features, "binary_control", true);
+    }
+#endif
+}
+
+void Protocol::ParseHelloFeatures(const cJSON* root) {
+    binary_control_ = false;
+#if CONFIG_PROTOCOL_BINARY_CONTROL
+    auto features = cJSON_GetObjectItem(root, "features");
+    if (cJSON_IsObject(features) && cJSON_IsTrue(cJSON_GetObjectItem(features, "binary_control"))) {
+        ESP_LOGI(TAG, "Binary control messages enabled");
+        binary_control_ = true;
+    }
+#endif
+}
+
+bool Protocol::DecodeJson(const char* data, size_t size, ControlMessage& message) {
+    if (!ControlMessageCodec::DecodeJson(data, size, json_scratch_, message)) {
+        ESP_LOGE(TAG, "Invalid message or missing type: %.*s", (int)size, data);
+        return false;
+    }
+    return true;
+}
+
+void Protocol::DispatchControl(const ControlMessage& message) {
+    if (on_incoming_control_ != nullptr) {
+        on_incoming_control_(message);
+    }
+}
+
+void Protocol::DispatchBinaryControl(const uint8_t* data, size_t size) {
+    ControlMessage message;
+    if (!ControlMessageCodec::Decode(data, size, message)) {
+        ESP_LOGE(TAG, "Invalid binary control message, %u bytes", size);
+        return;
+    }
+    DispatchControl(message);
+}
+
+void Protocol::SendControl(const ControlMessage& message) {
+    // Called from the main task and from MCP tool calls
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    control_buffer_.clear();
+    if (binary_control_) {
+        ControlMessageCodec::Encode(message, control_buffer_);
+        SendBinaryControl(control_buffer_);
     } else {
-        message += ",\"mode\":\"manual\"";
+        ControlMessageCodec::EncodeJson(message, control_buffer_);
+        SendText(control_buffer_);
     }
-    message += "}";
-    SendText(message);
+}
+
+void Protocol::SendAbortSpeaking(AbortReason reason) {
+    ControlMessage message;
+    message.type = kControlMessageAbort;
+    message.session_id = session_id_;
+    message.reason = reason;
+    SendControl(message);
+}
+
+void Protocol::SendWakeWordDetected(const std::string& wake_word) {
+    ControlMessage message;
+    message.type = kControlMessageListen;
+    message.state = kControlStateDetect;
+    message.session_id = session_id_;
+    message.text = wake_word;
+    SendControl(message);
+}
+
+void Protocol::SendStartListening(ListeningMode mode) {
+    ControlMessage message;
+    message.type = kControlMessageListen;
+    message.state = kControlStateStart;
+    message.session_id = session_id_;
+    message.mode = mode;
+    SendControl(message);
 }
 
 void Protocol::SendStopListening() {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
-    SendText(message);
+    ControlMessage message;
+    message.type = kControlMessageListen;
+    message.state = kControlStateStop;
+    message.session_id = session_id_;
+    SendControl(message);
 }
 
 void Protocol::SendMcpMessage(const std::string& payload) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":" + payload + "}";
-    SendText(message);
+    ControlMessage message;
+    message.type = kControlMessageMcp;
+    message.session_id = session_id_;
+    message.payload = payload;
+    SendControl(message);
 }
 
 bool Protocol::IsTimeout() const {
@@ -80,3 +162,89 @@ bool Protocol::IsTimeout() const {
     }
     return timeout;
 }
+
+void Protocol::ByteRate::Add(int64_t now_second, size_t count) {
+    if (now_second != second) {
+        last_bytes = now_second == second + 1 ? bytes : 0;
+        second = now_second;
+        bytes = 0;
+    }
+    bytes += count;
+}
+
+uint32_t Protocol::ByteRate::Get(int64_t now_second) const {
+    if (now_second == second) {
+        return last_bytes;
+    }
+    return now_second == second + 1 ? bytes : 0;
+}
+
+void Protocol::RecordIncomingAudio(uint32_t sequence, uint32_t timestamp, size_t bytes) {
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.rx_packets++;
+    rx_rate_.Add(now_ms / 1000, bytes);
+
+    if (sequence != 0) {
+        if (rx_highest_sequence_ == 0 || sequence + CHANNEL_STATS_SEQUENCE_RESTART < rx_highest_sequence_) {
+            rx_highest_sequence_ = sequence;
+        } else if (sequence > rx_highest_sequence_ + CHANNEL_STATS_SEQUENCE_RESTART) {
+            rx_highest_sequence_ = sequence;
+        } else if (sequence > rx_highest_sequence_) {
+            stats_.rx_lost += sequence - rx_highest_sequence_ - 1;
+            rx_highest_sequence_ = sequence;
+        } else if (sequence < rx_highest_sequence_) {
+            // A late packet fills a gap that was counted as lost
+            stats_.rx_reordered++;
+            if (stats_.rx_lost > 0) {
+                stats_.rx_lost--;
+            }
+        }
+    }
+
+    // Without a media timestamp, assume the packets were sent one frame apart
+    int64_t media_ms = timestamp != 0 ? timestamp : (int64_t)rx_packet_index_ * server_frame_duration_;
+    rx_packet_index_++;
+    rx_jitter_.Add(now_ms, media_ms);
+    stats_.jitter_ms = rx_jitter_.jitter_ms();
+}
+
+void Protocol::RecordOutgoingAudio(size_t bytes) {
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.tx_packets++;
+    tx_rate_.Add(now_ms / 1000, bytes);
+}
+
+void Protocol::RecordServerHello(int rtt_ms) {
+    hello_rtt_ms_ = rtt_ms;
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    // Each audio channel numbers its packets from the start
+    rx_highest_sequence_ = 0;
+    rx_packet_index_ = 0;
+    rx_jitter_.Restart();
+    stats_.rtt_ms = stats_.rtt_ms == 0 ? rtt_ms : (stats_.rtt_ms * 7 + rtt_ms) / 8;
+}
+
+ChannelStats Protocol::GetChannelStats() {
+    int64_t now_second = esp_timer_get_time() / 1000000;
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    ChannelStats stats = stats_;
+    stats.rx_bytes_per_second = rx_rate_.Get(now_second);
+    stats.tx_bytes_per_second = tx_rate_.Get(now_second);
+    return stats;
+}
+
+cJSON* Protocol::GetChannelStatsJson() {
+    auto stats = GetChannelStats();
+    auto json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "rtt_ms", stats.rtt_ms);
+    cJSON_AddNumberToObject(json, "jitter_ms", stats.jitter_ms);
+    cJSON_AddNumberToObject(json, "rx_packets", stats.rx_packets);
+    cJSON_AddNumberToObject(json, "rx_lost", stats.rx_lost);
+    cJSON_AddNumberToObject(json, "rx_reordered", stats.rx_reordered);
+    cJSON_AddNumberToObject(json, "tx_packets", stats.tx_packets);
+    cJSON_AddNumberToObject(json, "rx_bytes_per_second", stats.rx_bytes_per_second);
+    cJSON_AddNumberToObject(json, "tx_bytes_per_second", stats.tx_bytes_per_second);
+    return json;
+}
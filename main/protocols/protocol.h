@@ -3,20 +3,39 @@
 
 #include <cJSON.h>
 #include <string>
+#include <string_view>
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <memory>
+#include <mutex>
+
+#include "arrival_jitter.h"
 
 struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
     uint32_t timestamp = 0;
+    uint32_t sequence = 0;  // 0 if the transport does not number its packets
+    int64_t origin_time_us = 0;     // I2S read (uplink) or network receive (downlink), for latency stats
+    int64_t stage_time_us = 0;      // When the previous pipeline stage finished
     std::vector<uint8_t> payload;
 };
 
+// Returns the packet to AudioPool, packets are acquired with AudioPool::AcquirePacket()
+struct AudioStreamPacketDeleter {
+    void operator()(AudioStreamPacket* packet) const;
+};
+using AudioStreamPacketPtr = std::unique_ptr<AudioStreamPacket, AudioStreamPacketDeleter>;
+
+// Type of the binary frames, version 2 and 3 only
+#define BINARY_PROTOCOL_TYPE_OPUS 0
+#define BINARY_PROTOCOL_TYPE_JSON 1
+#define BINARY_PROTOCOL_TYPE_CONTROL 2     // CBOR encoded control message, see ControlMessageCodec
+
 struct BinaryProtocol2 {
     uint16_t version;
-    uint16_t type;          // Message type (0: OPUS, 1: JSON)
+    uint16_t type;          // Message type (0: OPUS, 1: JSON, 2: CBOR control)
     uint32_t reserved;      // Reserved for future use
     uint32_t timestamp;     // Timestamp in milliseconds (used for server-side AEC)
     uint32_t payload_size;  // Payload size in bytes
@@ -30,6 +49,18 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
+// Link metrics of the audio channel, counted since boot unless noted
+struct ChannelStats {
+    uint32_t rtt_ms = 0;                // Smoothed over the hello exchanges of each channel opened
+    uint32_t jitter_ms = 0;             // Inter-arrival jitter of the received audio (RFC 3550)
+    uint32_t rx_packets = 0;
+    uint32_t rx_lost = 0;               // Only counted by transports that number their packets
+    uint32_t rx_reordered = 0;
+    uint32_t tx_packets = 0;
+    uint32_t rx_bytes_per_second = 0;   // Over the last full second
+    uint32_t tx_bytes_per_second = 0;
+};
+
 enum AbortReason {
     kAbortReasonNone,
     kAbortReasonWakeWordDetected
@@ -41,6 +72,49 @@ enum ListeningMode {
     kListeningModeRealtime // 需要 AEC 支持
 };
 
+// The values are the type tags of the binary encoding, do not reorder
+enum ControlMessageType : uint8_t {
+    kControlMessageUnknown = 0,
+    kControlMessageListen,
+    kControlMessageTts,
+    kControlMessageStt,
+    kControlMessageLlm,
+    kControlMessageAbort,
+    kControlMessageMcp,
+    kControlMessageSystem,
+    kControlMessageAlert,
+    kControlMessageCustom,
+    kControlMessageGoodbye,
+    kControlMessageTypeCount
+};
+
+enum ControlMessageState : uint8_t {
+    kControlStateNone = 0,
+    kControlStateStart,
+    kControlStateStop,
+    kControlStateDetect,
+    kControlStateSentenceStart,
+    kControlStateSentenceEnd,
+    kControlStateCount
+};
+
+// A control message in either encoding. The strings point into the received frame or the parsed
+// JSON and are only valid during the OnIncomingControl() callback
+struct ControlMessage {
+    ControlMessageType type = kControlMessageUnknown;
+    ControlMessageState state = kControlStateNone;
+    int mode = -1;                          // ListeningMode, -1 if absent
+    AbortReason reason = kAbortReasonNone;
+    std::string_view type_name;             // Only set for JSON messages, for hello and logging unknown types
+    std::string_view session_id;
+    std::string_view text;
+    std::string_view emotion;
+    std::string_view command;
+    std::string_view status;
+    std::string_view message;
+    std::string_view payload;               // JSON text of mcp and custom payloads
+};
+
 class Protocol {
 public:
     virtual ~Protocol() = default;
@@ -54,18 +128,35 @@ public:
     inline const std::string& session_id() const {
         return session_id_;
     }
+    // Time from sending the client hello to receiving the server hello, 0 if never measured
+    inline int hello_rtt_ms() const {
+        return hello_rtt_ms_;
+    }
+    // Uplink frame duration announced in the next client hello
+    inline void SetClientFrameDuration(int frame_duration) {
+        client_frame_duration_ = frame_duration;
+    }
 
-    void OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
-    void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    ChannelStats GetChannelStats();
+    // The caller owns the returned object
+    cJSON* GetChannelStatsJson();
+
+    void OnIncomingAudio(std::function<void(AudioStreamPacketPtr packet)> callback);
+    void OnIncomingControl(std::function<void(const ControlMessage& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
 
     virtual bool Start() = 0;
-    virtual bool OpenAudioChannel() = 0;
+    // on_hello_sent is called right after the client hello if the transport can carry uplink audio before the
+    // server hello arrives, so buffered audio is not held back by the round trip. It is not called otherwise
+    virtual bool OpenAudioChannel(std::function<void()> on_hello_sent = nullptr) = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
-    virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
+    virtual bool SendAudio(AudioStreamPacketPtr packet) = 0;
+    // Sends the packets returned by next() until it returns null or a send fails, so a failure leaves
+    // the remaining packets where they came from. Returns the number of packets sent
+    virtual size_t SendAudioBatch(const std::function<AudioStreamPacketPtr()>& next);
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
@@ -73,21 +164,68 @@ public:
     virtual void SendMcpMessage(const std::string& message);
 
 protected:
-    std::function<void(const cJSON* root)> on_incoming_json_;
-    std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_incoming_audio_;
+    std::function<void(const ControlMessage& message)> on_incoming_control_;
+    std::function<void(AudioStreamPacketPtr packet)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
     std::function<void(const std::string& message)> on_network_error_;
 
     int server_sample_rate_ = 24000;
     int server_frame_duration_ = 60;
+    int client_frame_duration_ = 60;
+    int hello_rtt_ms_ = 0;
     bool error_occurred_ = false;
+    // Negotiated in the hello exchange, control messages are sent CBOR encoded instead of JSON
+    bool binary_control_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
 
+    // Called by the transports for every audio packet, sequence is 0 if the transport does not number its packets
+    void RecordIncomingAudio(uint32_t sequence, uint32_t timestamp, size_t bytes);
+    void RecordOutgoingAudio(size_t bytes);
+    // Called when the server hello of a new audio channel arrives, rtt_ms is the hello round trip
+    void RecordServerHello(int rtt_ms);
+
+    // Adds the features of the client hello that do not depend on the transport
+    void AddHelloFeatures(cJSON* features, bool binary_control_supported);
+    void ParseHelloFeatures(const cJSON* root);
+    // Decodes a JSON message without building a tree, called on the receiving task only
+    bool DecodeJson(const char* data, size_t size, ControlMessage& message);
+    void DispatchControl(const ControlMessage& message);
+    // Decodes a control message and passes it to the application
+    void DispatchBinaryControl(const uint8_t* data, size_t size);
+    void SendControl(const ControlMessage& message);
+
     virtual bool SendText(const std::string& text) = 0;
+    // Sends a CBOR encoded control message, only called after binary_control_ was negotiated
+    virtual bool SendBinaryControl(const std::string& data);
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+
+private:
+    struct ByteRate {
+        int64_t second = 0;
+        uint32_t bytes = 0;
+        uint32_t last_bytes = 0;
+
+        void Add(int64_t now_second, size_t count);
+        uint32_t Get(int64_t now_second) const;
+    };
+
+    // Written by the network and main tasks, read by the MCP tools
+    std::mutex stats_mutex_;
+    ChannelStats stats_;
+    ByteRate rx_rate_;
+    ByteRate tx_rate_;
+    uint32_t rx_highest_sequence_ = 0;
+    uint32_t rx_packet_index_ = 0;
+    ArrivalJitter rx_jitter_;
+
+    // Unescaped strings of the JSON message being decoded
+    std::string json_scratch_;
+    // Encoding buffer of SendControl()
+    std::mutex control_mutex_;
+    std::string control_buffer_;
 };
 
 #endif // PROTOCOL_H
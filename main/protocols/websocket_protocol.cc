@@ -3,8 +3,10 @@
 #include "system_info.h"
 #include "application.h"
 #include "settings.h"
+#include "audio_pool.h"
 
 #include <cstring>
+#include <algorithm>
 #include <cJSON.h>
 #include <esp_log.h>
 #include <arpa/inet.h>
@@ -14,55 +16,97 @@
 
 WebsocketProtocol::WebsocketProtocol() {
     event_group_handle_ = xEventGroupCreate();
+#if CONFIG_WEBSOCKET_WARM_STANDBY
+    esp_timer_create_args_t standby_timer_args = {
+        .callback = [](void* arg) {
+            auto protocol = (WebsocketProtocol*)arg;
+            // Closing the connection blocks, so leave it to the main loop
+            Application::GetInstance().Schedule([protocol]() {
+                protocol->DropStandby();
+            });
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "ws_standby",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&standby_timer_args, &standby_timer_);
+#endif
 }
 
 WebsocketProtocol::~WebsocketProtocol() {
+    if (standby_timer_ != nullptr) {
+        esp_timer_stop(standby_timer_);
+        esp_timer_delete(standby_timer_);
+    }
     vEventGroupDelete(event_group_handle_);
 }
 
 bool WebsocketProtocol::Start() {
-    // Only connect to server when audio channel is needed
+    // Only connect to server when audio channel is needed, or ahead of it in warm standby mode.
+    // A standby connection left from before a restart may use outdated settings
+    DropStandby();
+    WarmUp();
     return true;
 }
 
-bool WebsocketProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
-    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+std::shared_ptr<WebSocket> WebsocketProtocol::GetWebSocket() const {
+    std::lock_guard<std::mutex> lock(websocket_mutex_);
+    return websocket_;
+}
+
+void WebsocketProtocol::SetWebSocket(std::shared_ptr<WebSocket> websocket) {
+    std::shared_ptr<WebSocket> old_websocket;
+    {
+        std::lock_guard<std::mutex> lock(websocket_mutex_);
+        old_websocket = std::move(websocket_);
+        websocket_ = std::move(websocket);
+    }
+    // Closing the old connection blocks, and a sender may still hold it, so it is released outside the lock
+    old_websocket.reset();
+}
+
+bool WebsocketProtocol::SendAudio(AudioStreamPacketPtr packet) {
+    auto websocket = GetWebSocket();
+    if (websocket == nullptr || !websocket->IsConnected()) {
         return false;
     }
 
+    // Header and payload go out as one frame from a buffer that keeps its capacity, like control_frame_,
+    // so the packet is copied once and nothing is allocated after the first packets
+    auto& payload = packet->payload;
+    auto& frame = audio_frame_;
+    size_t header_size = version_ == 2 ? sizeof(BinaryProtocol2) : version_ == 3 ? sizeof(BinaryProtocol3) : 0;
+    frame.resize(header_size + payload.size());
     if (version_ == 2) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol2) + packet->payload.size());
-        auto bp2 = (BinaryProtocol2*)serialized.data();
+        auto bp2 = (BinaryProtocol2*)frame.data();
         bp2->version = htons(version_);
         bp2->type = 0;
         bp2->reserved = 0;
         bp2->timestamp = htonl(packet->timestamp);
-        bp2->payload_size = htonl(packet->payload.size());
-        memcpy(bp2->payload, packet->payload.data(), packet->payload.size());
-
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        bp2->payload_size = htonl(payload.size());
     } else if (version_ == 3) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol3) + packet->payload.size());
-        auto bp3 = (BinaryProtocol3*)serialized.data();
+        auto bp3 = (BinaryProtocol3*)frame.data();
         bp3->type = 0;
         bp3->reserved = 0;
-        bp3->payload_size = htons(packet->payload.size());
-        memcpy(bp3->payload, packet->payload.data(), packet->payload.size());
-
-        return websocket_->Send(serialized.data(), serialized.size(), true);
-    } else {
-        return websocket_->Send(packet->payload.data(), packet->payload.size(), true);
+        bp3->payload_size = htons(payload.size());
+    }
+    memcpy(frame.data() + header_size, payload.data(), payload.size());
+    if (!websocket->Send(frame.data(), frame.size(), true)) {
+        return false;
     }
+    RecordOutgoingAudio(frame.size());
+    tx_audio_packets_++;
+    return true;
 }
 
 bool WebsocketProtocol::SendText(const std::string& text) {
-    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+    auto websocket = GetWebSocket();
+    if (websocket == nullptr || !websocket->IsConnected()) {
         return false;
     }
 
-    if (!websocket_->Send(text)) {
+    if (!websocket->Send(text)) {
         ESP_LOGE(TAG, "Failed to send text: %s", text.c_str());
         SetError(Lang::Strings::SERVER_ERROR);
         return false;
@@ -71,15 +115,193 @@ bool WebsocketProtocol::SendText(const std::string& text) {
     return true;
 }
 
+bool WebsocketProtocol::SendBinaryControl(const std::string& data) {
+    auto websocket = GetWebSocket();
+    if (websocket == nullptr || !websocket->IsConnected()) {
+        return false;
+    }
+
+    auto& frame = control_frame_;
+    if (version_ == 2) {
+        frame.resize(sizeof(BinaryProtocol2));
+        auto bp2 = (BinaryProtocol2*)frame.data();
+        bp2->version = htons(version_);
+        bp2->type = htons(BINARY_PROTOCOL_TYPE_CONTROL);
+        bp2->reserved = 0;
+        bp2->timestamp = 0;
+        bp2->payload_size = htonl(data.size());
+    } else {
+        frame.resize(sizeof(BinaryProtocol3));
+        auto bp3 = (BinaryProtocol3*)frame.data();
+        bp3->type = BINARY_PROTOCOL_TYPE_CONTROL;
+        bp3->reserved = 0;
+        bp3->payload_size = htons(data.size());
+    }
+    frame.insert(frame.end(), data.begin(), data.end());
+    return websocket->Send(frame.data(), frame.size(), true);
+}
+
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+    // A warm standby connection is only handed over by OpenAudioChannel()
+    if (standby_) {
+        return false;
+    }
+    if (resuming_) {
+        return true;
+    }
+    auto websocket = GetWebSocket();
+    return websocket != nullptr && websocket->IsConnected() && !error_occurred_ && !IsTimeout();
 }
 
 void WebsocketProtocol::CloseAudioChannel() {
-    websocket_.reset();
+    // Stops a resume in progress, it gives up at its next attempt
+    bool was_resuming = resuming_.exchange(false);
+    bool was_opened = false;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        auto websocket = GetWebSocket();
+        was_opened = !standby_ && websocket != nullptr && websocket->IsConnected();
+        websocket.reset();
+        // The released connection is no longer current, so its OnDisconnected() leaves the callback to us, like MqttProtocol
+        closing_ = true;
+        SetWebSocket(nullptr);
+        standby_ = false;
+        closing_ = false;
+    }
+    if ((was_opened || was_resuming) && on_audio_channel_closed_ != nullptr) {
+        on_audio_channel_closed_();
+    }
+    WarmUp();
+}
+
+bool WebsocketProtocol::OpenAudioChannel(std::function<void()> on_hello_sent) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (standby_) {
+        esp_timer_stop(standby_timer_);
+        // The hello announces the frame duration and features, which may have changed since the warm up
+        auto websocket = GetWebSocket();
+        if (websocket != nullptr && websocket->IsConnected() && !error_occurred_ && GetHelloMessage() == hello_message_) {
+            ESP_LOGI(TAG, "Using the warm standby connection");
+            standby_ = false;
+            last_incoming_time_ = std::chrono::steady_clock::now();
+            if (on_audio_channel_opened_ != nullptr) {
+                on_audio_channel_opened_();
+            }
+            return true;
+        }
+        ESP_LOGI(TAG, "Warm standby connection is stale, reconnecting");
+        // Released while still marked as standby, so its disconnect is not taken for the end of a conversation
+        websocket.reset();
+        SetWebSocket(nullptr);
+        standby_ = false;
+    }
+
+    if (!Connect(on_hello_sent, true)) {
+        return false;
+    }
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+    return true;
+}
+
+void WebsocketProtocol::WarmUp() {
+#if CONFIG_WEBSOCKET_WARM_STANDBY
+    if (warming_up_.exchange(true)) {
+        return;
+    }
+    xTaskCreate([](void* arg) {
+        auto protocol = (WebsocketProtocol*)arg;
+        {
+            std::lock_guard<std::mutex> lock(protocol->channel_mutex_);
+            // Skip if the application opened the channel in the meantime
+            auto websocket = protocol->GetWebSocket();
+            bool connected = websocket != nullptr && websocket->IsConnected();
+            if (!connected && !protocol->standby_) {
+                protocol->standby_ = true;
+                if (protocol->Connect(nullptr, false)) {
+                    ESP_LOGI(TAG, "Warm standby connection ready");
+                    esp_timer_start_once(protocol->standby_timer_, CONFIG_WEBSOCKET_WARM_STANDBY_SECONDS * 1000000ULL);
+                } else {
+                    protocol->SetWebSocket(nullptr);
+                    protocol->standby_ = false;
+                }
+            }
+        }
+        protocol->warming_up_ = false;
+        vTaskDelete(NULL);
+    }, "ws_warm_up", 4096 * 2, this, 1, nullptr);
+#endif
+}
+
+void WebsocketProtocol::DropStandby() {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (standby_) {
+        ESP_LOGI(TAG, "Closing the idle warm standby connection");
+        esp_timer_stop(standby_timer_);
+        SetWebSocket(nullptr);
+        standby_ = false;
+    }
+}
+
+void WebsocketProtocol::Resume() {
+    if (resuming_.exchange(true)) {
+        return;
+    }
+    resume_session_id_ = session_id_;
+    xTaskCreate([](void* arg) {
+        auto protocol = (WebsocketProtocol*)arg;
+        protocol->ResumeTask();
+        vTaskDelete(NULL);
+    }, "ws_resume", 4096 * 2, this, 3, nullptr);
+}
+
+void WebsocketProtocol::ResumeTask() {
+    int64_t deadline = esp_timer_get_time() + CONFIG_WEBSOCKET_RESUME_SECONDS * 1000000LL;
+    int backoff_ms = WEBSOCKET_RESUME_MIN_BACKOFF_MS;
+    bool resumed = false;
+    bool rejected = false;
+    while (resuming_ && !resumed && !rejected && esp_timer_get_time() < deadline) {
+        {
+            std::lock_guard<std::mutex> lock(channel_mutex_);
+            if (!resuming_) {
+                break;
+            }
+            ESP_LOGI(TAG, "Resuming session %s", resume_session_id_.c_str());
+            if (Connect(nullptr, false)) {
+                resumed = session_id_ == resume_session_id_;
+                if (!resumed) {
+                    ESP_LOGW(TAG, "Server started a new session %s instead", session_id_.c_str());
+                    rejected = true;
+                    closing_ = true;
+                    SetWebSocket(nullptr);
+                    closing_ = false;
+                }
+            }
+        }
+        if (!resumed && !rejected) {
+            vTaskDelay(pdMS_TO_TICKS(backoff_ms));
+            backoff_ms = std::min(backoff_ms * 2, WEBSOCKET_RESUME_MAX_BACKOFF_MS);
+        }
+    }
+
+    if (!resuming_.exchange(false)) {
+        // Cancelled by CloseAudioChannel()
+        return;
+    }
+    if (resumed) {
+        ESP_LOGI(TAG, "Session %s resumed", session_id_.c_str());
+        last_incoming_time_ = std::chrono::steady_clock::now();
+        return;
+    }
+    ESP_LOGW(TAG, "Failed to resume session %s", resume_session_id_.c_str());
+    if (on_audio_channel_closed_ != nullptr) {
+        on_audio_channel_closed_();
+    }
+    WarmUp();
 }
 
-bool WebsocketProtocol::OpenAudioChannel() {
+bool WebsocketProtocol::Connect(const std::function<void()>& on_hello_sent, bool report_error) {
     Settings settings("websocket", false);
     std::string url = settings.GetString("url");
     std::string token = settings.GetString("token");
@@ -89,11 +311,19 @@ bool WebsocketProtocol::OpenAudioChannel() {
     }
 
     error_occurred_ = false;
+    session_id_.clear();
+    if (!resuming_) {
+        resume_supported_ = false;
+        rx_audio_packets_ = 0;
+        tx_audio_packets_ = 0;
+        last_rx_timestamp_ = 0;
+    }
 
     auto network = Board::GetInstance().GetNetwork();
-    websocket_ = network->CreateWebSocket(1);
-    if (websocket_ == nullptr) {
+    std::shared_ptr<WebSocket> websocket = network->CreateWebSocket(1);
+    if (websocket == nullptr) {
         ESP_LOGE(TAG, "Failed to create websocket");
+        SetWebSocket(nullptr);
         return false;
     }
 
@@ -102,100 +332,139 @@ bool WebsocketProtocol::OpenAudioChannel() {
         if (token.find(" ") == std::string::npos) {
             token = "Bearer " + token;
         }
-        websocket_->SetHeader("Authorization", token.c_str());
+        websocket->SetHeader("Authorization", token.c_str());
     }
-    websocket_->SetHeader("Protocol-Version", std::to_string(version_).c_str());
-    websocket_->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
-    websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
+    websocket->SetHeader("Protocol-Version", std::to_string(version_).c_str());
+    websocket->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
+    websocket->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
 
-    websocket_->OnData([this](const char* data, size_t len, bool binary) {
+    websocket->OnData([this](const char* data, size_t len, bool binary) {
         if (binary) {
-            if (on_incoming_audio_ != nullptr) {
-                if (version_ == 2) {
-                    BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
-                    bp2->version = ntohs(bp2->version);
-                    bp2->type = ntohs(bp2->type);
-                    bp2->timestamp = ntohl(bp2->timestamp);
-                    bp2->payload_size = ntohl(bp2->payload_size);
-                    auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    }));
-                } else if (version_ == 3) {
-                    BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
-                    bp3->type = bp3->type;
-                    bp3->payload_size = ntohs(bp3->payload_size);
-                    auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    }));
-                } else {
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
-                    }));
-                }
+            // Parse the header without touching the receive buffer, the payload is copied once into the pooled packet
+            size_t header_size = version_ == 2 ? sizeof(BinaryProtocol2) : version_ == 3 ? sizeof(BinaryProtocol3) : 0;
+            if (len < header_size) {
+                ESP_LOGE(TAG, "Invalid binary frame size: %u", len);
+                return;
+            }
+            size_t payload_size = len - header_size;
+            uint32_t timestamp = 0;
+            int type = BINARY_PROTOCOL_TYPE_OPUS;
+            if (version_ == 2) {
+                auto bp2 = (const BinaryProtocol2*)data;
+                type = ntohs(bp2->type);
+                payload_size = ntohl(bp2->payload_size);
+                timestamp = ntohl(bp2->timestamp);
+            } else if (version_ == 3) {
+                auto bp3 = (const BinaryProtocol3*)data;
+                type = bp3->type;
+                payload_size = ntohs(bp3->payload_size);
+            }
+            if (payload_size > len - header_size) {
+                ESP_LOGE(TAG, "Invalid binary frame size: %u", len);
+                return;
+            }
+            auto payload = (const uint8_t*)data + header_size;
+            if (standby_) {
+                // Not handed to the application yet
+            } else if (type == BINARY_PROTOCOL_TYPE_CONTROL) {
+                DispatchBinaryControl(payload, payload_size);
+            } else if (on_incoming_audio_ != nullptr) {
+                auto packet = AudioPool::GetInstance().AcquirePacket();
+                packet->origin_time_us = esp_timer_get_time();
+                packet->sample_rate = server_sample_rate_;
+                packet->frame_duration = server_frame_duration_;
+                packet->timestamp = timestamp;
+                packet->payload.assign(payload, payload + payload_size);
+                RecordIncomingAudio(0, packet->timestamp, len);
+                rx_audio_packets_++;
+                last_rx_timestamp_ = packet->timestamp;
+                on_incoming_audio_(std::move(packet));
             }
         } else {
-            // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (cJSON_IsString(type)) {
-                if (strcmp(type->valuestring, "hello") == 0) {
-                    ParseServerHello(root);
-                } else {
-                    if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
-                    }
-                }
-            } else {
-                ESP_LOGE(TAG, "Missing message type, data: %s", data);
+            // Routed without building a tree, only the rare server hello is parsed with cJSON
+            ControlMessage message;
+            if (!DecodeJson(data, len, message)) {
+                // Logged by DecodeJson()
+            } else if (message.type_name == "hello") {
+                auto root = cJSON_ParseWithLength(data, len);
+                ParseServerHello(root);
+                cJSON_Delete(root);
+            } else if (!standby_) {
+                DispatchControl(message);
             }
-            cJSON_Delete(root);
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
-    websocket_->OnDisconnected([this]() {
+    // Only compared with the current connection, a shared_ptr would keep the connection alive from its own callback
+    WebSocket* socket = websocket.get();
+    websocket->OnDisconnected([this, socket]() {
+        if (closing_ || GetWebSocket().get() != socket) {
+            // Released on purpose, or replaced by a newer connection
+            return;
+        }
+        if (standby_.exchange(false)) {
+            // Not in use yet, the next OpenAudioChannel() connects again
+            ESP_LOGI(TAG, "Warm standby connection closed by the server");
+            return;
+        }
         ESP_LOGI(TAG, "Websocket disconnected");
+        if (resuming_) {
+            // A failed resume attempt, ResumeTask() retries or gives up
+            return;
+        }
+#if CONFIG_WEBSOCKET_RESUME_SECONDS > 0
+        // A conversation that was cut off is resumed, one that went quiet is over
+        auto idle_time = std::chrono::steady_clock::now() - last_incoming_time_;
+        if (resume_supported_ && !session_id_.empty() && idle_time < std::chrono::seconds(CONFIG_WEBSOCKET_RESUME_SECONDS)) {
+            Resume();
+            return;
+        }
+#endif
         if (on_audio_channel_closed_ != nullptr) {
             on_audio_channel_closed_();
         }
+        WarmUp();
     });
 
+    // Published before connecting, so the previous connection is closed first
+    SetWebSocket(websocket);
     ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url.c_str(), version_);
-    if (!websocket_->Connect(url.c_str())) {
+    if (!websocket->Connect(url.c_str())) {
         ESP_LOGE(TAG, "Failed to connect to websocket server");
-        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        }
         return false;
     }
 
     // Send hello message to describe the client
-    auto message = GetHelloMessage();
-    if (!SendText(message)) {
+    xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
+    hello_message_ = GetHelloMessage();
+    auto hello_time = esp_timer_get_time();
+    if (!websocket->Send(hello_message_)) {
+        ESP_LOGE(TAG, "Failed to send hello");
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_ERROR);
+        }
         return false;
     }
 
+    // Binary audio needs nothing from the server hello, so it can follow the client hello right away
+    if (on_hello_sent) {
+        on_hello_sent();
+    }
+
     // Wait for server hello
     EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
     if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
         ESP_LOGE(TAG, "Failed to receive server hello");
-        SetError(Lang::Strings::SERVER_TIMEOUT);
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_TIMEOUT);
+        }
         return false;
     }
-
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
-    }
-
+    RecordServerHello((esp_timer_get_time() - hello_time) / 1000);
     return true;
 }
 
@@ -205,18 +474,28 @@ std::string WebsocketProtocol::GetHelloMessage() {
     cJSON_AddStringToObject(root, "type", "hello");
     cJSON_AddNumberToObject(root, "version", version_);
     cJSON* features = cJSON_CreateObject();
-#if CONFIG_USE_SERVER_AEC
-    cJSON_AddBoolToObject(features, "aec", true);
+    // Version 1 frames have no header to tell control messages from audio
+    AddHelloFeatures(features, version_ >= 2);
+#if CONFIG_WEBSOCKET_RESUME_SECONDS > 0
+    cJSON_AddBoolToObject(features, "resume", true);
 #endif
-    cJSON_AddBoolToObject(features, "mcp", true);
     cJSON_AddItemToObject(root, "features", features);
     cJSON_AddStringToObject(root, "transport", "websocket");
     cJSON* audio_params = cJSON_CreateObject();
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    cJSON_AddNumberToObject(audio_params, "frame_duration", client_frame_duration_);
     cJSON_AddItemToObject(root, "audio_params", audio_params);
+    if (resuming_) {
+        // Lets the server continue the session from where the client lost it
+        cJSON_AddStringToObject(root, "session_id", resume_session_id_.c_str());
+        cJSON* resume = cJSON_CreateObject();
+        cJSON_AddNumberToObject(resume, "received_packets", rx_audio_packets_);
+        cJSON_AddNumberToObject(resume, "last_timestamp", last_rx_timestamp_);
+        cJSON_AddNumberToObject(resume, "sent_packets", tx_audio_packets_);
+        cJSON_AddItemToObject(root, "resume", resume);
+    }
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
     cJSON_free(json_str);
@@ -236,6 +515,9 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         session_id_ = session_id->valuestring;
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
+    ParseHelloFeatures(root);
+    auto features = cJSON_GetObjectItem(root, "features");
+    resume_supported_ = cJSON_IsObject(features) && cJSON_IsTrue(cJSON_GetObjectItem(features, "resume"));
 
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
     if (cJSON_IsObject(audio_params)) {
@@ -7,8 +7,15 @@
 #include <web_socket.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <esp_timer.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
+#define WEBSOCKET_RESUME_MIN_BACKOFF_MS 250
+#define WEBSOCKET_RESUME_MAX_BACKOFF_MS 2000
 
 class WebsocketProtocol : public Protocol {
 public:
@@ -16,18 +23,54 @@ public:
     ~WebsocketProtocol();
 
     bool Start() override;
-    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
-    bool OpenAudioChannel() override;
+    bool SendAudio(AudioStreamPacketPtr packet) override;
+    bool OpenAudioChannel(std::function<void()> on_hello_sent = nullptr) override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
 
 private:
     EventGroupHandle_t event_group_handle_;
-    std::unique_ptr<WebSocket> websocket_;
+    // Replaced by the warm up and resume tasks, the senders take a reference with GetWebSocket()
+    std::shared_ptr<WebSocket> websocket_;
+    // Only held to swap or copy websocket_, never across a connect
+    mutable std::mutex websocket_mutex_;
     int version_ = 1;
 
+    // Serializes opening, closing and warming up the connection
+    std::mutex channel_mutex_;
+    // Connected and greeted in the background, but not handed to the application yet
+    std::atomic<bool> standby_{false};
+    std::atomic<bool> warming_up_{false};
+    // The client hello sent on the current connection
+    std::string hello_message_;
+    esp_timer_handle_t standby_timer_ = nullptr;
+
+    // Set while reconnecting to the same session after an unexpected disconnect
+    std::atomic<bool> resuming_{false};
+    std::atomic<bool> closing_{false};
+    // The server hello advertised that it can continue a session on a new connection
+    std::atomic<bool> resume_supported_{false};
+    std::string resume_session_id_;
+    // Audio packets of the current session, reported to the server when resuming
+    std::atomic<uint32_t> rx_audio_packets_{0};
+    std::atomic<uint32_t> tx_audio_packets_{0};
+    std::atomic<uint32_t> last_rx_timestamp_{0};
+
+    // Header and payload of the audio packet being sent, only used by the main loop
+    std::vector<uint8_t> audio_frame_;
+    // Header and payload of the binary control message being sent, guarded by Protocol::SendControl()
+    std::vector<uint8_t> control_frame_;
+
+    std::shared_ptr<WebSocket> GetWebSocket() const;
+    void SetWebSocket(std::shared_ptr<WebSocket> websocket);
+    bool Connect(const std::function<void()>& on_hello_sent, bool report_error);
+    void WarmUp();
+    void DropStandby();
+    void Resume();
+    void ResumeTask();
     void ParseServerHello(const cJSON* root);
     bool SendText(const std::string& text) override;
+    bool SendBinaryControl(const std::string& data) override;
     std::string GetHelloMessage();
 };
 
@@ -1,4 +1,5 @@
 #include "system_info.h"
+#include "audio_pool.h"
 
 #include <freertos/task.h>
 #include <esp_log.h>
@@ -141,5 +142,16 @@ void SystemInfo::PrintTaskList() {
 void SystemInfo::PrintHeapStats() {
     int free_sram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
     int min_free_sram = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
-    ESP_LOGI(TAG, "free sram: %u minimal sram: %u", free_sram, min_free_sram);
+    int largest_free_block = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
+    // Fragmentation: how much of the free SRAM is not usable as one contiguous block
+    int fragmentation = free_sram > 0 ? 100 - largest_free_block * 100 / free_sram : 0;
+    ESP_LOGI(TAG, "free sram: %u minimal sram: %u largest block: %u fragmentation: %d%%",
+        free_sram, min_free_sram, largest_free_block, fragmentation);
+
+    auto& pool = AudioPool::GetInstance();
+    auto packets = pool.GetPacketStats();
+    auto tasks = pool.GetTaskStats();
+    ESP_LOGI(TAG, "audio pool packets: %u/%u peak: %u fallback: %lu, tasks: %u/%u peak: %u fallback: %lu",
+        packets.in_use, packets.capacity, packets.peak_in_use, packets.fallback_allocations,
+        tasks.in_use, tasks.capacity, tasks.peak_in_use, tasks.fallback_allocations);
 }
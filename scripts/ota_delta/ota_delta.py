@@ -0,0 +1,256 @@
+#! /usr/bin/env python3
+# 生成和模拟应用差分升级补丁，格式见 main/ota_delta.h
+import argparse
+import hashlib
+import random
+import struct
+import sys
+
+MAGIC = b"XZDP"
+VERSION = 1
+HEADER_SIZE = 80
+OP_END = 0x00
+OP_COPY = 0x01
+OP_INSERT = 0x02
+# 与设备端 OTA_DELTA_COPY_BUFFER_SIZE 一致
+COPY_BUFFER_SIZE = 4096
+# 短于该长度的匹配不如直接插入划算
+MIN_MATCH = 16
+# 源固件索引的步长，步长越小匹配越多，内存占用也越大
+INDEX_STEP = 4
+
+
+def write_varint(out, value):
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return
+
+
+def build_index(source):
+    index = {}
+    for offset in range(0, len(source) - MIN_MATCH + 1, INDEX_STEP):
+        index.setdefault(source[offset:offset + MIN_MATCH], offset)
+    return index
+
+
+def match_length(source, source_offset, target, target_offset):
+    length = 0
+    limit = min(len(source) - source_offset, len(target) - target_offset)
+    # 先按块比较，再逐字节
+    while length + 256 <= limit and source[source_offset + length:source_offset + length + 256] == target[target_offset + length:target_offset + length + 256]:
+        length += 256
+    while length < limit and source[source_offset + length] == target[target_offset + length]:
+        length += 1
+    return length
+
+
+def diff(source, target):
+    index = build_index(source)
+    ops = []  # (OP_COPY, offset, length) 或 (OP_INSERT, start, end)
+    literal_start = 0
+    position = 0
+    # 上一次匹配后源固件中的位置，代码插入或删除后后续内容通常整体平移
+    next_source = None
+    while position + MIN_MATCH <= len(target):
+        best_offset, best_length = None, 0
+        if next_source is not None and next_source + MIN_MATCH <= len(source):
+            length = match_length(source, next_source, target, position)
+            if length >= MIN_MATCH:
+                best_offset, best_length = next_source, length
+        if best_offset is None:
+            offset = index.get(target[position:position + MIN_MATCH])
+            if offset is not None:
+                best_offset, best_length = offset, match_length(source, offset, target, position)
+        if best_length < MIN_MATCH:
+            position += 1
+            continue
+
+        # 向前扩展到尚未输出的字面量中
+        while position > literal_start and best_offset > 0 and source[best_offset - 1] == target[position - 1]:
+            position -= 1
+            best_offset -= 1
+            best_length += 1
+        if position > literal_start:
+            ops.append((OP_INSERT, literal_start, position))
+        ops.append((OP_COPY, best_offset, best_length))
+        position += best_length
+        literal_start = position
+        next_source = best_offset + best_length
+    if literal_start < len(target):
+        ops.append((OP_INSERT, literal_start, len(target)))
+
+    patch = bytearray(MAGIC)
+    patch += struct.pack("<B3xII", VERSION, len(source), len(target))
+    patch += hashlib.sha256(source).digest()
+    patch += hashlib.sha256(target).digest()
+    copied = 0
+    for op in ops:
+        patch.append(op[0])
+        if op[0] == OP_COPY:
+            write_varint(patch, op[1])
+            write_varint(patch, op[2])
+            copied += op[2]
+        else:
+            write_varint(patch, op[2] - op[1])
+            patch += target[op[1]:op[2]]
+    patch.append(OP_END)
+    return bytes(patch), copied
+
+
+class Patcher:
+    """与 OtaDeltaPatcher 相同的流式状态机，用于在主机上验证补丁"""
+
+    def __init__(self, source):
+        self.source = source
+        self.output = bytearray()
+        self.state = "header"
+        self.header = bytearray()
+
+    def fail(self, message):
+        raise ValueError(message)
+
+    def parse_header(self):
+        magic, version, source_size, target_size = struct.unpack_from("<4sB3xII", self.header)
+        if magic != MAGIC or version != VERSION:
+            self.fail("not a supported patch")
+        self.source_size, self.target_size = source_size, target_size
+        self.source_sha256 = bytes(self.header[16:48])
+        self.target_sha256 = bytes(self.header[48:80])
+        if source_size > len(self.source):
+            self.fail("patch source is larger than the source firmware")
+        if hashlib.sha256(self.source[:source_size]).digest() != self.source_sha256:
+            self.fail("source firmware does not match the patch")
+
+    def write(self, data):
+        position = 0
+        while position < len(data):
+            if self.state == "header":
+                length = min(len(data) - position, HEADER_SIZE - len(self.header))
+                self.header += data[position:position + length]
+                position += length
+                if len(self.header) == HEADER_SIZE:
+                    self.parse_header()
+                    self.state = "opcode"
+            elif self.state == "opcode":
+                self.opcode = data[position]
+                position += 1
+                if self.opcode == OP_END:
+                    self.state = "end"
+                elif self.opcode in (OP_COPY, OP_INSERT):
+                    self.operands = []
+                    self.operand = 0
+                    self.shift = 0
+                    self.state = "operand"
+                else:
+                    self.fail("unknown opcode 0x%02x" % self.opcode)
+            elif self.state == "operand":
+                byte = data[position]
+                position += 1
+                # The fifth byte holds the top 4 bits of a 32-bit operand and ends it
+                if self.shift == 28 and byte > 0x0F:
+                    self.fail("operand too large")
+                self.operand |= (byte & 0x7F) << self.shift
+                self.shift += 7
+                if byte & 0x80:
+                    continue
+                self.operands.append(self.operand)
+                self.operand = 0
+                self.shift = 0
+                if len(self.operands) == (2 if self.opcode == OP_COPY else 1):
+                    self.execute()
+            elif self.state == "insert":
+                length = min(len(data) - position, self.insert_remaining)
+                self.output += data[position:position + length]
+                position += length
+                self.insert_remaining -= length
+                if self.insert_remaining == 0:
+                    self.state = "opcode"
+            else:
+                self.fail("unexpected data after the end of the patch")
+
+    def execute(self):
+        remaining = self.target_size - len(self.output)
+        if self.opcode == OP_COPY:
+            offset, length = self.operands
+            if offset + length > self.source_size or length > remaining:
+                self.fail("copy out of range: %d+%d" % (offset, length))
+            # 设备端按拷贝缓冲区大小分段读取运行中的分区
+            while length > 0:
+                size = min(length, COPY_BUFFER_SIZE)
+                self.output += self.source[offset:offset + size]
+                offset += size
+                length -= size
+            self.state = "opcode"
+        else:
+            self.insert_remaining = self.operands[0]
+            if self.insert_remaining > remaining:
+                self.fail("insert out of range: %d" % self.insert_remaining)
+            self.state = "insert" if self.insert_remaining else "opcode"
+
+    def finish(self):
+        if self.state != "end" or len(self.output) != self.target_size:
+            self.fail("patch is incomplete, produced %d/%d bytes" % (len(self.output), self.target_size))
+        if hashlib.sha256(self.output).digest() != self.target_sha256:
+            self.fail("target SHA-256 mismatch")
+        return bytes(self.output)
+
+
+def apply(source, patch, seed=None):
+    # 以随机大小的分块输入补丁，模拟网络下载中的任意切分
+    rng = random.Random(seed)
+    patcher = Patcher(source)
+    position = 0
+    while position < len(patch):
+        size = rng.randint(1, 32 * 1024)
+        patcher.write(patch[position:position + size])
+        position += size
+    return patcher.finish()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Xiaozhi delta OTA patch tool")
+    subparsers = parser.add_subparsers(dest="command", required=True)
+    diff_parser = subparsers.add_parser("diff", help="generate a patch from the old to the new firmware")
+    diff_parser.add_argument("old")
+    diff_parser.add_argument("new")
+    diff_parser.add_argument("patch")
+    apply_parser = subparsers.add_parser("apply", help="apply a patch the way the device does")
+    apply_parser.add_argument("old")
+    apply_parser.add_argument("patch")
+    apply_parser.add_argument("output", nargs="?")
+    apply_parser.add_argument("--seed", type=int, help="seed of the random patch chunking")
+    args = parser.parse_args()
+
+    with open(args.old, "rb") as f:
+        source = f.read()
+    if args.command == "diff":
+        with open(args.new, "rb") as f:
+            target = f.read()
+        patch, copied = diff(source, target)
+        # 生成后立即按设备流程验证一次
+        apply(source, patch)
+        with open(args.patch, "wb") as f:
+            f.write(patch)
+        print("Patch: %d bytes (%.1f%% of %d), copied %d bytes from the old firmware" % (
+            len(patch), len(patch) * 100 / max(len(target), 1), len(target), copied))
+    else:
+        with open(args.patch, "rb") as f:
+            patch = f.read()
+        try:
+            output = apply(source, patch, args.seed)
+        except ValueError as e:
+            print("Failed to apply patch: %s" % e, file=sys.stderr)
+            sys.exit(1)
+        print("Patch applied, %d bytes, SHA-256 %s" % (len(output), hashlib.sha256(output).hexdigest()))
+        if args.output:
+            with open(args.output, "wb") as f:
+                f.write(output)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,202 @@
+import argparse
+import asyncio
+import json
+import struct
+import uuid
+
+import websockets
+
+
+'''
+  Local stand-in for the chat server, used to test WebSocket session resume.
+  The audio sent while listening is played back as TTS. During playback the
+  connection can be dropped on purpose, and a client that comes back with the
+  same session_id continues the playback from the last packet it received.
+'''
+
+
+class Session:
+    def __init__(self, session_id, frame_duration):
+        self.id = session_id
+        self.frame_duration = frame_duration
+        self.ws = None
+        self.version = 1
+        self.connected = asyncio.Event()
+        self.listening = False
+        self.uplink = []
+        # Downlink audio packets sent since the session started, as counted by the client
+        self.sent = 0
+        self.tts_base = 0
+        self.tts_position = 0
+        self.tts_task = None
+        self.dropped = False
+
+    def attach(self, ws, version):
+        self.ws = ws
+        self.version = version
+        self.connected.set()
+
+    def detach(self, ws):
+        if self.ws is ws:
+            self.ws = None
+            self.connected.clear()
+
+
+def pack_audio(version, payload, timestamp):
+    if version == 2:
+        return struct.pack('>HHIII', 2, 0, 0, timestamp, len(payload)) + payload
+    if version == 3:
+        return struct.pack('>BBH', 0, 0, len(payload)) + payload
+    return payload
+
+
+def unpack_audio(version, data):
+    if version == 2:
+        _, type, _, _, size = struct.unpack_from('>HHIII', data)
+        return type, data[16:16 + size]
+    if version == 3:
+        type, _, size = struct.unpack_from('>BBH', data)
+        return type, data[4:4 + size]
+    return 0, data
+
+
+class StandInServer:
+    def __init__(self, args):
+        self.args = args
+        self.sessions = {}
+
+    async def send_json(self, session, message):
+        await session.ws.send(json.dumps(message, ensure_ascii=False))
+
+    def drop(self, session):
+        print(f"[{session.id}] Dropping the connection after {session.tts_position} packets")
+        session.dropped = True
+        ws = session.ws
+        session.detach(ws)
+        # Abort without a close frame, like a lost link
+        ws.transport.abort()
+
+    async def play(self, session):
+        packets = session.uplink
+        session.uplink = []
+        session.tts_base = session.sent
+        session.tts_position = 0
+        await self.send_json(session, {"session_id": session.id, "type": "stt", "text": f"回放 {len(packets)} 个音频包"})
+        await self.send_json(session, {"session_id": session.id, "type": "tts", "state": "start"})
+        while session.tts_position < len(packets):
+            if session.ws is None:
+                try:
+                    await asyncio.wait_for(session.connected.wait(), self.args.window)
+                except asyncio.TimeoutError:
+                    print(f"[{session.id}] Client did not come back, playback abandoned")
+                    return
+                continue
+            if self.args.drop_after > 0 and not session.dropped and session.tts_position == self.args.drop_after:
+                self.drop(session)
+                continue
+            payload = packets[session.tts_position]
+            timestamp = session.tts_position * session.frame_duration
+            try:
+                await session.ws.send(pack_audio(session.version, payload, timestamp))
+            except websockets.ConnectionClosed:
+                session.detach(session.ws)
+                continue
+            session.tts_position += 1
+            session.sent += 1
+            await asyncio.sleep(session.frame_duration / 1000)
+        await self.send_json(session, {"session_id": session.id, "type": "tts", "state": "stop"})
+        print(f"[{session.id}] Played back {len(packets)} packets")
+
+    def start_playback(self, session):
+        session.listening = False
+        if session.tts_task is None or session.tts_task.done():
+            session.tts_task = asyncio.create_task(self.play(session))
+
+    async def stop_listening_later(self, session):
+        await asyncio.sleep(self.args.listen_seconds)
+        if session.listening:
+            self.start_playback(session)
+
+    def open_session(self, hello):
+        audio_params = hello.get("audio_params", {})
+        frame_duration = audio_params.get("frame_duration", 60)
+        resume = hello.get("resume")
+        session = self.sessions.get(hello.get("session_id"))
+        if self.args.resume and resume is not None and session is not None:
+            # Continue from the first packet the client did not get
+            session.tts_position = max(0, resume.get("received_packets", 0) - session.tts_base)
+            session.sent = session.tts_base + session.tts_position
+            print(f"[{session.id}] Resumed, client received {resume.get('received_packets')} "
+                  f"and sent {resume.get('sent_packets')} packets")
+            return session, True
+        session = Session(uuid.uuid4().hex[:8], frame_duration)
+        self.sessions[session.id] = session
+        print(f"[{session.id}] New session, frame duration {frame_duration} ms")
+        return session, False
+
+    async def handler(self, ws):
+        headers = ws.request.headers if hasattr(ws, "request") else ws.request_headers
+        version = int(headers.get("Protocol-Version", "1"))
+        try:
+            hello = json.loads(await ws.recv())
+        except (websockets.ConnectionClosed, ValueError):
+            return
+        if hello.get("type") != "hello":
+            return
+
+        session, resumed = self.open_session(hello)
+        session.attach(ws, version)
+        await self.send_json(session, {
+            "type": "hello",
+            "transport": "websocket",
+            "session_id": session.id,
+            "features": {"resume": self.args.resume},
+            "audio_params": {"format": "opus", "sample_rate": 16000, "channels": 1,
+                             "frame_duration": session.frame_duration},
+        })
+
+        try:
+            async for message in ws:
+                if isinstance(message, bytes):
+                    type, payload = unpack_audio(version, message)
+                    if type == 0 and session.listening:
+                        session.uplink.append(payload)
+                    continue
+                message = json.loads(message)
+                if message.get("type") != "listen":
+                    print(f"[{session.id}] {message}")
+                    continue
+                state = message.get("state")
+                if state == "start":
+                    session.listening = True
+                    session.uplink = []
+                    if message.get("mode") != "manual":
+                        asyncio.create_task(self.stop_listening_later(session))
+                elif state == "stop" and session.listening:
+                    self.start_playback(session)
+        except websockets.ConnectionClosed:
+            pass
+        finally:
+            session.detach(ws)
+            print(f"[{session.id}] Disconnected")
+
+
+async def main(args):
+    server = StandInServer(args)
+    async with websockets.serve(server.handler, args.host, args.port, max_size=None):
+        print(f"Listening on ws://{args.host}:{args.port}/, resume {'on' if args.resume else 'off'}")
+        await asyncio.Future()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="WebSocket stand-in server for forced disconnect tests")
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--drop-after", type=int, default=25,
+                        help="drop the connection once per session after this many TTS packets, 0 to never drop")
+    parser.add_argument("--window", type=float, default=10, help="seconds to wait for the client to come back")
+    parser.add_argument("--listen-seconds", type=float, default=3,
+                        help="length of the recording in auto listening mode")
+    parser.add_argument("--no-resume", dest="resume", action="store_false",
+                        help="do not advertise resume, every reconnect starts a new session")
+    asyncio.run(main(parser.parse_args()))
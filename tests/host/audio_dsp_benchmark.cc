@@ -0,0 +1,298 @@
+/*
+ * Checks the AudioDsp kernels against the scalar loops they replaced, then times both.
+ *
+ * Gain, interleave, deinterleave, channel extract and downmix must match the reference loops bit for bit.
+ * Narrowing differs in one documented case: the old loop clamped to -INT16_MAX (-32767), AudioDsp clamps
+ * to INT16_MIN (-32768), so inputs at or below -32768 after the shift come out one LSB lower.
+ *
+ * Times are per 60 ms frame at the sizes the I2S paths use. On x86 the TSC ticks per sample are printed
+ * as well, they run at the nominal clock rather than the core clock but compare the two loops fairly.
+ *
+ * Exits with 1 on any other mismatch.
+ */
+#include "audio_dsp.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_TSC 1
+#else
+#define HAS_TSC 0
+#endif
+
+// 60 ms frames: 24 kHz mono output, 16 kHz stereo input with the reference channel
+#define OUTPUT_SAMPLES 1440
+#define INPUT_FRAMES 960
+// NoAudioCodec reads 32 bit I2S words holding 20 significant bits
+#define NARROW_SHIFT 12
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+// The loops removed from NoAudioCodec and AudioService, not inlined or specialized so they are called like the AudioDsp kernels
+namespace reference {
+
+static int32_t VolumeToGain(int volume) {
+    return pow(double(volume) / 100.0, 2) * 65536;
+}
+
+__attribute__((noipa)) static void ApplyGain16To32(const int16_t* data, int32_t* buffer, int samples, int32_t volume_factor) {
+    for (int i = 0; i < samples; i++) {
+        int64_t temp = int64_t(data[i]) * volume_factor;
+        if (temp > INT32_MAX) {
+            buffer[i] = INT32_MAX;
+        } else if (temp < INT32_MIN) {
+            buffer[i] = INT32_MIN;
+        } else {
+            buffer[i] = static_cast<int32_t>(temp);
+        }
+    }
+}
+
+__attribute__((noipa)) static void Narrow32To16(const int32_t* bit32_buffer, int16_t* dest, int samples, int shift) {
+    for (int i = 0; i < samples; i++) {
+        int32_t value = bit32_buffer[i] >> shift;
+        dest[i] = (value > INT16_MAX) ? INT16_MAX : (value < -INT16_MAX) ? -INT16_MAX : (int16_t)value;
+    }
+}
+
+__attribute__((noipa)) static void Deinterleave(const int16_t* data, int16_t* mic, int16_t* reference, int frames) {
+    for (int i = 0, j = 0; i < frames; ++i, j += 2) {
+        mic[i] = data[j];
+        reference[i] = data[j + 1];
+    }
+}
+
+__attribute__((noipa)) static void Interleave(const int16_t* mic, const int16_t* reference, int16_t* data, int frames) {
+    for (int i = 0, j = 0; i < frames; ++i, j += 2) {
+        data[j] = mic[i];
+        data[j + 1] = reference[i];
+    }
+}
+
+__attribute__((noipa)) static void ExtractChannel(const int16_t* data, int16_t* mono, int frames, int channels, int channel) {
+    for (int i = 0; i < frames; i++) {
+        mono[i] = data[i * channels + channel];
+    }
+}
+
+// No loop was replaced here, this is the plain definition: the average rounded down
+__attribute__((noipa)) static void DownmixStereo(const int16_t* data, int16_t* mono, int frames) {
+    for (int i = 0; i < frames; i++) {
+        mono[i] = std::floor((data[2 * i] + data[2 * i + 1]) / 2.0);
+    }
+}
+
+} // namespace reference
+
+static std::mt19937 random_engine(1);
+
+static std::vector<int16_t> RandomPcm(size_t samples) {
+    std::uniform_int_distribution<int> distribution(INT16_MIN, INT16_MAX);
+    std::vector<int16_t> pcm(samples);
+    for (auto& sample : pcm) {
+        sample = distribution(random_engine);
+    }
+    // Keep the extremes in every buffer
+    pcm[0] = INT16_MIN;
+    pcm[1] = INT16_MAX;
+    pcm[2] = -1;
+    return pcm;
+}
+
+static void CheckGain() {
+    // Every int16 value at every volume step
+    std::vector<int16_t> in(65536);
+    for (int i = 0; i < 65536; i++) {
+        in[i] = i + INT16_MIN;
+    }
+    std::vector<int32_t> out(in.size()), expected(in.size());
+    for (int volume = 0; volume <= 100; volume++) {
+        int32_t gain = AudioDsp::VolumeToGain(volume);
+        CHECK(gain == reference::VolumeToGain(volume));
+        AudioDsp::ApplyGain16To32(in.data(), out.data(), in.size(), gain);
+        reference::ApplyGain16To32(in.data(), expected.data(), in.size(), gain);
+        CHECK(out == expected);
+    }
+    CHECK(AudioDsp::VolumeToGain(-1) == 0);
+    CHECK(AudioDsp::VolumeToGain(101) == 65536);
+}
+
+static void CheckNarrow() {
+    std::uniform_int_distribution<int32_t> distribution(INT32_MIN, INT32_MAX);
+    std::vector<int32_t> in(1 << 20);
+    for (auto& sample : in) {
+        sample = distribution(random_engine);
+    }
+    // The clamp boundaries and the tail after the unrolled loop
+    const int32_t edges[] = {INT32_MIN, INT32_MAX, 0, -1, 32767 << NARROW_SHIFT, 32768 << NARROW_SHIFT,
+        -32767 * (1 << NARROW_SHIFT), -32768 * (1 << NARROW_SHIFT), -32769 * (1 << NARROW_SHIFT)};
+    for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+        in[in.size() - 1 - i] = edges[i];
+    }
+
+    for (int shift = 0; shift <= 16; shift += 4) {
+        std::vector<int16_t> out(in.size()), expected(in.size());
+        AudioDsp::Narrow32To16(in.data(), out.data(), in.size(), shift);
+        reference::Narrow32To16(in.data(), expected.data(), in.size(), shift);
+        size_t saturated_low = 0;
+        for (size_t i = 0; i < in.size(); i++) {
+            if ((in[i] >> shift) <= INT16_MIN) {
+                // The documented difference, one LSB further down at full negative scale
+                saturated_low++;
+                CHECK(out[i] == INT16_MIN && expected[i] == -INT16_MAX);
+            } else if (out[i] != expected[i]) {
+                printf("FAILED narrow shift %d: %ld -> %d, expected %d\n", shift, (long)in[i], out[i], expected[i]);
+                failures++;
+                break;
+            }
+        }
+        if (shift == NARROW_SHIFT) {
+            printf("narrow: %zu of %zu samples saturate to INT16_MIN instead of -INT16_MAX, all others match\n",
+                saturated_low, in.size());
+        }
+    }
+}
+
+static void CheckChannels() {
+    // An odd frame count exercises the tails
+    const int frames = INPUT_FRAMES + 3;
+    auto stereo = RandomPcm(frames * 2);
+    std::vector<int16_t> left(frames), right(frames), expected_left(frames), expected_right(frames);
+    AudioDsp::Deinterleave(stereo.data(), left.data(), right.data(), frames);
+    reference::Deinterleave(stereo.data(), expected_left.data(), expected_right.data(), frames);
+    CHECK(left == expected_left && right == expected_right);
+
+    std::vector<int16_t> merged(frames * 2);
+    AudioDsp::Interleave(left.data(), right.data(), merged.data(), frames);
+    CHECK(merged == stereo);
+
+    for (int channels = 1; channels <= 4; channels++) {
+        auto interleaved = RandomPcm(frames * channels);
+        for (int channel = 0; channel < channels; channel++) {
+            std::vector<int16_t> out(frames), expected(frames);
+            AudioDsp::ExtractChannel(interleaved.data(), out.data(), frames, channels, channel);
+            reference::ExtractChannel(interleaved.data(), expected.data(), frames, channels, channel);
+            CHECK(out == expected);
+
+            // In place, as the audio testing path does
+            auto in_place = interleaved;
+            AudioDsp::ExtractChannel(in_place.data(), in_place.data(), frames, channels, channel);
+            CHECK(std::equal(expected.begin(), expected.end(), in_place.begin()));
+        }
+    }
+
+    std::vector<int16_t> mono(frames), expected_mono(frames);
+    AudioDsp::DownmixStereo(stereo.data(), mono.data(), frames);
+    reference::DownmixStereo(stereo.data(), expected_mono.data(), frames);
+    CHECK(mono == expected_mono);
+    auto in_place = stereo;
+    AudioDsp::DownmixStereo(in_place.data(), in_place.data(), frames);
+    CHECK(std::equal(expected_mono.begin(), expected_mono.end(), in_place.begin()));
+}
+
+struct Timing {
+    double ns;
+    double ticks;
+};
+
+template <typename Function>
+static Timing Time(int iterations, Function&& function) {
+    // Warm the caches and the branch predictors first
+    for (int i = 0; i < iterations / 10 + 1; i++) {
+        function();
+    }
+#if HAS_TSC
+    uint64_t start_ticks = __rdtsc();
+#endif
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        function();
+        asm volatile("" ::: "memory");
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    Timing timing;
+    timing.ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+#if HAS_TSC
+    timing.ticks = double(__rdtsc() - start_ticks) / iterations;
+#else
+    timing.ticks = 0;
+#endif
+    return timing;
+}
+
+static void Report(const char* name, int samples, Timing kernel, Timing reference) {
+    printf("%-16s %5d samples  AudioDsp %8.0f ns/frame", name, samples, kernel.ns);
+    if (HAS_TSC) {
+        printf(" %5.2f ticks/sample", kernel.ticks / samples);
+    }
+    printf("  reference %8.0f ns/frame", reference.ns);
+    if (HAS_TSC) {
+        printf(" %5.2f ticks/sample", reference.ticks / samples);
+    }
+    printf("  %.2fx\n", reference.ns / kernel.ns);
+}
+
+static void Benchmark(int iterations) {
+    auto pcm = RandomPcm(OUTPUT_SAMPLES);
+    std::vector<int32_t> wide(OUTPUT_SAMPLES);
+    int32_t gain = AudioDsp::VolumeToGain(70);
+    Report("gain", OUTPUT_SAMPLES,
+        Time(iterations, [&]() { AudioDsp::ApplyGain16To32(pcm.data(), wide.data(), OUTPUT_SAMPLES, gain); }),
+        Time(iterations, [&]() { reference::ApplyGain16To32(pcm.data(), wide.data(), OUTPUT_SAMPLES, gain); }));
+
+    std::vector<int16_t> narrow(OUTPUT_SAMPLES);
+    Report("narrow", OUTPUT_SAMPLES,
+        Time(iterations, [&]() { AudioDsp::Narrow32To16(wide.data(), narrow.data(), OUTPUT_SAMPLES, NARROW_SHIFT); }),
+        Time(iterations, [&]() { reference::Narrow32To16(wide.data(), narrow.data(), OUTPUT_SAMPLES, NARROW_SHIFT); }));
+
+    auto stereo = RandomPcm(INPUT_FRAMES * 2);
+    std::vector<int16_t> left(INPUT_FRAMES), right(INPUT_FRAMES);
+    Report("deinterleave", INPUT_FRAMES * 2,
+        Time(iterations, [&]() { AudioDsp::Deinterleave(stereo.data(), left.data(), right.data(), INPUT_FRAMES); }),
+        Time(iterations, [&]() { reference::Deinterleave(stereo.data(), left.data(), right.data(), INPUT_FRAMES); }));
+    Report("interleave", INPUT_FRAMES * 2,
+        Time(iterations, [&]() { AudioDsp::Interleave(left.data(), right.data(), stereo.data(), INPUT_FRAMES); }),
+        Time(iterations, [&]() { reference::Interleave(left.data(), right.data(), stereo.data(), INPUT_FRAMES); }));
+    Report("extract channel", INPUT_FRAMES * 2,
+        Time(iterations, [&]() { AudioDsp::ExtractChannel(stereo.data(), left.data(), INPUT_FRAMES, 2, 0); }),
+        Time(iterations, [&]() { reference::ExtractChannel(stereo.data(), left.data(), INPUT_FRAMES, 2, 0); }));
+    Report("downmix", INPUT_FRAMES * 2,
+        Time(iterations, [&]() { AudioDsp::DownmixStereo(stereo.data(), left.data(), INPUT_FRAMES); }),
+        Time(iterations, [&]() { reference::DownmixStereo(stereo.data(), left.data(), INPUT_FRAMES); }));
+}
+
+int main(int argc, char** argv) {
+    int iterations = 20000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [--iterations N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    CheckGain();
+    CheckNarrow();
+    CheckChannels();
+    Benchmark(iterations);
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
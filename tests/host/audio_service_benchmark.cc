@@ -0,0 +1,337 @@
+/*
+ * Runs AudioService on the host with NoAudioProcessor and WavFileAudioCodec, and reports:
+ *
+ * - uplink throughput: a WAV file is read and encoded as fast as the encoder allows
+ * - uplink latency and send queue depth: the same input paced like an I2S microphone
+ * - downlink latency: Opus packets pushed every 60 ms like a server, played to a WAV file
+ *
+ * Exits with 1 if frames are lost, the pipeline falls behind realtime or the uplink allocates per frame.
+ */
+#include "audio_service.h"
+#include "audio_pool.h"
+#include "audio_latency.h"
+#include "codecs/wav_file_audio_codec.h"
+#include "board.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <opus_encoder.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#define TAG "Benchmark"
+
+// Counts heap allocations of every thread, to check the pipeline does not allocate per frame
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+#define SERVER_SAMPLE_RATE 24000
+#define SERVER_FRAME_DURATION_MS 60
+
+class BenchmarkBoard : public Board {
+public:
+    AudioCodec* codec = nullptr;
+    AudioCodec* GetAudioCodec() override { return codec; }
+};
+
+DECLARE_BOARD(BenchmarkBoard);
+
+static BenchmarkBoard& GetBoard() {
+    return static_cast<BenchmarkBoard&>(Board::GetInstance());
+}
+
+// Voiced syllables at 4 Hz with a pause every two seconds, so DTX and the silence paths are exercised
+static void GenerateSpeech(std::vector<int16_t>& pcm, int sample_rate, int seconds) {
+    pcm.resize(sample_rate * seconds);
+    uint32_t noise = 1;
+    double phase = 0;
+    for (size_t i = 0; i < pcm.size(); i++) {
+        double t = (double)i / sample_rate;
+        double f0 = 140 + 30 * sin(2 * M_PI * 0.5 * t);
+        phase += 2 * M_PI * f0 / sample_rate;
+        double envelope = fmod(t, 2.0) < 1.6 ? std::max(0.0, sin(2 * M_PI * 4 * t)) : 0;
+        double voice = 0;
+        for (int k = 1; k <= 8; k++) {
+            voice += sin(k * phase) / k;
+        }
+        noise = noise * 1664525 + 1013904223;
+        double hiss = ((int32_t)noise >> 16) / 32768.0;
+        pcm[i] = (int16_t)(6000 * envelope * voice + 30 * hiss);
+    }
+}
+
+static bool WriteWav(const std::string& path, const std::vector<int16_t>& pcm, int sample_rate) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    uint32_t data_size = pcm.size() * sizeof(int16_t);
+    uint32_t riff_size = 36 + data_size;
+    uint32_t fmt_size = 16;
+    uint16_t format = 1;
+    uint16_t channels = 1;
+    uint32_t byte_rate = sample_rate * sizeof(int16_t);
+    uint16_t block_align = sizeof(int16_t);
+    uint16_t bits = 16;
+    // The host is little endian like the WAV format
+    fwrite("RIFF", 1, 4, file);
+    fwrite(&riff_size, 4, 1, file);
+    fwrite("WAVEfmt ", 1, 8, file);
+    fwrite(&fmt_size, 4, 1, file);
+    fwrite(&format, 2, 1, file);
+    fwrite(&channels, 2, 1, file);
+    fwrite(&sample_rate, 4, 1, file);
+    fwrite(&byte_rate, 4, 1, file);
+    fwrite(&block_align, 2, 1, file);
+    fwrite(&bits, 2, 1, file);
+    fwrite("data", 1, 4, file);
+    fwrite(&data_size, 4, 1, file);
+    fwrite(pcm.data(), sizeof(int16_t), pcm.size(), file);
+    fclose(file);
+    return true;
+}
+
+// Signalled by AudioService when packets are ready, like the main loop of Application
+struct SendQueueWaiter {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool available = false;
+
+    void Notify() {
+        std::lock_guard<std::mutex> lock(mutex);
+        available = true;
+        cv.notify_one();
+    }
+
+    void Wait(int timeout_ms) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]() { return available; });
+        available = false;
+    }
+};
+
+// The services are never destroyed, their tasks run until the process exits
+static AudioService* CreateService(AudioCodec* codec, SendQueueWaiter* waiter) {
+    GetBoard().codec = codec;
+    auto service = new AudioService();
+    service->Initialize(codec);
+    AudioServiceCallbacks callbacks;
+    callbacks.on_send_queue_available = [waiter]() {
+        waiter->Notify();
+    };
+    service->SetCallbacks(callbacks);
+    service->Start();
+    return service;
+}
+
+struct UplinkResult {
+    int frames = 0;
+    size_t bytes = 0;
+    size_t max_queue = 0;
+    double seconds = 0;
+    // Heap allocations per frame once the buffers have grown, -1 if too few frames
+    double allocations_per_frame = -1;
+};
+
+// Frames before the allocation count starts, the pools and scratch buffers grow on first use
+#define WARMUP_FRAMES 10
+
+// Collects the given number of frames from the send queue, false if the pipeline stalls
+static bool RunUplink(AudioCodec* codec, int expected_frames, UplinkResult& result) {
+    static SendQueueWaiter waiter;
+    auto service = CreateService(codec, &waiter);
+    int64_t start_us = esp_timer_get_time();
+    int64_t last_frame_us = start_us;
+    service->EnableVoiceProcessing(true);
+
+    uint64_t warm_allocations = 0;
+    while (result.frames < expected_frames) {
+        waiter.Wait(100);
+        result.max_queue = std::max(result.max_queue, service->GetSendQueueSize());
+        while (auto packet = service->PopPacketFromSendQueue()) {
+            if (++result.frames == WARMUP_FRAMES) {
+                warm_allocations = allocations.load();
+            }
+            result.bytes += packet->payload.size();
+            last_frame_us = esp_timer_get_time();
+        }
+        if (esp_timer_get_time() - last_frame_us > 5000000) {
+            ESP_LOGE(TAG, "Uplink stalled after %d of %d frames", result.frames, expected_frames);
+            break;
+        }
+    }
+    result.seconds = (last_frame_us - start_us) / 1000000.0;
+    if (result.frames > WARMUP_FRAMES) {
+        result.allocations_per_frame = double(allocations.load() - warm_allocations) / (result.frames - WARMUP_FRAMES);
+    }
+    service->EnableVoiceProcessing(false);
+    service->Stop();
+    return result.frames >= expected_frames;
+}
+
+struct DownlinkResult {
+    int pushed = 0;
+    int dropped = 0;
+    uint32_t played = 0;
+    JitterBufferStats jitter;
+};
+
+// Pushes the packets at the pace of a server and waits for the playback to finish
+static void RunDownlink(AudioCodec* codec, const std::vector<std::vector<uint8_t>>& packets, DownlinkResult& result) {
+    static SendQueueWaiter waiter;
+    auto service = CreateService(codec, &waiter);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < packets.size(); i++) {
+        std::this_thread::sleep_until(start + std::chrono::milliseconds(i * SERVER_FRAME_DURATION_MS));
+        auto packet = AudioPool::GetInstance().AcquirePacket();
+        packet->sample_rate = SERVER_SAMPLE_RATE;
+        packet->frame_duration = SERVER_FRAME_DURATION_MS;
+        packet->timestamp = i * SERVER_FRAME_DURATION_MS;
+        packet->sequence = i + 1;
+        packet->origin_time_us = esp_timer_get_time();
+        packet->payload = packets[i];
+        result.pushed++;
+        if (!service->PushPacketToDecodeQueue(std::move(packet))) {
+            result.dropped++;
+        }
+    }
+
+    int64_t deadline_us = esp_timer_get_time() + 5000000;
+    while (!service->IsIdle() && esp_timer_get_time() < deadline_us) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    // Let the output task write the last frame
+    vTaskDelay(pdMS_TO_TICKS(200));
+    result.jitter = service->GetJitterBufferStats();
+    service->Stop();
+}
+
+static void PrintLatency(const char* pass) {
+    printf("%s latency: %s\n", pass, AudioLatency::GetInstance().GetStatsJson().c_str());
+}
+
+static void PrintPool() {
+    auto packets = AudioPool::GetInstance().GetPacketStats();
+    auto tasks = AudioPool::GetInstance().GetTaskStats();
+    printf("audio pool: packets peak %zu of %zu, heap fallbacks %u; tasks peak %zu of %zu, heap fallbacks %u\n",
+        packets.peak_in_use, packets.capacity, packets.fallback_allocations,
+        tasks.peak_in_use, tasks.capacity, tasks.fallback_allocations);
+}
+
+int main(int argc, char* argv[]) {
+    int seconds = 10;
+    std::string output_dir = ".";
+    bool verbose = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output-dir") == 0 && i + 1 < argc) {
+            output_dir = argv[++i];
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--seconds N] [--output-dir DIR] [--verbose]\n", argv[0]);
+            return 2;
+        }
+    }
+    esp_log_level_set("*", verbose ? ESP_LOG_INFO : ESP_LOG_WARN);
+
+    std::vector<int16_t> speech;
+    GenerateSpeech(speech, 16000, seconds);
+    std::string input_path = output_dir + "/uplink_input.wav";
+    if (!WriteWav(input_path, speech, 16000)) {
+        fprintf(stderr, "Failed to write %s\n", input_path.c_str());
+        return 2;
+    }
+    int expected_frames = seconds * 1000 / OPUS_FRAME_DURATION_MS;
+    bool ok = true;
+
+    /* Uplink throughput: the codec returns the input as fast as it is read */
+    UplinkResult throughput;
+    auto fast_codec = new WavFileAudioCodec(input_path, "", SERVER_SAMPLE_RATE, false);
+    AudioLatency::GetInstance().Reset();
+    if (!RunUplink(fast_codec, expected_frames, throughput)) {
+        ok = false;
+    }
+    double audio_seconds = throughput.frames * OPUS_FRAME_DURATION_MS / 1000.0;
+    double speed = throughput.seconds > 0 ? audio_seconds / throughput.seconds : 0;
+    printf("uplink throughput: %d frames, %zu bytes in %.3f s, %.1fx realtime, %.0f frames/s, max send queue %zu\n",
+        throughput.frames, throughput.bytes, throughput.seconds, speed,
+        throughput.seconds > 0 ? throughput.frames / throughput.seconds : 0, throughput.max_queue);
+    PrintLatency("uplink throughput");
+    if (speed < 1) {
+        ESP_LOGE(TAG, "The encoder is slower than realtime");
+        ok = false;
+    }
+
+    /* Uplink and downlink latency, the codec is paced like I2S */
+    auto realtime_codec = new WavFileAudioCodec(input_path, output_dir + "/downlink_output.wav", SERVER_SAMPLE_RATE, true);
+    UplinkResult realtime;
+    AudioLatency::GetInstance().Reset();
+    if (!RunUplink(realtime_codec, expected_frames, realtime)) {
+        ok = false;
+    }
+    printf("uplink realtime: %d frames, %.1f kbps, max send queue %zu, %.2f heap allocations per frame\n",
+        realtime.frames, realtime.bytes * 8 / (realtime.frames * OPUS_FRAME_DURATION_MS / 1000.0) / 1000,
+        realtime.max_queue, realtime.allocations_per_frame);
+    if (realtime.allocations_per_frame > 0.1) {
+        ESP_LOGE(TAG, "The uplink allocates on the heap for every frame");
+        ok = false;
+    }
+    PrintLatency("uplink realtime");
+
+    std::vector<int16_t> server_speech;
+    GenerateSpeech(server_speech, SERVER_SAMPLE_RATE, seconds);
+    OpusEncoderWrapper encoder(SERVER_SAMPLE_RATE, 1, SERVER_FRAME_DURATION_MS);
+    std::vector<std::vector<uint8_t>> packets;
+    encoder.Encode(std::move(server_speech), [&packets](std::vector<uint8_t>&& opus) {
+        packets.push_back(std::move(opus));
+    });
+
+    DownlinkResult downlink;
+    AudioLatency::GetInstance().Reset();
+    RunDownlink(realtime_codec, packets, downlink);
+    PrintLatency("downlink");
+    // Each played frame records one downlink latency
+    downlink.played = AudioLatency::GetInstance().GetCount(kAudioLatencyDownlink);
+    printf("downlink: %d packets pushed, %d dropped, %lu played, %lu concealed, %lu underruns, jitter target %lu frames\n",
+        downlink.pushed, downlink.dropped, (unsigned long)downlink.played, (unsigned long)downlink.jitter.concealed,
+        (unsigned long)downlink.jitter.underruns, (unsigned long)downlink.jitter.target_frames);
+    if (downlink.dropped > 0 || downlink.played < (uint32_t)downlink.pushed || downlink.jitter.underruns > 0) {
+        ESP_LOGE(TAG, "Downlink lost audio");
+        ok = false;
+    }
+
+    PrintPool();
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // The audio tasks are still running, skip the static destructors
+    _exit(ok ? 0 : 1);
+}
@@ -0,0 +1,193 @@
+/*
+ * Plays a simulated downlink through AudioJitterBuffer, sized and drained like in AudioService.
+ *
+ * The server sends one 60 ms packet per frame in a few utterances. The network adds a base delay, uniform
+ * jitter, random loss, occasional reordering and Wi-Fi stalls that hold back everything sent during them.
+ * Every millisecond the simulated codec task moves arrived packets into the jitter buffer and decodes while
+ * the two frame playback queue has room, and the speaker plays one frame every 60 ms.
+ *
+ * For each scenario it reports what the buffer concealed, dropped as late and ran dry on, and the delay from
+ * sending a packet to hearing it. Exits with 1 if a packet is unaccounted for, or if a clean or mildly
+ * jittery link conceals or underruns.
+ */
+#include "audio_jitter_buffer.h"
+#include "audio_pool.h"
+#include "audio_service.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <vector>
+
+#define FRAME_MS 60
+#define UTTERANCES 4
+#define UTTERANCE_FRAMES 100
+#define UTTERANCE_GAP_MS 1500
+
+struct Scenario {
+    const char* name;
+    int base_delay_ms;
+    int jitter_ms;          // Uniform extra delay of 0 to jitter_ms
+    double loss;
+    double reorder;         // Chance a packet is held back by a bit more than a frame
+    int stall_every_ms;     // 0 for no stalls
+    int stall_ms;
+    bool strict;            // Must play without concealment or underruns
+};
+
+struct InFlight {
+    int64_t arrival_ms;
+    int64_t sent_ms;
+    uint32_t sequence;
+};
+
+struct Result {
+    uint32_t sent = 0;
+    uint32_t lost = 0;
+    uint32_t played = 0;
+    std::vector<int64_t> delays;
+    JitterBufferStats stats;
+};
+
+static Result Simulate(const Scenario& scenario, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> chance(0, 1);
+    std::uniform_int_distribution<int> jitter(0, scenario.jitter_ms);
+
+    // Schedule every packet of every utterance
+    std::vector<InFlight> network;
+    Result result;
+    int64_t send_ms = 0;
+    uint32_t sequence = 1;
+    for (int u = 0; u < UTTERANCES; u++) {
+        for (int i = 0; i < UTTERANCE_FRAMES; i++, sequence++, send_ms += FRAME_MS) {
+            result.sent++;
+            // The first and last packet of an utterance always arrive, so every frame between them is accounted for
+            bool edge = i == 0 || i == UTTERANCE_FRAMES - 1;
+            if (!edge && chance(random) < scenario.loss) {
+                result.lost++;
+                continue;
+            }
+            int64_t arrival = send_ms + scenario.base_delay_ms + jitter(random);
+            if (!edge && chance(random) < scenario.reorder) {
+                arrival += FRAME_MS + 10;
+            }
+            if (scenario.stall_every_ms > 0) {
+                int64_t phase = arrival % scenario.stall_every_ms;
+                if (phase < scenario.stall_ms) {
+                    arrival += scenario.stall_ms - phase;
+                }
+            }
+            network.push_back({arrival, send_ms, sequence});
+        }
+        send_ms += UTTERANCE_GAP_MS;
+    }
+    std::stable_sort(network.begin(), network.end(), [](const InFlight& a, const InFlight& b) {
+        return a.arrival_ms < b.arrival_ms;
+    });
+
+    AudioJitterBuffer buffer(MAX_DECODE_PACKETS_IN_QUEUE);
+    std::deque<int64_t> playback_queue;    // Send time of each decoded frame, -1 for a concealed one
+    int64_t speaker_free_ms = 0;
+    size_t next = 0;
+    int64_t end_ms = network.back().arrival_ms + 10 * FRAME_MS;
+    for (int64_t now_ms = 0; now_ms < end_ms; now_ms++) {
+        while (next < network.size() && network[next].arrival_ms <= now_ms && !buffer.Full()) {
+            auto packet = AudioPool::GetInstance().AcquirePacket();
+            packet->sample_rate = 24000;
+            packet->frame_duration = FRAME_MS;
+            packet->sequence = network[next].sequence;
+            packet->timestamp = network[next].sent_ms;
+            packet->origin_time_us = network[next].sent_ms * 1000;
+            buffer.Put(std::move(packet), now_ms);
+            next++;
+        }
+
+        while (playback_queue.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
+            AudioStreamPacketPtr packet;
+            auto state = buffer.Get(packet, now_ms);
+            if (state == kJitterBufferPacket) {
+                playback_queue.push_back(packet->origin_time_us / 1000);
+            } else if (state == kJitterBufferConceal) {
+                playback_queue.push_back(-1);
+            } else {
+                break;
+            }
+        }
+
+        if (now_ms >= speaker_free_ms && !playback_queue.empty()) {
+            int64_t sent_ms = playback_queue.front();
+            playback_queue.pop_front();
+            if (sent_ms >= 0) {
+                result.played++;
+                result.delays.push_back(now_ms - sent_ms);
+            }
+            speaker_free_ms = now_ms + FRAME_MS;
+        }
+    }
+    result.stats = buffer.stats();
+    return result;
+}
+
+int main(int argc, char** argv) {
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], nullptr, 10);
+        } else {
+            printf("Usage: %s [--seed N]\n", argv[0]);
+            return 1;
+        }
+    }
+    AudioPool::GetInstance().Initialize(MAX_DECODE_PACKETS_IN_QUEUE * 2, 1);
+
+    const Scenario scenarios[] = {
+        {"clean",           30,   2, 0,    0,    0,    0,   true},
+        {"jitter 30 ms",    30,  30, 0,    0,    0,    0,   true},
+        {"jitter 100 ms",   30, 100, 0,    0,    0,    0,   false},
+        {"loss 5%",         30,  30, 0.05, 0,    0,    0,   false},
+        {"reorder 5%",      30,  30, 0,    0.05, 0,    0,   false},
+        {"stall 300 ms/5s", 30,  30, 0,    0,    5000, 300, false},
+        {"all of the above",30, 100, 0.05, 0.05, 5000, 300, false},
+    };
+
+    bool ok = true;
+    printf("%-17s %5s %5s %6s %9s %5s %9s %9s %6s %6s %7s %7s\n", "scenario", "sent", "lost", "played",
+        "concealed", "late", "reordered", "underruns", "jitter", "target", "p50", "p95");
+    for (auto& scenario : scenarios) {
+        auto result = Simulate(scenario, seed);
+        auto& stats = result.stats;
+        std::sort(result.delays.begin(), result.delays.end());
+        int64_t p50 = result.delays[result.delays.size() / 2];
+        int64_t p95 = result.delays[result.delays.size() * 95 / 100];
+        printf("%-17s %5lu %5lu %6lu %9lu %5lu %9lu %9lu %4lums %6lu %5ldms %5ldms\n", scenario.name,
+            (unsigned long)result.sent, (unsigned long)result.lost, (unsigned long)result.played,
+            (unsigned long)stats.concealed, (unsigned long)stats.late, (unsigned long)stats.reordered,
+            (unsigned long)stats.underruns, (unsigned long)stats.jitter_ms, (unsigned long)stats.target_frames,
+            (long)p50, (long)p95);
+
+        // Every packet that arrived is played or dropped as late
+        if (result.played + stats.late != stats.received) {
+            printf("FAILED %s: %lu received but %lu played and %lu late\n", scenario.name,
+                (unsigned long)stats.received, (unsigned long)result.played, (unsigned long)stats.late);
+            ok = false;
+        }
+        // Every frame of an utterance is played or concealed, except a late first packet skipped at its start
+        uint32_t covered = result.played + stats.concealed;
+        if (covered > result.sent || covered + UTTERANCES < result.sent) {
+            printf("FAILED %s: %lu of %lu frames played or concealed\n", scenario.name,
+                (unsigned long)covered, (unsigned long)result.sent);
+            ok = false;
+        }
+        if (scenario.strict && (stats.concealed > 0 || stats.underruns > 0 || stats.late > 0)) {
+            printf("FAILED %s: a clean link must play without gaps\n", scenario.name);
+            ok = false;
+        }
+    }
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
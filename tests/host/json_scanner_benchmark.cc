@@ -0,0 +1,240 @@
+/*
+ * Replays the server messages of a typical session through ControlMessageCodec, and compares it with
+ * parsing the same messages into a cJSON tree as the protocol did before the scanner.
+ *
+ * Checks that every message decodes to the same fields as cJSON reads, that escaped strings unescape the
+ * same way, that the CBOR form round trips, and that every truncated message is rejected. Then reports
+ * messages per second and MB/s for the scanner, for cJSON and for the CBOR decoder.
+ *
+ * Exits with 1 on any mismatch.
+ */
+#include "control_message.h"
+#include "json_scanner.h"
+
+#include <cJSON.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+// The messages of one turn, in the order and shape the server sends them
+static const char* const kSessionTrace[] = {
+    R"({"type":"hello","transport":"websocket","session_id":"2c1f5a8e","audio_params":{"format":"opus","sample_rate":24000,"channels":1,"frame_duration":60}})",
+    R"({"type":"mcp","session_id":"2c1f5a8e","payload":{"jsonrpc":"2.0","id":1,"method":"initialize","params":{"capabilities":{"vision":{"url":"http://example.com/vision","token":"abc"}}}}})",
+    R"({"type":"mcp","session_id":"2c1f5a8e","payload":{"jsonrpc":"2.0","id":2,"method":"tools/list","params":{"cursor":""}}})",
+    R"({"type":"stt","text":"今天天气怎么样","session_id":"2c1f5a8e"})",
+    R"({"type":"llm","text":"😊","emotion":"happy","session_id":"2c1f5a8e"})",
+    R"({"type":"tts","state":"start","sample_rate":24000,"session_id":"2c1f5a8e"})",
+    R"({"type":"tts","state":"sentence_start","text":"今天北京晴，最高气温二十五度。","session_id":"2c1f5a8e"})",
+    R"({"type":"tts","state":"sentence_end","text":"今天北京晴，最高气温二十五度。","session_id":"2c1f5a8e"})",
+    R"({"type":"tts","state":"sentence_start","text":"适合出门，记得说\"\u4f60\u597d\"\n","session_id":"2c1f5a8e"})",
+    R"({"type":"tts","state":"sentence_end","text":"适合出门，记得说\"你好\"\n","session_id":"2c1f5a8e"})",
+    R"({"type":"mcp","session_id":"2c1f5a8e","payload":{"jsonrpc":"2.0","id":3,"method":"tools/call","params":{"name":"self.audio_speaker.set_volume","arguments":{"volume":60}}}})",
+    R"({"type":"tts","state":"stop","session_id":"2c1f5a8e"})",
+    R"({ "type" : "listen", "state" : "start", "mode" : "auto", "session_id" : "2c1f5a8e" })",
+    R"({"type":"system","command":"reboot","session_id":"2c1f5a8e"})",
+    R"({"type":"alert","status":"Warning","message":"Battery low","emotion":"sad"})",
+    R"({"type":"abort","reason":"wake_word_detected","extra":[1,2,{"nested":[true,false,null]}],"number":-1.5e3})",
+    R"({"type":"goodbye","session_id":"2c1f5a8e"})",
+};
+
+static std::string_view CjsonString(const cJSON* root, const char* name) {
+    auto item = cJSON_GetObjectItem(root, name);
+    return cJSON_IsString(item) ? std::string_view(item->valuestring) : std::string_view();
+}
+
+// What the protocol read from each message when it parsed them with cJSON
+static bool ReadWithCjson(const std::string& json, std::string fields[], std::string& payload) {
+    auto root = cJSON_Parse(json.c_str());
+    if (root == nullptr) {
+        return false;
+    }
+    const char* const names[] = {"type", "state", "mode", "session_id", "text", "emotion", "command", "status", "message"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        fields[i] = CjsonString(root, names[i]);
+    }
+    auto item = cJSON_GetObjectItem(root, "payload");
+    payload.clear();
+    if (cJSON_IsObject(item)) {
+        char* text = cJSON_PrintUnformatted(item);
+        payload = text;
+        cJSON_free(text);
+    }
+    cJSON_Delete(root);
+    return true;
+}
+
+static std::string Reformat(std::string_view json) {
+    std::string text(json);
+    auto root = cJSON_Parse(text.c_str());
+    if (root == nullptr) {
+        return "<invalid>";
+    }
+    char* printed = cJSON_PrintUnformatted(root);
+    text = printed;
+    cJSON_free(printed);
+    cJSON_Delete(root);
+    return text;
+}
+
+static void CheckMessage(const std::string& json) {
+    std::string scratch;
+    ControlMessage message;
+    if (!ControlMessageCodec::DecodeJson(json.data(), json.size(), scratch, message)) {
+        printf("FAILED to decode %s\n", json.c_str());
+        failures++;
+        return;
+    }
+
+    std::string fields[9], payload;
+    CHECK(ReadWithCjson(json, fields, payload));
+    CHECK(message.type_name == fields[0]);
+    CHECK(fields[1].empty() || message.state != kControlStateNone);
+    CHECK(fields[2].empty() || message.mode >= 0);
+    CHECK(message.session_id == fields[3]);
+    CHECK(message.text == fields[4]);
+    CHECK(message.emotion == fields[5]);
+    CHECK(message.command == fields[6]);
+    CHECK(message.status == fields[7]);
+    CHECK(message.message == fields[8]);
+    CHECK(payload.empty() ? message.payload.empty() : Reformat(message.payload) == payload);
+
+    // The binary form carries the same message, the type name only exists in JSON
+    if (message.type != kControlMessageUnknown) {
+        std::string cbor;
+        ControlMessageCodec::Encode(message, cbor);
+        CHECK(ControlMessageCodec::IsBinary(cbor[0]));
+        ControlMessage decoded;
+        CHECK(ControlMessageCodec::Decode((const uint8_t*)cbor.data(), cbor.size(), decoded));
+        CHECK(decoded.type == message.type && decoded.state == message.state && decoded.mode == message.mode &&
+            decoded.reason == message.reason && decoded.session_id == message.session_id &&
+            decoded.text == message.text && decoded.emotion == message.emotion &&
+            decoded.payload == message.payload && decoded.message == message.message);
+
+        for (size_t length = 0; length < cbor.size(); length++) {
+            ControlMessage truncated;
+            CHECK(!ControlMessageCodec::Decode((const uint8_t*)cbor.data(), length, truncated));
+        }
+    }
+
+    // Cut anywhere, the message is incomplete. The copy has no terminator, so a read past the end shows up under ASan
+    for (size_t length = 0; length < json.size(); length++) {
+        std::vector<char> truncated(json.begin(), json.begin() + length);
+        ControlMessage partial;
+        if (ControlMessageCodec::DecodeJson(truncated.data(), truncated.size(), scratch, partial)) {
+            printf("FAILED accepted %zu of %zu bytes: %.*s\n", length, json.size(), (int)length, json.c_str());
+            failures++;
+            break;
+        }
+    }
+}
+
+static double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void Report(const char* name, double seconds, int messages, size_t bytes) {
+    printf("%-8s %9.0f messages/s %8.1f MB/s %7.0f ns/message\n", name, messages / seconds, bytes / seconds / 1e6,
+        seconds * 1e9 / messages);
+}
+
+static void Benchmark(const std::vector<std::string>& trace, int rounds) {
+    size_t trace_bytes = 0;
+    for (auto& json : trace) {
+        trace_bytes += json.size();
+    }
+    int messages = rounds * trace.size();
+    size_t bytes = rounds * trace_bytes;
+    size_t sink = 0;
+
+    std::string scratch;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        for (auto& json : trace) {
+            ControlMessage message;
+            ControlMessageCodec::DecodeJson(json.data(), json.size(), scratch, message);
+            sink += message.type + message.text.size();
+        }
+    }
+    Report("scanner", SecondsSince(start), messages, bytes);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        for (auto& json : trace) {
+            auto root = cJSON_Parse(json.c_str());
+            sink += CjsonString(root, "type").size() + CjsonString(root, "state").size() +
+                CjsonString(root, "text").size() + CjsonString(root, "session_id").size() +
+                (cJSON_GetObjectItem(root, "payload") != nullptr);
+            cJSON_Delete(root);
+        }
+    }
+    Report("cJSON", SecondsSince(start), messages, bytes);
+
+    std::vector<std::string> binary;
+    size_t binary_bytes = 0;
+    for (auto& json : trace) {
+        ControlMessage message;
+        ControlMessageCodec::DecodeJson(json.data(), json.size(), scratch, message);
+        std::string cbor;
+        ControlMessageCodec::Encode(message, cbor);
+        binary_bytes += cbor.size();
+        binary.push_back(std::move(cbor));
+    }
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        for (auto& cbor : binary) {
+            ControlMessage message;
+            ControlMessageCodec::Decode((const uint8_t*)cbor.data(), cbor.size(), message);
+            sink += message.type + message.text.size();
+        }
+    }
+    Report("CBOR", SecondsSince(start), messages, rounds * binary_bytes);
+    printf("trace: %zu messages, %zu bytes as JSON, %zu bytes as CBOR (checksum %zu)\n", trace.size(), trace_bytes,
+        binary_bytes, sink);
+}
+
+int main(int argc, char** argv) {
+    int rounds = 20000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [--rounds N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<std::string> trace(std::begin(kSessionTrace), std::end(kSessionTrace));
+    for (auto& json : trace) {
+        CheckMessage(json);
+    }
+
+    // A string payload is not mistaken for an object, surrogate pairs decode to one UTF-8 character
+    std::string scratch;
+    ControlMessage message;
+    std::string json = R"({"type":"mcp","payload":"{}","text":"a\u00e9\ud83d\ude00"})";
+    CHECK(ControlMessageCodec::DecodeJson(json.data(), json.size(), scratch, message));
+    CHECK(message.type == kControlMessageMcp && message.payload.empty());
+    CHECK(message.text == "a\xc3\xa9\xf0\x9f\x98\x80");
+    json = R"({"state":"start"})";
+    CHECK(!ControlMessageCodec::DecodeJson(json.data(), json.size(), scratch, message));
+    json = R"(["type","tts"])";
+    CHECK(!ControlMessageCodec::DecodeJson(json.data(), json.size(), scratch, message));
+
+    Benchmark(trace, rounds);
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,541 @@
+/*
+ * Sends and receives encrypted audio datagrams through MqttProtocol, over an MQTT broker and a UDP server in the
+ * same process, and compares the AES-CTR path with the one it replaced:
+ *
+ * - send "strings": the first SendAudio() copied the nonce into a std::string and encrypted into a new
+ *   std::string for every packet
+ * - send "send buffer": SendAudio() now builds the nonce on the stack and encrypts into a buffer that keeps
+ *   its capacity
+ * - receive "new packet": the datagram was decrypted into a newly allocated packet, with the datagram itself
+ *   as the counter block
+ * - receive "pooled": the datagram is now decrypted into a pooled packet, with a copy of the nonce as the
+ *   counter block
+ *
+ * These rows time the path alone, copied from each version of the code. The SendAudio() and OnMessage() rows
+ * time the protocol itself, which also takes the channel mutex and updates the channel stats. Uplink packets
+ * are sized like 16 kHz Opus frames and downlink packets like 24 kHz ones, both 60 ms long.
+ *
+ * Checks AES-CTR against the NIST SP 800-38A test vector, that every send path produces the same datagram, that
+ * the server decrypts it, that every receive path decrypts the server datagrams without changing them, and that
+ * short datagrams and unknown packet types are dropped. Then reports packets per second, per-packet latency and
+ * heap allocations.
+ *
+ * Exits with 1 on a mismatch, or if the new paths allocate once warmed up.
+ */
+#include "mqtt_protocol.h"
+#include "audio_pool.h"
+#include "board.h"
+#include "network_interface.h"
+#include "settings.h"
+
+#include <arpa/inet.h>
+#include <mbedtls/aes.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// Counts heap allocations, to check the new paths do not allocate per packet
+static std::atomic<uint64_t> allocations{0};
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+// Packets before the allocation count starts, the pool and send buffers grow on first use
+#define WARMUP_PACKETS 10
+#define FRAME_DURATION_MS 60
+
+// Opus payloads of 60 ms frames, 12 to 20 kbps for the 16 kHz uplink and 20 to 32 kbps for the 24 kHz downlink
+static const size_t kUplinkSizes[] = {90, 120, 150};
+static const size_t kDownlinkSizes[] = {150, 180, 240};
+#define SIZE_COUNT 3
+
+// 128-bit key and nonce of the UDP channel, in the hex form of the server hello
+#define SERVER_KEY "2b7e151628aed2a6abf7158809cf4f3c"
+#define SERVER_NONCE "01000000a1b2c3d40000000000000000"
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+static std::string DecodeHex(const char* hex) {
+    std::string bytes;
+    for (size_t i = 0; hex[i] != '\0' && hex[i + 1] != '\0'; i += 2) {
+        char byte[3] = {hex[i], hex[i + 1], '\0'};
+        bytes.push_back((char)strtoul(byte, nullptr, 16));
+    }
+    return bytes;
+}
+
+// Answers the client hello on the broker, collects the datagrams the client sends and encrypts the downlink
+class LoopbackServer {
+public:
+    bool capture = false;
+    std::vector<std::string> datagrams;
+    size_t bytes = 0;
+
+    LoopbackServer() {
+        mbedtls_aes_init(&aes_);
+        mbedtls_aes_setkey_enc(&aes_, (const unsigned char*)DecodeHex(SERVER_KEY).data(), 128);
+        nonce_ = DecodeHex(SERVER_NONCE);
+    }
+
+    bool HandleMqtt(Mqtt* mqtt, const std::string& topic, const std::string& payload) {
+        if (payload.find("\"hello\"") != std::string::npos) {
+            mqtt->Receive("devices/p2p/host", R"({"type":"hello","transport":"udp","session_id":"host",)"
+                R"("audio_params":{"format":"opus","sample_rate":24000,"channels":1,"frame_duration":60},)"
+                R"("udp":{"server":"127.0.0.1","port":8888,"key":")" SERVER_KEY R"(","nonce":")" SERVER_NONCE R"("}})");
+        }
+        return true;
+    }
+
+    int HandleUdp(Udp* udp, const std::string& data) {
+        bytes += data.size();
+        if (capture) {
+            datagrams.push_back(data);
+        }
+        return data.size();
+    }
+
+    // A downlink datagram as the server sends it
+    std::string Encrypt(const uint8_t* payload, size_t size, uint32_t timestamp, uint32_t sequence) {
+        std::string datagram(MQTT_AUDIO_NONCE_SIZE + size, '\0');
+        auto nonce = (uint8_t*)datagram.data();
+        memcpy(nonce, nonce_.data(), MQTT_AUDIO_NONCE_SIZE);
+        *(uint16_t*)&nonce[2] = htons(size);
+        *(uint32_t*)&nonce[8] = htonl(timestamp);
+        *(uint32_t*)&nonce[12] = htonl(sequence);
+        uint8_t counter[MQTT_AUDIO_NONCE_SIZE];
+        memcpy(counter, nonce, sizeof(counter));
+        size_t nc_off = 0;
+        uint8_t stream_block[16];
+        mbedtls_aes_crypt_ctr(&aes_, size, &nc_off, counter, stream_block, payload, nonce + MQTT_AUDIO_NONCE_SIZE);
+        return datagram;
+    }
+
+    // The payload of an uplink datagram, empty if its header does not match
+    std::string Decrypt(const std::string& datagram, uint32_t timestamp, uint32_t sequence) {
+        if (datagram.size() < MQTT_AUDIO_NONCE_SIZE) {
+            return "";
+        }
+        uint8_t counter[MQTT_AUDIO_NONCE_SIZE];
+        memcpy(counter, datagram.data(), sizeof(counter));
+        size_t size = datagram.size() - MQTT_AUDIO_NONCE_SIZE;
+        if (counter[0] != 0x01 || ntohs(*(uint16_t*)&counter[2]) != size ||
+            ntohl(*(uint32_t*)&counter[8]) != timestamp || ntohl(*(uint32_t*)&counter[12]) != sequence) {
+            return "";
+        }
+        std::string payload(size, '\0');
+        size_t nc_off = 0;
+        uint8_t stream_block[16];
+        mbedtls_aes_crypt_ctr(&aes_, size, &nc_off, counter, stream_block,
+            (const uint8_t*)datagram.data() + MQTT_AUDIO_NONCE_SIZE, (uint8_t*)payload.data());
+        return payload;
+    }
+
+private:
+    mbedtls_aes_context aes_;
+    std::string nonce_;
+};
+
+static LoopbackServer server;
+
+class LoopbackNetwork : public NetworkInterface {
+public:
+    // The UDP socket of the protocol, to deliver server datagrams on
+    Udp* udp = nullptr;
+
+    std::unique_ptr<Mqtt> CreateMqtt(int connect_id) override {
+        return std::make_unique<Mqtt>([](Mqtt* mqtt, const std::string& topic, const std::string& payload) {
+            return server.HandleMqtt(mqtt, topic, payload);
+        });
+    }
+
+    std::unique_ptr<Udp> CreateUdp(int connect_id) override {
+        auto socket = std::make_unique<Udp>([](Udp* udp, const std::string& data) {
+            return server.HandleUdp(udp, data);
+        });
+        udp = socket.get();
+        return socket;
+    }
+};
+
+class HostBoard : public Board {
+public:
+    LoopbackNetwork network;
+
+    AudioCodec* GetAudioCodec() override { return nullptr; }
+    NetworkInterface* GetNetwork() override { return &network; }
+};
+
+DECLARE_BOARD(HostBoard)
+
+static LoopbackNetwork& Network() {
+    return static_cast<HostBoard&>(Board::GetInstance()).network;
+}
+
+// The UDP channel as both copies of the client code see it
+struct Channel {
+    mbedtls_aes_context aes;
+    std::string aes_nonce;
+    uint32_t local_sequence = 0;
+    std::string send_buffer;
+    Udp udp{[](Udp* udp, const std::string& data) { return server.HandleUdp(udp, data); }};
+
+    Channel() {
+        mbedtls_aes_init(&aes);
+        mbedtls_aes_setkey_enc(&aes, (const unsigned char*)DecodeHex(SERVER_KEY).data(), 128);
+        aes_nonce = DecodeHex(SERVER_NONCE);
+        udp.Connect("127.0.0.1", 8888);
+    }
+    ~Channel() {
+        mbedtls_aes_free(&aes);
+    }
+};
+
+// SendAudio() before the send buffer, the nonce and the ciphertext in new strings for every packet
+static bool SendWithStrings(Channel& channel, const AudioStreamPacket& packet) {
+    std::string nonce(channel.aes_nonce);
+    *(uint16_t*)&nonce[2] = htons(packet.payload.size());
+    *(uint32_t*)&nonce[8] = htonl(packet.timestamp);
+    *(uint32_t*)&nonce[12] = htonl(++channel.local_sequence);
+
+    std::string encrypted;
+    encrypted.resize(channel.aes_nonce.size() + packet.payload.size());
+    memcpy(encrypted.data(), nonce.data(), nonce.size());
+
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    if (mbedtls_aes_crypt_ctr(&channel.aes, packet.payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
+        (uint8_t*)packet.payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
+        return false;
+    }
+    return channel.udp.Send(encrypted) > 0;
+}
+
+// The path of SendAudio() now, the nonce on the stack and the ciphertext in a buffer that keeps its capacity
+static bool SendWithBuffer(Channel& channel, const AudioStreamPacket& packet) {
+    uint8_t nonce[MQTT_AUDIO_NONCE_SIZE];
+    memcpy(nonce, channel.aes_nonce.data(), sizeof(nonce));
+    *(uint16_t*)&nonce[2] = htons(packet.payload.size());
+    *(uint32_t*)&nonce[8] = htonl(packet.timestamp);
+    *(uint32_t*)&nonce[12] = htonl(++channel.local_sequence);
+
+    channel.send_buffer.resize(sizeof(nonce) + packet.payload.size());
+    auto buffer = reinterpret_cast<uint8_t*>(channel.send_buffer.data());
+    memcpy(buffer, nonce, sizeof(nonce));
+
+    size_t nc_off = 0;
+    uint8_t stream_block[16];
+    if (mbedtls_aes_crypt_ctr(&channel.aes, packet.payload.size(), &nc_off, nonce, stream_block,
+        packet.payload.data(), buffer + sizeof(nonce)) != 0) {
+        return false;
+    }
+    return channel.udp.Send(channel.send_buffer) > 0;
+}
+
+// The receive path before the pool, the datagram itself was used and advanced as the counter block
+static std::unique_ptr<AudioStreamPacket> ReceiveIntoNewPacket(Channel& channel, const std::string& data) {
+    if (data.size() < MQTT_AUDIO_NONCE_SIZE || data[0] != 0x01) {
+        return nullptr;
+    }
+    uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
+    size_t decrypted_size = data.size() - MQTT_AUDIO_NONCE_SIZE;
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    auto nonce = (uint8_t*)data.data();
+    auto encrypted = (uint8_t*)data.data() + MQTT_AUDIO_NONCE_SIZE;
+    auto packet = std::make_unique<AudioStreamPacket>();
+    packet->sample_rate = 24000;
+    packet->frame_duration = FRAME_DURATION_MS;
+    packet->timestamp = timestamp;
+    packet->payload.resize(decrypted_size);
+    if (mbedtls_aes_crypt_ctr(&channel.aes, decrypted_size, &nc_off, nonce, stream_block, encrypted,
+        (uint8_t*)packet->payload.data()) != 0) {
+        return nullptr;
+    }
+    return packet;
+}
+
+// The receive path now, a copy of the nonce as the counter block and a pooled packet
+static AudioStreamPacketPtr ReceiveIntoPooledPacket(Channel& channel, const std::string& data) {
+    if (data.size() < MQTT_AUDIO_NONCE_SIZE) {
+        return nullptr;
+    }
+    auto datagram = reinterpret_cast<const uint8_t*>(data.data());
+    if (datagram[0] != 0x01) {
+        return nullptr;
+    }
+    uint8_t nonce[MQTT_AUDIO_NONCE_SIZE];
+    memcpy(nonce, datagram, sizeof(nonce));
+    size_t decrypted_size = data.size() - MQTT_AUDIO_NONCE_SIZE;
+    size_t nc_off = 0;
+    uint8_t stream_block[16];
+    auto packet = AudioPool::GetInstance().AcquirePacket();
+    packet->sample_rate = 24000;
+    packet->frame_duration = FRAME_DURATION_MS;
+    packet->timestamp = ntohl(*(const uint32_t*)&datagram[8]);
+    packet->sequence = ntohl(*(const uint32_t*)&datagram[12]);
+    packet->payload.resize(decrypted_size);
+    if (mbedtls_aes_crypt_ctr(&channel.aes, decrypted_size, &nc_off, nonce, stream_block,
+        datagram + MQTT_AUDIO_NONCE_SIZE, packet->payload.data()) != 0) {
+        return nullptr;
+    }
+    return packet;
+}
+
+// F.5.1 CTR-AES128.Encrypt of NIST SP 800-38A, the first two blocks
+static void CheckAesCtr() {
+    mbedtls_aes_context aes;
+    mbedtls_aes_init(&aes);
+    CHECK(mbedtls_aes_setkey_enc(&aes, (const unsigned char*)DecodeHex("2b7e151628aed2a6abf7158809cf4f3c").data(), 128) == 0);
+    auto counter = DecodeHex("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+    auto plaintext = DecodeHex("6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51");
+    auto expected = DecodeHex("874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff");
+    std::string ciphertext(plaintext.size(), '\0');
+    size_t nc_off = 0;
+    uint8_t stream_block[16];
+    CHECK(mbedtls_aes_crypt_ctr(&aes, plaintext.size(), &nc_off, (uint8_t*)counter.data(), stream_block,
+        (const uint8_t*)plaintext.data(), (uint8_t*)ciphertext.data()) == 0);
+    CHECK(ciphertext == expected);
+    mbedtls_aes_free(&aes);
+}
+
+static AudioStreamPacketPtr MakePacket(const std::vector<uint8_t>& source, size_t size, uint32_t timestamp) {
+    auto packet = AudioPool::GetInstance().AcquirePacket();
+    packet->sample_rate = 16000;
+    packet->frame_duration = FRAME_DURATION_MS;
+    packet->timestamp = timestamp;
+    packet->payload.assign(source.begin(), source.begin() + size);
+    return packet;
+}
+
+static void CheckDatagrams(MqttProtocol& protocol, const std::vector<uint8_t>& source,
+    std::vector<AudioStreamPacketPtr>& received) {
+    Channel strings, buffer;
+    server.capture = true;
+    for (size_t i = 0; i < SIZE_COUNT; i++) {
+        server.datagrams.clear();
+        size_t size = kUplinkSizes[i];
+        uint32_t timestamp = 0x12345678 + i;
+        auto packet = MakePacket(source, size, timestamp);
+        SendWithStrings(strings, *packet);
+        SendWithBuffer(buffer, *packet);
+        CHECK(protocol.SendAudio(std::move(packet)));
+        CHECK(server.datagrams.size() == 3);
+        if (server.datagrams.size() != 3) {
+            continue;
+        }
+        CHECK(server.datagrams[1] == server.datagrams[0]);
+        CHECK(server.datagrams[2] == server.datagrams[0]);
+        CHECK(server.Decrypt(server.datagrams[0], timestamp, i + 1) == std::string(source.begin(), source.begin() + size));
+    }
+    server.capture = false;
+    server.datagrams.clear();
+
+    Channel channel;
+    for (size_t i = 0; i < SIZE_COUNT; i++) {
+        size_t size = kDownlinkSizes[i];
+        uint32_t sequence = i + 1;
+        auto datagram = server.Encrypt(source.data(), size, sequence * FRAME_DURATION_MS, sequence);
+        std::string receive_buffer = datagram;
+        std::vector<uint8_t> payload(source.begin(), source.begin() + size);
+
+        received.clear();
+        Network().udp->Receive(receive_buffer);
+        CHECK(receive_buffer == datagram);
+        CHECK(received.size() == 1 && received[0]->payload == payload && received[0]->sequence == sequence &&
+            received[0]->timestamp == sequence * FRAME_DURATION_MS);
+
+        auto pooled = ReceiveIntoPooledPacket(channel, receive_buffer);
+        CHECK(receive_buffer == datagram);
+        CHECK(pooled != nullptr && pooled->payload == payload && pooled->sequence == sequence);
+
+        // Decrypts the same, but advances the counter block inside the received datagram
+        auto new_packet = ReceiveIntoNewPacket(channel, receive_buffer);
+        CHECK(new_packet != nullptr && new_packet->payload == payload);
+    }
+
+    // Shorter than the nonce, or not an audio packet
+    received.clear();
+    auto datagram = server.Encrypt(source.data(), 40, 0, SIZE_COUNT + 1);
+    Network().udp->Receive(datagram.substr(0, MQTT_AUDIO_NONCE_SIZE - 1));
+    datagram[0] = 0x02;
+    Network().udp->Receive(datagram);
+    CHECK(received.empty());
+}
+
+struct Measurement {
+    double packets_per_second = 0;
+    double latency_p50_us = 0;
+    double latency_p99_us = 0;
+    double allocations_per_packet = 0;
+};
+
+// Runs packet(i) for every packet and times each call, the allocations are counted after the warm up
+template <typename Packet>
+static Measurement Measure(int packets, Packet packet) {
+    std::vector<int64_t> latencies(packets);
+    uint64_t warm_allocations = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < packets; i++) {
+        if (i == WARMUP_PACKETS) {
+            warm_allocations = allocations.load();
+        }
+        auto packet_start = std::chrono::steady_clock::now();
+        packet(i);
+        latencies[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - packet_start).count();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    Measurement measurement;
+    measurement.allocations_per_packet = double(allocations.load() - warm_allocations) / (packets - WARMUP_PACKETS);
+    std::sort(latencies.begin(), latencies.end());
+    measurement.packets_per_second = packets / seconds;
+    measurement.latency_p50_us = latencies[packets / 2] / 1000.0;
+    measurement.latency_p99_us = latencies[packets * 99 / 100] / 1000.0;
+    return measurement;
+}
+
+static void Report(const char* direction, const char* name, const Measurement& measurement) {
+    // The stream needs one packet per frame
+    double realtime = measurement.packets_per_second * FRAME_DURATION_MS / 1000;
+    printf("  %-8s %-12s %6.2f M packets/s (%6.0fx real time)  p50 %5.2f us  p99 %5.2f us  %4.2f allocations/packet\n",
+        direction, name, measurement.packets_per_second / 1e6, realtime, measurement.latency_p50_us,
+        measurement.latency_p99_us, measurement.allocations_per_packet);
+}
+
+static void Benchmark(MqttProtocol& protocol, const std::vector<uint8_t>& source, int packets) {
+    Channel strings, buffer, channel;
+    printf("uplink, 16 kHz Opus, %zu-%zu byte payloads:\n", kUplinkSizes[0], kUplinkSizes[SIZE_COUNT - 1]);
+    // Every packet is taken from the pool and filled with the encoder output, the same for all send paths
+    auto send_strings = Measure(packets, [&](int i) {
+        SendWithStrings(strings, *MakePacket(source, kUplinkSizes[i % SIZE_COUNT], i * FRAME_DURATION_MS));
+    });
+    auto send_buffer = Measure(packets, [&](int i) {
+        SendWithBuffer(buffer, *MakePacket(source, kUplinkSizes[i % SIZE_COUNT], i * FRAME_DURATION_MS));
+    });
+    auto send_audio = Measure(packets, [&](int i) {
+        protocol.SendAudio(MakePacket(source, kUplinkSizes[i % SIZE_COUNT], i * FRAME_DURATION_MS));
+    });
+    Report("send", "strings", send_strings);
+    Report("send", "send buffer", send_buffer);
+    Report("send", "SendAudio()", send_audio);
+    if (send_buffer.allocations_per_packet > 0.1 || send_audio.allocations_per_packet > 0.1) {
+        printf("FAILED SendAudio() allocates %.2f times per packet\n", send_audio.allocations_per_packet);
+        failures++;
+    }
+
+    printf("downlink, 24 kHz Opus, %zu-%zu byte payloads:\n", kDownlinkSizes[0], kDownlinkSizes[SIZE_COUNT - 1]);
+    std::vector<std::string> datagrams;
+    for (size_t i = 0; i < SIZE_COUNT; i++) {
+        datagrams.push_back(server.Encrypt(source.data(), kDownlinkSizes[i], i * FRAME_DURATION_MS, i + 1));
+    }
+    // Every datagram is first copied into the receive buffer, as the UDP socket does
+    std::string receive_buffer;
+    receive_buffer.reserve(MQTT_AUDIO_NONCE_SIZE + kDownlinkSizes[SIZE_COUNT - 1]);
+    size_t checksum = 0;
+    auto new_packet = Measure(packets, [&](int i) {
+        receive_buffer.assign(datagrams[i % SIZE_COUNT]);
+        auto packet = ReceiveIntoNewPacket(channel, receive_buffer);
+        checksum += packet->payload.size();
+    });
+    auto pooled = Measure(packets, [&](int i) {
+        receive_buffer.assign(datagrams[i % SIZE_COUNT]);
+        auto packet = ReceiveIntoPooledPacket(channel, receive_buffer);
+        checksum += packet->payload.size();
+    });
+    auto on_message = Measure(packets, [&](int i) {
+        receive_buffer.assign(datagrams[i % SIZE_COUNT]);
+        Network().udp->Receive(receive_buffer);
+    });
+    Report("receive", "new packet", new_packet);
+    Report("receive", "pooled", pooled);
+    Report("receive", "OnMessage()", on_message);
+    if (pooled.allocations_per_packet > 0.1 || on_message.allocations_per_packet > 0.1) {
+        printf("FAILED OnMessage() allocates %.2f times per packet\n", on_message.allocations_per_packet);
+        failures++;
+    }
+    if (checksum == 0) {
+        failures++;
+    }
+}
+
+int main(int argc, char** argv) {
+    int packets = 200000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--packets") == 0 && i + 1 < argc) {
+            packets = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [--packets N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (packets <= WARMUP_PACKETS) {
+        packets = WARMUP_PACKETS + 1;
+    }
+
+    AudioPool::GetInstance().Initialize(8, 1);
+    std::mt19937 random(1);
+    std::vector<uint8_t> source(kDownlinkSizes[SIZE_COUNT - 1]);
+    for (auto& byte : source) {
+        byte = random();
+    }
+    CheckAesCtr();
+
+    Settings settings("mqtt", true);
+    settings.SetString("endpoint", "loopback:8883");
+    settings.SetString("client_id", "host");
+    settings.SetString("publish_topic", "device-server");
+
+    MqttProtocol protocol;
+    // Only kept while checking, the benchmark releases the packets right away
+    bool keep_received = true;
+    std::vector<AudioStreamPacketPtr> received;
+    size_t received_bytes = 0;
+    protocol.OnIncomingAudio([&](AudioStreamPacketPtr packet) {
+        received_bytes += packet->payload.size();
+        if (keep_received) {
+            received.push_back(std::move(packet));
+        }
+    });
+    if (!protocol.Start() || !protocol.OpenAudioChannel() || !protocol.IsAudioChannelOpened()) {
+        printf("FAILED to open the audio channel\n");
+        return 1;
+    }
+    CheckDatagrams(protocol, source, received);
+    received.clear();
+    keep_received = false;
+    Benchmark(protocol, source, packets);
+    if (received_bytes == 0) {
+        failures++;
+    }
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,349 @@
+/*
+ * Applies patches generated by scripts/ota_delta/ota_delta.py with OtaDeltaPatcher, reading the old firmware
+ * through the esp_partition shim. The old firmware is 2.3 MB, so copy offsets take four LEB128 bytes.
+ *
+ * Each patch is fed whole, one byte at a time, split at every position of the header and the first
+ * operations, and in random chunk sizes. The rebuilt firmware must match the new one byte for byte. Then
+ * checks that a different running firmware, a truncated patch, trailing data, an unknown opcode and a copy
+ * past the end of the source are rejected.
+ *
+ * Exits with 1 on any mismatch.
+ */
+#include "ota_delta.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+#define SOURCE_SIZE (2300 * 1024)
+
+using Bytes = std::vector<uint8_t>;
+
+static Bytes RandomBytes(std::mt19937& rng, size_t size) {
+    Bytes bytes(size);
+    for (auto& byte : bytes) {
+        byte = rng();
+    }
+    return bytes;
+}
+
+// Code-like data: random instruction words with repeated sequences and zero padding between sections
+static Bytes MakeFirmware(std::mt19937& rng, size_t size) {
+    Bytes firmware;
+    firmware.reserve(size);
+    while (firmware.size() < size) {
+        size_t length = std::min<size_t>(size - firmware.size(), 64 + rng() % 8192);
+        if (rng() % 16 == 0) {
+            firmware.insert(firmware.end(), length, 0);
+        } else if (rng() % 4 == 0 && firmware.size() > length) {
+            size_t from = rng() % (firmware.size() - length);
+            firmware.insert(firmware.end(), firmware.begin() + from, firmware.begin() + from + length);
+        } else {
+            auto random = RandomBytes(rng, length);
+            firmware.insert(firmware.end(), random.begin(), random.end());
+        }
+    }
+    return firmware;
+}
+
+struct Update {
+    const char* name;
+    Bytes target;
+    Bytes patch;
+};
+
+static std::vector<Update> MakeUpdates(const Bytes& source, std::mt19937& rng) {
+    std::vector<Update> updates;
+    updates.push_back({"identical", source, {}});
+
+    Bytes edited = source;
+    for (int i = 0; i < 40; i++) {
+        edited[rng() % edited.size()] ^= 1 + rng() % 255;
+    }
+    updates.push_back({"edited", edited, {}});
+
+    // Code added early shifts everything after it
+    Bytes inserted = source;
+    auto code = RandomBytes(rng, 3000);
+    inserted.insert(inserted.begin() + 100000, code.begin(), code.end());
+    code = RandomBytes(rng, 100);
+    inserted.insert(inserted.begin() + 1000, code.begin(), code.end());
+    updates.push_back({"inserted", inserted, {}});
+
+    Bytes removed = source;
+    removed.erase(removed.begin() + 1500000, removed.begin() + 1600000);
+    updates.push_back({"removed", removed, {}});
+
+    // Two sections swap places, a link order change
+    Bytes moved(source.begin(), source.begin() + 500000);
+    moved.insert(moved.end(), source.begin() + 900000, source.begin() + 1300000);
+    moved.insert(moved.end(), source.begin() + 500000, source.begin() + 900000);
+    moved.insert(moved.end(), source.begin() + 1300000, source.end());
+    updates.push_back({"moved", moved, {}});
+
+    Bytes grown = source;
+    auto assets = RandomBytes(rng, 200000);
+    grown.insert(grown.end(), assets.begin(), assets.end());
+    updates.push_back({"grown", grown, {}});
+
+    updates.push_back({"unrelated", RandomBytes(rng, 70000), {}});
+    updates.push_back({"empty", {}, {}});
+    return updates;
+}
+
+static bool WriteFile(const std::string& path, const Bytes& data) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool written = data.empty() || fwrite(data.data(), 1, data.size(), file) == data.size();
+    return fclose(file) == 0 && written;
+}
+
+static bool ReadFile(const std::string& path, Bytes& data) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    data.clear();
+    uint8_t buffer[65536];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data.insert(data.end(), buffer, buffer + length);
+    }
+    fclose(file);
+    return true;
+}
+
+static std::string Hex(const uint8_t* data, size_t size) {
+    std::string hex;
+    char digits[3];
+    for (size_t i = 0; i < size; i++) {
+        snprintf(digits, sizeof(digits), "%02x", data[i]);
+        hex += digits;
+    }
+    return hex;
+}
+
+struct PatchResult {
+    bool written = true;
+    bool finished = false;
+    Bytes output;
+    std::string target_sha256;
+};
+
+// Feeds the patch in chunks ending at the given positions, then the rest
+static PatchResult Apply(const esp_partition_t* source, const Bytes& patch, const std::vector<size_t>& splits) {
+    PatchResult result;
+    OtaDeltaPatcher patcher(source, [&result](const uint8_t* data, size_t size) {
+        result.output.insert(result.output.end(), data, data + size);
+        return true;
+    });
+    size_t position = 0;
+    for (size_t split : splits) {
+        if (!patcher.Write(patch.data() + position, split - position)) {
+            result.written = false;
+            return result;
+        }
+        position = split;
+    }
+    result.written = patcher.Write(patch.data() + position, patch.size() - position);
+    result.finished = result.written && patcher.Finish();
+    result.target_sha256 = patcher.target_sha256();
+    return result;
+}
+
+static std::vector<size_t> RandomSplits(std::mt19937& rng, size_t size, size_t max_chunk) {
+    std::vector<size_t> splits;
+    for (size_t position = 1 + rng() % max_chunk; position < size; position += 1 + rng() % max_chunk) {
+        splits.push_back(position);
+    }
+    return splits;
+}
+
+// Rebuilds the update and compares it byte for byte, returns false if it does not match
+static bool Matches(const esp_partition_t* source, const Update& update, const std::vector<size_t>& splits) {
+    auto result = Apply(source, update.patch, splits);
+    if (result.finished && result.output == update.target &&
+        result.target_sha256 == Hex(update.patch.data() + 48, 32)) {
+        return true;
+    }
+    printf("FAILED %s: written %d, finished %d, %zu of %zu bytes, first split at %zu\n", update.name,
+        result.written, result.finished, result.output.size(), update.target.size(),
+        splits.empty() ? update.patch.size() : splits[0]);
+    failures++;
+    return false;
+}
+
+static void CheckUpdate(const esp_partition_t* source, const Update& update, std::mt19937& rng) {
+    const Bytes& patch = update.patch;
+    int runs = 0, mismatches = 0;
+
+    // Whole, then one byte per Write(), which splits every header field and operand
+    std::vector<size_t> splits;
+    mismatches += !Matches(source, update, splits);
+    for (size_t position = 1; position < patch.size(); position++) {
+        splits.push_back(position);
+    }
+    mismatches += !Matches(source, update, splits);
+    runs += 2;
+
+    for (size_t max_chunk : {7, 64, 1500, 32768}) {
+        for (int i = 0; i < 3; i++) {
+            mismatches += !Matches(source, update, RandomSplits(rng, patch.size(), max_chunk));
+            runs++;
+        }
+    }
+    printf("%-10s %8zu -> %8zu bytes, patch %7zu bytes, %d chunkings%s\n", update.name, (size_t)source->size,
+        update.target.size(), patch.size(), runs, mismatches == 0 ? "" : " FAILED");
+}
+
+// Two chunks split at every position of the header and of the operations that follow it
+static void CheckHeaderSplits(const esp_partition_t* source, const Update& update) {
+    for (size_t position = 1; position < std::min<size_t>(update.patch.size(), OTA_DELTA_HEADER_SIZE + 32); position++) {
+        if (!Matches(source, update, {position})) {
+            break;
+        }
+    }
+}
+
+static void CheckRejected(const esp_partition_t* source, const Bytes& source_data, const Update& update) {
+    const Bytes& patch = update.patch;
+
+    // A device running another build fails on the header, before anything is written
+    Bytes other = source_data;
+    other[source_data.size() / 2] ^= 0x01;
+    esp_partition_t other_partition = *source;
+    other_partition.host_data = other.data();
+    auto result = Apply(&other_partition, patch, {});
+    CHECK(!result.written && result.output.empty());
+
+    // The same image in a smaller partition
+    esp_partition_t small_partition = *source;
+    small_partition.size = source_data.size() - 1;
+    result = Apply(&small_partition, patch, {});
+    CHECK(!result.written);
+
+    // Cut anywhere, the patch is incomplete
+    for (size_t length = 0; length < patch.size(); length++) {
+        Bytes truncated(patch.begin(), patch.begin() + length);
+        result = Apply(source, truncated, {});
+        if (result.finished) {
+            printf("FAILED accepted %zu of %zu patch bytes\n", length, patch.size());
+            failures++;
+            break;
+        }
+    }
+
+    Bytes trailing = patch;
+    trailing.push_back(0);
+    result = Apply(source, trailing, {});
+    CHECK(!result.written);
+
+    Bytes unknown = patch;
+    unknown[OTA_DELTA_HEADER_SIZE] = 0x03;
+    result = Apply(source, unknown, {});
+    CHECK(!result.written);
+
+    // Copy one byte from just past the end of the source, then an operand longer than 32 bits
+    Bytes past_end(patch.begin(), patch.begin() + OTA_DELTA_HEADER_SIZE);
+    uint32_t offset = source_data.size();
+    past_end.push_back(0x01);
+    while (offset >= 0x80) {
+        past_end.push_back((offset & 0x7F) | 0x80);
+        offset >>= 7;
+    }
+    past_end.push_back(offset);
+    past_end.push_back(1);
+    result = Apply(source, past_end, {});
+    CHECK(!result.written);
+
+    Bytes too_long(patch.begin(), patch.begin() + OTA_DELTA_HEADER_SIZE);
+    too_long.insert(too_long.end(), {0x02, 0xFF, 0xFF, 0xFF, 0xFF, 0x10});
+    result = Apply(source, too_long, {});
+    CHECK(!result.written);
+}
+
+int main(int argc, char** argv) {
+    std::string python = "python3";
+    std::string script;
+    std::string work_dir = ".";
+    unsigned seed = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--python") == 0 && i + 1 < argc) {
+            python = argv[++i];
+        } else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            script = argv[++i];
+        } else if (strcmp(argv[i], "--work-dir") == 0 && i + 1 < argc) {
+            work_dir = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], nullptr, 10);
+        } else {
+            printf("Usage: %s --script ota_delta.py [--python PATH] [--work-dir DIR] [--seed N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (script.empty()) {
+        printf("Usage: %s --script ota_delta.py [--python PATH] [--work-dir DIR] [--seed N]\n", argv[0]);
+        return 1;
+    }
+
+    std::mt19937 rng(seed);
+    Bytes source_data = MakeFirmware(rng, SOURCE_SIZE);
+    std::string old_path = work_dir + "/ota_delta_old.bin";
+    if (!WriteFile(old_path, source_data)) {
+        printf("FAILED to write %s\n", old_path.c_str());
+        return 1;
+    }
+
+    // The partition is larger than the image, like an OTA slot
+    Bytes partition_data = source_data;
+    partition_data.resize(SOURCE_SIZE + 64 * 1024, 0xFF);
+    esp_partition_t source = {};
+    source.address = 0x20000;
+    source.size = partition_data.size();
+    strcpy(source.label, "ota_0");
+    source.host_data = partition_data.data();
+
+    auto updates = MakeUpdates(source_data, rng);
+    for (auto& update : updates) {
+        std::string new_path = work_dir + "/ota_delta_" + update.name + ".bin";
+        std::string patch_path = work_dir + "/ota_delta_" + update.name + ".patch";
+        std::string command = python + " \"" + script + "\" diff \"" + old_path + "\" \"" + new_path + "\" \"" +
+            patch_path + "\" > /dev/null";
+        if (!WriteFile(new_path, update.target) || std::system(command.c_str()) != 0 ||
+            !ReadFile(patch_path, update.patch) || update.patch.size() <= OTA_DELTA_HEADER_SIZE) {
+            printf("FAILED to generate the %s patch: %s\n", update.name, command.c_str());
+            failures++;
+            continue;
+        }
+        CheckUpdate(&source, update, rng);
+    }
+
+    // The moved patch has copies with four byte operands and is short enough to cut at every byte
+    const Update& moved = updates[4];
+    if (moved.patch.size() > OTA_DELTA_HEADER_SIZE) {
+        CheckHeaderSplits(&source, moved);
+        Bytes image(partition_data.begin(), partition_data.begin() + SOURCE_SIZE);
+        esp_partition_t image_partition = source;
+        image_partition.size = SOURCE_SIZE;
+        image_partition.host_data = image.data();
+        CheckRejected(&image_partition, image, moved);
+    }
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,619 @@
+/*
+ * Checks AudioRingBuffer ordering, Clear() and SetCapacity(), then compares it with the mutex + deque queue
+ * it replaced:
+ *
+ * - uncontended: push and pop on one thread, the cost of the queue itself
+ * - contended: a producer and a consumer thread moving items as fast as they can
+ * - handoff latency: the time from Push() returning to Pop() on the other thread
+ *
+ * Then runs the audio pipeline of AudioService with an input, a codec and an output task, once with the single
+ * condition variable and notify_all of the baseline and once with the event group bits that replaced it, and
+ * counts how often each task is woken and how often it found nothing to do.
+ *
+ * Exits with 1 if an item is lost, duplicated or reordered.
+ */
+#include "audio_ring_buffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define QUEUE_CAPACITY 40
+
+struct Item {
+    uint32_t sequence = 0;
+    int64_t pushed_ns = 0;
+};
+
+// The queue used by AudioService before the ring buffers, bounded the same way
+class MutexDequeQueue {
+public:
+    bool Push(Item&& item) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queue_.size() >= QUEUE_CAPACITY) {
+            return false;
+        }
+        queue_.push_back(std::move(item));
+        return true;
+    }
+
+    bool Pop(Item& item) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queue_.empty()) {
+            return false;
+        }
+        item = std::move(queue_.front());
+        queue_.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex mutex_;
+    std::deque<Item> queue_;
+};
+
+using RingQueue = AudioRingBuffer<Item, QUEUE_CAPACITY>;
+
+static int64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+static void CheckRingBuffer() {
+    RingQueue ring;
+    Item item;
+    for (uint32_t i = 0; i < QUEUE_CAPACITY; i++) {
+        CHECK(ring.Push(Item{i, 0}));
+    }
+    CHECK(ring.Full());
+    CHECK(!ring.Push(Item{QUEUE_CAPACITY, 0}));
+
+    bool was_full = false;
+    CHECK(ring.Pop(item, &was_full));
+    CHECK(item.sequence == 0);
+    CHECK(was_full);
+
+    // Items pushed after Clear() returns are kept
+    ring.Clear();
+    CHECK(ring.Empty());
+    CHECK(ring.Push(Item{100, 0}));
+    CHECK(ring.Size() == 1);
+    CHECK(ring.Pop(item));
+    CHECK(item.sequence == 100);
+    CHECK(!ring.Pop(item));
+
+    // A lowered capacity limits Push() but keeps what is queued
+    for (uint32_t i = 0; i < 10; i++) {
+        CHECK(ring.Push(Item{i, 0}));
+    }
+    ring.SetCapacity(4);
+    CHECK(ring.capacity() == 4);
+    CHECK(!ring.Push(Item{10, 0}));
+    for (uint32_t i = 0; i < 7; i++) {
+        CHECK(ring.Pop(item));
+    }
+    CHECK(ring.Push(Item{10, 0}));
+    ring.SetCapacity(0);
+    CHECK(ring.capacity() == 1);
+    ring.SetCapacity(1000);
+    CHECK(ring.capacity() == QUEUE_CAPACITY);
+}
+
+template <typename Queue>
+static double Uncontended(int rounds) {
+    Queue queue;
+    Item item;
+    int64_t start = NowNs();
+    for (int i = 0; i < rounds; i++) {
+        // A burst like the send queue filling during a network stall
+        for (uint32_t j = 0; j < 8; j++) {
+            queue.Push(Item{j, 0});
+        }
+        for (uint32_t j = 0; j < 8; j++) {
+            queue.Pop(item);
+        }
+    }
+    return (double)(NowNs() - start) / (rounds * 8);
+}
+
+struct ContendedResult {
+    double items_per_second;
+    int64_t latency_p50_ns;
+    int64_t latency_p99_ns;
+    int64_t latency_max_ns;
+    bool in_order;
+};
+
+// With pace_ns 0 both threads spin, otherwise the producer pushes one item per period like an audio task
+template <typename Queue>
+static ContendedResult Contended(uint32_t count, int64_t pace_ns) {
+    Queue queue;
+    std::vector<int64_t> latencies;
+    latencies.reserve(count);
+    bool in_order = true;
+
+    int64_t start = NowNs();
+    std::thread consumer([&]() {
+        Item item;
+        uint32_t expected = 0;
+        while (expected < count) {
+            if (!queue.Pop(item)) {
+                std::this_thread::yield();
+                continue;
+            }
+            latencies.push_back(NowNs() - item.pushed_ns);
+            if (item.sequence != expected) {
+                in_order = false;
+            }
+            expected = item.sequence + 1;
+        }
+    });
+    int64_t next = NowNs();
+    for (uint32_t i = 0; i < count; i++) {
+        if (pace_ns > 0) {
+            next += pace_ns;
+            while (NowNs() < next) {
+                std::this_thread::yield();
+            }
+        }
+        while (!queue.Push(Item{i, NowNs()})) {
+            std::this_thread::yield();
+        }
+    }
+    consumer.join();
+    int64_t elapsed = NowNs() - start;
+
+    std::sort(latencies.begin(), latencies.end());
+    ContendedResult result;
+    result.items_per_second = count * 1e9 / elapsed;
+    result.latency_p50_ns = latencies[latencies.size() / 2];
+    result.latency_p99_ns = latencies[latencies.size() * 99 / 100];
+    result.latency_max_ns = latencies.back();
+    result.in_order = in_order && latencies.size() == count;
+    return result;
+}
+
+template <typename Queue>
+static void Run(const char* name, uint32_t count) {
+    double ns = Uncontended<Queue>(count / 8);
+    auto spin = Contended<Queue>(count, 0);
+    // One item every 100 us, faster than any audio queue but slow enough to find the queue empty
+    auto paced = Contended<Queue>(count / 100, 100000);
+    printf("%-12s uncontended %6.1f ns/op, contended %6.2f M items/s, handoff p50 %5.2f us p99 %6.2f us max %7.2f us\n",
+        name, ns, spin.items_per_second / 1e6, paced.latency_p50_ns / 1000.0, paced.latency_p99_ns / 1000.0,
+        paced.latency_max_ns / 1000.0);
+    if (!spin.in_order || !paced.in_order) {
+        printf("FAILED %s lost or reordered items\n", name);
+        failures++;
+    }
+}
+
+/*
+ * Wakeups of the audio tasks. Every frame period the microphone hands a frame to the input task, the network
+ * delivers a packet for the decoder and takes what the encoder produced, and the speaker consumes a frame.
+ * The queues are bounded like in AudioService, the network thread stands in for the protocol.
+ */
+#define PIPELINE_FRAME_US 1000
+#define PIPELINE_ENCODE_CAPACITY 2
+#define PIPELINE_PLAYBACK_CAPACITY 2
+
+struct TaskWakeups {
+    uint32_t wakeups = 0;
+    uint32_t spurious = 0;     // Woken, then went back to waiting without moving an item
+};
+
+struct PipelineResult {
+    TaskWakeups input;
+    TaskWakeups codec;
+    TaskWakeups output;
+    bool complete;
+};
+
+using Clock = std::chrono::steady_clock;
+
+static Clock::time_point FrameTime(Clock::time_point start, uint32_t frame) {
+    return start + std::chrono::microseconds((int64_t)frame * PIPELINE_FRAME_US);
+}
+
+// The speaker plays frame n at the end of frame period n + 2 and blocks until then, like codec_->OutputData()
+class Speaker {
+public:
+    explicit Speaker(Clock::time_point start) : start_(start) {}
+
+    void Play(const Item& item) {
+        std::this_thread::sleep_until(FrameTime(start_, item.sequence + 2));
+        if (item.sequence != played_) {
+            in_order_ = false;
+        }
+        played_ = item.sequence + 1;
+    }
+
+    uint32_t played() const { return played_; }
+    bool in_order() const { return in_order_; }
+
+private:
+    Clock::time_point start_;
+    std::atomic<uint32_t> played_ = 0;
+    bool in_order_ = true;
+};
+
+/*
+ * The baseline: all queues behind one mutex and one condition variable, notified with notify_all on every
+ * push and pop, so any queue operation wakes every task waiting on any queue.
+ */
+class SharedConditionPipeline {
+public:
+    explicit SharedConditionPipeline(Clock::time_point start) : start_(start), speaker_(start) {}
+
+    // The microphone produces frames while listening, the server sends them while speaking
+    PipelineResult Run(uint32_t frames, bool listening, bool speaking) {
+        PipelineResult result;
+        auto start = start_;
+        std::thread input([&]() {
+            for (uint32_t i = 0; listening && i < frames; i++) {
+                std::this_thread::sleep_until(FrameTime(start, i));
+                std::unique_lock<std::mutex> lock(mutex_);
+                Wait(lock, [this]() { return encode_queue_.size() < PIPELINE_ENCODE_CAPACITY; }, result.input);
+                encode_queue_.push_back(Item{i, 0});
+                cv_.notify_all();
+            }
+        });
+        std::thread codec([&]() { CodecTask(result.codec); });
+        std::thread output([&]() { OutputTask(result.output); });
+
+        uint32_t sent = 0;
+        bool in_order = true;
+        uint32_t to_send = listening ? frames : 0, to_play = speaking ? frames : 0;
+        for (uint32_t i = 0; sent < to_send || speaker_.played() < to_play; i++) {
+            std::this_thread::sleep_until(FrameTime(start, i));
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (i < to_play && decode_queue_.size() < QUEUE_CAPACITY) {
+                decode_queue_.push_back(Item{i, 0});
+                cv_.notify_all();
+            }
+            while (!send_queue_.empty()) {
+                in_order = in_order && send_queue_.front().sequence == sent;
+                sent++;
+                send_queue_.pop_front();
+                cv_.notify_all();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+            cv_.notify_all();
+        }
+        input.join();
+        codec.join();
+        output.join();
+        result.complete = in_order && sent == to_send && speaker_.played() == to_play && speaker_.in_order();
+        return result;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Item> encode_queue_;
+    std::deque<Item> send_queue_;
+    std::deque<Item> decode_queue_;
+    std::deque<Item> playback_queue_;
+    bool stopped_ = false;
+    Clock::time_point start_;
+    Speaker speaker_;
+
+    // cv_.wait(lock, ready), counting every return from the condition variable before the service stops
+    template <typename Ready>
+    void Wait(std::unique_lock<std::mutex>& lock, Ready ready, TaskWakeups& task) {
+        while (!ready()) {
+            cv_.wait(lock);
+            if (stopped_) {
+                return;
+            }
+            task.wakeups++;
+            if (!ready()) {
+                task.spurious++;
+            }
+        }
+    }
+
+    void CodecTask(TaskWakeups& task) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            Wait(lock, [this]() {
+                return stopped_ ||
+                    (!encode_queue_.empty() && send_queue_.size() < QUEUE_CAPACITY) ||
+                    (!decode_queue_.empty() && playback_queue_.size() < PIPELINE_PLAYBACK_CAPACITY);
+            }, task);
+            if (stopped_) {
+                break;
+            }
+            if (!decode_queue_.empty() && playback_queue_.size() < PIPELINE_PLAYBACK_CAPACITY) {
+                playback_queue_.push_back(decode_queue_.front());
+                decode_queue_.pop_front();
+                cv_.notify_all();
+            }
+            if (!encode_queue_.empty() && send_queue_.size() < QUEUE_CAPACITY) {
+                send_queue_.push_back(encode_queue_.front());
+                encode_queue_.pop_front();
+                cv_.notify_all();
+            }
+        }
+    }
+
+    void OutputTask(TaskWakeups& task) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            Wait(lock, [this]() { return stopped_ || !playback_queue_.empty(); }, task);
+            if (stopped_) {
+                break;
+            }
+            Item item = playback_queue_.front();
+            playback_queue_.pop_front();
+            cv_.notify_all();
+            lock.unlock();
+            speaker_.Play(item);
+        }
+    }
+};
+
+/*
+ * xEventGroupWaitBits() as FreeRTOS implements it: setting bits only unblocks the tasks whose bits are now
+ * set. The host event group shim wakes every waiter and lets each one check, which would hide the difference.
+ */
+class TaskEventGroup {
+public:
+    void SetBits(uint32_t bits) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bits_ |= bits;
+        for (auto waiter : waiters_) {
+            if (!waiter->ready && (bits_ & waiter->bits) != 0) {
+                waiter->ready = true;
+                waiter->cv.notify_one();
+            }
+        }
+    }
+
+    // Waits for any of the bits and clears them on exit
+    void WaitBits(uint32_t bits) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if ((bits_ & bits) == 0) {
+            Waiter waiter;
+            waiter.bits = bits;
+            waiters_.push_back(&waiter);
+            waiter.cv.wait(lock, [&waiter]() { return waiter.ready; });
+            waiters_.erase(std::find(waiters_.begin(), waiters_.end(), &waiter));
+        }
+        bits_ &= ~bits;
+    }
+
+private:
+    struct Waiter {
+        uint32_t bits = 0;
+        bool ready = false;
+        std::condition_variable cv;
+    };
+
+    std::mutex mutex_;
+    uint32_t bits_ = 0;
+    std::vector<Waiter*> waiters_;
+};
+
+/*
+ * The current AudioService: ring buffers and one event bit per condition. A task counts a wakeup on every
+ * return from WaitBits(), also when a bit that was set while it was busy lets it return at once.
+ */
+class EventBitsPipeline {
+public:
+    explicit EventBitsPipeline(Clock::time_point start) : start_(start), speaker_(start) {}
+
+    // The microphone produces frames while listening, the server sends them while speaking
+    PipelineResult Run(uint32_t frames, bool listening, bool speaking) {
+        PipelineResult result;
+        auto start = start_;
+        std::thread input([&]() {
+            for (uint32_t i = 0; listening && i < frames; i++) {
+                std::this_thread::sleep_until(FrameTime(start, i));
+                Item item{i, 0};
+                bool woken = false;
+                while (!PushToQueue(encode_queue_, item, kEncodeNotEmpty)) {
+                    if (woken) {
+                        result.input.spurious++;
+                    }
+                    events_.WaitBits(kEncodeNotFull);
+                    result.input.wakeups++;
+                    woken = true;
+                }
+            }
+        });
+        std::thread codec([&]() { CodecTask(result.codec); });
+        std::thread output([&]() { OutputTask(result.output); });
+
+        uint32_t sent = 0;
+        bool in_order = true;
+        Item item;
+        uint32_t to_send = listening ? frames : 0, to_play = speaking ? frames : 0;
+        for (uint32_t i = 0; sent < to_send || speaker_.played() < to_play; i++) {
+            std::this_thread::sleep_until(FrameTime(start, i));
+            if (i < to_play) {
+                Item packet{i, 0};
+                PushToQueue(decode_queue_, packet, kDecodeNotEmpty);
+            }
+            while (PopFromQueue(send_queue_, item, kSendNotFull)) {
+                in_order = in_order && item.sequence == sent;
+                sent++;
+            }
+        }
+        stopped_ = true;
+        events_.SetBits(kEncodeNotFull | kEncodeNotEmpty | kDecodeNotEmpty | kPlaybackNotEmpty);
+        input.join();
+        codec.join();
+        output.join();
+        result.complete = in_order && sent == to_send && speaker_.played() == to_play && speaker_.in_order();
+        return result;
+    }
+
+private:
+    static constexpr uint32_t kPlaybackNotEmpty = 1 << 3;
+    static constexpr uint32_t kPlaybackNotFull = 1 << 4;
+    static constexpr uint32_t kEncodeNotEmpty = 1 << 5;
+    static constexpr uint32_t kEncodeNotFull = 1 << 6;
+    static constexpr uint32_t kDecodeNotEmpty = 1 << 7;
+    static constexpr uint32_t kDecodeNotFull = 1 << 8;
+    static constexpr uint32_t kSendNotFull = 1 << 9;
+
+    TaskEventGroup events_;
+    AudioRingBuffer<Item, PIPELINE_ENCODE_CAPACITY> encode_queue_;
+    AudioRingBuffer<Item, QUEUE_CAPACITY> send_queue_;
+    AudioRingBuffer<Item, QUEUE_CAPACITY> decode_queue_;
+    AudioRingBuffer<Item, PIPELINE_PLAYBACK_CAPACITY> playback_queue_;
+    std::atomic<bool> stopped_ = false;
+    Clock::time_point start_;
+    Speaker speaker_;
+
+    template <typename Queue>
+    bool PushToQueue(Queue& queue, Item& item, uint32_t not_empty_bit) {
+        if (!queue.Push(std::move(item))) {
+            return false;
+        }
+        events_.SetBits(not_empty_bit);
+        return true;
+    }
+
+    template <typename Queue>
+    bool PopFromQueue(Queue& queue, Item& item, uint32_t not_full_bit) {
+        bool was_full = false;
+        bool popped = queue.Pop(item, &was_full);
+        if (was_full) {
+            events_.SetBits(not_full_bit);
+        }
+        return popped;
+    }
+
+    void CodecTask(TaskWakeups& task) {
+        while (true) {
+            events_.WaitBits(kEncodeNotEmpty | kDecodeNotEmpty | kPlaybackNotFull | kSendNotFull);
+            if (stopped_) {
+                break;
+            }
+            task.wakeups++;
+            uint32_t moved = 0;
+            bool busy = true;
+            while (busy) {
+                busy = false;
+                Item item;
+                if (!playback_queue_.Full() && PopFromQueue(decode_queue_, item, kDecodeNotFull)) {
+                    PushToQueue(playback_queue_, item, kPlaybackNotEmpty);
+                    busy = true;
+                }
+                if (!send_queue_.Full() && PopFromQueue(encode_queue_, item, kEncodeNotFull)) {
+                    send_queue_.Push(std::move(item));
+                    busy = true;
+                }
+                moved += busy;
+            }
+            if (moved == 0) {
+                task.spurious++;
+            }
+        }
+    }
+
+    void OutputTask(TaskWakeups& task) {
+        while (true) {
+            events_.WaitBits(kPlaybackNotEmpty);
+            if (stopped_) {
+                break;
+            }
+            task.wakeups++;
+            uint32_t played = 0;
+            Item item;
+            while (!stopped_ && PopFromQueue(playback_queue_, item, kPlaybackNotFull)) {
+                speaker_.Play(item);
+                played++;
+            }
+            if (played == 0) {
+                task.spurious++;
+            }
+        }
+    }
+};
+
+static void PrintWakeups(const char* name, const PipelineResult& result, uint32_t frames) {
+    const TaskWakeups* tasks[] = {&result.input, &result.codec, &result.output};
+    const char* task_names[] = {"input", "codec", "output"};
+    uint32_t wakeups = 0, spurious = 0;
+    for (int i = 0; i < 3; i++) {
+        printf("%-16s %-6s %7u wakeups %7u spurious %5.2f wakeups/frame\n", name, task_names[i], tasks[i]->wakeups,
+            tasks[i]->spurious, (double)tasks[i]->wakeups / frames);
+        wakeups += tasks[i]->wakeups;
+        spurious += tasks[i]->spurious;
+    }
+    printf("%-16s total  %7u wakeups %7u spurious %5.2f wakeups/frame\n", name, wakeups, spurious,
+        (double)wakeups / frames);
+}
+
+static void CompareWakeups(uint32_t frames) {
+    struct Scenario {
+        const char* name;
+        bool listening;
+        bool speaking;
+    };
+    const Scenario scenarios[] = {{"listening", true, false}, {"speaking", false, true}, {"full duplex", true, true}};
+    printf("audio pipeline, %u frames of %u us:\n", frames, PIPELINE_FRAME_US);
+    for (auto& scenario : scenarios) {
+        // Start a few frames ahead so the tasks are waiting when the first frame arrives
+        auto start = Clock::now() + std::chrono::microseconds(5 * PIPELINE_FRAME_US);
+        auto shared = SharedConditionPipeline(start).Run(frames, scenario.listening, scenario.speaking);
+        start = Clock::now() + std::chrono::microseconds(5 * PIPELINE_FRAME_US);
+        auto bits = EventBitsPipeline(start).Run(frames, scenario.listening, scenario.speaking);
+        printf("%s:\n", scenario.name);
+        PrintWakeups("notify_all", shared, frames);
+        PrintWakeups("event bits", bits, frames);
+        if (!shared.complete || !bits.complete) {
+            printf("FAILED %s lost or reordered frames\n", scenario.name);
+            failures++;
+        }
+        // A task is only woken by the bits of its own queues
+        CHECK(scenario.speaking || bits.output.wakeups == 0);
+        CHECK(scenario.listening || bits.input.wakeups == 0);
+    }
+}
+
+int main(int argc, char** argv) {
+    uint32_t count = 1000000;
+    uint32_t frames = 500;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            count = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = strtoul(argv[++i], nullptr, 10);
+        } else {
+            printf("Usage: %s [--count N] [--frames N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    CheckRingBuffer();
+    Run<RingQueue>("ring buffer", count);
+    Run<MutexDequeQueue>("mutex+deque", count);
+    CompareWakeups(frames);
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,17 @@
+#ifndef _APPLICATION_H_
+#define _APPLICATION_H_
+
+#include <functional>
+
+// The protocols only schedule work on the main loop. There is no main loop on the host, it runs right away
+class Application {
+public:
+    static Application& GetInstance() {
+        static Application instance;
+        return instance;
+    }
+
+    void Schedule(std::function<void()> callback) { callback(); }
+};
+
+#endif // _APPLICATION_H_
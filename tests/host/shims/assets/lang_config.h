@@ -0,0 +1,11 @@
+#pragma once
+
+// The strings of the generated language config that the host build uses
+namespace Lang {
+    namespace Strings {
+        constexpr const char* SERVER_ERROR = "Sending failed, please check the network";
+        constexpr const char* SERVER_NOT_CONNECTED = "Unable to connect to service, please try again later";
+        constexpr const char* SERVER_NOT_FOUND = "Looking for available service";
+        constexpr const char* SERVER_TIMEOUT = "Waiting for response timeout";
+    }
+}
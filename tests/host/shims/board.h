@@ -0,0 +1,39 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+#include <string>
+#include <network_interface.h>
+
+/*
+ * The part of Board that the audio and protocol code uses. Like on the device, the program defines its board
+ * with DECLARE_BOARD().
+ */
+void* create_board();
+class AudioCodec;
+class Board {
+private:
+    Board(const Board&) = delete;
+    Board& operator=(const Board&) = delete;
+
+protected:
+    Board() = default;
+
+public:
+    static Board& GetInstance() {
+        static Board* instance = static_cast<Board*>(create_board());
+        return *instance;
+    }
+
+    virtual ~Board() = default;
+    virtual AudioCodec* GetAudioCodec() = 0;
+    // Only the protocol programs connect to a server
+    virtual NetworkInterface* GetNetwork() { return nullptr; }
+    virtual std::string GetUuid() { return "00000000-0000-0000-0000-000000000000"; }
+};
+
+#define DECLARE_BOARD(BOARD_CLASS_NAME) \
+void* create_board() { \
+    return new BOARD_CLASS_NAME(); \
+}
+
+#endif // BOARD_H
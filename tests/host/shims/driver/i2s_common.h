@@ -0,0 +1,16 @@
+#ifndef HOST_DRIVER_I2S_COMMON_H
+#define HOST_DRIVER_I2S_COMMON_H
+
+#include "i2s_std.h"
+
+static inline esp_err_t i2s_channel_enable(i2s_chan_handle_t handle) {
+    (void)handle;
+    return ESP_OK;
+}
+
+static inline esp_err_t i2s_channel_disable(i2s_chan_handle_t handle) {
+    (void)handle;
+    return ESP_OK;
+}
+
+#endif // HOST_DRIVER_I2S_COMMON_H
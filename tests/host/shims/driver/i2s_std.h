@@ -0,0 +1,9 @@
+#ifndef HOST_DRIVER_I2S_STD_H
+#define HOST_DRIVER_I2S_STD_H
+
+#include "esp_err.h"
+
+// The host codecs have no I2S channels, the handles stay null
+typedef struct HostI2sChannel* i2s_chan_handle_t;
+
+#endif // HOST_DRIVER_I2S_STD_H
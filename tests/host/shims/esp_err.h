@@ -0,0 +1,36 @@
+#ifndef HOST_ESP_ERR_H
+#define HOST_ESP_ERR_H
+
+#include <cstdio>
+#include <cstdlib>
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+
+static inline const char* esp_err_to_name(esp_err_t err) {
+    switch (err) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    default: return "UNKNOWN ERROR";
+    }
+}
+
+#define ESP_ERROR_CHECK(x) do {                                             \
+        esp_err_t err_ = (x);                                               \
+        if (err_ != ESP_OK) {                                               \
+            fprintf(stderr, "%s:%d: %s failed: %d\n", __FILE__, __LINE__, #x, err_); \
+            abort();                                                        \
+        }                                                                   \
+    } while (0)
+
+#endif // HOST_ESP_ERR_H
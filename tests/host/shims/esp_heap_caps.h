@@ -0,0 +1,27 @@
+#ifndef HOST_ESP_HEAP_CAPS_H
+#define HOST_ESP_HEAP_CAPS_H
+
+#include <cstddef>
+#include <cstdlib>
+
+// There is only one heap on the host, the capabilities are ignored
+#define MALLOC_CAP_DEFAULT (1 << 12)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_8BIT (1 << 2)
+
+static inline void* heap_caps_malloc(size_t size, unsigned int caps) {
+    (void)caps;
+    return malloc(size);
+}
+
+static inline void* heap_caps_calloc(size_t count, size_t size, unsigned int caps) {
+    (void)caps;
+    return calloc(count, size);
+}
+
+static inline void heap_caps_free(void* ptr) {
+    free(ptr);
+}
+
+#endif // HOST_ESP_HEAP_CAPS_H
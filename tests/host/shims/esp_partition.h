@@ -0,0 +1,29 @@
+#ifndef HOST_ESP_PARTITION_H
+#define HOST_ESP_PARTITION_H
+
+#include "esp_err.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// A partition in host memory, only the fields the firmware reads and the contents
+typedef struct {
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+    const uint8_t* host_data;   // Host only: what esp_partition_read() returns
+} esp_partition_t;
+
+static inline esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size) {
+    if (partition == nullptr || dst == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (src_offset > partition->size || size > partition->size - src_offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, partition->host_data + src_offset, size);
+    return ESP_OK;
+}
+
+#endif // HOST_ESP_PARTITION_H
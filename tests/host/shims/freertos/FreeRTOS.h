@@ -0,0 +1,23 @@
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+#include <cstdint>
+#include "sdkconfig.h"
+
+// One tick per millisecond
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t StackType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+#define portTICK_PERIOD_MS 1
+#define configTICK_RATE_HZ 1000
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+#endif // HOST_FREERTOS_H
@@ -0,0 +1,21 @@
+#ifndef HOST_FREERTOS_TASK_H
+#define HOST_FREERTOS_TASK_H
+
+#include "FreeRTOS.h"
+
+/*
+ * Tasks run on detached threads. The stack size, priority and core are ignored, and vTaskDelete() only
+ * supports NULL at the end of the task function, which is how the firmware ends its tasks.
+ */
+typedef struct HostTask* TaskHandle_t;
+typedef void (*TaskFunction_t)(void* arg);
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stack_size, void* arg,
+    UBaseType_t priority, TaskHandle_t* handle);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, uint32_t stack_size, void* arg,
+    UBaseType_t priority, TaskHandle_t* handle, BaseType_t core_id);
+void vTaskDelete(TaskHandle_t handle);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
+
+#endif // HOST_FREERTOS_TASK_H
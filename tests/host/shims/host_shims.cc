@@ -0,0 +1,306 @@
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+
+#include "settings.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <thread>
+
+static const auto kStartTime = std::chrono::steady_clock::now();
+
+/* Logging */
+
+static std::atomic<int> log_level{ESP_LOG_INFO};
+static std::mutex log_mutex;
+
+void esp_log_level_set(const char* tag, esp_log_level_t level) {
+    (void)tag;
+    log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...) {
+    if (level > log_level) {
+        return;
+    }
+    static const char kLetters[] = "NEWIDV";
+    std::lock_guard<std::mutex> lock(log_mutex);
+    fprintf(stderr, "%c (%lld) %s: ", kLetters[level], (long long)(esp_timer_get_time() / 1000), tag);
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+/* Tasks */
+
+struct HostTask {
+    TaskFunction_t function;
+    void* arg;
+};
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stack_size, void* arg,
+    UBaseType_t priority, TaskHandle_t* handle) {
+    (void)name;
+    (void)stack_size;
+    (void)priority;
+    // Kept for the life of the process, like the handles of tasks that never end
+    auto task = new HostTask{function, arg};
+    if (handle != nullptr) {
+        *handle = task;
+    }
+    std::thread([task]() {
+        task->function(task->arg);
+    }).detach();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, uint32_t stack_size, void* arg,
+    UBaseType_t priority, TaskHandle_t* handle, BaseType_t core_id) {
+    (void)core_id;
+    return xTaskCreate(function, name, stack_size, arg, priority, handle);
+}
+
+void vTaskDelete(TaskHandle_t handle) {
+    if (handle != nullptr) {
+        fprintf(stderr, "vTaskDelete() of another task is not supported on the host\n");
+        abort();
+    }
+    // The task function returns right after this call, which ends its thread
+}
+
+void vTaskDelay(TickType_t ticks) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+TickType_t xTaskGetTickCount() {
+    return (TickType_t)(esp_timer_get_time() / 1000);
+}
+
+/* Event groups */
+
+struct HostEventGroup {
+    std::mutex mutex;
+    std::condition_variable cv;
+    EventBits_t bits = 0;
+};
+
+EventGroupHandle_t xEventGroupCreate() {
+    return new HostEventGroup();
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) {
+    delete group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+    std::lock_guard<std::mutex> lock(group->mutex);
+    group->bits |= bits;
+    group->cv.notify_all();
+    return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+    std::lock_guard<std::mutex> lock(group->mutex);
+    EventBits_t previous = group->bits;
+    group->bits &= ~bits;
+    return previous;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+    std::lock_guard<std::mutex> lock(group->mutex);
+    return group->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+    BaseType_t wait_for_all, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(group->mutex);
+    auto satisfied = [group, bits, wait_for_all]() {
+        return wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0;
+    };
+    if (ticks == portMAX_DELAY) {
+        group->cv.wait(lock, satisfied);
+    } else {
+        group->cv.wait_for(lock, std::chrono::milliseconds(ticks), satisfied);
+    }
+    // Like FreeRTOS, the bits are returned as they were before clearing
+    EventBits_t result = group->bits;
+    if (clear_on_exit && satisfied()) {
+        group->bits &= ~bits;
+    }
+    return result;
+}
+
+/* Timers */
+
+struct HostTimer {
+    esp_timer_cb_t callback;
+    void* arg;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+    bool active = false;
+    bool deleted = false;
+    uint64_t period_us = 0;
+    std::chrono::steady_clock::time_point deadline;
+    // Bumped by every start and stop, so a sleeping timer notices it was rearmed
+    uint32_t generation = 0;
+
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!deleted) {
+            if (!active) {
+                cv.wait(lock);
+                continue;
+            }
+            uint32_t armed = generation;
+            if (cv.wait_until(lock, deadline) != std::cv_status::timeout || armed != generation) {
+                continue;
+            }
+            if (period_us > 0) {
+                deadline += std::chrono::microseconds(period_us);
+            } else {
+                active = false;
+            }
+            lock.unlock();
+            callback(arg);
+            lock.lock();
+        }
+    }
+};
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle) {
+    auto timer = new HostTimer();
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    timer->thread = std::thread([timer]() {
+        timer->Run();
+    });
+    *handle = timer;
+    return ESP_OK;
+}
+
+static esp_err_t StartTimer(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us) {
+    std::lock_guard<std::mutex> lock(timer->mutex);
+    if (timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->active = true;
+    timer->period_us = period_us;
+    timer->deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+    timer->generation++;
+    timer->cv.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    return StartTimer(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us) {
+    return StartTimer(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    std::lock_guard<std::mutex> lock(timer->mutex);
+    if (!timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->active = false;
+    timer->generation++;
+    timer->cv.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    {
+        std::lock_guard<std::mutex> lock(timer->mutex);
+        timer->deleted = true;
+        timer->cv.notify_all();
+    }
+    timer->thread.join();
+    delete timer;
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) {
+    std::lock_guard<std::mutex> lock(timer->mutex);
+    return timer->active;
+}
+
+int64_t esp_timer_get_time() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - kStartTime).count();
+}
+
+/* Settings */
+
+static std::mutex settings_mutex;
+static std::map<std::string, std::map<std::string, std::string>> settings_strings;
+static std::map<std::string, std::map<std::string, int32_t>> settings_ints;
+
+Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
+}
+
+Settings::~Settings() {
+}
+
+std::string Settings::GetString(const std::string& key, const std::string& default_value) {
+    std::lock_guard<std::mutex> lock(settings_mutex);
+    auto& values = settings_strings[ns_];
+    auto it = values.find(key);
+    return it == values.end() ? default_value : it->second;
+}
+
+void Settings::SetString(const std::string& key, const std::string& value) {
+    if (!read_write_) {
+        ESP_LOGW("Settings", "Namespace %s is not open for writing", ns_.c_str());
+        return;
+    }
+    std::lock_guard<std::mutex> lock(settings_mutex);
+    settings_strings[ns_][key] = value;
+}
+
+int32_t Settings::GetInt(const std::string& key, int32_t default_value) {
+    std::lock_guard<std::mutex> lock(settings_mutex);
+    auto& values = settings_ints[ns_];
+    auto it = values.find(key);
+    return it == values.end() ? default_value : it->second;
+}
+
+void Settings::SetInt(const std::string& key, int32_t value) {
+    if (!read_write_) {
+        ESP_LOGW("Settings", "Namespace %s is not open for writing", ns_.c_str());
+        return;
+    }
+    std::lock_guard<std::mutex> lock(settings_mutex);
+    settings_ints[ns_][key] = value;
+}
+
+bool Settings::GetBool(const std::string& key, bool default_value) {
+    return GetInt(key, default_value ? 1 : 0) != 0;
+}
+
+void Settings::SetBool(const std::string& key, bool value) {
+    SetInt(key, value ? 1 : 0);
+}
+
+void Settings::EraseKey(const std::string& key) {
+    std::lock_guard<std::mutex> lock(settings_mutex);
+    settings_strings[ns_].erase(key);
+    settings_ints[ns_].erase(key);
+}
+
+void Settings::EraseAll() {
+    std::lock_guard<std::mutex> lock(settings_mutex);
+    settings_strings.erase(ns_);
+    settings_ints.erase(ns_);
+}
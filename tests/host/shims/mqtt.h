@@ -0,0 +1,61 @@
+#ifndef MQTT_H
+#define MQTT_H
+
+#include <functional>
+#include <string>
+
+/*
+ * An MQTT client connected to a broker in the same process. Every publish goes to the server handler on the
+ * calling thread, and the program delivers server messages with Receive().
+ */
+class Mqtt {
+public:
+    using ServerHandler = std::function<bool(Mqtt* mqtt, const std::string& topic, const std::string& payload)>;
+
+    explicit Mqtt(ServerHandler server) : server_(std::move(server)) {}
+    virtual ~Mqtt() = default;
+
+    void SetKeepAlive(int keep_alive_seconds) {}
+    bool Connect(const std::string& broker_address, int broker_port, const std::string& client_id,
+        const std::string& username, const std::string& password) {
+        connected_ = true;
+        if (on_connected_ != nullptr) {
+            on_connected_();
+        }
+        return true;
+    }
+    void Disconnect() {
+        if (connected_) {
+            connected_ = false;
+            if (on_disconnected_ != nullptr) {
+                on_disconnected_();
+            }
+        }
+    }
+    bool Publish(const std::string& topic, const std::string& payload, int qos = 0) {
+        return connected_ && server_(this, topic, payload);
+    }
+    bool Subscribe(const std::string& topic, int qos = 0) { return connected_; }
+    bool IsConnected() { return connected_; }
+    void OnConnected(std::function<void()> callback) { on_connected_ = callback; }
+    void OnDisconnected(std::function<void()> callback) { on_disconnected_ = callback; }
+    void OnMessage(std::function<void(const std::string& topic, const std::string& payload)> callback) {
+        on_message_ = callback;
+    }
+
+    // Delivers a message from the server
+    void Receive(const std::string& topic, const std::string& payload) {
+        if (on_message_ != nullptr) {
+            on_message_(topic, payload);
+        }
+    }
+
+private:
+    ServerHandler server_;
+    bool connected_ = false;
+    std::function<void()> on_connected_;
+    std::function<void()> on_disconnected_;
+    std::function<void(const std::string& topic, const std::string& payload)> on_message_;
+};
+
+#endif // MQTT_H
@@ -0,0 +1,19 @@
+#ifndef NETWORK_INTERFACE_H
+#define NETWORK_INTERFACE_H
+
+#include <memory>
+
+#include "mqtt.h"
+#include "udp.h"
+#include "web_socket.h"
+
+// The connections the protocols create, a program overrides the ones it serves
+class NetworkInterface {
+public:
+    virtual ~NetworkInterface() = default;
+    virtual std::unique_ptr<WebSocket> CreateWebSocket(int connect_id = -1) { return nullptr; }
+    virtual std::unique_ptr<Mqtt> CreateMqtt(int connect_id = -1) { return nullptr; }
+    virtual std::unique_ptr<Udp> CreateUdp(int connect_id = -1) { return nullptr; }
+};
+
+#endif // NETWORK_INTERFACE_H
@@ -0,0 +1,31 @@
+#ifndef OPUS_RESAMPLER_H
+#define OPUS_RESAMPLER_H
+
+#include <cstdint>
+
+/*
+ * Same interface as the esp-opus-encoder resampler. The device uses the SILK resampler, which the
+ * libopus API does not export, so the host interpolates linearly. Good enough to keep the pipeline
+ * timing right, not for listening tests.
+ */
+class OpusResampler {
+public:
+    OpusResampler();
+    ~OpusResampler();
+
+    void Configure(int input_sample_rate, int output_sample_rate);
+    void Process(const int16_t* input, int input_samples, int16_t* output);
+    int GetOutputSamples(int input_samples) const;
+
+    int input_sample_rate() const { return input_sample_rate_; }
+    int output_sample_rate() const { return output_sample_rate_; }
+
+private:
+    int input_sample_rate_ = 0;
+    int output_sample_rate_ = 0;
+    // Position of the next output sample in input samples, in Q16, relative to the last input sample
+    int64_t position_q16_ = 0;
+    int16_t last_sample_ = 0;
+};
+
+#endif // OPUS_RESAMPLER_H
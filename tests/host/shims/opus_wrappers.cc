@@ -0,0 +1,190 @@
+#include "opus_encoder.h"
+#include "opus_decoder.h"
+#include "opus_resampler.h"
+
+#include <esp_log.h>
+
+#define TAG "OpusWrapper"
+
+OpusEncoderWrapper::OpusEncoderWrapper(int sample_rate, int channels, int duration_ms)
+    : sample_rate_(sample_rate), duration_ms_(duration_ms) {
+    int error;
+    audio_enc_ = opus_encoder_create(sample_rate, channels, OPUS_APPLICATION_VOIP, &error);
+    if (audio_enc_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", error);
+        return;
+    }
+
+    // Default DTX enabled, like the device
+    SetDtx(true);
+    SetComplexity(0);
+
+    frame_size_ = sample_rate / 1000 * channels * duration_ms;
+}
+
+OpusEncoderWrapper::~OpusEncoderWrapper() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (audio_enc_ != nullptr) {
+        opus_encoder_destroy(audio_enc_);
+    }
+}
+
+void OpusEncoderWrapper::SetDtx(bool enable) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (audio_enc_ != nullptr) {
+        opus_encoder_ctl(audio_enc_, OPUS_SET_DTX(enable ? 1 : 0));
+    }
+}
+
+void OpusEncoderWrapper::SetComplexity(int complexity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (audio_enc_ != nullptr) {
+        opus_encoder_ctl(audio_enc_, OPUS_SET_COMPLEXITY(complexity));
+    }
+}
+
+void OpusEncoderWrapper::Encode(std::vector<int16_t>&& pcm, std::function<void(std::vector<uint8_t>&& opus)> handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (audio_enc_ == nullptr) {
+        ESP_LOGE(TAG, "Audio encoder is not configured");
+        return;
+    }
+
+    if (in_buffer_.empty()) {
+        in_buffer_ = std::move(pcm);
+    } else {
+        in_buffer_.insert(in_buffer_.end(), pcm.begin(), pcm.end());
+    }
+
+    while (in_buffer_.size() >= (size_t)frame_size_) {
+        uint8_t opus[MAX_OPUS_PACKET_SIZE];
+        auto ret = opus_encode(audio_enc_, in_buffer_.data(), frame_size_, opus, MAX_OPUS_PACKET_SIZE);
+        if (ret < 0) {
+            ESP_LOGE(TAG, "Failed to encode audio, error code: %ld", (long)ret);
+            return;
+        }
+
+        if (handler != nullptr) {
+            handler(std::vector<uint8_t>(opus, opus + ret));
+        }
+
+        in_buffer_.erase(in_buffer_.begin(), in_buffer_.begin() + frame_size_);
+    }
+}
+
+bool OpusEncoderWrapper::Encode(std::vector<int16_t>&& pcm, std::vector<uint8_t>& opus) {
+    if (audio_enc_ == nullptr) {
+        ESP_LOGE(TAG, "Audio encoder is not configured");
+        return false;
+    }
+
+    if (pcm.size() != (size_t)frame_size_) {
+        ESP_LOGE(TAG, "Audio data size is not equal to frame size, size: %u, frame size: %u",
+            (unsigned)pcm.size(), (unsigned)frame_size_);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    opus.resize(MAX_OPUS_PACKET_SIZE);
+    auto ret = opus_encode(audio_enc_, pcm.data(), frame_size_, opus.data(), opus.size());
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to encode audio, error code: %ld", (long)ret);
+        return false;
+    }
+    opus.resize(ret);
+    return true;
+}
+
+void OpusEncoderWrapper::ResetState() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (audio_enc_ != nullptr) {
+        opus_encoder_ctl(audio_enc_, OPUS_RESET_STATE);
+        in_buffer_.clear();
+    }
+}
+
+OpusDecoderWrapper::OpusDecoderWrapper(int sample_rate, int channels, int duration_ms)
+    : sample_rate_(sample_rate), duration_ms_(duration_ms) {
+    int error;
+    audio_dec_ = opus_decoder_create(sample_rate, channels, &error);
+    if (audio_dec_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", error);
+        return;
+    }
+
+    frame_size_ = sample_rate / 1000 * channels * duration_ms;
+}
+
+OpusDecoderWrapper::~OpusDecoderWrapper() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (audio_dec_ != nullptr) {
+        opus_decoder_destroy(audio_dec_);
+    }
+}
+
+bool OpusDecoderWrapper::Decode(std::vector<uint8_t>&& opus, std::vector<int16_t>& pcm) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (audio_dec_ == nullptr) {
+        ESP_LOGE(TAG, "Audio decoder is not configured");
+        return false;
+    }
+
+    pcm.resize(frame_size_);
+    // A null packet makes libopus conceal the frame
+    auto ret = opus_decode(audio_dec_, opus.empty() ? nullptr : opus.data(), opus.size(), pcm.data(), pcm.size(), 0);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to decode audio, error code: %d", ret);
+        return false;
+    }
+
+    pcm.resize(ret);
+    return true;
+}
+
+void OpusDecoderWrapper::ResetState() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (audio_dec_ != nullptr) {
+        opus_decoder_ctl(audio_dec_, OPUS_RESET_STATE);
+    }
+}
+
+OpusResampler::OpusResampler() {
+}
+
+OpusResampler::~OpusResampler() {
+}
+
+void OpusResampler::Configure(int input_sample_rate, int output_sample_rate) {
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+    position_q16_ = 0;
+    last_sample_ = 0;
+    ESP_LOGI(TAG, "Resampler configured with input sample rate %d and output sample rate %d",
+        input_sample_rate_, output_sample_rate_);
+}
+
+int OpusResampler::GetOutputSamples(int input_samples) const {
+    return input_samples * output_sample_rate_ / input_sample_rate_;
+}
+
+void OpusResampler::Process(const int16_t* input, int input_samples, int16_t* output) {
+    // Each output sample lies between two input samples, index -1 is the last sample of the previous call
+    int64_t step_q16 = ((int64_t)input_sample_rate_ << 16) / output_sample_rate_;
+    int output_samples = GetOutputSamples(input_samples);
+    for (int i = 0; i < output_samples; i++) {
+        int64_t index = (position_q16_ >> 16) - 1;
+        int32_t fraction = position_q16_ & 0xFFFF;
+        int32_t a = index < 0 ? last_sample_ : input[index];
+        int32_t b = input[index + 1 < input_samples ? index + 1 : input_samples - 1];
+        output[i] = (int16_t)(a + (((b - a) * fraction) >> 16));
+        position_q16_ += step_q16;
+    }
+    // Carry the fractional position over to the next call
+    position_q16_ -= (int64_t)input_samples << 16;
+    if (position_q16_ < 0) {
+        position_q16_ = 0;
+    }
+    if (input_samples > 0) {
+        last_sample_ = input[input_samples - 1];
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+// Host build configuration: no AFE, no wake word, 60 ms frames like the default firmware
+#define CONFIG_OPUS_FRAME_DURATION_60 1
+#define CONFIG_OPUS_FIXED_FRAME_DURATION_MS 60
+#define CONFIG_AUDIO_SEND_COALESCE_MS 20
+#define CONFIG_AUDIO_POOL_IN_PSRAM 0
+// No warm standby connection and no session resume, the protocol programs open one channel at a time
+#define CONFIG_WEBSOCKET_RESUME_SECONDS 0
+
+#endif // SDKCONFIG_H
@@ -0,0 +1,12 @@
+#ifndef _SYSTEM_INFO_H_
+#define _SYSTEM_INFO_H_
+
+#include <string>
+
+// The identity the protocols send in their headers and hello messages
+class SystemInfo {
+public:
+    static std::string GetMacAddress() { return "00:00:00:00:00:00"; }
+};
+
+#endif // _SYSTEM_INFO_H_
@@ -0,0 +1,39 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <functional>
+#include <string>
+
+/*
+ * A UDP socket connected to a server in the same process. Every datagram sent goes to the server handler on
+ * the calling thread, and the program delivers server datagrams with Receive().
+ */
+class Udp {
+public:
+    using ServerHandler = std::function<int(Udp* udp, const std::string& data)>;
+
+    explicit Udp(ServerHandler server) : server_(std::move(server)) {}
+    virtual ~Udp() = default;
+
+    bool Connect(const std::string& host, int port) {
+        connected_ = true;
+        return true;
+    }
+    void Disconnect() { connected_ = false; }
+    int Send(const std::string& data) { return connected_ ? server_(this, data) : -1; }
+    void OnMessage(std::function<void(const std::string& data)> callback) { on_message_ = callback; }
+
+    // Delivers a datagram from the server
+    void Receive(const std::string& data) {
+        if (on_message_ != nullptr) {
+            on_message_(data);
+        }
+    }
+
+private:
+    ServerHandler server_;
+    bool connected_ = false;
+    std::function<void(const std::string& data)> on_message_;
+};
+
+#endif // UDP_H
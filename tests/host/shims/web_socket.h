@@ -0,0 +1,66 @@
+#ifndef WEB_SOCKET_H
+#define WEB_SOCKET_H
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+
+/*
+ * A WebSocket connected to a server in the same process. Every frame the client sends goes to the server
+ * handler on the calling thread, and the program delivers server frames with Receive(), like the receive
+ * task of the device does.
+ */
+class WebSocket {
+public:
+    using ServerHandler = std::function<bool(WebSocket* websocket, const char* data, size_t len, bool binary)>;
+
+    explicit WebSocket(ServerHandler server) : server_(std::move(server)) {}
+    virtual ~WebSocket() = default;
+
+    void SetHeader(const char* key, const char* value) { headers_[key] = value; }
+    void SetReceiveBufferSize(size_t size) {}
+    bool IsConnected() const { return connected_; }
+    bool Connect(const char* uri) {
+        connected_ = true;
+        if (on_connected_ != nullptr) {
+            on_connected_();
+        }
+        return true;
+    }
+    bool Send(const std::string& data) { return Send(data.data(), data.size(), false); }
+    bool Send(const void* data, size_t len, bool binary = false, bool fin = true) {
+        return connected_ && server_(this, (const char*)data, len, binary);
+    }
+    void Ping() {}
+    void Close() {
+        if (connected_) {
+            connected_ = false;
+            if (on_disconnected_ != nullptr) {
+                on_disconnected_();
+            }
+        }
+    }
+    void OnConnected(std::function<void()> callback) { on_connected_ = callback; }
+    void OnDisconnected(std::function<void()> callback) { on_disconnected_ = callback; }
+    void OnData(std::function<void(const char*, size_t, bool)> callback) { on_data_ = callback; }
+    void OnError(std::function<void(int)> callback) { on_error_ = callback; }
+
+    // Delivers a frame from the server
+    void Receive(const char* data, size_t len, bool binary) {
+        if (on_data_ != nullptr) {
+            on_data_(data, len, binary);
+        }
+    }
+
+private:
+    ServerHandler server_;
+    bool connected_ = false;
+    std::map<std::string, std::string> headers_;
+    std::function<void()> on_connected_;
+    std::function<void()> on_disconnected_;
+    std::function<void(const char*, size_t, bool)> on_data_;
+    std::function<void(int)> on_error_;
+};
+
+#endif // WEB_SOCKET_H
@@ -0,0 +1,527 @@
+/*
+ * Sends and receives audio through WebsocketProtocol over a WebSocket connected to a server in the same process,
+ * and compares its framing with the code it replaced:
+ *
+ * - send "string": the first SendAudio() built a new std::string of header and payload for every packet
+ * - send "insert": the header was then inserted in front of the payload inside the packet, moving the payload
+ * - send "frame buffer": SendAudio() now writes header and payload into a buffer that keeps its capacity
+ * - receive "in place": OnData() byte-swapped the header inside the receive buffer and copied the payload into a
+ *   newly allocated packet
+ * - receive "view": OnData() now reads the header through a const view and copies the payload into a pooled packet
+ *
+ * These rows time the framing alone, copied from each version of the code. The SendAudio() and OnData() rows
+ * time the protocol itself, which also takes the connection under its mutex and updates the channel stats.
+ *
+ * Checks that every send path puts the same bytes on the wire for protocol versions 2 and 3, that all receive
+ * paths read the same packets, that the receive buffer is left untouched and that short or inconsistent frames
+ * are dropped. Then reports the time, heap allocations and bytes written per frame.
+ *
+ * Exits with 1 on a mismatch, or if the new paths allocate once warmed up.
+ */
+#include "websocket_protocol.h"
+#include "audio_pool.h"
+#include "board.h"
+#include "network_interface.h"
+#include "settings.h"
+
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// Counts heap allocations, to check the new paths do not allocate per frame
+static std::atomic<uint64_t> allocations{0};
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+// Frames before the allocation count starts, the pool and frame buffers grow on first use
+#define WARMUP_FRAMES 10
+#define FRAME_DURATION_MS 60
+
+// Opus payloads of 60 ms frames, from silence to a loud 24 kHz downlink
+static const size_t kPayloadSizes[] = {40, 120, 180, 260};
+#define PAYLOAD_SIZE_COUNT (sizeof(kPayloadSizes) / sizeof(kPayloadSizes[0]))
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+// Answers the client hello and collects the binary frames the client sends
+class LoopbackServer {
+public:
+    bool capture = false;
+    std::vector<std::string> frames;
+    size_t bytes = 0;
+
+    bool Handle(WebSocket* websocket, const char* data, size_t len, bool binary) {
+        if (!binary) {
+            static const char kServerHello[] = R"({"type":"hello","transport":"websocket","session_id":"host",)"
+                R"("audio_params":{"format":"opus","sample_rate":24000,"channels":1,"frame_duration":60}})";
+            websocket->Receive(kServerHello, sizeof(kServerHello) - 1, false);
+            return true;
+        }
+        bytes += len;
+        if (capture) {
+            frames.emplace_back(data, len);
+        }
+        return true;
+    }
+
+    WebSocket::ServerHandler Handler() {
+        return [this](WebSocket* websocket, const char* data, size_t len, bool binary) {
+            return Handle(websocket, data, len, binary);
+        };
+    }
+};
+
+static LoopbackServer server;
+
+class LoopbackNetwork : public NetworkInterface {
+public:
+    // The connection of the protocol, to deliver server frames on
+    WebSocket* client = nullptr;
+
+    std::unique_ptr<WebSocket> CreateWebSocket(int connect_id) override {
+        auto websocket = std::make_unique<WebSocket>(server.Handler());
+        client = websocket.get();
+        return websocket;
+    }
+};
+
+class HostBoard : public Board {
+public:
+    LoopbackNetwork network;
+
+    AudioCodec* GetAudioCodec() override { return nullptr; }
+    NetworkInterface* GetNetwork() override { return &network; }
+};
+
+DECLARE_BOARD(HostBoard)
+
+static LoopbackNetwork& Network() {
+    return static_cast<HostBoard&>(Board::GetInstance()).network;
+}
+
+static size_t HeaderSize(int version) {
+    return version == 2 ? sizeof(BinaryProtocol2) : sizeof(BinaryProtocol3);
+}
+
+// SendAudio() before the frame buffer, a new string for every packet
+static bool SendWithString(WebSocket& websocket, int version, AudioStreamPacketPtr packet) {
+    if (version == 2) {
+        std::string serialized;
+        serialized.resize(sizeof(BinaryProtocol2) + packet->payload.size());
+        auto bp2 = (BinaryProtocol2*)serialized.data();
+        bp2->version = htons(version);
+        bp2->type = 0;
+        bp2->reserved = 0;
+        bp2->timestamp = htonl(packet->timestamp);
+        bp2->payload_size = htonl(packet->payload.size());
+        memcpy(bp2->payload, packet->payload.data(), packet->payload.size());
+        return websocket.Send(serialized.data(), serialized.size(), true);
+    }
+    std::string serialized;
+    serialized.resize(sizeof(BinaryProtocol3) + packet->payload.size());
+    auto bp3 = (BinaryProtocol3*)serialized.data();
+    bp3->type = 0;
+    bp3->reserved = 0;
+    bp3->payload_size = htons(packet->payload.size());
+    memcpy(bp3->payload, packet->payload.data(), packet->payload.size());
+    return websocket.Send(serialized.data(), serialized.size(), true);
+}
+
+// The first in place version, the header was inserted in front of the payload of the packet
+static bool SendWithInsert(WebSocket& websocket, int version, AudioStreamPacketPtr packet) {
+    auto& payload = packet->payload;
+    size_t payload_size = payload.size();
+    if (version == 2) {
+        payload.insert(payload.begin(), sizeof(BinaryProtocol2), 0);
+        auto bp2 = (BinaryProtocol2*)payload.data();
+        bp2->version = htons(version);
+        bp2->type = 0;
+        bp2->reserved = 0;
+        bp2->timestamp = htonl(packet->timestamp);
+        bp2->payload_size = htonl(payload_size);
+    } else {
+        payload.insert(payload.begin(), sizeof(BinaryProtocol3), 0);
+        auto bp3 = (BinaryProtocol3*)payload.data();
+        bp3->type = 0;
+        bp3->reserved = 0;
+        bp3->payload_size = htons(payload_size);
+    }
+    return websocket.Send(payload.data(), payload.size(), true);
+}
+
+// The framing of SendAudio() now, header and payload written into a buffer that keeps its capacity
+static bool SendWithFrameBuffer(WebSocket& websocket, int version, std::vector<uint8_t>& frame, AudioStreamPacketPtr packet) {
+    auto& payload = packet->payload;
+    size_t header_size = version == 2 ? sizeof(BinaryProtocol2) : sizeof(BinaryProtocol3);
+    frame.resize(header_size + payload.size());
+    if (version == 2) {
+        auto bp2 = (BinaryProtocol2*)frame.data();
+        bp2->version = htons(version);
+        bp2->type = 0;
+        bp2->reserved = 0;
+        bp2->timestamp = htonl(packet->timestamp);
+        bp2->payload_size = htonl(payload.size());
+    } else {
+        auto bp3 = (BinaryProtocol3*)frame.data();
+        bp3->type = 0;
+        bp3->reserved = 0;
+        bp3->payload_size = htons(payload.size());
+    }
+    memcpy(frame.data() + header_size, payload.data(), payload.size());
+    return websocket.Send(frame.data(), frame.size(), true);
+}
+
+// OnData() before the view, the header fields were swapped inside the receive buffer
+static void ReceiveInPlace(int version, char* data, size_t len,
+    const std::function<void(std::unique_ptr<AudioStreamPacket> packet)>& on_incoming_audio) {
+    if (version == 2) {
+        BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
+        bp2->version = ntohs(bp2->version);
+        bp2->type = ntohs(bp2->type);
+        bp2->timestamp = ntohl(bp2->timestamp);
+        bp2->payload_size = ntohl(bp2->payload_size);
+        auto payload = (uint8_t*)bp2->payload;
+        on_incoming_audio(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
+            .sample_rate = 24000,
+            .frame_duration = FRAME_DURATION_MS,
+            .timestamp = bp2->timestamp,
+            .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
+        }));
+    } else {
+        BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
+        bp3->payload_size = ntohs(bp3->payload_size);
+        auto payload = (uint8_t*)bp3->payload;
+        on_incoming_audio(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
+            .sample_rate = 24000,
+            .frame_duration = FRAME_DURATION_MS,
+            .timestamp = 0,
+            .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
+        }));
+    }
+}
+
+// The framing of OnData() now, the header read through a const view and the payload copied into a pooled packet
+static void ReceiveWithView(int version, const char* data, size_t len,
+    const std::function<void(AudioStreamPacketPtr packet)>& on_incoming_audio) {
+    size_t header_size = version == 2 ? sizeof(BinaryProtocol2) : sizeof(BinaryProtocol3);
+    if (len < header_size) {
+        return;
+    }
+    size_t payload_size = len - header_size;
+    uint32_t timestamp = 0;
+    if (version == 2) {
+        auto bp2 = (const BinaryProtocol2*)data;
+        payload_size = ntohl(bp2->payload_size);
+        timestamp = ntohl(bp2->timestamp);
+    } else {
+        auto bp3 = (const BinaryProtocol3*)data;
+        payload_size = ntohs(bp3->payload_size);
+    }
+    if (payload_size > len - header_size) {
+        return;
+    }
+    auto payload = (const uint8_t*)data + header_size;
+    auto packet = AudioPool::GetInstance().AcquirePacket();
+    packet->sample_rate = 24000;
+    packet->frame_duration = FRAME_DURATION_MS;
+    packet->timestamp = timestamp;
+    packet->payload.assign(payload, payload + payload_size);
+    on_incoming_audio(std::move(packet));
+}
+
+// Opens a channel with the given protocol version, the server hello is answered by LoopbackServer
+static bool OpenChannel(WebsocketProtocol& protocol, int version) {
+    protocol.CloseAudioChannel();
+    Settings settings("websocket", true);
+    settings.SetString("url", "ws://loopback/xiaozhi/v1/");
+    settings.SetInt("version", version);
+    return protocol.OpenAudioChannel() && protocol.IsAudioChannelOpened();
+}
+
+static AudioStreamPacketPtr MakePacket(const std::vector<uint8_t>& source, size_t size, uint32_t timestamp) {
+    auto packet = AudioPool::GetInstance().AcquirePacket();
+    packet->sample_rate = 16000;
+    packet->frame_duration = FRAME_DURATION_MS;
+    packet->timestamp = timestamp;
+    packet->payload.assign(source.begin(), source.begin() + size);
+    return packet;
+}
+
+struct Received {
+    uint32_t timestamp = 0;
+    std::vector<uint8_t> payload;
+};
+
+static void CheckFraming(WebsocketProtocol& protocol, int version, const std::vector<uint8_t>& source,
+    std::vector<Received>& view_received) {
+    WebSocket reference(server.Handler());
+    reference.Connect("ws://loopback/");
+    std::vector<uint8_t> frame;
+    server.capture = true;
+    for (size_t size : kPayloadSizes) {
+        server.frames.clear();
+        uint32_t timestamp = 0x12345678 + size;
+        SendWithString(reference, version, MakePacket(source, size, timestamp));
+        SendWithInsert(reference, version, MakePacket(source, size, timestamp));
+        SendWithFrameBuffer(reference, version, frame, MakePacket(source, size, timestamp));
+        CHECK(protocol.SendAudio(MakePacket(source, size, timestamp)));
+        CHECK(server.frames.size() == 4);
+        if (server.frames.size() != 4) {
+            continue;
+        }
+        auto& wire = server.frames[0];
+        CHECK(wire.size() == HeaderSize(version) + size);
+        for (auto& sent : server.frames) {
+            CHECK(sent == wire);
+        }
+
+        // Received back by both paths, the payload and the timestamp of version 2 match what was sent
+        std::string receive_buffer = wire;
+        Network().client->Receive(receive_buffer.data(), receive_buffer.size(), true);
+        CHECK(receive_buffer == wire);
+        CHECK(!view_received.empty());
+        if (view_received.empty()) {
+            continue;
+        }
+        auto& view = view_received.back();
+        CHECK(view.payload == std::vector<uint8_t>(source.begin(), source.begin() + size));
+        CHECK(view.timestamp == (version == 2 ? timestamp : 0));
+
+        std::unique_ptr<AudioStreamPacket> in_place;
+        ReceiveInPlace(version, receive_buffer.data(), receive_buffer.size(), [&](std::unique_ptr<AudioStreamPacket> packet) {
+            in_place = std::move(packet);
+        });
+        CHECK(in_place != nullptr && in_place->payload == view.payload && in_place->timestamp == view.timestamp);
+
+        receive_buffer = wire;
+        AudioStreamPacketPtr copied;
+        ReceiveWithView(version, receive_buffer.data(), receive_buffer.size(), [&](AudioStreamPacketPtr packet) {
+            copied = std::move(packet);
+        });
+        CHECK(receive_buffer == wire);
+        CHECK(copied != nullptr && copied->payload == view.payload && copied->timestamp == view.timestamp);
+    }
+    server.capture = false;
+    server.frames.clear();
+
+    // Shorter than the header, or announcing more payload than received
+    size_t received = view_received.size();
+    std::string wire(HeaderSize(version) + 40, '\0');
+    if (version == 2) {
+        auto bp2 = (BinaryProtocol2*)wire.data();
+        bp2->version = htons(2);
+        bp2->payload_size = htonl(41);
+    } else {
+        auto bp3 = (BinaryProtocol3*)wire.data();
+        bp3->payload_size = htons(41);
+    }
+    Network().client->Receive(wire.data(), HeaderSize(version) - 1, true);
+    Network().client->Receive(wire.data(), wire.size(), true);
+    CHECK(view_received.size() == received);
+
+    // Bytes after the announced payload are not part of it
+    if (version == 2) {
+        ((BinaryProtocol2*)wire.data())->payload_size = htonl(39);
+    } else {
+        ((BinaryProtocol3*)wire.data())->payload_size = htons(39);
+    }
+    Network().client->Receive(wire.data(), wire.size(), true);
+    CHECK(view_received.size() == received + 1 && view_received.back().payload.size() == 39);
+}
+
+struct Measurement {
+    double ns_per_frame = 0;
+    double allocations_per_frame = 0;
+    double bytes_written_per_frame = 0;
+};
+
+// Runs frame(i) for every frame, the allocations are counted after the warm up
+template <typename Frame>
+static Measurement Measure(int frames, Frame frame) {
+    uint64_t warm_allocations = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        if (i == WARMUP_FRAMES) {
+            warm_allocations = allocations.load();
+        }
+        frame(i);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    Measurement measurement;
+    measurement.ns_per_frame = seconds * 1e9 / frames;
+    measurement.allocations_per_frame = double(allocations.load() - warm_allocations) / (frames - WARMUP_FRAMES);
+    return measurement;
+}
+
+static void Report(const char* direction, const char* name, const Measurement& measurement) {
+    printf("  %-7s %-13s %7.1f ns/frame %5.2f allocations/frame %6.1f bytes written/frame\n", direction, name,
+        measurement.ns_per_frame, measurement.allocations_per_frame, measurement.bytes_written_per_frame);
+}
+
+static void Benchmark(WebsocketProtocol& protocol, int version, const std::vector<uint8_t>& source, int frames) {
+    WebSocket reference(server.Handler());
+    reference.Connect("ws://loopback/");
+    size_t header_size = HeaderSize(version);
+    double payload_size = 0;
+    for (size_t size : kPayloadSizes) {
+        payload_size += size / (double)PAYLOAD_SIZE_COUNT;
+    }
+    printf("version %d, %zu byte header, %.0f byte payloads on average:\n", version, header_size, payload_size);
+
+    // Every frame takes a pooled packet and fills in the encoder output, the same for all send paths
+    auto string = Measure(frames, [&](int i) {
+        SendWithString(reference, version, MakePacket(source, kPayloadSizes[i % PAYLOAD_SIZE_COUNT], i * FRAME_DURATION_MS));
+    });
+    auto insert = Measure(frames, [&](int i) {
+        SendWithInsert(reference, version, MakePacket(source, kPayloadSizes[i % PAYLOAD_SIZE_COUNT], i * FRAME_DURATION_MS));
+    });
+    std::vector<uint8_t> frame;
+    auto frame_buffer = Measure(frames, [&](int i) {
+        SendWithFrameBuffer(reference, version, frame,
+            MakePacket(source, kPayloadSizes[i % PAYLOAD_SIZE_COUNT], i * FRAME_DURATION_MS));
+    });
+    auto send_audio = Measure(frames, [&](int i) {
+        protocol.SendAudio(MakePacket(source, kPayloadSizes[i % PAYLOAD_SIZE_COUNT], i * FRAME_DURATION_MS));
+    });
+    // Counted from what each path writes: the zero fill of resize() and insert(), the header, and the payload
+    // copied or moved behind it
+    string.bytes_written_per_frame = 2 * (header_size + payload_size);
+    insert.bytes_written_per_frame = 2 * header_size + payload_size;
+    frame_buffer.bytes_written_per_frame = header_size + payload_size;
+    send_audio.bytes_written_per_frame = header_size + payload_size;
+    Report("send", "string", string);
+    Report("send", "insert", insert);
+    Report("send", "frame buffer", frame_buffer);
+    Report("send", "SendAudio()", send_audio);
+    if (frame_buffer.allocations_per_frame > 0.1 || send_audio.allocations_per_frame > 0.1) {
+        printf("FAILED SendAudio() allocates %.2f times per frame\n", send_audio.allocations_per_frame);
+        failures++;
+    }
+
+    // Every frame is first written into the receive buffer, as the websocket client does
+    std::vector<std::string> wire;
+    server.capture = true;
+    for (size_t size : kPayloadSizes) {
+        protocol.SendAudio(MakePacket(source, size, size));
+    }
+    server.capture = false;
+    wire.swap(server.frames);
+    std::vector<char> receive_buffer(header_size + kPayloadSizes[PAYLOAD_SIZE_COUNT - 1]);
+    size_t checksum = 0;
+    auto in_place = Measure(frames, [&](int i) {
+        auto& frame = wire[i % wire.size()];
+        memcpy(receive_buffer.data(), frame.data(), frame.size());
+        ReceiveInPlace(version, receive_buffer.data(), frame.size(), [&](std::unique_ptr<AudioStreamPacket> packet) {
+            checksum += packet->payload.size();
+        });
+    });
+    auto view = Measure(frames, [&](int i) {
+        auto& frame = wire[i % wire.size()];
+        memcpy(receive_buffer.data(), frame.data(), frame.size());
+        ReceiveWithView(version, receive_buffer.data(), frame.size(), [&](AudioStreamPacketPtr packet) {
+            checksum += packet->payload.size();
+        });
+    });
+    auto on_data = Measure(frames, [&](int i) {
+        auto& frame = wire[i % wire.size()];
+        memcpy(receive_buffer.data(), frame.data(), frame.size());
+        Network().client->Receive(receive_buffer.data(), frame.size(), true);
+    });
+    // The swapped header fields, and the payload copied into the packet
+    in_place.bytes_written_per_frame = (version == 2 ? 12 : 2) + payload_size;
+    view.bytes_written_per_frame = payload_size;
+    on_data.bytes_written_per_frame = payload_size;
+    Report("receive", "in place", in_place);
+    Report("receive", "view", view);
+    Report("receive", "OnData()", on_data);
+    if (view.allocations_per_frame > 0.1 || on_data.allocations_per_frame > 0.1) {
+        printf("FAILED OnData() allocates %.2f times per frame\n", on_data.allocations_per_frame);
+        failures++;
+    }
+    if (checksum == 0) {
+        failures++;
+    }
+}
+
+int main(int argc, char** argv) {
+    int frames = 200000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [--frames N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (frames <= WARMUP_FRAMES) {
+        frames = WARMUP_FRAMES + 1;
+    }
+
+    AudioPool::GetInstance().Initialize(8, 1);
+    std::mt19937 random(1);
+    std::vector<uint8_t> source(kPayloadSizes[PAYLOAD_SIZE_COUNT - 1]);
+    for (auto& byte : source) {
+        byte = random();
+    }
+
+    WebsocketProtocol protocol;
+    // Only kept while checking, the benchmark releases the packets right away
+    bool keep_received = true;
+    std::vector<Received> view_received;
+    size_t received_bytes = 0;
+    protocol.OnIncomingAudio([&](AudioStreamPacketPtr packet) {
+        received_bytes += packet->payload.size();
+        if (keep_received) {
+            view_received.push_back({packet->timestamp, packet->payload});
+        }
+    });
+
+    for (int version : {2, 3}) {
+        if (!OpenChannel(protocol, version)) {
+            printf("FAILED to open a version %d channel\n", version);
+            failures++;
+            continue;
+        }
+        keep_received = true;
+        view_received.clear();
+        CheckFraming(protocol, version, source, view_received);
+        keep_received = false;
+        Benchmark(protocol, version, source, frames);
+    }
+    protocol.CloseAudioChannel();
+    if (received_bytes == 0) {
+        failures++;
+    }
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}